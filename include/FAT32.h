@@ -9,23 +9,23 @@ typedef union
 {
 	struct
 	{
-		/* The first four bits are unused. */
-		uint32_t : 4;
-
 		/* The entire value of the index. */
 		uint32_t index : 28;
+
+		/* The last four bits are reserved. */
+		uint32_t : 4;
 	};
 
 	struct
 	{
-		/* The first four bits are unused. */
-		uint16_t : 4;
+		/* The low two bytes of the index. */
+		uint16_t index_low;
 
 		/* The high two bytes of the index. */
 		uint16_t index_high : 12;
 
-		/* The low two bytes of the index. */
-		uint16_t index_low;
+		/* The last four bits are reserved. */
+		uint16_t : 4;
 	};
 
 } FAT32_cluster_address_t;
@@ -34,24 +34,64 @@ typedef union
 #define FAT32_CLUSTER_ADDRESS_NULL 0x0000000
 
 /* A cluster address with this index indicates that this cluster is the end of the cluster chain. */
-#define FAT32_CLUSTER_ADDRESS_EOC 0xFFFFFF
+#define FAT32_CLUSTER_ADDRESS_EOC 0xFFFFFFF
+
+/* Any cluster address with an index at least this high marks the end of the cluster chain. */
+#define FAT32_CLUSTER_ADDRESS_EOC_MIN 0xFFFFFF8
+
+/* A cluster address with this index marks a cluster containing bad sectors. */
+#define FAT32_CLUSTER_ADDRESS_BAD 0xFFFFFF7
+
+/* Returns whether the given cluster index marks the end of a cluster chain. */
+#define FAT32_CLUSTER_ADDRESS_IS_EOC(index) ((index) >= FAT32_CLUSTER_ADDRESS_EOC_MIN)
 
+struct FAT32_volume_t;
 struct FAT32_file_t;
 
-/* Initializes the FAT32 file system. */
-void FAT32_init(void);
+enum
+{
+	/* Never updates the last access date of files. Reading a file then writes nothing. */
+	FAT32_MOUNT_NOATIME = 0x01,
+
+	/* Only updates the last access date of a file if it's older than its modification date, or more than a day old. */
+	FAT32_MOUNT_RELATIME = 0x02,
+
+	/* Keeps a CRC32C of each cluster, checked the first time the cluster is read. Images keep them in a file alongside, named after the image with ".crc" appended. */
+	FAT32_MOUNT_CHECKSUMS = 0x04,
+};
+typedef uint8_t FAT32_mount_flags_t;
+
+/* Mounts the FAT32 image at the given path, or formats a small in-memory volume if 'path' is NULL.
+* Returns NULL if the image could not be opened, or is not a FAT32 volume.
+* Separate volumes share no state, and may be used from different threads at the same time. */
+struct FAT32_volume_t* FAT32_init(const char* path, FAT32_mount_flags_t flags);
+
+/* Writes the free space hints back to the image, and unmounts it. */
+void FAT32_shutdown(struct FAT32_volume_t* volume);
+
+/* Writes back any directory entry changes that are still cached, and flushes the image to stable storage. */
+void FAT32_sync(struct FAT32_volume_t* volume);
+
+/* Returns the options the volume was mounted with. */
+FAT32_mount_flags_t FAT32_get_mount_flags(const struct FAT32_volume_t* volume);
 
 /* Returns the cluster address of the root directory in the file system. */
-FAT32_cluster_address_t FAT32_get_root(void);
+FAT32_cluster_address_t FAT32_get_root(const struct FAT32_volume_t* volume);
+
+/* Reserves an empty cluster, and returns the address to the caller. Returns NULL if every cluster is taken. The cluster isn't zeroed
+* on the device until it's first written, or its table entry is committed to the journal. Volumes without a journal only zero it at
+* unmount, so after a crash it may hold whatever it held before. */
+FAT32_cluster_address_t FAT32_new_cluster(struct FAT32_volume_t* volume);
 
-/* Reserves an empty cluster, and returns the address to the caller. */
-FAT32_cluster_address_t FAT32_new_cluster(void);
+/* Reserves a chain of 'length' clusters (at least one), and returns the address of its first cluster. The chain is one contiguous
+* run of clusters if there is a free run long enough to hold it. Returns NULL, reserving nothing, if there aren't enough free clusters. */
+FAT32_cluster_address_t FAT32_new_chain(struct FAT32_volume_t* volume, uint32_t length);
 
 /* Frees all clusters in the chain given by 'address'. */
-void FAT32_free_cluster(FAT32_cluster_address_t address);
+void FAT32_free_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
 
 /* Opens a FAT32 file, given its starting cluster address, and the size of the file. */
-struct FAT32_file_t* FAT32_fopen(FAT32_cluster_address_t address, uint32_t size);
+struct FAT32_file_t* FAT32_fopen(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t size);
 
 /* Closes a FAT32 file. */
 int FAT32_fclose(struct FAT32_file_t* file);
@@ -59,9 +99,48 @@ int FAT32_fclose(struct FAT32_file_t* file);
 /* Works the same was as normal 'fread'. */
 size_t FAT32_fread(void* buffer, size_t size, size_t count, struct FAT32_file_t* file);
 
-/* Works the same way as normal 'fwrite'. */
+/* Works the same way as normal 'fwrite', writing less than asked for if the volume runs out of clusters. */
 size_t FAT32_fwrite(const void* buffer, size_t size, size_t count, struct FAT32_file_t* file);
 
+/* A buffer for scatter/gather I/O. */
+typedef struct
+{
+	void* base;
+	size_t len;
+} FAT32_iovec_t;
+
+/* Reads up to 'size' bytes from the given offset in the file, without moving the file's position. Returns the number of bytes read.
+* Any number of threads may read from one file at once. */
+size_t FAT32_pread(struct FAT32_file_t* file, void* buffer, size_t size, uint32_t offset);
+
+/* Writes 'size' bytes at the given offset in the file, without moving the file's position. Returns the number of bytes written,
+* which falls short if the volume runs out of clusters. Writes that grow the chain allocate clusters, so they must not run at the same
+* time as other writes to the volume. */
+size_t FAT32_pwrite(struct FAT32_file_t* file, const void* buffer, size_t size, uint32_t offset);
+
+/* Finds where the bytes at the given offset in the file are kept in the image file, so they can be copied straight out of it (with
+* 'sendfile', say) rather than read through 'FAT32_pread'. Returns how many of the next 'size' bytes lie one after another from
+* 'outOffset' in the file descriptor 'outFd', or 0 if the next bytes must go through 'FAT32_pread': past the end of the file, in
+* compressed files, on in-memory volumes, or in clusters that have never been written or haven't had their checksums checked yet.
+* The bytes stay there until the file is next written to. */
+size_t FAT32_pread_map(struct FAT32_file_t* file, size_t size, uint32_t offset, int* outFd, uint64_t* outOffset);
+
+/* Sets the size of the file. Shrinking keeps the start of the chain and frees the rest, extending adds zeroed clusters to the end of it.
+* Returns 0 on success, or 1 if the volume ran out of clusters, leaving the size as it was. */
+int FAT32_ftruncate(struct FAT32_file_t* file, uint32_t size);
+
+/* Works the same way as 'FAT32_pread', filling each buffer in turn. */
+size_t FAT32_preadv(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt, uint32_t offset);
+
+/* Works the same way as 'FAT32_pwrite', writing each buffer in turn. */
+size_t FAT32_pwritev(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt, uint32_t offset);
+
+/* Reads into each buffer in turn from the file's position, like 'FAT32_fread'. */
+size_t FAT32_readv(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt);
+
+/* Writes each buffer in turn at the file's position, like 'FAT32_fwrite'. */
+size_t FAT32_writev(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt);
+
 /* Sets the seek origin to the beginning of the file. */
 #define FAT32_SEEK_SET -1
 
@@ -80,11 +159,17 @@ void FAT32_rewind(struct FAT32_file_t* file);
 /* Returns the number of bytes in the file reader is. */
 long FAT32_ftell(const struct FAT32_file_t* file);
 
+/* Returns the volume the given file object is on. */
+struct FAT32_volume_t* FAT32_fvolume(const struct FAT32_file_t* file);
+
 /* Returns the starting cluster address of the given file object. */
 FAT32_cluster_address_t FAT32_faddress(const struct FAT32_file_t* file);
 
 /* Returns whether the given file has been written to. */
 int FAT32_fmodified(const struct FAT32_file_t* file);
 
+/* Returns whether a read from the given file has failed, because the data didn't match its checksum. The read stops short at the bad cluster. */
+int FAT32_ferror(const struct FAT32_file_t* file);
+
 /* Prints the state of the FAT32 hard drive. */
-void FAT32_print_disk(void);
+void FAT32_print_disk(struct FAT32_volume_t* volume);
@@ -0,0 +1,100 @@
+// FAT32Aging.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+/* How values are drawn from a 'FAT32_aging_range_t'. */
+enum FAT32_aging_distribution_t
+{
+    /* Every value in the range is equally likely. */
+    FAT32_AGING_UNIFORM,
+
+    /* Every power of two in the range is equally likely, then every value up to the next one.
+    * Small values are much more common than large ones, as with the sizes and lifetimes of real files. */
+    FAT32_AGING_LOG_UNIFORM,
+};
+
+/* A range of values, and how they're drawn from it. */
+struct FAT32_aging_range_t
+{
+    enum FAT32_aging_distribution_t distribution;
+    uint32_t min;
+    uint32_t max;
+};
+
+struct FAT32_aging_config_t
+{
+    /* Seeds the random choices. The same seed and configuration on the same image always do the same operations. */
+    uint64_t seed;
+
+    /* The number of operations to run. Each operation creates a file or appends to one, after deleting the files whose time is up. */
+    uint32_t num_operations;
+
+    /* The number of operations between checkpoints. There's always one at the end. */
+    uint32_t checkpoint_interval;
+
+    /* The sizes of new files, in bytes. */
+    struct FAT32_aging_range_t file_sizes;
+
+    /* The number of bytes added by each append. */
+    struct FAT32_aging_range_t append_sizes;
+
+    /* How many operations files live for before they're deleted. */
+    struct FAT32_aging_range_t lifetimes;
+
+    /* The percentage of operations that append to an existing file, rather than creating a new one. */
+    uint32_t append_percent;
+
+    /* The percentage of the volume the workload may fill. Files closest to the end of their lives are deleted early to stay below it. */
+    uint32_t max_fill_percent;
+
+    /* The number of directories the files are spread over. */
+    uint32_t num_directories;
+
+    /* The most bytes read back at each checkpoint to measure read throughput. */
+    uint64_t max_read_bytes;
+};
+
+/* Measurements taken at a checkpoint. */
+struct FAT32_aging_checkpoint_t
+{
+    /* The number of operations run so far. */
+    uint32_t operation;
+
+    /* The number of files alive, and their total size in bytes. */
+    uint32_t num_files;
+    uint64_t num_bytes;
+
+    /* The number of files created, appended to and deleted since the last checkpoint. */
+    uint32_t num_created;
+    uint32_t num_appended;
+    uint32_t num_deleted;
+
+    /* The average number of contiguous runs of clusters (fragments) in the chains of the files alive. */
+    double fragments_per_file;
+
+    /* The rate the files were read back at, in megabytes per second. Reads go through the host's cache, so this mostly reflects the
+    * work of following fragmented chains. */
+    double read_mb_per_second;
+
+    /* The time taken to allocate the clusters for each creation or append since the last checkpoint, in microseconds. */
+    double mean_allocation_us;
+    double p99_allocation_us;
+    double max_allocation_us;
+
+    /* The free space of the volume: the number of free clusters, how many runs they're in, and the longest run. */
+    uint32_t num_free_clusters;
+    uint32_t num_free_extents;
+    uint32_t largest_free_extent;
+};
+
+/* Function called by 'FAT32_age' at each checkpoint. */
+typedef void(*FAT32_aging_callback_t)(const struct FAT32_aging_checkpoint_t* checkpoint, void* userData);
+
+/* Fills in a configuration for a modest workload: files of 512 bytes to 1MB and lifetimes of 16 to 4096 operations, both log-uniform,
+* 30% appends, and at most 80% of the volume filled, over 16 directories. */
+void FAT32_aging_default_config(uint64_t seed, uint32_t numOperations, struct FAT32_aging_config_t* outConfig);
+
+/* Ages the volume by running the configured workload of creating, appending to and deleting files, in subdirectories of 'dir' named
+* "aging0", "aging1" and so on. Calls 'callback' at each checkpoint. Returns 0 if the subdirectories already exist. */
+int FAT32_age(struct FAT32_file_t* dir, const struct FAT32_aging_config_t* config, FAT32_aging_callback_t callback, void* userData);
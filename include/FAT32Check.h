@@ -0,0 +1,58 @@
+// FAT32Check.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+enum
+{
+    /* Fixes any problems that are found, rather than just reporting them. */
+    FAT32_CHECK_REPAIR = 0x01,
+};
+typedef uint8_t FAT32_check_flags_t;
+
+enum FAT32_check_problem_t
+{
+    /* A cluster is claimed by more than one cluster chain. */
+    FAT32_CHECK_CROSS_LINKED,
+
+    /* A cluster is allocated, but is not reachable from any directory entry. */
+    FAT32_CHECK_LOST_CLUSTER,
+
+    /* A directory entry or cluster chain refers to a cluster that is not allocated. */
+    FAT32_CHECK_FREE_REFERENCE,
+
+    /* A directory entry or cluster chain refers to a cluster outside of the volume. */
+    FAT32_CHECK_INVALID_ADDRESS,
+
+    /* A directory's '.' entry doesn't refer to the directory itself, or its '..' entry doesn't refer to its parent. */
+    FAT32_CHECK_BAD_LINK,
+};
+
+struct FAT32_check_report_t
+{
+    /* The number of files visited. */
+    uint32_t num_files;
+
+    /* The number of directories visited, including the root. */
+    uint32_t num_directories;
+
+    /* The number of problems found, by 'FAT32_check_problem_t'. */
+    uint32_t num_cross_linked;
+    uint32_t num_lost_clusters;
+    uint32_t num_free_references;
+    uint32_t num_invalid_addresses;
+    uint32_t num_bad_links;
+
+    /* The number of problems that were repaired. */
+    uint32_t num_repaired;
+};
+
+/* Function called by 'FAT32_check' for each problem found. 'path' is empty for lost clusters. */
+typedef void(*FAT32_check_callback_t)(enum FAT32_check_problem_t problem, const char* path, FAT32_cluster_address_t cluster, void* userData);
+
+/* Checks the consistency of the File Allocation Table against the directory tree, walking the tree with 'numThreads' threads (0 for one per hardware thread).
+* 'callback' may be NULL. Returns the number of problems found. */
+uint32_t FAT32_check(struct FAT32_volume_t* volume, FAT32_check_flags_t flags, uint32_t numThreads, struct FAT32_check_report_t* outReport, FAT32_check_callback_t callback, void* userData);
+
+/* Checks the file system, and prints any problems that were found. */
+void FAT32_check_print_report(struct FAT32_volume_t* volume, FAT32_check_flags_t flags);
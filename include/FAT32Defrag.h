@@ -0,0 +1,45 @@
+// FAT32Defrag.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+/* The number of buckets in the free extent histogram.
+* Bucket 'i' counts the free extents with a length (in clusters) in the range [2^i, 2^(i+1)). */
+#define FAT32_DEFRAG_HISTOGRAM_BUCKETS 32
+
+struct FAT32_defrag_report_t
+{
+    /* The number of files and subdirectories visited. */
+    uint32_t num_files;
+
+    /* The number of files whose cluster chain is split into more than one fragment. */
+    uint32_t num_fragmented_files;
+
+    /* The total number of fragments across all visited files. */
+    uint32_t num_fragments;
+
+    /* The number of unused clusters. */
+    uint32_t num_free_clusters;
+
+    /* The number of runs of contiguous unused clusters. */
+    uint32_t num_free_extents;
+
+    /* The length of the largest run of contiguous unused clusters. */
+    uint32_t largest_free_extent;
+
+    /* Histogram of free extent lengths. */
+    uint32_t free_extent_histogram[FAT32_DEFRAG_HISTOGRAM_BUCKETS];
+};
+
+/* Function called by 'FAT32_defrag_analyze' for each file visited, with its path and fragment count. */
+typedef void(*FAT32_defrag_file_callback_t)(const char* path, const struct FAT32_directory_entry_t* entry, uint32_t fragments, void* userData);
+
+/* Scans the File Allocation Table and directory tree, and fills in the given report. 'callback' may be NULL. */
+void FAT32_defrag_analyze(struct FAT32_volume_t* volume, struct FAT32_defrag_report_t* outReport, FAT32_defrag_file_callback_t callback, void* userData);
+
+/* Prints the fragmentation of each fragmented file, as well as the state of free space. */
+void FAT32_defrag_print_report(struct FAT32_volume_t* volume);
+
+/* Rewrites fragmented cluster chains into contiguous extents, updating their directory entries.
+* Entries marked with 'FAT32_DIR_ENTRY_ATTRIB_SYSTEM' are left in place. Returns the number of chains moved. */
+uint32_t FAT32_defrag_compact(struct FAT32_volume_t* volume);
@@ -17,9 +17,18 @@ enum
     * system (boot loaders, kernel images, swap files, extended attributes, etc.).*/
     FAT32_DIR_ENTRY_ATTRIB_SYSTEM = 0x04,
 
+    /* Indicates an optional directory volume label, normally only residing in a volume's root directory. */
+    FAT32_DIR_ENTRY_ATTRIB_VOLUME_ID = 0x08,
+
     /* Indicates that the cluster-chain associated with this entry gets interpreted as subdirectory instead of as a file.
     * Subdirectories have a filesize entry of zero. */
     FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY = 0x010,
+
+    /* Typically set by the operating system as soon as the file is created or modified. */
+    FAT32_DIR_ENTRY_ATTRIB_ARCHIVE = 0x20,
+
+    /* This combination of attributes marks a slot holding part of a long file name (see 'FAT32_long_name_entry_t'). */
+    FAT32_DIR_ENTRY_ATTRIB_LONG_NAME = 0x0F,
 };
 typedef uint8_t FAT32_dir_entry_attribs_t;
 
@@ -49,7 +58,7 @@ struct FAT32_date_t
 
 struct FAT32_directory_entry_t
 {
-    /* The name of the file. Long names are not supported. */
+    /* The short name of the file. Long names are held in preceding 'FAT32_long_name_entry_t' slots. */
     char name[8];
 
     /* The file extension. */
@@ -58,8 +67,8 @@ struct FAT32_directory_entry_t
     /* The file attributes. */
     FAT32_dir_entry_attribs_t attribs;
 
-    /* Unused byte. */
-    uint8_t unused;
+    /* The 'FAT32_DIR_ENTRY_FLAG_' bits. Bits 3 and 4 hold the case of the short name, as on other systems. */
+    uint8_t flags;
 
     /* Time the file was created, fine resultion. Measured in multiples of 10ms. */
     uint8_t create_time_fine;
@@ -89,6 +98,56 @@ struct FAT32_directory_entry_t
     uint32_t size;
 };
 
+/* The first byte of the name of a directory entry that has been deleted. */
+#define FAT32_DIR_ENTRY_DELETED 0xE5
+
+/* Set in the flags of an entry whose short name has a lower case base name or extension. Short names are stored in upper case,
+ * so names whose parts are each in one case need no long name. */
+#define FAT32_DIR_ENTRY_FLAG_LOWER_BASE 0x08
+#define FAT32_DIR_ENTRY_FLAG_LOWER_EXT 0x10
+
+/* Set in the flags of a file that's stored compressed. Its size is the stored size, and opening it reads and writes the
+ * uncompressed bytes, which may only be appended to. Only set it on an empty file, or one about to be opened to be overwritten. */
+#define FAT32_DIR_ENTRY_FLAG_COMPRESSED 0x80
+
+/* The number of characters of a long name held in each long name slot. */
+#define FAT32_DIR_LONG_NAME_SLOT_CHARS 13
+
+/* The maximum number of long name slots that may precede a directory entry. */
+#define FAT32_DIR_LONG_NAME_MAX_SLOTS 20
+
+/* Marks the first physical (and last logical) long name slot. */
+#define FAT32_DIR_LONG_NAME_LAST_SLOT 0x40
+
+/* A directory slot holding up to 13 UCS-2 characters of a long file name.
+* A long name is stored in reverse order directly before the directory entry it belongs to. */
+struct FAT32_long_name_entry_t
+{
+    /* Sequence number of this slot (1-20), or'd with 'FAT32_DIR_LONG_NAME_LAST_SLOT' for the last one. */
+    uint8_t sequence;
+
+    /* Characters 1-5. */
+    uint8_t name0[10];
+
+    /* Always 'FAT32_DIR_ENTRY_ATTRIB_LONG_NAME'. */
+    FAT32_dir_entry_attribs_t attribs;
+
+    /* Always zero. */
+    uint8_t type;
+
+    /* Checksum of the short name of the entry this slot belongs to. */
+    uint8_t checksum;
+
+    /* Characters 6-11. */
+    uint8_t name1[12];
+
+    /* Always zero. */
+    uint16_t first_cluster_index_low;
+
+    /* Characters 12-13. */
+    uint8_t name2[4];
+};
+
 /* Returns the cluster address contained in a directory entry. */
 FAT32_cluster_address_t FAT32_dir_get_entry_address(const struct FAT32_directory_entry_t* entry);
 
@@ -98,29 +157,96 @@ void FAT32_dir_set_entry_address(struct FAT32_directory_entry_t* entry, FAT32_cl
 /* The size of a character array required to hold a null-terminated, formatted directory name. */
 #define FAT32_DIR_NAME_LEN 13
 
-/* Returns a formatted name of the directory entry. */
+/* The size of a character array required to hold a null-terminated long name.
+* Characters outside of Latin-1 are read back as '_'. */
+#define FAT32_DIR_LONG_NAME_LEN 256
+
+/* Returns a formatted name of the directory entry, in the case given by its flags. */
 void FAT32_dir_get_entry_name(const struct FAT32_directory_entry_t* entry, char* outName);
 
-/* Sets the name of a directory entry. */
+/* Sets the short name of a directory entry, which must fit in 8.3. The name is stored in upper case, and the entry's case flags are set
+* for the parts that were in lower case. */
 void FAT32_dir_set_entry_name(struct FAT32_directory_entry_t* entry, const char* name);
 
-/* Searches for the first directory entry that matches the given name. */
+/* Returns whether the entry is the '.' or '..' link of a subdirectory. */
+int FAT32_dir_is_dot_entry(const struct FAT32_directory_entry_t* entry);
+
+/* Computes the checksum of the short name of a directory entry, as stored in its long name slots. */
+uint8_t FAT32_dir_get_entry_checksum(const struct FAT32_directory_entry_t* entry);
+
+/* Reads the next directory entry from the directory file, skipping deleted entries and long name slots.
+* If 'outName' is not NULL, it receives the long name of the entry, or its formatted short name if it has none. */
+int FAT32_dir_read_entry(struct FAT32_file_t* dir, struct FAT32_directory_entry_t* outEntry, char* outName);
+
+/* A directory entry decoded by 'FAT32_readdir_batch'. */
+struct FAT32_dirent_t
+{
+	/* The entry itself. */
+	struct FAT32_directory_entry_t entry;
+
+	/* The index of the entry's slot in the directory. */
+	uint32_t slot;
+
+	/* The index of the first slot of the entry's long name, or 'slot' if it has none. */
+	uint32_t first_slot;
+
+	/* The long name of the entry, or its formatted short name if it has none. */
+	char name[FAT32_DIR_LONG_NAME_LEN];
+};
+
+/* The number of slots 'FAT32_readdir_batch' reads from the directory at a time. */
+#define FAT32_DIR_BATCH_SLOTS 128
+
+/* Decodes up to 'maxEntries' entries from the directory into 'outEntries', skipping deleted entries, long name slots and volume labels,
+* and returns how many were decoded. 0 means the end of the directory has been reached.
+* 'cookie' gives where to start: 0 for the beginning of the directory, or the value left in it by the previous call to carry on from there. */
+uint32_t FAT32_readdir_batch(struct FAT32_file_t* dir, uint32_t* cookie, struct FAT32_dirent_t* outEntries, uint32_t maxEntries);
+
+/* Searches for the first directory entry that matches the given long or short name, ignoring case. */
 int FAT32_dir_get_entry(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry);
 
-/* Searches for the first directory entry that has the given cluster address. */
-int FAT32_dir_get_entry_by_address(struct FAT32_file_t* dir, FAT32_cluster_address_t address, struct FAT32_directory_entry_t* outEntry);
+/* Searches for the first directory entry that has the given cluster address. 'outName' may be NULL. */
+int FAT32_dir_get_entry_by_address(struct FAT32_file_t* dir, FAT32_cluster_address_t address, struct FAT32_directory_entry_t* outEntry, char* outName);
+
+/* Opens a file containing the directory entry, on the given volume. A '..' entry with a NULL address refers to the root directory. */
+struct FAT32_file_t* FAT32_dir_open_entry(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry);
+
+/* Opens the file for the given entry to be rewritten from the start. Its clusters are reused as it's written, and any that are
+* left over are freed by 'FAT32_dir_close_entry'. Returns NULL for directories. */
+struct FAT32_file_t* FAT32_dir_open_entry_overwrite(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry);
 
-/* Opens a file containing the directory entry. */
-struct FAT32_file_t* FAT32_dir_open_entry(struct FAT32_directory_entry_t* entry);
+/* Closes a file handle for the given entry, updating its size, address, modification time and access date.
+* Returns whether the entry changed, and so has to be written back to its directory. */
+int FAT32_dir_close_entry(struct FAT32_directory_entry_t* entry, struct FAT32_file_t* file);
 
-/* Closes a file handle for the given entry. */
-void FAT32_dir_close_entry(struct FAT32_directory_entry_t* entry, struct FAT32_file_t* file);
+/* Writes the entry back to the slot the directory is positioned at (as left by 'FAT32_dir_get_entry'), and moves past it.
+* The write is deferred, so repeated changes to an entry are combined. They reach the image on 'FAT32_sync' or 'FAT32_shutdown'. */
+void FAT32_dir_update_entry(struct FAT32_file_t* dir, const struct FAT32_directory_entry_t* entry);
 
-/* Creates a new file with the given name and attributes in the given directory file. */
+/* Creates a new file with the given name and attributes in the given directory file.
+* Names that do not fit in 8.3 form are stored as long names, with a generated short name. Returns 0 if the volume is out of clusters. */
 int FAT32_dir_new_entry(struct FAT32_file_t* dir, const char* name, FAT32_dir_entry_attribs_t attribs, struct FAT32_directory_entry_t* outEntry);
 
+/* Creates a new file with the given name and attributes in the given directory file, already 'size' bytes long. Its chain is allocated
+* in one go, in one contiguous run if there's one long enough. The contents read as zeroes until they're written.
+* Returns 0, leaving no entry behind, if there aren't enough free clusters. */
+int FAT32_dir_new_file(struct FAT32_file_t* dir, const char* name, FAT32_dir_entry_attribs_t attribs, uint32_t size, struct FAT32_directory_entry_t* outEntry);
+
+/* Creates a new subdirectory with the given name in the given directory file, along with its '.' and '..' links. */
+int FAT32_dir_new_directory(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry);
+
 /* Deletes a file with the given name and attributes from the given directory file. */
 int FAT32_dir_remove_entry(struct FAT32_file_t* dir, const char* name);
 
+/* Creates a new file with the given name in the directory, as a clone of the given file: the two share the same clusters,
+* and each cluster is only copied when either file first changes it. Returns 0 if the name is taken, the source is a directory,
+* or the volume is out of clusters. */
+int FAT32_clone(struct FAT32_file_t* dir, const struct FAT32_directory_entry_t* source, const char* name, struct FAT32_directory_entry_t* outEntry);
+
+/* Moves the entry with the given name to 'newDir' (which may be 'dir') under 'newName', without touching its contents.
+* Subdirectories have their parent link pointed at 'newDir'. Returns 0 if the entry doesn't exist, 'newName' is taken,
+* a directory would be moved beneath itself, or 'newDir' has to grow but the volume is out of clusters. */
+int FAT32_dir_rename(struct FAT32_file_t* dir, const char* name, struct FAT32_file_t* newDir, const char* newName);
+
 /* Clears the contents of the given entry. */
-void FAT32_dir_clear_entry(struct FAT32_directory_entry_t* entry);
+void FAT32_dir_clear_entry(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry);
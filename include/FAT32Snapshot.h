@@ -0,0 +1,63 @@
+// FAT32Snapshot.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+/* The length of a packed short name: 8 name characters then 3 extension characters, padded with spaces and without the dot. */
+#define FAT32_SNAPSHOT_NAME_LEN 11
+
+/* A copy of the entries of a directory, with each field kept in its own array so scans over one field stay tight.
+* Entry 'i' of the directory is made up of 'names[i]', 'attribs[i]', 'sizes[i]', 'first_clusters[i]' and 'slots[i]'.
+* Deleted entries, long name slots and volume labels are left out, as with 'FAT32_dir_read_entry'. */
+struct FAT32_dir_snapshot_t
+{
+    /* The number of entries in the snapshot. */
+    uint32_t num_entries;
+
+    /* The packed short names of the entries. */
+    char (*names)[FAT32_SNAPSHOT_NAME_LEN];
+
+    /* The attributes of the entries. */
+    FAT32_dir_entry_attribs_t* attribs;
+
+    /* The sizes of the entries, in bytes. */
+    uint32_t* sizes;
+
+    /* The indices of the first clusters of the entries. */
+    uint32_t* first_clusters;
+
+    /* The index of each entry's slot in the directory, to read the whole entry or its long name back from the directory. */
+    uint32_t* slots;
+
+    /* The volume and first cluster of the directory, and the generation of the directory the snapshot was taken at. */
+    struct FAT32_volume_t* volume;
+    FAT32_cluster_address_t directory;
+    uint64_t generation;
+
+    /* The number of entries the arrays have room for. */
+    uint32_t capacity;
+};
+
+/* Takes a snapshot of the given directory. The directory is left at its end. */
+struct FAT32_dir_snapshot_t* FAT32_dir_snapshot_create(struct FAT32_file_t* dir);
+
+/* Returns whether the directory may have changed since the snapshot was taken. Changes to other directories
+* occasionally make a snapshot look stale too, but a stale snapshot never looks current. */
+int FAT32_dir_snapshot_is_stale(const struct FAT32_dir_snapshot_t* snapshot);
+
+/* Takes the snapshot again, reusing its arrays, if it's stale. Returns whether it was taken again. */
+int FAT32_dir_snapshot_refresh(struct FAT32_dir_snapshot_t* snapshot, struct FAT32_file_t* dir);
+
+/* Frees a snapshot. */
+void FAT32_dir_snapshot_free(struct FAT32_dir_snapshot_t* snapshot);
+
+/* Fills 'outIndices' with the indices of the entries whose attributes, masked with 'mask', equal 'value', and returns how many there are.
+* For example, a mask and value of 'FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY' finds the subdirectories. 'outIndices' must have room for every entry. */
+uint32_t FAT32_dir_snapshot_filter_attribs(const struct FAT32_dir_snapshot_t* snapshot, FAT32_dir_entry_attribs_t mask, FAT32_dir_entry_attribs_t value, uint32_t* outIndices);
+
+/* Fills 'outIndices' with the indices of the entries at least 'minSize' bytes in size, and returns how many there are.
+* 'outIndices' must have room for every entry. */
+uint32_t FAT32_dir_snapshot_filter_size(const struct FAT32_dir_snapshot_t* snapshot, uint32_t minSize, uint32_t* outIndices);
+
+/* Returns the index of the entry with the given short name (as in "NAME.EXT"), or -1 if there isn't one. */
+int32_t FAT32_dir_snapshot_find(const struct FAT32_dir_snapshot_t* snapshot, const char* shortName);
@@ -0,0 +1,30 @@
+// FAT32Transfer.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+struct FAT32_transfer_report_t
+{
+    /* The number of files copied. */
+    uint32_t num_files;
+
+    /* The number of directories copied, not counting the one the copy started from. */
+    uint32_t num_directories;
+
+    /* The number of bytes of file contents copied. */
+    uint64_t num_bytes;
+
+    /* The number of files and directories that could not be copied, or were only partly copied. */
+    uint32_t num_failed;
+};
+
+/* Copies the contents of the directory at 'hostPath' on the host into the given directory file, including its subdirectories.
+* Entries are created with their chains sized from the host file sizes up front, in one contiguous run where possible, while 'numThreads'
+* threads (0 for one per hardware thread) copy the contents of files that have been created already. Directories that already exist are
+* merged into, but files that already exist are left alone and counted as failures. Returns the number of failures. */
+uint32_t FAT32_import(struct FAT32_file_t* dir, const char* hostPath, uint32_t numThreads, struct FAT32_transfer_report_t* outReport);
+
+/* Copies the contents of the given directory file into the directory at 'hostPath' on the host (which is created if it doesn't exist),
+* including its subdirectories. Host files are created at their full size up front, and filled by 'numThreads' threads (0 for one per
+* hardware thread) while the rest of the tree is walked. Existing host files are replaced. Returns the number of failures. */
+uint32_t FAT32_export(struct FAT32_file_t* dir, const char* hostPath, uint32_t numThreads, struct FAT32_transfer_report_t* outReport);
@@ -0,0 +1,85 @@
+// FAT32Walk.h
+#pragma once
+
+#include "FAT32Directory.h"
+
+/* What a walk should do after visiting an entry. */
+enum FAT32_walk_action_t
+{
+    /* Carry on, walking into the entry if it's a directory. */
+    FAT32_WALK_CONTINUE,
+
+    /* Carry on, but don't walk into the entry. */
+    FAT32_WALK_SKIP,
+
+    /* Stop the whole walk as soon as possible. */
+    FAT32_WALK_STOP,
+};
+
+/* An entry visited by 'FAT32_walk'. */
+struct FAT32_walk_entry_t
+{
+    /* The entry, as read from its directory. */
+    const struct FAT32_dirent_t* dirent;
+
+    /* The path of the entry, starting with the path the walk was given. */
+    const char* path;
+
+    /* The first cluster of the directory holding the entry. */
+    FAT32_cluster_address_t dir;
+
+    /* The number of directories between the entry and where the walk started, 0 for entries of the starting directory. */
+    uint32_t depth;
+
+    /* The thread visiting the entry, counting from 0. No two calls on the same thread overlap, so state may be kept per thread without locks. */
+    uint32_t thread;
+};
+
+/* Function called by 'FAT32_walk' for each entry. Calls are made from several threads at once. */
+typedef enum FAT32_walk_action_t(*FAT32_walk_callback_t)(const struct FAT32_walk_entry_t* entry, void* userData);
+
+/* Visits every entry below the given directory file (except '.' and '..' links), on 'numThreads' threads (0 for one per hardware thread).
+* Each thread walks the directories it finds itself, depth first, and takes directories from the others when it runs out.
+* Subdirectories are read ahead as they're found. Directories reached more than once (through a damaged tree) are only walked the first time.
+* 'path' is the path of the directory, to build the paths of the entries from. Returns 0 if the walk was stopped by the callback. */
+int FAT32_walk(struct FAT32_file_t* dir, const char* path, uint32_t numThreads, FAT32_walk_callback_t callback, void* userData);
+
+/* Returns whether a name matches a pattern, ignoring case. In the pattern, '*' matches any run of characters and '?' matches any one. */
+int FAT32_walk_match(const char* pattern, const char* name);
+
+struct FAT32_find_query_t
+{
+    /* The pattern the names of matching entries match, as for 'FAT32_walk_match'. NULL matches every name. */
+    const char* pattern;
+
+    /* Attributes that matching entries have all of. */
+    FAT32_dir_entry_attribs_t attribs_set;
+
+    /* Attributes that matching entries have none of. */
+    FAT32_dir_entry_attribs_t attribs_clear;
+};
+
+/* Function called by 'FAT32_find' for each matching entry. Calls are made one at a time, but in no particular order. */
+typedef void(*FAT32_find_callback_t)(const char* path, const struct FAT32_directory_entry_t* entry, void* userData);
+
+/* Finds every entry below the given directory file that matches the query, walking it with 'numThreads' threads.
+* Returns the number of matches. */
+uint32_t FAT32_find(struct FAT32_file_t* dir, const char* path, const struct FAT32_find_query_t* query, uint32_t numThreads, FAT32_find_callback_t callback, void* userData);
+
+struct FAT32_du_report_t
+{
+    /* The number of files below the directory. */
+    uint32_t num_files;
+
+    /* The number of directories below the directory, not counting itself. */
+    uint32_t num_directories;
+
+    /* The total of the sizes of the files. Compressed files count the size they're stored at. */
+    uint64_t num_bytes;
+
+    /* The total of the sizes of the files, rounded up to whole clusters. Clusters shared by clones are counted once for each. */
+    uint64_t num_allocated_bytes;
+};
+
+/* Adds up the sizes of the files below the given directory file, walking it with 'numThreads' threads. */
+void FAT32_du(struct FAT32_file_t* dir, uint32_t numThreads, struct FAT32_du_report_t* outReport);
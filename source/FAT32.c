@@ -3,165 +3,1966 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <limits.h>
-#include "../include/FAT32.h"
+#include <time.h>
+#include "FAT32Internal.h"
 
-/* The number of bytes in a FAT32 cluster */
-#define FAT32_CLUSTER_SIZE 8
-#define FAT32_NUM_CLUSTERS 64
-#define FAT32_TABLE_SIZE (sizeof(FAT32_cluster_address_t) * FAT32_NUM_CLUSTERS)
-#define FAT32_DATA_SIZE (FAT32_CLUSTER_SIZE * FAT32_NUM_CLUSTERS)
+/* Size of the boot sector and FSInfo structures, regardless of the sector size. */
+#define FAT32_BOOT_SECTOR_SIZE 512
 
-/* Type used to represent a byte on the hard drive. */
-typedef uint8_t HDByte_t;
+/* Signatures identifying the FSInfo sector. */
+#define FAT32_FSINFO_LEAD_SIGNATURE 0x41615252
+#define FAT32_FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FAT32_FSINFO_TRAIL_SIGNATURE 0xAA550000
 
-/* Virtual Hard drive object. */
-HDByte_t FAT32_HARD_DRIVE[FAT32_TABLE_SIZE + FAT32_DATA_SIZE];
+/* Value of an FSInfo field that has not been computed. */
+#define FAT32_FSINFO_UNKNOWN 0xFFFFFFFF
 
-/* Returns the address stored in the File Allocation Table for the given address. */
-static FAT32_cluster_address_t get_table_entry(FAT32_cluster_address_t address)
+/* Where the generation of the free extent summary is kept, in the reserved bytes at the end of the FSInfo sector. */
+#define FAT32_FSINFO_GENERATION_OFFSET 496
+
+/* Where the volume's flags are kept, just after the generation. */
+#define FAT32_FSINFO_FLAGS_OFFSET 500
+
+/* Set in the FSInfo flags while any chain is shared between clones, so the reference counts aren't lost along with the file they're saved to. */
+#define FAT32_FSINFO_FLAG_SHARED 0x00000001
+
+/* Bit of the second reserved table entry that is set while the volume is not mounted (or was unmounted cleanly). */
+#define FAT32_CLEAN_SHUTDOWN_BIT 0x08000000
+
+/* The number of table entries read from the device at a time. */
+#define FAT32_TABLE_CHUNK_ENTRIES 1024
+
+/* The number of sectors in the boot record, and in its backup. */
+#define FAT32_BOOT_RECORD_SECTORS 3
+
+/* Identifies the free extent summary, stored in the reserved sectors after the boot record, FSInfo and their backups. */
+#define FAT32_SUMMARY_MAGIC 0x53454646 /* "FFES" */
+#define FAT32_SUMMARY_HEADER_SIZE 16
+#define FAT32_SUMMARY_EXTENT_SIZE 8
+#define FAT32_SUMMARY_MIN_OFFSET (12 * FAT32_BOOT_SECTOR_SIZE)
+
+/* Limits on the size of the metadata journal. */
+#define FAT32_JOURNAL_MAX_SIZE (1024 * 1024)
+#define FAT32_JOURNAL_MIN_SECTORS 4
+
+/* The number of free extents tracked when the volume has no room to persist them. */
+#define FAT32_DEFAULT_MAX_FREE_EXTENTS 1024
+
+/* Set in the extended flags of the boot sector if only one copy of the File Allocation Table is in use. */
+#define FAT32_EXT_FLAGS_NO_MIRRORING 0x80
+
+/* Geometry of the in-memory volume. Sectors are tiny so that the whole disk can be visualized. */
+#define FAT32_MEMORY_BYTES_PER_SECTOR 8
+#define FAT32_MEMORY_RESERVED_SIZE (16 * FAT32_BOOT_SECTOR_SIZE)
+#define FAT32_MEMORY_NUM_CLUSTERS 64
+#define FAT32_MEMORY_NUM_FATS 2
+
+static uint16_t get_u16(const HDByte_t* bytes)
+{
+	return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t get_u32(const HDByte_t* bytes)
+{
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void put_u16(HDByte_t* bytes, uint16_t value)
+{
+	bytes[0] = (HDByte_t)value;
+	bytes[1] = (HDByte_t)(value >> 8);
+}
+
+static void put_u32(HDByte_t* bytes, uint32_t value)
+{
+	put_u16(bytes, (uint16_t)value);
+	put_u16(bytes + 2, (uint16_t)(value >> 16));
+}
+
+static int is_power_of_two(uint32_t value)
+{
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+/* Returns the base 2 logarithm of a power of two. */
+static uint32_t log2_of(uint32_t value)
+{
+	uint32_t result = 0;
+	while ((value >> result) > 1)
+	{
+		++result;
+	}
+
+	return result;
+}
+
+/* Returns a pointer to the table entry for the given index, loading its chunk if necessary. */
+static FAT32_cluster_address_t* get_table_slot(struct FAT32_volume_t* volume, uint32_t index)
+{
+	const uint32_t chunk = index / FAT32_TABLE_CHUNK_ENTRIES;
+	const uint64_t bit = (uint64_t)1 << (chunk % 64);
+
+	if ((FAT32_atomic_load64(&volume->loaded_chunks[chunk / 64]) & bit) == 0)
+	{
+		FAT32_mutex_lock(&volume->table_mutex);
+
+		// Another thread may have loaded it while we waited
+		if ((volume->loaded_chunks[chunk / 64] & bit) == 0)
+		{
+			const uint32_t first = chunk * FAT32_TABLE_CHUNK_ENTRIES;
+			uint32_t count = volume->num_entries - first;
+			count = count < FAT32_TABLE_CHUNK_ENTRIES ? count : FAT32_TABLE_CHUNK_ENTRIES;
+
+			const uint64_t offset = volume->fat_offset + volume->active_fat * volume->fat_size + first * sizeof(FAT32_cluster_address_t);
+			if (!FAT32_device_read(&volume->device, offset, &volume->table[first], count * sizeof(FAT32_cluster_address_t)))
+			{
+				// Treat anything unreadable as bad, so it's never allocated or followed
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					volume->table[first + i].index = FAT32_CLUSTER_ADDRESS_BAD;
+				}
+			}
+
+			FAT32_atomic_fetch_or64(&volume->loaded_chunks[chunk / 64], bit);
+		}
+
+		FAT32_mutex_unlock(&volume->table_mutex);
+	}
+
+	return &volume->table[index];
+}
+
+void FAT32_write_table_copies(struct FAT32_volume_t* volume, uint32_t first, uint32_t count)
+{
+	for (uint32_t fat = 0; fat < volume->num_fats; ++fat)
+	{
+		if (volume->mirror_fats || fat == volume->active_fat)
+		{
+			const uint64_t offset = volume->fat_offset + fat * volume->fat_size + first * sizeof(FAT32_cluster_address_t);
+			FAT32_device_write(&volume->device, offset, &volume->table[first], count * sizeof(FAT32_cluster_address_t));
+		}
+	}
+}
+
+/* Writes a run of (loaded) table entries to each copy of the table, or leaves them for the journal to commit. */
+static void write_table_range(struct FAT32_volume_t* volume, uint32_t first, uint32_t count)
+{
+	if (volume->journal_active)
+	{
+		FAT32_journal_mark_table(volume, first, count);
+	}
+	else
+	{
+		FAT32_write_table_copies(volume, first, count);
+	}
+}
+
+/* Writes the given table entry to each copy of the table. */
+static void write_table_entry(struct FAT32_volume_t* volume, uint32_t index)
+{
+	write_table_range(volume, index, 1);
+}
+
+void FAT32_mark_volume_shared(struct FAT32_volume_t* volume)
+{
+	if (volume->fsinfo_offset == 0 || (volume->fsinfo_flags & FAT32_FSINFO_FLAG_SHARED))
+	{
+		return;
+	}
+
+	// The flag has to be on the disk before anything it protects
+	HDByte_t flags[sizeof(uint32_t)];
+	volume->fsinfo_flags |= FAT32_FSINFO_FLAG_SHARED;
+	put_u32(flags, volume->fsinfo_flags);
+	FAT32_device_write(&volume->device, volume->fsinfo_offset + FAT32_FSINFO_FLAGS_OFFSET, flags, sizeof(flags));
+	FAT32_device_flush(&volume->device);
+}
+
+int FAT32_is_unzeroed(const struct FAT32_volume_t* volume, uint32_t index)
+{
+	return (FAT32_atomic_load64(&volume->unzeroed[index / 64]) >> (index % 64)) & 1;
+}
+
+/* Clears the 'unzeroed' bit for the given cluster, and returns whether it was set. */
+static int take_unzeroed(struct FAT32_volume_t* volume, uint32_t index)
+{
+	const uint64_t bit = (uint64_t)1 << (index % 64);
+	return (FAT32_atomic_load64(&volume->unzeroed[index / 64]) & bit) != 0 &&
+		(FAT32_atomic_fetch_and64(&volume->unzeroed[index / 64], ~bit) & bit) != 0;
+}
+
+/* Returns the position of the first free extent that starts after the given index. */
+static uint32_t find_free_extent(const struct FAT32_volume_t* volume, uint32_t index)
+{
+	uint32_t low = 0;
+	uint32_t high = volume->num_free_extents;
+
+	while (low < high)
+	{
+		const uint32_t mid = low + (high - low) / 2;
+		if (volume->free_extents[mid].start <= index)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+/* Inserts a free extent at the given position. If there's no room for it, the free extents are no longer valid. */
+static void insert_free_extent(struct FAT32_volume_t* volume, uint32_t pos, uint32_t start, uint32_t length)
+{
+	if (volume->num_free_extents == volume->max_free_extents)
+	{
+		volume->free_extents_valid = 0;
+		volume->num_free_extents = 0;
+		return;
+	}
+
+	memmove(&volume->free_extents[pos + 1], &volume->free_extents[pos], (volume->num_free_extents - pos) * sizeof(struct FAT32_extent_t));
+	volume->free_extents[pos].start = start;
+	volume->free_extents[pos].length = length;
+	volume->num_free_extents += 1;
+}
+
+static void remove_free_extent(struct FAT32_volume_t* volume, uint32_t pos)
+{
+	volume->num_free_extents -= 1;
+	memmove(&volume->free_extents[pos], &volume->free_extents[pos + 1], (volume->num_free_extents - pos) * sizeof(struct FAT32_extent_t));
+}
+
+/* Adds a cluster that was just freed to the free extents, merging it with its neighbours. */
+static void add_free_cluster(struct FAT32_volume_t* volume, uint32_t index)
+{
+	struct FAT32_extent_t* extents = volume->free_extents;
+	const uint32_t pos = find_free_extent(volume, index);
+	const int joinsNext = pos < volume->num_free_extents && extents[pos].start == index + 1;
+
+	if (pos > 0 && extents[pos - 1].start + extents[pos - 1].length >= index)
+	{
+		// Extend the previous extent (unless it already covers this cluster)
+		if (extents[pos - 1].start + extents[pos - 1].length == index)
+		{
+			extents[pos - 1].length += 1;
+			if (joinsNext)
+			{
+				extents[pos - 1].length += extents[pos].length;
+				remove_free_extent(volume, pos);
+			}
+		}
+	}
+	else if (joinsNext)
+	{
+		extents[pos].start -= 1;
+		extents[pos].length += 1;
+	}
+	else
+	{
+		insert_free_extent(volume, pos, index, 1);
+	}
+}
+
+/* Removes a cluster that was just allocated from the free extents. */
+static void remove_free_cluster(struct FAT32_volume_t* volume, uint32_t index)
+{
+	struct FAT32_extent_t* extents = volume->free_extents;
+	const uint32_t pos = find_free_extent(volume, index);
+
+	// If no extent covers it, there's nothing to do
+	if (pos == 0 || extents[pos - 1].start + extents[pos - 1].length <= index)
+	{
+		return;
+	}
+
+	struct FAT32_extent_t* extent = &extents[pos - 1];
+	const uint32_t end = extent->start + extent->length;
+
+	if (index == extent->start)
+	{
+		extent->start += 1;
+		extent->length -= 1;
+		if (extent->length == 0)
+		{
+			remove_free_extent(volume, pos - 1);
+		}
+	}
+	else
+	{
+		// Split the extent around the cluster
+		extent->length = index - extent->start;
+		if (index + 1 < end)
+		{
+			insert_free_extent(volume, pos, index + 1, end - index - 1);
+		}
+	}
+}
+
+/* Rebuilds the free extents from the (fully loaded) table. Returns the number of free clusters. */
+static uint32_t rebuild_free_extents(struct FAT32_volume_t* volume)
+{
+	uint32_t freeCount = 0;
+
+	volume->num_free_extents = 0;
+	volume->free_extents_valid = 1;
+	for (uint32_t index = FAT32_FIRST_CLUSTER; index < volume->num_entries; ++index)
+	{
+		if (volume->table[index].index != FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			continue;
+		}
+
+		freeCount += 1;
+		if (!volume->free_extents_valid)
+		{
+			continue;
+		}
+
+		const uint32_t last = volume->num_free_extents;
+		if (last > 0 && volume->free_extents[last - 1].start + volume->free_extents[last - 1].length == index)
+		{
+			volume->free_extents[last - 1].length += 1;
+		}
+		else
+		{
+			insert_free_extent(volume, last, index, 1);
+		}
+	}
+
+	return freeCount;
+}
+
+/* Sets a table entry in memory only, keeping track of free space. */
+static void update_table_entry(struct FAT32_volume_t* volume, uint32_t index, uint32_t value)
+{
+	// Preserve the reserved bits of the entry
+	FAT32_cluster_address_t* entry = get_table_slot(volume, index);
+	const uint32_t previous = entry->index;
+	entry->index = value;
+
+	if (index < FAT32_FIRST_CLUSTER)
+	{
+		return;
+	}
+
+	if (previous == FAT32_CLUSTER_ADDRESS_NULL && value != FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		volume->free_count -= 1;
+		if (volume->free_extents_valid)
+		{
+			remove_free_cluster(volume, index);
+		}
+	}
+	else if (previous != FAT32_CLUSTER_ADDRESS_NULL && value == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		volume->free_count += 1;
+		if (volume->free_extents_valid)
+		{
+			add_free_cluster(volume, index);
+		}
+
+		// Whatever it held no longer matters
+		FAT32_cluster_address_t address;
+		address.index = index;
+		take_unzeroed(volume, index);
+		FAT32_entry_cache_drop(volume, address);
+	}
+}
+
+FAT32_cluster_address_t FAT32_get_table_entry(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return *get_table_slot(volume, address.index);
+}
+
+void FAT32_set_table_entry(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, FAT32_cluster_address_t value)
+{
+	update_table_entry(volume, address.index, value.index);
+
+	// Write it to each copy of the table
+	write_table_entry(volume, address.index);
+}
+
+FAT32_cluster_address_t* FAT32_get_table(struct FAT32_volume_t* volume)
+{
+	if (!volume->table_complete)
+	{
+		for (uint32_t index = 0; index < volume->num_entries; index += FAT32_TABLE_CHUNK_ENTRIES)
+		{
+			get_table_slot(volume, index);
+		}
+
+		// Now that we can see everything, the free space can be recounted
+		volume->free_count = rebuild_free_extents(volume);
+		volume->table_complete = 1;
+	}
+
+	return volume->table;
+}
+
+int FAT32_is_valid_cluster(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return address.index >= FAT32_FIRST_CLUSTER && address.index < volume->num_entries;
+}
+
+int FAT32_read_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size)
+{
+	// Clusters are only checked the first time they're read
+	if (volume->checksums && !FAT32_checksum_is_verified(volume, address))
+	{
+		return FAT32_checksum_read(volume, address, offset, buffer, size);
+	}
+
+	FAT32_read_cluster_unverified(volume, address, offset, buffer, size);
+	return 1;
+}
+
+void FAT32_read_cluster_unverified(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size)
+{
+	// Clusters that have never been written are all zeroes, whatever is on the device
+	if (FAT32_is_unzeroed(volume, address.index))
+	{
+		memset(buffer, 0, size);
+	}
+	else
+	{
+		FAT32_device_read(&volume->device, FAT32_get_cluster_offset(volume, address) + offset, buffer, size);
+	}
+
+	// Entries that haven't been written back yet are newer than the device
+	FAT32_entry_cache_overlay(volume, address, offset, buffer, size);
+}
+
+void FAT32_write_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size)
+{
+	// The checksum is worked out from the bytes being replaced, so nothing else may write to the cluster in the meantime
+	if (volume->checksums)
+	{
+		FAT32_checksum_lock(volume, address);
+		FAT32_checksum_write(volume, address, offset, buffer, size);
+	}
+
+	FAT32_entry_cache_absorb(volume, address, offset, buffer, size);
+	FAT32_write_cluster_uncached(volume, address, offset, buffer, size);
+
+	if (volume->checksums)
+	{
+		FAT32_checksum_unlock(volume, address);
+	}
+}
+
+void FAT32_write_cluster_uncached(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size)
+{
+	// The first write to a new cluster zeroes whatever it doesn't cover, so nothing stale can be read back
+	if (take_unzeroed(volume, address.index))
+	{
+		const uint64_t clusterOffset = FAT32_get_cluster_offset(volume, address);
+		if (offset > 0)
+		{
+			FAT32_device_write(&volume->device, clusterOffset, volume->zero_cluster, offset);
+		}
+		if (offset + size < volume->cluster_size)
+		{
+			FAT32_device_write(&volume->device, clusterOffset + offset + size, volume->zero_cluster, volume->cluster_size - offset - size);
+		}
+	}
+
+	FAT32_device_write(&volume->device, FAT32_get_cluster_offset(volume, address) + offset, buffer, size);
+}
+
+/* Creates a tiny FAT32 volume in memory, with an empty root directory. */
+static void format_memory_volume(struct FAT32_volume_t* volume)
+{
+	const uint32_t bytesPerSector = FAT32_MEMORY_BYTES_PER_SECTOR;
+	const uint32_t reservedSectors = FAT32_MEMORY_RESERVED_SIZE / bytesPerSector;
+	const uint32_t fatSectors = ((FAT32_MEMORY_NUM_CLUSTERS + FAT32_FIRST_CLUSTER) * sizeof(FAT32_cluster_address_t) + bytesPerSector - 1) / bytesPerSector;
+	const uint32_t totalSectors = reservedSectors + FAT32_MEMORY_NUM_FATS * fatSectors + FAT32_MEMORY_NUM_CLUSTERS;
+
+	FAT32_device_open_memory(&volume->device, (uint64_t)totalSectors * bytesPerSector);
+
+	// Write the boot sector
+	HDByte_t sector[FAT32_BOOT_SECTOR_SIZE];
+	memset(sector, 0, sizeof(sector));
+	sector[0] = 0xEB;
+	sector[1] = 0x58;
+	sector[2] = 0x90;
+	memcpy(&sector[3], "FAT32SB ", 8);
+	put_u16(&sector[11], (uint16_t)bytesPerSector);
+	sector[13] = 1;
+	put_u16(&sector[14], (uint16_t)reservedSectors);
+	sector[16] = FAT32_MEMORY_NUM_FATS;
+	sector[21] = 0xF8;
+	put_u32(&sector[32], totalSectors);
+	put_u32(&sector[36], fatSectors);
+	put_u32(&sector[44], FAT32_FIRST_CLUSTER);
+	put_u16(&sector[48], (uint16_t)(FAT32_BOOT_SECTOR_SIZE / bytesPerSector));
+	sector[66] = 0x29;
+	memcpy(&sector[71], "NO NAME    ", 11);
+	memcpy(&sector[82], "FAT32   ", 8);
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	FAT32_device_write(&volume->device, 0, sector, sizeof(sector));
+
+	// Write the FSInfo sector (the root directory takes one cluster)
+	memset(sector, 0, sizeof(sector));
+	put_u32(&sector[0], FAT32_FSINFO_LEAD_SIGNATURE);
+	put_u32(&sector[484], FAT32_FSINFO_STRUCT_SIGNATURE);
+	put_u32(&sector[488], FAT32_MEMORY_NUM_CLUSTERS - 1);
+	put_u32(&sector[492], FAT32_FIRST_CLUSTER + 1);
+	put_u32(&sector[508], FAT32_FSINFO_TRAIL_SIGNATURE);
+	FAT32_device_write(&volume->device, FAT32_BOOT_SECTOR_SIZE, sector, sizeof(sector));
+
+	// Write the reserved table entries, and terminate the root directory
+	HDByte_t entries[3 * sizeof(FAT32_cluster_address_t)];
+	put_u32(&entries[0], 0x0FFFFF00 | sector[21]);
+	put_u32(&entries[4], FAT32_CLUSTER_ADDRESS_EOC);
+	put_u32(&entries[8], FAT32_CLUSTER_ADDRESS_EOC);
+
+	for (uint32_t fat = 0; fat < FAT32_MEMORY_NUM_FATS; ++fat)
+	{
+		FAT32_device_write(&volume->device, (uint64_t)(reservedSectors + fat * fatSectors) * bytesPerSector, entries, sizeof(entries));
+	}
+}
+
+/* Returns the checksum of a free extent summary, which also covers the FSInfo hints it was saved with. */
+static uint32_t summary_checksum(const HDByte_t* header, const HDByte_t* extents, uint32_t numExtents, uint32_t freeCount, uint32_t nextFree)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	HDByte_t hints[2 * sizeof(uint32_t)];
+	put_u32(&hints[0], freeCount);
+	put_u32(&hints[4], nextFree);
+
+	for (uint32_t i = 0; i < 12; ++i)
+	{
+		hash = (hash ^ header[i]) * 16777619u;
+	}
+	for (uint32_t i = 0; i < sizeof(hints); ++i)
+	{
+		hash = (hash ^ hints[i]) * 16777619u;
+	}
+	for (uint32_t i = 0; i < numExtents * FAT32_SUMMARY_EXTENT_SIZE; ++i)
+	{
+		hash = (hash ^ extents[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* Loads the persisted free extent summary. Returns 0 if it's missing, or doesn't match the rest of the volume. */
+static int load_summary(struct FAT32_volume_t* volume, uint32_t generation)
+{
+
+	HDByte_t header[FAT32_SUMMARY_HEADER_SIZE];
+	if (!FAT32_device_read(&volume->device, volume->summary_offset, header, sizeof(header)) ||
+		get_u32(&header[0]) != FAT32_SUMMARY_MAGIC || get_u32(&header[4]) != generation || get_u32(&header[8]) > volume->max_free_extents)
+	{
+		return 0;
+	}
+
+	const uint32_t numExtents = get_u32(&header[8]);
+	HDByte_t* extents = (HDByte_t*)malloc(numExtents * FAT32_SUMMARY_EXTENT_SIZE + 1);
+	int valid = FAT32_device_read(&volume->device, volume->summary_offset + sizeof(header), extents, numExtents * FAT32_SUMMARY_EXTENT_SIZE) &&
+		summary_checksum(header, extents, numExtents, volume->free_count, volume->next_free) == get_u32(&header[12]);
+
+	// The extents must be sorted, separate and on the volume
+	uint32_t end = FAT32_FIRST_CLUSTER;
+	for (uint32_t i = 0; valid && i < numExtents; ++i)
+	{
+		const uint32_t start = get_u32(&extents[i * FAT32_SUMMARY_EXTENT_SIZE]);
+		const uint32_t length = get_u32(&extents[i * FAT32_SUMMARY_EXTENT_SIZE + 4]);
+
+		valid = start >= end && length > 0 && length <= volume->num_entries - start;
+		volume->free_extents[i].start = start;
+		volume->free_extents[i].length = length;
+		end = start + length;
+	}
+
+	volume->num_free_extents = valid ? numExtents : 0;
+	volume->free_extents_valid = valid;
+	free(extents);
+	return valid;
+}
+
+/* Persists the free extents, under a new generation. */
+static void save_summary(struct FAT32_volume_t* volume)
+{
+	const uint32_t numExtents = volume->num_free_extents;
+
+	// If they aren't valid, moving to a new generation is enough to invalidate the old summary
+	volume->summary_generation += 1;
+	if (!volume->free_extents_valid)
+	{
+		return;
+	}
+
+	HDByte_t* buffer = (HDByte_t*)malloc(FAT32_SUMMARY_HEADER_SIZE + numExtents * FAT32_SUMMARY_EXTENT_SIZE);
+	HDByte_t* extents = buffer + FAT32_SUMMARY_HEADER_SIZE;
+	for (uint32_t i = 0; i < numExtents; ++i)
+	{
+		put_u32(&extents[i * FAT32_SUMMARY_EXTENT_SIZE], volume->free_extents[i].start);
+		put_u32(&extents[i * FAT32_SUMMARY_EXTENT_SIZE + 4], volume->free_extents[i].length);
+	}
+
+	put_u32(&buffer[0], FAT32_SUMMARY_MAGIC);
+	put_u32(&buffer[4], volume->summary_generation);
+	put_u32(&buffer[8], numExtents);
+	put_u32(&buffer[12], summary_checksum(buffer, extents, numExtents, volume->free_count, volume->next_free));
+
+	FAT32_device_write(&volume->device, volume->summary_offset, buffer, FAT32_SUMMARY_HEADER_SIZE + numExtents * FAT32_SUMMARY_EXTENT_SIZE);
+	free(buffer);
+}
+
+/* Reads the boot sector and FSInfo sector of the device. The File Allocation Table is read as it's used. */
+static int mount_volume(struct FAT32_volume_t* volume, const char* path)
+{
+	HDByte_t sector[FAT32_BOOT_SECTOR_SIZE];
+	if (!FAT32_device_read(&volume->device, 0, sector, sizeof(sector)) || sector[510] != 0x55 || sector[511] != 0xAA)
+	{
+		return 0;
+	}
+
+	// Parse the BIOS Parameter Block
+	const uint32_t bytesPerSector = get_u16(&sector[11]);
+	const uint32_t sectorsPerCluster = sector[13];
+	const uint32_t reservedSectors = get_u16(&sector[14]);
+	const uint32_t numFats = sector[16];
+	const uint32_t numRootEntries = get_u16(&sector[17]);
+	const uint32_t totalSectors = get_u16(&sector[19]) ? get_u16(&sector[19]) : get_u32(&sector[32]);
+	const uint32_t fatSectors = get_u32(&sector[36]);
+	const uint32_t extFlags = get_u16(&sector[40]);
+	const uint32_t fsinfoSector = get_u16(&sector[48]);
+
+	// FAT32 volumes have no fixed root directory, and only use the 32-bit FAT size
+	if (!is_power_of_two(bytesPerSector) || !is_power_of_two(sectorsPerCluster) || reservedSectors == 0 || numFats == 0 ||
+		numRootEntries != 0 || get_u16(&sector[22]) != 0 || fatSectors == 0)
+	{
+		return 0;
+	}
+
+	volume->bytes_per_sector = bytesPerSector;
+	volume->cluster_size = bytesPerSector * sectorsPerCluster;
+	volume->cluster_shift = log2_of(volume->cluster_size);
+	volume->cluster_mask = volume->cluster_size - 1;
+	volume->num_fats = numFats;
+	volume->mirror_fats = (extFlags & FAT32_EXT_FLAGS_NO_MIRRORING) == 0;
+	volume->active_fat = volume->mirror_fats ? 0 : extFlags & 0x0F;
+	volume->fat_offset = (uint64_t)reservedSectors * bytesPerSector;
+	volume->fat_size = (uint64_t)fatSectors * bytesPerSector;
+	volume->data_offset = volume->fat_offset + numFats * volume->fat_size;
+
+	if (volume->active_fat >= numFats || volume->data_offset >= volume->device.size)
+	{
+		return 0;
+	}
+
+	// Work out how many clusters there are, limited by the size of the table and the image
+	uint64_t numClusters = ((uint64_t)totalSectors * bytesPerSector - volume->data_offset) >> volume->cluster_shift;
+	if (numClusters > volume->fat_size / sizeof(FAT32_cluster_address_t) - FAT32_FIRST_CLUSTER)
+	{
+		numClusters = volume->fat_size / sizeof(FAT32_cluster_address_t) - FAT32_FIRST_CLUSTER;
+	}
+	if (numClusters > (volume->device.size - volume->data_offset) >> volume->cluster_shift)
+	{
+		numClusters = (volume->device.size - volume->data_offset) >> volume->cluster_shift;
+	}
+	if (numClusters > FAT32_CLUSTER_ADDRESS_BAD - FAT32_FIRST_CLUSTER)
+	{
+		numClusters = FAT32_CLUSTER_ADDRESS_BAD - FAT32_FIRST_CLUSTER;
+	}
+	volume->num_entries = (uint32_t)numClusters + FAT32_FIRST_CLUSTER;
+
+	volume->root.index = get_u32(&sector[44]);
+	if (!FAT32_is_valid_cluster(volume, volume->root))
+	{
+		return 0;
+	}
+
+	// Set up the table, to be loaded as it's used. Untouched pages of it are never committed.
+	const uint32_t numChunks = (volume->num_entries + FAT32_TABLE_CHUNK_ENTRIES - 1) / FAT32_TABLE_CHUNK_ENTRIES;
+	volume->table = (FAT32_cluster_address_t*)malloc(sizeof(FAT32_cluster_address_t) * volume->num_entries);
+	volume->loaded_chunks = (volatile uint64_t*)calloc((numChunks + 63) / 64, sizeof(uint64_t));
+	volume->unzeroed = (volatile uint64_t*)calloc((volume->num_entries + 63) / 64, sizeof(uint64_t));
+	FAT32_mutex_init(&volume->table_mutex);
+	FAT32_entry_cache_init(volume);
+
+	volume->zero_cluster = (HDByte_t*)calloc(volume->cluster_size, 1);
+
+	// Use the free space hints, if there are any
+	const uint32_t backupSector = get_u16(&sector[50]);
+	uint32_t generation = 0;
+	volume->fsinfo_offset = 0;
+	volume->free_count = FAT32_FSINFO_UNKNOWN;
+	volume->next_free = FAT32_FSINFO_UNKNOWN;
+
+	if (fsinfoSector != 0 && fsinfoSector < reservedSectors &&
+		FAT32_device_read(&volume->device, (uint64_t)fsinfoSector * bytesPerSector, sector, sizeof(sector)) &&
+		get_u32(&sector[0]) == FAT32_FSINFO_LEAD_SIGNATURE && get_u32(&sector[484]) == FAT32_FSINFO_STRUCT_SIGNATURE)
+	{
+		volume->fsinfo_offset = (uint64_t)fsinfoSector * bytesPerSector;
+		volume->free_count = get_u32(&sector[488]);
+		volume->next_free = get_u32(&sector[492]);
+		generation = get_u32(&sector[FAT32_FSINFO_GENERATION_OFFSET]);
+		volume->fsinfo_flags = get_u32(&sector[FAT32_FSINFO_FLAGS_OFFSET]);
+	}
+
+	// Find room for the free extent summary, after the boot record, FSInfo and their backups (laid out as in FAT32Internal.h)
+	uint32_t firstSpareSector = FAT32_BOOT_RECORD_SECTORS;
+	if (volume->fsinfo_offset != 0 && fsinfoSector + 1 > firstSpareSector)
+	{
+		firstSpareSector = fsinfoSector + 1;
+	}
+	if (backupSector != 0 && backupSector < reservedSectors && backupSector + FAT32_BOOT_RECORD_SECTORS > firstSpareSector)
+	{
+		firstSpareSector = backupSector + FAT32_BOOT_RECORD_SECTORS;
+	}
+
+	uint64_t summaryOffset = (uint64_t)firstSpareSector * bytesPerSector;
+	summaryOffset = summaryOffset > FAT32_SUMMARY_MIN_OFFSET ? summaryOffset : FAT32_SUMMARY_MIN_OFFSET;
+	summaryOffset = (summaryOffset + bytesPerSector - 1) / bytesPerSector * bytesPerSector;
+
+	// Neither the summary nor the journal is kept unless the volume reserves the sectors for them
+	const int hasSpareSectors = summaryOffset < volume->fat_offset;
+
+	// Image files keep a metadata journal at the end of the reserved sectors, taking up to half the room after the summary
+	uint64_t summaryEnd = volume->fat_offset;
+	if (volume->device.fd >= 0 && hasSpareSectors)
+	{
+		uint64_t journalSize = (volume->fat_offset - summaryOffset) / 2;
+		journalSize = journalSize < FAT32_JOURNAL_MAX_SIZE ? journalSize : FAT32_JOURNAL_MAX_SIZE;
+		journalSize = journalSize / bytesPerSector * bytesPerSector;
+
+		if (journalSize >= FAT32_JOURNAL_MIN_SECTORS * bytesPerSector)
+		{
+			volume->journal_offset = volume->fat_offset - journalSize;
+			volume->journal_size = journalSize;
+			summaryEnd = volume->journal_offset;
+		}
+	}
+
+	volume->max_free_extents = FAT32_DEFAULT_MAX_FREE_EXTENTS;
+	if (volume->fsinfo_offset != 0 && hasSpareSectors && summaryOffset + FAT32_SUMMARY_HEADER_SIZE + FAT32_SUMMARY_EXTENT_SIZE <= summaryEnd)
+	{
+		volume->summary_offset = summaryOffset;
+		volume->max_free_extents = (uint32_t)((summaryEnd - summaryOffset - FAT32_SUMMARY_HEADER_SIZE) / FAT32_SUMMARY_EXTENT_SIZE);
+	}
+	volume->free_extents = (struct FAT32_extent_t*)malloc(sizeof(struct FAT32_extent_t) * volume->max_free_extents);
+
+	// Finish anything committed to the journal before the table is read
+	const int replayed = volume->journal_offset != 0 ? FAT32_journal_open(volume) : 0;
+
+	// The summary can only be trusted if the volume was unmounted cleanly since it was saved
+	FAT32_cluster_address_t state;
+	state.index = 1;
+	const int clean = replayed == 0 && (FAT32_get_table_entry(volume, state).index & FAT32_CLEAN_SHUTDOWN_BIT) != 0;
+
+	if (volume->summary_offset != 0 && clean && load_summary(volume, generation))
+	{
+		volume->summary_generation = generation;
+	}
+
+	// Nor can the free cluster count
+	if (!clean)
+	{
+		volume->free_count = FAT32_FSINFO_UNKNOWN;
+	}
+
+	// Mark the volume as in use until it's unmounted
+	get_table_slot(volume, state.index)->index &= ~FAT32_CLEAN_SHUTDOWN_BIT;
+	write_table_entry(volume, state.index);
+	FAT32_device_flush(&volume->device);
+
+	if (volume->free_count > volume->num_entries - FAT32_FIRST_CLUSTER)
+	{
+		// No usable hint, so count them
+		FAT32_get_table(volume);
+	}
+
+	if (volume->next_free < FAT32_FIRST_CLUSTER || volume->next_free >= volume->num_entries)
+	{
+		volume->next_free = FAT32_FIRST_CLUSTER;
+	}
+
+	// Checksums saved with the image are only trusted under the same conditions as the summary
+	if (volume->mount_flags & FAT32_MOUNT_CHECKSUMS)
+	{
+		FAT32_checksums_open(volume, path, clean, generation);
+	}
+
+	// As are the counts of references to clusters shared between clones
+	FAT32_shares_open(volume, path, clean, generation, (volume->fsinfo_flags & FAT32_FSINFO_FLAG_SHARED) != 0);
+
+	// From here on, metadata changes go through the journal
+	volume->journal_active = volume->journal_offset != 0;
+
+	return 1;
+}
+
+/* Releases everything held by the volume, without writing anything. */
+static void release_volume(struct FAT32_volume_t* volume)
+{
+	FAT32_device_close(&volume->device);
+	FAT32_mutex_destroy(&volume->clock_mutex);
+	FAT32_entry_cache_release(volume);
+	FAT32_journal_release(volume);
+	FAT32_checksums_release(volume);
+	FAT32_shares_release(volume);
+	FAT32_mutex_destroy(&volume->share_mutex);
+
+	if (volume->loaded_chunks)
+	{
+		FAT32_mutex_destroy(&volume->table_mutex);
+	}
+
+	free(volume->table);
+	free((void*)volume->loaded_chunks);
+	free((void*)volume->unzeroed);
+	free(volume->free_extents);
+	free(volume->zero_cluster);
+	free(volume);
+}
+
+/* Converts the given time to the packed date and time of directory entries. */
+static void pack_local_time(time_t t, uint16_t* outDate, uint16_t* outTime)
+{
+	// Unlike 'localtime', these are safe to call from multiple threads
+	struct tm tm;
+#ifdef _WIN32
+	localtime_s(&tm, &t);
+#else
+	localtime_r(&t, &tm);
+#endif
+
+	*outDate = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+	*outTime = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+}
+
+struct FAT32_clock_t FAT32_get_clock(struct FAT32_volume_t* volume)
+{
+	const time_t now = time(NULL);
+	const int64_t tick = (int64_t)now & ~(int64_t)1;
+
+	FAT32_mutex_lock(&volume->clock_mutex);
+
+	// Only convert the time when it has moved on far enough to show
+	if (volume->clock.tick != tick)
+	{
+		uint16_t unused;
+		pack_local_time(now, &volume->clock.date, &volume->clock.time);
+		pack_local_time(now - 24 * 60 * 60, &volume->clock.yesterday, &unused);
+		volume->clock.tick = tick;
+	}
+
+	const struct FAT32_clock_t result = volume->clock;
+	FAT32_mutex_unlock(&volume->clock_mutex);
+
+	return result;
+}
+
+struct FAT32_volume_t* FAT32_init(const char* path, FAT32_mount_flags_t flags)
+{
+	struct FAT32_volume_t* volume = (struct FAT32_volume_t*)calloc(1, sizeof(struct FAT32_volume_t));
+	volume->mount_flags = flags;
+	volume->clock.tick = -1;
+	FAT32_mutex_init(&volume->clock_mutex);
+	volume->share_device.fd = -1;
+	FAT32_mutex_init(&volume->share_mutex);
+
+	if (path)
+	{
+		if (!FAT32_device_open(&volume->device, path))
+		{
+			release_volume(volume);
+			return NULL;
+		}
+	}
+	else
+	{
+		format_memory_volume(volume);
+	}
+
+	if (!mount_volume(volume, path))
+	{
+		release_volume(volume);
+		return NULL;
+	}
+
+	return volume;
+}
+
+void FAT32_shutdown(struct FAT32_volume_t* volume)
+{
+	// Write everything in place, so the journal is empty while the volume isn't mounted
+	if (volume->journal_active)
+	{
+		FAT32_journal_close(volume);
+	}
+	FAT32_entry_cache_flush(volume);
+
+	// Anything allocated but never written still has to be zeroed on the device
+	for (uint32_t word = 0; word < (volume->num_entries + 63) / 64; ++word)
+	{
+		while (volume->unzeroed[word] != 0)
+		{
+			FAT32_cluster_address_t address;
+			address.index = word * 64;
+			while (((volume->unzeroed[word] >> (address.index % 64)) & 1) == 0)
+			{
+				++address.index;
+			}
+
+			FAT32_write_cluster(volume, address, 0, volume->zero_cluster, volume->cluster_size);
+		}
+	}
+
+	// Save the free space hints, and the summary that goes with them
+	if (volume->fsinfo_offset != 0)
+	{
+		if (volume->summary_offset != 0)
+		{
+			save_summary(volume);
+		}
+
+		HDByte_t hints[2 * sizeof(uint32_t)];
+		put_u32(&hints[0], volume->free_count);
+		put_u32(&hints[4], volume->next_free);
+		FAT32_device_write(&volume->device, volume->fsinfo_offset + 488, hints, sizeof(hints));
+
+		// The shared flag only clears once nothing is shared any more
+		if (FAT32_atomic_load64(&volume->num_shared_clusters) == 0)
+		{
+			volume->fsinfo_flags &= ~(uint32_t)FAT32_FSINFO_FLAG_SHARED;
+		}
+
+		put_u32(&hints[0], volume->summary_generation);
+		put_u32(&hints[4], volume->fsinfo_flags);
+		FAT32_device_write(&volume->device, volume->fsinfo_offset + FAT32_FSINFO_GENERATION_OFFSET, hints, sizeof(hints));
+	}
+
+	// The checksums are saved under the same generation
+	if (volume->checksums)
+	{
+		FAT32_checksums_save(volume);
+	}
+	FAT32_shares_save(volume);
+
+	// Only mark the volume clean once everything else is on disk
+	FAT32_device_flush(&volume->device);
+	get_table_slot(volume, 1)->index |= FAT32_CLEAN_SHUTDOWN_BIT;
+	write_table_entry(volume, 1);
+	FAT32_device_flush(&volume->device);
+
+	release_volume(volume);
+}
+
+void FAT32_sync(struct FAT32_volume_t* volume)
+{
+	if (volume->journal_active)
+	{
+		FAT32_journal_commit(volume);
+	}
+	else
+	{
+		FAT32_entry_cache_flush(volume);
+	}
+
+	FAT32_device_flush(&volume->device);
+}
+
+FAT32_mount_flags_t FAT32_get_mount_flags(const struct FAT32_volume_t* volume)
+{
+	return volume->mount_flags;
+}
+
+FAT32_cluster_address_t FAT32_get_root(const struct FAT32_volume_t* volume)
+{
+	return volume->root;
+}
+
+FAT32_cluster_address_t FAT32_new_cluster(struct FAT32_volume_t* volume)
+{
+	FAT32_journal_begin(volume);
+
+	FAT32_cluster_address_t result;
+	result.index = FAT32_CLUSTER_ADDRESS_NULL;
+
+	// Don't bother searching a full volume
+	if (volume->free_count == 0)
+	{
+		FAT32_journal_end(volume);
+		return result;
+	}
+
+	// Use the free extents if we have them, starting from where the last allocation left off
+	if (volume->free_extents_valid && volume->num_free_extents > 0)
+	{
+		const uint32_t pos = find_free_extent(volume, volume->next_free);
+		if (pos > 0 && volume->free_extents[pos - 1].start + volume->free_extents[pos - 1].length > volume->next_free)
+		{
+			result.index = volume->next_free;
+		}
+		else
+		{
+			result.index = volume->free_extents[pos < volume->num_free_extents ? pos : 0].start;
+		}
+
+		// If the extents are out of date, stop relying on them
+		if (FAT32_get_table_entry(volume, result).index != FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			volume->free_extents_valid = 0;
+			volume->num_free_extents = 0;
+			result.index = FAT32_CLUSTER_ADDRESS_NULL;
+		}
+	}
+
+	if (result.index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		result.index = volume->next_free;
+
+		// For each cluster address, starting from where the last allocation left off
+		for (uint32_t i = FAT32_FIRST_CLUSTER; i < volume->num_entries; ++i)
+		{
+			// If the FAT value for this address is NULL, it's unused
+			if (FAT32_get_table_entry(volume, result).index == FAT32_CLUSTER_ADDRESS_NULL)
+			{
+				break;
+			}
+
+			result.index = (uint32_t)result.index + 1 < volume->num_entries ? result.index + 1 : FAT32_FIRST_CLUSTER;
+		}
+	}
+
+	// The search comes back around to where it started if every cluster is taken
+	if (FAT32_get_table_entry(volume, result).index != FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		result.index = FAT32_CLUSTER_ADDRESS_NULL;
+		FAT32_journal_end(volume);
+		return result;
+	}
+	FAT32_journal_reuse_cluster(volume, result);
+
+	// Set the value as the EOC value
+	FAT32_cluster_address_t resultValue;
+	resultValue.index = FAT32_CLUSTER_ADDRESS_EOC;
+	FAT32_set_table_entry(volume, result, resultValue);
+
+	// Continue from here next time
+	volume->next_free = (uint32_t)result.index + 1 < volume->num_entries ? result.index + 1 : FAT32_FIRST_CLUSTER;
+
+	// Don't zero it until something is written to it
+	FAT32_atomic_fetch_or64(&volume->unzeroed[result.index / 64], (uint64_t)1 << (result.index % 64));
+	if (volume->checksums)
+	{
+		FAT32_checksum_new_cluster(volume, result);
+	}
+
+	FAT32_journal_end(volume);
+	return result;
+}
+
+/* Returns the position of the first free extent at least 'length' clusters long, searching from the one where the last allocation
+ * left off (or that ends there, having just been freed). Returns the number of free extents if none is long enough. */
+static uint32_t find_free_run(const struct FAT32_volume_t* volume, uint32_t length)
+{
+	uint32_t first = find_free_extent(volume, volume->next_free);
+	if (first > 0 && volume->free_extents[first - 1].start + volume->free_extents[first - 1].length >= volume->next_free)
+	{
+		first -= 1;
+	}
+
+	for (uint32_t i = 0; i < volume->num_free_extents; ++i)
+	{
+		const uint32_t pos = (first + i) % volume->num_free_extents;
+		if (volume->free_extents[pos].length >= length)
+		{
+			return pos;
+		}
+	}
+
+	return volume->num_free_extents;
+}
+
+FAT32_cluster_address_t FAT32_new_chain(struct FAT32_volume_t* volume, uint32_t length)
+{
+	FAT32_journal_begin(volume);
+
+	FAT32_cluster_address_t result;
+	result.index = FAT32_CLUSTER_ADDRESS_NULL;
+
+	// Look for a free run long enough to hold the whole chain
+	if (volume->free_extents_valid && length > 1)
+	{
+		const uint32_t pos = find_free_run(volume, length);
+		if (pos < volume->num_free_extents)
+		{
+			result.index = volume->free_extents[pos].start;
+
+			// If the extents are out of date, stop relying on them
+			for (uint32_t i = 0; i < length; ++i)
+			{
+				FAT32_cluster_address_t address;
+				address.index = result.index + i;
+				if (FAT32_get_table_entry(volume, address).index != FAT32_CLUSTER_ADDRESS_NULL)
+				{
+					volume->free_extents_valid = 0;
+					volume->num_free_extents = 0;
+					result.index = FAT32_CLUSTER_ADDRESS_NULL;
+					break;
+				}
+			}
+		}
+	}
+
+	// Without one, link together whatever is free
+	if (result.index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		result = FAT32_new_cluster(volume);
+
+		FAT32_cluster_address_t last = result;
+		for (uint32_t i = 1; i < length && last.index != FAT32_CLUSTER_ADDRESS_NULL; ++i)
+		{
+			const FAT32_cluster_address_t next = FAT32_new_cluster(volume);
+			if (next.index == FAT32_CLUSTER_ADDRESS_NULL)
+			{
+				// Give back what we took, rather than handing out a short chain
+				FAT32_free_cluster(volume, result);
+				result.index = FAT32_CLUSTER_ADDRESS_NULL;
+				break;
+			}
+
+			FAT32_set_table_entry(volume, last, next);
+			last = next;
+		}
+
+		FAT32_journal_end(volume);
+		return result;
+	}
+
+	// Link the run together, and write its table entries in one go
+	for (uint32_t i = 0; i < length; ++i)
+	{
+		FAT32_cluster_address_t address;
+		address.index = result.index + i;
+		FAT32_journal_reuse_cluster(volume, address);
+		update_table_entry(volume, address.index, i + 1 < length ? address.index + 1 : FAT32_CLUSTER_ADDRESS_EOC);
+
+		// Don't zero it until something is written to it
+		FAT32_atomic_fetch_or64(&volume->unzeroed[address.index / 64], (uint64_t)1 << (address.index % 64));
+		if (volume->checksums)
+		{
+			FAT32_checksum_new_cluster(volume, address);
+		}
+	}
+	write_table_range(volume, result.index, length);
+
+	// Continue from here next time
+	const uint32_t end = result.index + length;
+	volume->next_free = end < volume->num_entries ? end : FAT32_FIRST_CLUSTER;
+
+	FAT32_journal_end(volume);
+	return result;
+}
+
+struct FAT32_file_t
+{
+	/* The volume the file is on. */
+	struct FAT32_volume_t* volume;
+
+    /* The address of the starting cluster of this file. */
+    FAT32_cluster_address_t start_cluster;
+
+    /* The address of the current cluster for this file. */
+    FAT32_cluster_address_t current_cluster;
+
+    /* How far in the chain the current cluster is. */
+    uint32_t current_cluster_distance;
+
+    /* The byte offset within the current cluster. */
+    uint32_t cluster_offset;
+
+    /* The readable size of the file, in bytes. */
+    uint32_t size;
+
+	/* Stores whether the file has been modified. */
+	int modified;
+
+	/* Whether the file is a directory (directories are unsized), whose writes are metadata. */
+	int metadata;
+
+	/* Whether a read from the file has failed. */
+	int error;
+
+	/* The addresses of the clusters in the chain, by distance from the start, as far as they have been looked up. */
+	FAT32_cluster_address_t* chain;
+	uint32_t chain_len;
+	uint32_t chain_capacity;
+
+	/* Protects the chain index, size and modified flag during positional I/O. */
+	FAT32_mutex_t mutex;
+
+	/* The number of clusters at the start of the chain known not to be shared with any clone, as of the given share generation. */
+	uint32_t private_len;
+	uint64_t share_generation;
+
+	/* If the file is compressed, the container everything is passed through to. */
+	struct FAT32_compressed_t* compressed;
+
+	/* Set if the file was opened to be written over, and clusters holding its old contents may lie past its size. */
+	int stale;
+};
+
+struct FAT32_file_t* FAT32_fopen(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t size)
+{
+    // Create a file object
+    struct FAT32_file_t* file = (struct FAT32_file_t*)malloc(sizeof(struct FAT32_file_t));
+	file->volume = volume;
+    file->start_cluster = address;
+    file->current_cluster = address;
+    file->current_cluster_distance = 0;
+    file->cluster_offset = 0;
+    file->size = size;
+	file->modified = 0;
+	file->metadata = size == UINT32_MAX;
+	file->error = 0;
+	file->chain = NULL;
+	file->chain_len = 0;
+	file->chain_capacity = 0;
+	FAT32_mutex_init(&file->mutex);
+	file->private_len = 0;
+	file->share_generation = 0;
+	file->compressed = NULL;
+	file->stale = 0;
+
+    return file;
+}
+
+struct FAT32_file_t* FAT32_fopen_overwrite(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	struct FAT32_file_t* file = FAT32_fopen(volume, address, 0);
+	file->stale = FAT32_is_valid_cluster(volume, address);
+
+	return file;
+}
+
+struct FAT32_file_t* FAT32_fopen_compressed(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t storedSize)
+{
+	// The outer file only holds the container, which is stored as a plain file
+	FAT32_cluster_address_t null;
+	null.index = FAT32_CLUSTER_ADDRESS_NULL;
+	struct FAT32_file_t* file = FAT32_fopen(volume, null, 0);
+	file->compressed = FAT32_compressed_open(FAT32_fopen(volume, address, storedSize), storedSize);
+
+	return file;
+}
+
+uint32_t FAT32_finish_compressed(struct FAT32_file_t* file)
+{
+	return FAT32_compressed_finish(file->compressed);
+}
+
+void FAT32_touch_directory(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	FAT32_atomic_fetch_add64(&volume->dir_generations[address.index % FAT32_DIR_GENERATION_BUCKETS], 1);
+}
+
+uint64_t FAT32_get_directory_generation(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return FAT32_atomic_load64(&volume->dir_generations[address.index % FAT32_DIR_GENERATION_BUCKETS]);
+}
+
+void FAT32_prefetch_chain(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t maxClusters)
+{
+	FAT32_cluster_address_t start = address;
+	uint32_t length = 0;
+
+	for (uint32_t i = 0; i < maxClusters && FAT32_is_valid_cluster(volume, address); ++i)
+	{
+		// Start a new run wherever the chain jumps
+		if (length > 0 && address.index != start.index + length)
+		{
+			FAT32_device_prefetch(&volume->device, FAT32_get_cluster_offset(volume, start), (uint64_t)length << volume->cluster_shift);
+			start = address;
+			length = 0;
+		}
+
+		length += 1;
+		address = FAT32_get_table_entry(volume, address);
+	}
+
+	if (length > 0)
+	{
+		FAT32_device_prefetch(&volume->device, FAT32_get_cluster_offset(volume, start), (uint64_t)length << volume->cluster_shift);
+	}
+}
+
+/* Writes out the table entries for a run of freed clusters, and discards their contents. */
+static void release_extent(struct FAT32_volume_t* volume, struct FAT32_extent_t extent)
+{
+	if (extent.length == 0)
+	{
+		return;
+	}
+
+	write_table_range(volume, extent.start, extent.length);
+
+	FAT32_cluster_address_t start;
+	start.index = extent.start;
+	FAT32_device_discard(&volume->device, FAT32_get_cluster_offset(volume, start), (uint64_t)extent.length << volume->cluster_shift);
+}
+
+void FAT32_free_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	FAT32_cluster_address_t nextAddr;
+	FAT32_journal_begin(volume);
+
+	// If this was a directory, snapshots of it are stale now
+	FAT32_touch_directory(volume, address);
+
+	// Freed clusters are gathered into runs, so the table and device see one request per run instead of per cluster
+	struct FAT32_extent_t run;
+	run.start = FAT32_CLUSTER_ADDRESS_NULL;
+	run.length = 0;
+
+	while (FAT32_is_valid_cluster(volume, address))
+	{
+		// The rest of the chain is still used by the clones it's shared with
+		if (FAT32_release_cluster_share(volume, address))
+		{
+			break;
+		}
+
+		// Get the address of the next cluster
+		nextAddr = FAT32_get_table_entry(volume, address);
+
+		// Stop if the chain runs into a cluster that is already free
+		if (nextAddr.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			break;
+		}
+
+		// Null out this one
+		update_table_entry(volume, address.index, FAT32_CLUSTER_ADDRESS_NULL);
+
+		if (run.length > 0 && address.index == run.start + run.length)
+		{
+			run.length += 1;
+		}
+		else
+		{
+			release_extent(volume, run);
+			run.start = address.index;
+			run.length = 1;
+		}
+
+		// Move to the next address
+		address = nextAddr;
+	}
+
+	release_extent(volume, run);
+	FAT32_journal_end(volume);
+}
+
+int FAT32_fclose(struct FAT32_file_t* file)
+{
+	if (file->compressed)
+	{
+		FAT32_compressed_close(file->compressed);
+	}
+
+	FAT32_mutex_destroy(&file->mutex);
+	free(file->chain);
+    free(file);
+    return 0;
+}
+
+/* Returns whether the cluster at the given distance along the file's chain is shared with a clone, in which case it has to be copied
+ * before it's changed. Clusters only lead into ones shared at least as much, so everything after a shared cluster is shared too.
+ * The chain index must reach that far, and the file's mutex must be held. */
+static int is_shared(struct FAT32_file_t* file, uint32_t distance)
+{
+	struct FAT32_volume_t* volume = file->volume;
+	if (FAT32_atomic_load64(&volume->num_shared_clusters) == 0)
+	{
+		return 0;
+	}
+
+	// A clone may have shared clusters that used to be the file's own
+	const uint64_t generation = FAT32_atomic_load64(&volume->share_generation);
+	if (file->share_generation != generation)
+	{
+		file->share_generation = generation;
+		file->private_len = 0;
+	}
+
+	FAT32_mutex_lock(&volume->share_mutex);
+	while (file->private_len <= distance && FAT32_get_cluster_shares(volume, file->chain[file->private_len]) == 0)
+	{
+		file->private_len += 1;
+	}
+	FAT32_mutex_unlock(&volume->share_mutex);
+
+	return file->private_len <= distance;
+}
+
+/* Gives the file its own copies of the shared clusters up to the given distance along its chain, so they can be changed without
+ * affecting the files they're shared with. The copies lead back into the rest of the shared chain. The chain index must reach
+ * that far, and the file's mutex must be held. Returns 0 if the volume ran out of clusters first, leaving the rest shared. */
+static int unshare(struct FAT32_file_t* file, uint32_t distance)
+{
+	struct FAT32_volume_t* volume = file->volume;
+	HDByte_t* cluster = (HDByte_t*)malloc(volume->cluster_size);
+
+	FAT32_journal_begin(volume);
+	FAT32_mutex_lock(&volume->share_mutex);
+
+	// Start from the first shared cluster, unless the files sharing it have let go of it since
+	uint32_t first = file->private_len;
+	while (first <= distance && FAT32_get_cluster_shares(volume, file->chain[first]) == 0)
+	{
+		++first;
+	}
+
+	uint32_t end = distance + 1;
+	if (first <= distance)
+	{
+		const FAT32_cluster_address_t firstShared = file->chain[first];
+		FAT32_cluster_address_t rest = FAT32_get_table_entry(volume, file->chain[distance]);
+
+		// Copy each cluster, linking the copies in place of the originals as we go
+		for (uint32_t i = first; i <= distance; ++i)
+		{
+			const FAT32_cluster_address_t copy = FAT32_new_cluster(volume);
+
+			// Out of clusters, so the copies lead back into the original of this one instead
+			if (copy.index == FAT32_CLUSTER_ADDRESS_NULL)
+			{
+				rest = file->chain[i];
+				end = i;
+				break;
+			}
+
+			const int valid = FAT32_read_cluster(volume, file->chain[i], 0, cluster, volume->cluster_size);
+			FAT32_write_cluster(volume, copy, 0, cluster, volume->cluster_size);
+
+			// Keep a bad cluster looking bad in its copy
+			if (!valid)
+			{
+				FAT32_checksum_copy(volume, file->chain[i], copy);
+			}
+
+			if (i == 0)
+			{
+				file->start_cluster = copy;
+			}
+			else
+			{
+				FAT32_set_table_entry(volume, file->chain[i - 1], copy);
+			}
+
+			if (file->current_cluster_distance == i)
+			{
+				file->current_cluster = copy;
+			}
+			file->chain[i] = copy;
+		}
+
+		// The original of the first copy has one less reference, and the rest of the chain one more
+		if (end > first)
+		{
+			FAT32_set_table_entry(volume, file->chain[end - 1], rest);
+			if (FAT32_is_valid_cluster(volume, rest))
+			{
+				FAT32_add_cluster_share(volume, rest);
+			}
+			FAT32_remove_cluster_share(volume, firstShared);
+
+			file->modified = 1;
+		}
+	}
+
+	file->private_len = end > first ? end : first;
+
+	FAT32_mutex_unlock(&volume->share_mutex);
+	FAT32_journal_end(volume);
+	free(cluster);
+
+	return end > distance;
+}
+
+/* Returns the address of the cluster at the given distance along the file's chain, extending the chain if 'grow' is set.
+* Returns NULL if the chain is too short, or can't grow as the volume is out of clusters. The file's mutex must be held. */
+static FAT32_cluster_address_t chain_lookup(struct FAT32_file_t* file, uint32_t distance, int grow)
+{
+	struct FAT32_volume_t* volume = file->volume;
+
+	while (file->chain_len <= distance)
+	{
+		FAT32_cluster_address_t next;
+		if (file->chain_len == 0)
+		{
+			next = file->start_cluster;
+		}
+		else
+		{
+			next = FAT32_get_table_entry(volume, file->chain[file->chain_len - 1]);
+		}
+
+		// If we've run off the end of the chain
+		if (!FAT32_is_valid_cluster(volume, next))
+		{
+			if (!grow)
+			{
+				next.index = FAT32_CLUSTER_ADDRESS_NULL;
+				return next;
+			}
+
+			// The last cluster changes to lead into the new one, so it can't be shared
+			if (file->chain_len > 0 && is_shared(file, file->chain_len - 1) && !unshare(file, file->chain_len - 1))
+			{
+				next.index = FAT32_CLUSTER_ADDRESS_NULL;
+				return next;
+			}
+
+			next = FAT32_new_cluster(volume);
+			if (next.index == FAT32_CLUSTER_ADDRESS_NULL)
+			{
+				return next;
+			}
+
+			if (file->chain_len == 0)
+			{
+				file->start_cluster = next;
+				file->current_cluster = next;
+			}
+			else
+			{
+				FAT32_set_table_entry(volume, file->chain[file->chain_len - 1], next);
+			}
+		}
+
+		// Add it to the index
+		if (file->chain_len == file->chain_capacity)
+		{
+			file->chain_capacity = file->chain_capacity ? file->chain_capacity * 2 : 16;
+			file->chain = (FAT32_cluster_address_t*)realloc(file->chain, sizeof(FAT32_cluster_address_t) * file->chain_capacity);
+		}
+		file->chain[file->chain_len++] = next;
+	}
+
+	return file->chain[distance];
+}
+
+/* Like 'chain_lookup', but copies the cluster first if it's shared with a clone, so it's safe to change. Returns NULL if there's
+* no room for the copy. */
+static FAT32_cluster_address_t own_cluster(struct FAT32_file_t* file, uint32_t distance, int grow)
 {
-    return ((FAT32_cluster_address_t*)FAT32_HARD_DRIVE)[address.index];
+	FAT32_cluster_address_t address = chain_lookup(file, distance, grow);
+	if (address.index == FAT32_CLUSTER_ADDRESS_NULL || !is_shared(file, distance))
+	{
+		return address;
+	}
+
+	if (!unshare(file, distance))
+	{
+		address.index = FAT32_CLUSTER_ADDRESS_NULL;
+		return address;
+	}
+
+	return file->chain[distance];
 }
 
-/* Sets the address stored in the File Allocation Table for the given address. */
-static void set_table_entry(FAT32_cluster_address_t address, FAT32_cluster_address_t value)
+/* Copies the file's current cluster if it's shared with a clone, before it's changed. Returns 0 if there's no room for the copy. */
+static int own_current_cluster(struct FAT32_file_t* file)
 {
-    ((FAT32_cluster_address_t*)FAT32_HARD_DRIVE)[address.index] = value;
+	if (FAT32_atomic_load64(&file->volume->num_shared_clusters) == 0)
+	{
+		return 1;
+	}
+
+	FAT32_mutex_lock(&file->mutex);
+	const FAT32_cluster_address_t address = own_cluster(file, file->current_cluster_distance, 0);
+	if (address.index != FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		file->current_cluster = address;
+	}
+	FAT32_mutex_unlock(&file->mutex);
+
+	return address.index != FAT32_CLUSTER_ADDRESS_NULL;
 }
 
-static HDByte_t* get_data_entry(FAT32_cluster_address_t address)
+/* Makes the file's chain just long enough to hold 'size' bytes, growing it with zeroed clusters or releasing what's past the end,
+* and zeroes the rest of the last cluster if 'zeroTail' is set. The file's mutex must be held. Returns 0 if the volume ran out of
+* clusters to grow the chain, or to copy a last cluster that's shared with a clone. */
+static int fit_chain(struct FAT32_file_t* file, uint32_t size, int zeroTail)
 {
-    return &FAT32_HARD_DRIVE[FAT32_TABLE_SIZE + address.index * FAT32_CLUSTER_SIZE];
+	struct FAT32_volume_t* volume = file->volume;
+	const uint32_t numClusters = (uint32_t)(((uint64_t)size + volume->cluster_mask) >> volume->cluster_shift);
+
+	// Empty files have no clusters at all
+	if (numClusters == 0)
+	{
+		FAT32_free_cluster(volume, file->start_cluster);
+		file->start_cluster.index = FAT32_CLUSTER_ADDRESS_NULL;
+		file->current_cluster.index = FAT32_CLUSTER_ADDRESS_NULL;
+		file->chain_len = 0;
+		return 1;
+	}
+
+	// Find the new last cluster, extending the chain if needed (new clusters are already zeroed)
+	FAT32_cluster_address_t last = chain_lookup(file, numClusters - 1, 1);
+	if (last.index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		return 0;
+	}
+
+	// Both releasing the rest of the chain and zeroing the tail change the last cluster, so it can't be shared
+	const FAT32_cluster_address_t next = FAT32_get_table_entry(volume, last);
+	const uint32_t tail = size & volume->cluster_mask;
+	zeroTail = zeroTail && tail != 0;
+	if (!FAT32_CLUSTER_ADDRESS_IS_EOC(next.index) || zeroTail)
+	{
+		last = own_cluster(file, numClusters - 1, 0);
+		if (last.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			return 0;
+		}
+	}
+
+	if (!FAT32_CLUSTER_ADDRESS_IS_EOC(next.index))
+	{
+		FAT32_cluster_address_t eoc;
+		eoc.index = FAT32_CLUSTER_ADDRESS_EOC;
+		FAT32_set_table_entry(volume, last, eoc);
+		FAT32_free_cluster(volume, next);
+	}
+	file->chain_len = file->chain_len < numClusters ? file->chain_len : numClusters;
+
+	if (zeroTail)
+	{
+		FAT32_write_cluster(volume, last, tail, volume->zero_cluster, volume->cluster_size - tail);
+	}
+
+	return 1;
 }
 
-void FAT32_init(void)
+/* Cuts the chain of a file that's being written over just after the cluster holding its end, and zeroes the rest of that cluster,
+* so the old contents aren't read back once the file grows past bytes that haven't been written. The file's mutex must be held.
+* Returns 0 if that couldn't be done for want of clusters, as 'fit_chain' does. */
+static int release_stale_clusters(struct FAT32_file_t* file)
 {
-	// Set the root cluster table entry to the EOC code
-	FAT32_cluster_address_t rootCluster = FAT32_get_root();
-	FAT32_cluster_address_t value;
-	value.index = FAT32_CLUSTER_ADDRESS_EOC;
-	set_table_entry(rootCluster, value);
+	if (!fit_chain(file, file->size, 1))
+	{
+		return 0;
+	}
+
+	file->stale = 0;
+	return 1;
 }
 
-FAT32_cluster_address_t FAT32_get_root(void)
+size_t FAT32_pread(struct FAT32_file_t* file, void* buffer, size_t size, uint32_t offset)
 {
-	FAT32_cluster_address_t result;
-	result.index = 1;
-	return result;
+	if (file->compressed)
+	{
+		return FAT32_compressed_pread(file->compressed, buffer, size, offset);
+	}
+
+	struct FAT32_volume_t* volume = file->volume;
+
+	FAT32_mutex_lock(&file->mutex);
+	const uint32_t fileSize = file->size;
+	FAT32_mutex_unlock(&file->mutex);
+
+	// Don't read past the end of the file
+	if (offset >= fileSize)
+	{
+		return 0;
+	}
+	const uint32_t total = size < fileSize - offset ? (uint32_t)size : fileSize - offset;
+
+	uint32_t done = 0;
+	while (done < total)
+	{
+		const uint32_t pos = offset + done;
+
+		FAT32_mutex_lock(&file->mutex);
+		const FAT32_cluster_address_t cluster = chain_lookup(file, pos >> volume->cluster_shift, 0);
+		FAT32_mutex_unlock(&file->mutex);
+
+		// The chain may be shorter than the file claims
+		if (cluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			break;
+		}
+
+		// Read as much as we can from this cluster
+		const uint32_t clusterOffset = pos & volume->cluster_mask;
+		uint32_t span = volume->cluster_size - clusterOffset;
+		span = span < total - done ? span : total - done;
+
+		// Stop at a cluster that fails its check
+		if (!FAT32_read_cluster(volume, cluster, clusterOffset, (HDByte_t*)buffer + done, span))
+		{
+			file->error = 1;
+			break;
+		}
+		done += span;
+	}
+
+	return done;
 }
 
-FAT32_cluster_address_t FAT32_new_cluster(void)
+size_t FAT32_pread_map(struct FAT32_file_t* file, size_t size, uint32_t offset, int* outFd, uint64_t* outOffset)
 {
-    FAT32_cluster_address_t result;
+	struct FAT32_volume_t* volume = file->volume;
 
-    // For each cluster address
-    for (result.index = 1; result.index < FAT32_NUM_CLUSTERS; ++result.index)
-    {
-        // If the FAT value for this address is NULL, it's unused
-        if (get_table_entry(result).index == FAT32_CLUSTER_ADDRESS_NULL)
-        {
-            break;
-        }
-    }
+	// Compressed files and in-memory volumes have no bytes to point at
+	if (file->compressed || volume->device.fd < 0)
+	{
+		return 0;
+	}
 
-	// Make sure we didn't run out of clusters
-	assert(result.index != FAT32_NUM_CLUSTERS /* All out of clusters! */);
+	FAT32_mutex_lock(&file->mutex);
 
-	// Set the value as the EOC value
-	FAT32_cluster_address_t resultValue;
-	resultValue.index = FAT32_CLUSTER_ADDRESS_EOC;
-	set_table_entry(result, resultValue);
+	// Don't map past the end of the file
+	if (offset >= file->size)
+	{
+		FAT32_mutex_unlock(&file->mutex);
+		return 0;
+	}
+	const uint32_t total = size < file->size - offset ? (uint32_t)size : file->size - offset;
+
+	uint32_t done = 0;
+	uint32_t previous = FAT32_CLUSTER_ADDRESS_NULL;
+	while (done < total)
+	{
+		const uint32_t pos = offset + done;
+		const FAT32_cluster_address_t cluster = chain_lookup(file, pos >> volume->cluster_shift, 0);
+
+		// Stop where the run of clusters breaks, or at a cluster whose bytes on the device aren't the ones 'FAT32_pread' would return
+		if (cluster.index == FAT32_CLUSTER_ADDRESS_NULL || (done && cluster.index != previous + 1) || FAT32_is_unzeroed(volume, cluster.index) ||
+			(volume->checksums && !FAT32_checksum_is_verified(volume, cluster)) || FAT32_entry_cache_holds(volume, cluster))
+		{
+			break;
+		}
 
-	// Zero out the hard drive bytes
-	memset(get_data_entry(result), 0, FAT32_CLUSTER_SIZE);
+		const uint32_t clusterOffset = pos & volume->cluster_mask;
+		if (!done)
+		{
+			*outOffset = FAT32_get_cluster_offset(volume, cluster) + clusterOffset;
+		}
+
+		uint32_t span = volume->cluster_size - clusterOffset;
+		span = span < total - done ? span : total - done;
+		done += span;
+		previous = cluster.index;
+	}
 
-    return result;
+	FAT32_mutex_unlock(&file->mutex);
+
+	*outFd = volume->device.fd;
+	return done;
 }
 
-struct FAT32_file_t
+size_t FAT32_pwrite(struct FAT32_file_t* file, const void* buffer, size_t size, uint32_t offset)
 {
-    /* The address of the starting cluster of this file. */
-    FAT32_cluster_address_t start_cluster;
+	// Compressed files are only written sequentially
+	if (file->compressed)
+	{
+		return 0;
+	}
 
-    /* The address of the current cluster for this file. */
-    FAT32_cluster_address_t current_cluster;
+	struct FAT32_volume_t* volume = file->volume;
 
-    /* How far in the chain the current cluster is. */
-    uint32_t current_cluster_distance;
+	// Files can't grow beyond 4GB
+	const uint32_t total = size < UINT32_MAX - offset ? (uint32_t)size : UINT32_MAX - offset;
+	FAT32_journal_begin(volume);
 
-    /* The byte offset within the current cluster. */
-    uint32_t cluster_offset;
+	// Skipping past the end of a file being written over would expose its old contents
+	FAT32_mutex_lock(&file->mutex);
+	const int ready = !file->stale || offset <= file->size || total == 0 || release_stale_clusters(file);
+	FAT32_mutex_unlock(&file->mutex);
 
-    /* The readable size of the file, in bytes. */
-    uint32_t size;
+	uint32_t done = 0;
+	while (ready && done < total)
+	{
+		const uint32_t pos = offset + done;
 
-	/* Stores whether the file has been modified. */
-	int modified;
-};
+		FAT32_mutex_lock(&file->mutex);
+		const FAT32_cluster_address_t cluster = own_cluster(file, pos >> volume->cluster_shift, 1);
+		FAT32_mutex_unlock(&file->mutex);
+
+		// Stop short when the volume is full
+		if (cluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			break;
+		}
+
+		// Write as much as fits in this cluster
+		const uint32_t clusterOffset = pos & volume->cluster_mask;
+		uint32_t span = volume->cluster_size - clusterOffset;
+		span = span < total - done ? span : total - done;
+
+		FAT32_write_cluster(volume, cluster, clusterOffset, (const HDByte_t*)buffer + done, span);
+		done += span;
+	}
+
+	// Update the size of the file, if anything was written
+	FAT32_mutex_lock(&file->mutex);
+	file->modified = 1;
+	file->size = done > 0 && offset + done > file->size ? offset + done : file->size;
+	FAT32_mutex_unlock(&file->mutex);
+
+	if (file->metadata)
+	{
+		FAT32_touch_directory(volume, file->start_cluster);
+	}
+
+	FAT32_journal_end(volume);
+	return done;
+}
 
-struct FAT32_file_t* FAT32_fopen(FAT32_cluster_address_t address, uint32_t size)
+int FAT32_ftruncate(struct FAT32_file_t* file, uint32_t size)
 {
-    // Create a file object
-    struct FAT32_file_t* file = (struct FAT32_file_t*)malloc(sizeof(struct FAT32_file_t));
-    file->start_cluster = address;
-    file->current_cluster = address;
-    file->current_cluster_distance = 0;
-    file->cluster_offset = 0;
-    file->size = size;
-	file->modified = 0;
+	if (file->compressed)
+	{
+		file->modified = 1;
+		return FAT32_compressed_truncate(file->compressed, size);
+	}
 
-    return file;
+	struct FAT32_volume_t* volume = file->volume;
+
+	FAT32_journal_begin(volume);
+	FAT32_mutex_lock(&file->mutex);
+
+	// Whatever is left of a file being written over goes first, so growing it reads back zeroes
+	int result = !file->stale || release_stale_clusters(file);
+
+	// If the file is growing, zero whatever was past the old end of its last cluster
+	if (result && size > file->size && (file->size & volume->cluster_mask) != 0)
+	{
+		const FAT32_cluster_address_t oldLast = own_cluster(file, file->size >> volume->cluster_shift, 0);
+		if (oldLast.index != FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			const uint32_t tail = file->size & volume->cluster_mask;
+			FAT32_write_cluster(volume, oldLast, tail, volume->zero_cluster, volume->cluster_size - tail);
+		}
+	}
+
+	// If the file is shrinking, zero the rest of the last cluster, so it reads back as zeroes if the file grows again
+	result = result && fit_chain(file, size, size < file->size);
+	if (result)
+	{
+		file->size = size;
+		file->modified = 1;
+	}
+	FAT32_mutex_unlock(&file->mutex);
+
+	// Don't leave the position past the end of the file
+	if ((uint32_t)FAT32_ftell(file) > file->size)
+	{
+		FAT32_fseek(file, (long)file->size, FAT32_SEEK_SET);
+	}
+
+	FAT32_journal_end(volume);
+	return result ? 0 : 1;
 }
 
-void FAT32_free_cluster(FAT32_cluster_address_t address)
+size_t FAT32_preadv(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt, uint32_t offset)
 {
-	FAT32_cluster_address_t nextAddr;
+	size_t total = 0;
+	for (uint32_t i = 0; i < iovcnt; ++i)
+	{
+		const size_t done = FAT32_pread(file, iov[i].base, iov[i].len, offset + (uint32_t)total);
+		total += done;
+
+		// Stop at the end of the file
+		if (done < iov[i].len)
+		{
+			break;
+		}
+	}
+
+	return total;
+}
 
-	while (address.index != FAT32_CLUSTER_ADDRESS_EOC)
+size_t FAT32_pwritev(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt, uint32_t offset)
+{
+	size_t total = 0;
+	for (uint32_t i = 0; i < iovcnt; ++i)
 	{
-		// Get the address of the next cluster
-		nextAddr = get_table_entry(address);
+		const size_t done = FAT32_pwrite(file, iov[i].base, iov[i].len, offset + (uint32_t)total);
+		total += done;
 
-		// Null out this one
-		FAT32_cluster_address_t value;
-		value.index = FAT32_CLUSTER_ADDRESS_NULL;
-		set_table_entry(address, value);
+		if (done < iov[i].len)
+		{
+			break;
+		}
+	}
 
-		// Move to the next address
-		address = nextAddr;
+	return total;
+}
+
+size_t FAT32_readv(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt)
+{
+	size_t total = 0;
+	for (uint32_t i = 0; i < iovcnt; ++i)
+	{
+		const size_t done = FAT32_fread(iov[i].base, 1, iov[i].len, file);
+		total += done;
+
+		if (done < iov[i].len)
+		{
+			break;
+		}
 	}
+
+	return total;
 }
 
-int FAT32_fclose(struct FAT32_file_t* file)
+size_t FAT32_writev(struct FAT32_file_t* file, const FAT32_iovec_t* iov, uint32_t iovcnt)
 {
-    free(file);
-    return 0;
+	size_t total = 0;
+	for (uint32_t i = 0; i < iovcnt; ++i)
+	{
+		total += FAT32_fwrite(iov[i].base, 1, iov[i].len, file);
+	}
+
+	return total;
 }
 
 size_t FAT32_fread(void* buffer, size_t size, size_t count, struct FAT32_file_t* file)
 {
+	if (file->compressed)
+	{
+		return FAT32_compressed_read(file->compressed, buffer, count * size) / size;
+	}
+
+	struct FAT32_volume_t* volume = file->volume;
+	const uint32_t clusterSize = volume->cluster_size;
+	const uint32_t total = (uint32_t)(count * size);
+
     // Fill the buffer with bytes
     uint32_t offset = 0;
-
-    // For each byte to be read
-    for (; offset < count * size; ++offset, ++file->cluster_offset)
+    while (offset < total)
     {
         // If we've reached the end of this file
-        if (FAT32_ftell(file) >= file->size)
+		const uint32_t pos = (uint32_t)FAT32_ftell(file);
+        if (pos >= file->size)
         {
             break;
         }
 
         // If we're at the end of this cluster
-        if (file->cluster_offset >= FAT32_CLUSTER_SIZE)
+        if (file->cluster_offset >= clusterSize)
         {
 			// Get the next cluster in the chain
-			FAT32_cluster_address_t nextCluster = get_table_entry(file->current_cluster);
+			FAT32_cluster_address_t nextCluster = FAT32_get_table_entry(volume, file->current_cluster);
 
 			// If we're already at the end of the chain
-			if (nextCluster.index == FAT32_CLUSTER_ADDRESS_EOC)
+			if (FAT32_CLUSTER_ADDRESS_IS_EOC(nextCluster.index))
 			{
 				break;
 			}
@@ -172,8 +1973,19 @@ size_t FAT32_fread(void* buffer, size_t size, size_t count, struct FAT32_file_t*
             file->cluster_offset = 0;
         }
 
-		// Read the byte
-        ((HDByte_t*)buffer)[offset] = get_data_entry(file->current_cluster)[file->cluster_offset];
+		// Read as much as we can from this cluster
+		uint32_t span = clusterSize - file->cluster_offset;
+		span = span < total - offset ? span : total - offset;
+		span = span < file->size - pos ? span : file->size - pos;
+
+		// Stop at a cluster that fails its check
+		if (!FAT32_read_cluster(volume, file->current_cluster, file->cluster_offset, (HDByte_t*)buffer + offset, span))
+		{
+			file->error = 1;
+			break;
+		}
+		offset += span;
+		file->cluster_offset += span;
     }
 
     return offset / size;
@@ -181,24 +1993,58 @@ size_t FAT32_fread(void* buffer, size_t size, size_t count, struct FAT32_file_t*
 
 size_t FAT32_fwrite(const void* buffer, size_t size, size_t count, struct FAT32_file_t* file)
 {
+	if (file->compressed)
+	{
+		file->modified = 1;
+		return FAT32_compressed_write(file->compressed, buffer, count * size) / size;
+	}
+
+	struct FAT32_volume_t* volume = file->volume;
+	const uint32_t clusterSize = volume->cluster_size;
+	const uint32_t total = (uint32_t)(count * size);
+
 	// Mark the file as being modified
 	file->modified = 1;
+	FAT32_journal_begin(volume);
 
     uint32_t offset = 0;
-    for (; offset < count * size; ++offset, ++file->cluster_offset)
+    while (offset < total)
     {
+		// Empty files may not have any clusters yet
+		if (file->current_cluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			file->start_cluster = FAT32_new_cluster(volume);
+			file->current_cluster = file->start_cluster;
+
+			// Stop short when the volume is full
+			if (file->start_cluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+			{
+				break;
+			}
+		}
+
         // If we've reached the end of this cluster
-        if (file->cluster_offset >= FAT32_CLUSTER_SIZE)
+        if (file->cluster_offset >= clusterSize)
         {
             // Get the next cluster in the chain
-            FAT32_cluster_address_t nextCluster = get_table_entry(file->current_cluster);
+            FAT32_cluster_address_t nextCluster = FAT32_get_table_entry(volume, file->current_cluster);
 
             // If we're at the last cluster in this chain
-            if (nextCluster.index == FAT32_CLUSTER_ADDRESS_EOC)
+            if (FAT32_CLUSTER_ADDRESS_IS_EOC(nextCluster.index))
             {
+				// It's about to lead into a new cluster, so it can't be shared
+				if (!own_current_cluster(file))
+				{
+					break;
+				}
+
                 // Create a new cluster
-                nextCluster = FAT32_new_cluster();
-                set_table_entry(file->current_cluster, nextCluster);
+                nextCluster = FAT32_new_cluster(volume);
+				if (nextCluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+				{
+					break;
+				}
+                FAT32_set_table_entry(volume, file->current_cluster, nextCluster);
             }
 
             // Move to the next cluster
@@ -207,48 +2053,133 @@ size_t FAT32_fwrite(const void* buffer, size_t size, size_t count, struct FAT32_
             file->cluster_offset = 0;
         }
 
-		// Write the byte
-		get_data_entry(file->current_cluster)[file->cluster_offset] = ((const HDByte_t*)buffer)[offset];
+		// Write as much as fits in this cluster, once it's the file's own
+		uint32_t span = clusterSize - file->cluster_offset;
+		span = span < total - offset ? span : total - offset;
+		if (!file->metadata && !own_current_cluster(file))
+		{
+			break;
+		}
+
+		// Whole directory entries wait in the entry cache to be journaled, rather than being written in place
+		if (file->metadata && volume->journal_active && file->cluster_offset % FAT32_ENTRY_SLOT_SIZE == 0 && span % FAT32_ENTRY_SLOT_SIZE == 0)
+		{
+			for (uint32_t slot = 0; slot < span; slot += FAT32_ENTRY_SLOT_SIZE)
+			{
+				FAT32_entry_cache_put(volume, file->current_cluster, (file->cluster_offset + slot) / FAT32_ENTRY_SLOT_SIZE, (const HDByte_t*)buffer + offset + slot);
+			}
+		}
+		else
+		{
+			FAT32_write_cluster(volume, file->current_cluster, file->cluster_offset, (const HDByte_t*)buffer + offset, span);
+		}
+		offset += span;
+		file->cluster_offset += span;
     }
 
     // Update the size of the file
-    const long pos = FAT32_ftell(file);
+    const uint32_t pos = (uint32_t)FAT32_ftell(file);
     file->size = pos > file->size ? pos : file->size;
 
+	if (file->metadata)
+	{
+		FAT32_touch_directory(volume, file->start_cluster);
+	}
+
+	FAT32_journal_end(volume);
     return offset / size;
 }
 
-static void seek_forward(struct FAT32_file_t* file, long distance)
+size_t FAT32_fwrite_entry(struct FAT32_file_t* file, const void* entry)
 {
-	// While there's still more to go
-	while (distance > 0 && FAT32_ftell(file) < file->size)
-	{
-		// Move forward
-		file->cluster_offset += 1;
-		distance -= 1;
+	struct FAT32_volume_t* volume = file->volume;
 
-		// If we've reached the end of this cluster
-		if (file->cluster_offset >= FAT32_CLUSTER_SIZE)
+	// Step onto the next cluster if we're at the end of this one, as long as it exists
+	if (file->cluster_offset >= volume->cluster_size && file->current_cluster.index != FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		const FAT32_cluster_address_t nextCluster = FAT32_get_table_entry(volume, file->current_cluster);
+		if (FAT32_is_valid_cluster(volume, nextCluster))
 		{
-			// Get the next cluster
-			FAT32_cluster_address_t nextCluster = get_table_entry(file->current_cluster);
-
-			// If we're at the end of the chain
-			if (nextCluster.index == FAT32_CLUSTER_ADDRESS_EOC)
-			{
-				break;
-			}
-
-			// Move to the next cluster
 			file->current_cluster = nextCluster;
 			file->current_cluster_distance += 1;
 			file->cluster_offset = 0;
 		}
 	}
+
+	// Entries that don't sit in a single slot of an existing cluster (on volumes with tiny clusters, say) are written straight away
+	if (!FAT32_is_valid_cluster(volume, file->current_cluster) || file->cluster_offset % FAT32_ENTRY_SLOT_SIZE != 0 ||
+		file->cluster_offset + FAT32_ENTRY_SLOT_SIZE > volume->cluster_size)
+	{
+		return FAT32_fwrite(entry, FAT32_ENTRY_SLOT_SIZE, 1, file);
+	}
+
+	FAT32_entry_cache_put(volume, file->current_cluster, file->cluster_offset / FAT32_ENTRY_SLOT_SIZE, entry);
+	file->cluster_offset += FAT32_ENTRY_SLOT_SIZE;
+	file->modified = 1;
+	FAT32_touch_directory(volume, file->start_cluster);
+
+	const uint32_t pos = (uint32_t)FAT32_ftell(file);
+	file->size = pos > file->size ? pos : file->size;
+
+	return 1;
+}
+
+static void seek_forward(struct FAT32_file_t* file, long distance)
+{
+	struct FAT32_volume_t* volume = file->volume;
+
+	// Work out where we're going, without going past the end of the file
+	const uint32_t pos = (uint32_t)FAT32_ftell(file);
+	if (distance <= 0 || pos >= file->size)
+	{
+		return;
+	}
+
+	const uint32_t target = (uint64_t)pos + (unsigned long)distance < file->size ? pos + (uint32_t)distance : file->size;
+	uint32_t targetDistance = target >> volume->cluster_shift;
+	uint32_t targetOffset = target & volume->cluster_mask;
+
+	// Stay at the end of a cluster rather than the start of the next one, which may not exist yet
+	if (targetOffset == 0 && targetDistance > 0)
+	{
+		targetDistance -= 1;
+		targetOffset = volume->cluster_size;
+	}
+
+	// Jump straight to the target cluster, using the chain index
+	if (targetDistance > file->current_cluster_distance)
+	{
+		FAT32_mutex_lock(&file->mutex);
+		FAT32_cluster_address_t cluster = chain_lookup(file, targetDistance, 0);
+
+		// If the chain is shorter than the file, stop at the end of it
+		if (cluster.index == FAT32_CLUSTER_ADDRESS_NULL && file->chain_len > 0)
+		{
+			targetDistance = file->chain_len - 1;
+			targetOffset = volume->cluster_size;
+			cluster = file->chain[targetDistance];
+		}
+		FAT32_mutex_unlock(&file->mutex);
+
+		if (cluster.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			return;
+		}
+
+		file->current_cluster = cluster;
+		file->current_cluster_distance = targetDistance;
+	}
+
+	file->cluster_offset = targetOffset;
 }
 
 int FAT32_fseek(struct FAT32_file_t* file, long offset, int origin)
 {
+	if (file->compressed)
+	{
+		return FAT32_compressed_seek(file->compressed, offset, origin);
+	}
+
     // If they're seeking forward or to an origin
 	if (offset >= 0)
 	{
@@ -306,6 +2237,12 @@ int FAT32_fseek(struct FAT32_file_t* file, long offset, int origin)
 
 void FAT32_rewind(struct FAT32_file_t* file)
 {
+	if (file->compressed)
+	{
+		FAT32_compressed_seek(file->compressed, 0, FAT32_SEEK_SET);
+		return;
+	}
+
 	// Just go back to the beginning
 	file->current_cluster = file->start_cluster;
 	file->current_cluster_distance = 0;
@@ -314,11 +2251,26 @@ void FAT32_rewind(struct FAT32_file_t* file)
 
 long FAT32_ftell(const struct FAT32_file_t* file)
 {
-    return file->current_cluster_distance * FAT32_CLUSTER_SIZE + file->cluster_offset;
+	if (file->compressed)
+	{
+		return FAT32_compressed_tell(file->compressed);
+	}
+
+    return (long)(((uint64_t)file->current_cluster_distance << file->volume->cluster_shift) + file->cluster_offset);
+}
+
+struct FAT32_volume_t* FAT32_fvolume(const struct FAT32_file_t* file)
+{
+	return file->volume;
 }
 
 FAT32_cluster_address_t FAT32_faddress(const struct FAT32_file_t* file)
 {
+	if (file->compressed)
+	{
+		return FAT32_faddress(FAT32_compressed_inner(file->compressed));
+	}
+
     return file->start_cluster;
 }
 
@@ -327,24 +2279,31 @@ int FAT32_fmodified(const struct FAT32_file_t* file)
 	return file->modified;
 }
 
-void FAT32_print_disk(void)
+int FAT32_ferror(const struct FAT32_file_t* file)
+{
+	return file->error || (file->compressed && FAT32_compressed_failed(file->compressed));
+}
+
+void FAT32_print_disk(struct FAT32_volume_t* volume)
 {
+	const uint32_t clusterSize = volume->cluster_size;
+	HDByte_t* cluster = (HDByte_t*)malloc(clusterSize);
+
 	FAT32_cluster_address_t address;
-	address.index = 0;
+	address.index = FAT32_FIRST_CLUSTER;
 
 	// For each cluster
-	for (; address.index < FAT32_NUM_CLUSTERS; ++address.index)
+	for (; address.index < volume->num_entries; ++address.index)
 	{
-		HDByte_t cluster[FAT32_CLUSTER_SIZE];
-		memset(cluster, ' ', FAT32_CLUSTER_SIZE);
+		memset(cluster, ' ', clusterSize);
 
 		// If the cluster contains actual data
-		if (get_table_entry(address).index != FAT32_CLUSTER_ADDRESS_NULL)
+		if (FAT32_get_table_entry(volume, address).index != FAT32_CLUSTER_ADDRESS_NULL)
 		{
-			memcpy(cluster, get_data_entry(address), FAT32_CLUSTER_SIZE);
+			FAT32_read_cluster(volume, address, 0, cluster, clusterSize);
 
 			// Remove unwanted characters
-			for (size_t i = 0; i < FAT32_CLUSTER_SIZE; ++i)
+			for (size_t i = 0; i < clusterSize; ++i)
 			{
 				const char c = cluster[i];
 				if (c == '\a' || c == '\b' || c == '\e' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v')
@@ -356,7 +2315,9 @@ void FAT32_print_disk(void)
 
 		// Print the contents
 		printf("[");
-		fwrite(cluster, 1, FAT32_CLUSTER_SIZE, stdout);
+		fwrite(cluster, 1, clusterSize, stdout);
 		printf("]\n");
 	}
+
+	free(cluster);
 }
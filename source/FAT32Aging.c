@@ -0,0 +1,481 @@
+// FAT32Aging.c
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "FAT32Internal.h"
+#include "FAT32Thread.h"
+#include "../include/FAT32Aging.h"
+#include "../include/FAT32Defrag.h"
+
+/* The number of bytes of the pattern written to files, over and over. */
+#define FAT32_AGING_PATTERN_SIZE (64 * 1024)
+
+/* The number of bytes read at a time when measuring read throughput. */
+#define FAT32_AGING_READ_SIZE (256 * 1024)
+
+/* The size of a character array large enough for the name of any file or directory of the workload. */
+#define FAT32_AGING_NAME_LEN 16
+
+/* A file of the workload that's alive. */
+struct aging_file_t
+{
+	/* The file is named after this, and lives in the directory it selects. */
+	uint32_t id;
+
+	/* The operation the file is deleted at. */
+	uint32_t death;
+
+	uint32_t size;
+	FAT32_cluster_address_t address;
+};
+
+struct aging_state_t
+{
+	struct FAT32_volume_t* volume;
+	const struct FAT32_aging_config_t* config;
+	uint64_t random;
+
+	/* The directories the files are spread over. */
+	struct FAT32_file_t** dirs;
+
+	/* The files alive, as a heap with the first to be deleted at the top. */
+	struct aging_file_t* files;
+	uint32_t num_files;
+	uint32_t files_capacity;
+	uint64_t num_bytes;
+	uint32_t next_id;
+
+	/* The time each allocation since the last checkpoint took, in nanoseconds. */
+	uint64_t* latencies;
+	uint32_t num_latencies;
+	uint32_t latencies_capacity;
+
+	uint32_t num_created;
+	uint32_t num_appended;
+	uint32_t num_deleted;
+
+	/* The bytes written to files, and read back into. */
+	HDByte_t* pattern;
+	HDByte_t* buffer;
+};
+
+/* Returns the next number from the random sequence (SplitMix64). */
+static uint64_t next_random(uint64_t* random)
+{
+	uint64_t value = (*random += 0x9E3779B97F4A7C15ull);
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+	return value ^ (value >> 31);
+}
+
+/* Returns a random number in [low, high]. */
+static uint32_t random_between(uint64_t* random, uint32_t low, uint32_t high)
+{
+	return low + (uint32_t)(next_random(random) % ((uint64_t)high - low + 1));
+}
+
+static uint32_t floor_log2(uint32_t value)
+{
+	uint32_t result = 0;
+	while (value >>= 1)
+	{
+		++result;
+	}
+
+	return result;
+}
+
+/* Draws a value from the given range. */
+static uint32_t draw(uint64_t* random, const struct FAT32_aging_range_t* range)
+{
+	if (range->max <= range->min)
+	{
+		return range->min;
+	}
+
+	if (range->distribution == FAT32_AGING_UNIFORM)
+	{
+		return random_between(random, range->min, range->max);
+	}
+
+	// Pick a power of two, then a value up to the next one, kept within the range
+	const uint32_t bit = random_between(random, floor_log2(range->min > 0 ? range->min : 1), floor_log2(range->max));
+	const uint32_t low = (uint32_t)1 << bit;
+	const uint32_t high = bit == 31 ? UINT32_MAX : ((uint32_t)2 << bit) - 1;
+
+	return random_between(random, low > range->min ? low : range->min, high < range->max ? high : range->max);
+}
+
+static void name_file(uint32_t id, char* outName)
+{
+	snprintf(outName, FAT32_AGING_NAME_LEN, "f%u", id);
+}
+
+static struct FAT32_file_t* file_dir(const struct aging_state_t* state, uint32_t id)
+{
+	return state->dirs[id % state->config->num_directories];
+}
+
+static void swap_files(struct aging_file_t* a, struct aging_file_t* b)
+{
+	const struct aging_file_t temp = *a;
+	*a = *b;
+	*b = temp;
+}
+
+static void push_file(struct aging_state_t* state, const struct aging_file_t* file)
+{
+	if (state->num_files == state->files_capacity)
+	{
+		state->files_capacity = state->files_capacity ? state->files_capacity * 2 : 64;
+		state->files = (struct aging_file_t*)realloc(state->files, sizeof(struct aging_file_t) * state->files_capacity);
+	}
+
+	// Sift it up to its place in the heap
+	uint32_t pos = state->num_files++;
+	state->files[pos] = *file;
+	while (pos > 0 && state->files[(pos - 1) / 2].death > state->files[pos].death)
+	{
+		swap_files(&state->files[(pos - 1) / 2], &state->files[pos]);
+		pos = (pos - 1) / 2;
+	}
+}
+
+/* Deletes the file at the top of the heap, the first due to be deleted. */
+static void delete_first_file(struct aging_state_t* state)
+{
+	char name[FAT32_AGING_NAME_LEN];
+	name_file(state->files[0].id, name);
+	FAT32_dir_remove_entry(file_dir(state, state->files[0].id), name);
+
+	state->num_bytes -= state->files[0].size;
+	state->num_deleted += 1;
+
+	// Sift the last file down from the top
+	state->files[0] = state->files[--state->num_files];
+	uint32_t pos = 0;
+	while (1)
+	{
+		uint32_t first = pos;
+		const uint32_t left = pos * 2 + 1;
+		const uint32_t right = left + 1;
+		if (left < state->num_files && state->files[left].death < state->files[first].death)
+		{
+			first = left;
+		}
+		if (right < state->num_files && state->files[right].death < state->files[first].death)
+		{
+			first = right;
+		}
+
+		if (first == pos)
+		{
+			break;
+		}
+
+		swap_files(&state->files[first], &state->files[pos]);
+		pos = first;
+	}
+}
+
+/* Deletes files early until 'numClusters' more fit within the configured fill limit. Returns 0 if they can't. */
+static int make_room(struct aging_state_t* state, uint64_t numClusters)
+{
+	const uint64_t totalClusters = state->volume->num_entries - FAT32_FIRST_CLUSTER;
+	const uint64_t limit = totalClusters * state->config->max_fill_percent / 100;
+
+	while (totalClusters - state->volume->free_count + numClusters > limit)
+	{
+		if (state->num_files == 0)
+		{
+			return 0;
+		}
+
+		delete_first_file(state);
+	}
+
+	return 1;
+}
+
+static void add_latency(struct aging_state_t* state, uint64_t nanoseconds)
+{
+	if (state->num_latencies == state->latencies_capacity)
+	{
+		state->latencies_capacity = state->latencies_capacity ? state->latencies_capacity * 2 : 256;
+		state->latencies = (uint64_t*)realloc(state->latencies, sizeof(uint64_t) * state->latencies_capacity);
+	}
+
+	state->latencies[state->num_latencies++] = nanoseconds;
+}
+
+/* Grows an open file to 'size' bytes, timing the allocation, then fills the new bytes from 'offset' on with the pattern. */
+static void grow_file(struct aging_state_t* state, struct FAT32_file_t* file, uint32_t offset, uint32_t size)
+{
+	const uint64_t start = FAT32_monotonic_ns();
+	FAT32_ftruncate(file, size);
+	add_latency(state, FAT32_monotonic_ns() - start);
+
+	while (offset < size)
+	{
+		const uint32_t span = size - offset < FAT32_AGING_PATTERN_SIZE ? size - offset : FAT32_AGING_PATTERN_SIZE;
+		FAT32_pwrite(file, state->pattern, span, offset);
+		offset += span;
+	}
+}
+
+static uint64_t clusters_for(const struct aging_state_t* state, uint64_t size)
+{
+	return (size + state->volume->cluster_mask) >> state->volume->cluster_shift;
+}
+
+static void create_file(struct aging_state_t* state, uint32_t operation)
+{
+	const uint32_t size = draw(&state->random, &state->config->file_sizes);
+	const uint32_t lifetime = draw(&state->random, &state->config->lifetimes);
+
+	// Even empty files have a cluster, and the directory may need another
+	const uint64_t numClusters = clusters_for(state, size);
+	if (!make_room(state, (numClusters > 0 ? numClusters : 1) + 1))
+	{
+		return;
+	}
+
+	struct aging_file_t record;
+	record.id = state->next_id++;
+	record.death = operation + (lifetime > 0 ? lifetime : 1);
+	record.size = size;
+
+	char name[FAT32_AGING_NAME_LEN];
+	name_file(record.id, name);
+	struct FAT32_file_t* dir = file_dir(state, record.id);
+
+	struct FAT32_directory_entry_t entry;
+	FAT32_dir_new_entry(dir, name, FAT32_DIR_ENTRY_ATTRIB_ARCHIVE, &entry);
+
+	struct FAT32_file_t* file = FAT32_dir_open_entry(state->volume, &entry);
+	grow_file(state, file, 0, size);
+	if (FAT32_dir_close_entry(&entry, file))
+	{
+		FAT32_dir_update_entry(dir, &entry);
+	}
+
+	record.address = FAT32_dir_get_entry_address(&entry);
+	push_file(state, &record);
+	state->num_bytes += size;
+	state->num_created += 1;
+}
+
+static void append_file(struct aging_state_t* state)
+{
+	uint32_t size = draw(&state->random, &state->config->append_sizes);
+	if (!make_room(state, clusters_for(state, size)) || state->num_files == 0)
+	{
+		return;
+	}
+
+	// Any file will do, and appending doesn't change when it's deleted, so it stays where it is in the heap
+	struct aging_file_t* record = &state->files[random_between(&state->random, 0, state->num_files - 1)];
+	size = size < UINT32_MAX - record->size ? size : UINT32_MAX - record->size;
+
+	char name[FAT32_AGING_NAME_LEN];
+	name_file(record->id, name);
+	struct FAT32_file_t* dir = file_dir(state, record->id);
+
+	struct FAT32_directory_entry_t entry;
+	if (!FAT32_dir_get_entry(dir, name, &entry))
+	{
+		return;
+	}
+
+	struct FAT32_file_t* file = FAT32_dir_open_entry(state->volume, &entry);
+	grow_file(state, file, record->size, record->size + size);
+	if (FAT32_dir_close_entry(&entry, file))
+	{
+		FAT32_dir_update_entry(dir, &entry);
+	}
+
+	record->address = FAT32_dir_get_entry_address(&entry);
+	record->size += size;
+	state->num_bytes += size;
+	state->num_appended += 1;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	const uint64_t lhs = *(const uint64_t*)a;
+	const uint64_t rhs = *(const uint64_t*)b;
+	return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* Takes the measurements for a checkpoint, and starts counting afresh. */
+static void take_checkpoint(struct aging_state_t* state, uint32_t operation, FAT32_aging_callback_t callback, void* userData)
+{
+	struct FAT32_volume_t* volume = state->volume;
+	struct FAT32_aging_checkpoint_t checkpoint;
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	checkpoint.operation = operation;
+	checkpoint.num_files = state->num_files;
+	checkpoint.num_bytes = state->num_bytes;
+	checkpoint.num_created = state->num_created;
+	checkpoint.num_appended = state->num_appended;
+	checkpoint.num_deleted = state->num_deleted;
+
+	// Count the runs of each chain
+	uint64_t numFragments = 0;
+	for (uint32_t i = 0; i < state->num_files; ++i)
+	{
+		FAT32_cluster_address_t address = state->files[i].address;
+		FAT32_cluster_address_t previous;
+		previous.index = FAT32_CLUSTER_ADDRESS_NULL;
+		for (uint32_t length = 0; FAT32_is_valid_cluster(volume, address) && length < volume->num_entries; ++length)
+		{
+			numFragments += address.index != previous.index + 1;
+			previous = address;
+			address = FAT32_get_table_entry(volume, address);
+		}
+	}
+	checkpoint.fragments_per_file = state->num_files > 0 ? (double)numFragments / state->num_files : 0.0;
+
+	// Read files back until enough has been read
+	uint64_t numRead = 0;
+	const uint64_t readStart = FAT32_monotonic_ns();
+	for (uint32_t i = 0; i < state->num_files && numRead < state->config->max_read_bytes; ++i)
+	{
+		struct FAT32_file_t* file = FAT32_fopen(volume, state->files[i].address, state->files[i].size);
+		for (uint32_t offset = 0; offset < state->files[i].size; offset += FAT32_AGING_READ_SIZE)
+		{
+			numRead += FAT32_pread(file, state->buffer, FAT32_AGING_READ_SIZE, offset);
+		}
+		FAT32_fclose(file);
+	}
+	const uint64_t readTime = FAT32_monotonic_ns() - readStart;
+	checkpoint.read_mb_per_second = readTime > 0 ? (double)numRead / (1024.0 * 1024.0) / ((double)readTime / 1e9) : 0.0;
+
+	if (state->num_latencies > 0)
+	{
+		qsort(state->latencies, state->num_latencies, sizeof(uint64_t), &compare_latencies);
+
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < state->num_latencies; ++i)
+		{
+			total += state->latencies[i];
+		}
+
+		checkpoint.mean_allocation_us = (double)total / state->num_latencies / 1000.0;
+		checkpoint.p99_allocation_us = (double)state->latencies[(uint64_t)state->num_latencies * 99 / 100] / 1000.0;
+		checkpoint.max_allocation_us = (double)state->latencies[state->num_latencies - 1] / 1000.0;
+	}
+
+	struct FAT32_defrag_report_t report;
+	FAT32_defrag_analyze(volume, &report, NULL, NULL);
+	checkpoint.num_free_clusters = report.num_free_clusters;
+	checkpoint.num_free_extents = report.num_free_extents;
+	checkpoint.largest_free_extent = report.largest_free_extent;
+
+	callback(&checkpoint, userData);
+
+	state->num_latencies = 0;
+	state->num_created = 0;
+	state->num_appended = 0;
+	state->num_deleted = 0;
+}
+
+void FAT32_aging_default_config(uint64_t seed, uint32_t numOperations, struct FAT32_aging_config_t* outConfig)
+{
+	memset(outConfig, 0, sizeof(struct FAT32_aging_config_t));
+	outConfig->seed = seed;
+	outConfig->num_operations = numOperations;
+	outConfig->checkpoint_interval = numOperations >= 10 ? numOperations / 10 : 1;
+	outConfig->file_sizes.distribution = FAT32_AGING_LOG_UNIFORM;
+	outConfig->file_sizes.min = 512;
+	outConfig->file_sizes.max = 1024 * 1024;
+	outConfig->append_sizes.distribution = FAT32_AGING_LOG_UNIFORM;
+	outConfig->append_sizes.min = 512;
+	outConfig->append_sizes.max = 64 * 1024;
+	outConfig->lifetimes.distribution = FAT32_AGING_LOG_UNIFORM;
+	outConfig->lifetimes.min = 16;
+	outConfig->lifetimes.max = 4096;
+	outConfig->append_percent = 30;
+	outConfig->max_fill_percent = 80;
+	outConfig->num_directories = 16;
+	outConfig->max_read_bytes = 64 * 1024 * 1024;
+}
+
+int FAT32_age(struct FAT32_file_t* dir, const struct FAT32_aging_config_t* config, FAT32_aging_callback_t callback, void* userData)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+	const uint32_t numDirectories = config->num_directories > 0 ? config->num_directories : 1;
+
+	// Don't run over an earlier workload
+	struct FAT32_directory_entry_t entry;
+	if (FAT32_dir_get_entry(dir, "aging0", &entry))
+	{
+		return 0;
+	}
+
+	struct aging_state_t state;
+	memset(&state, 0, sizeof(state));
+	state.volume = volume;
+	state.random = config->seed;
+	state.dirs = (struct FAT32_file_t**)malloc(sizeof(struct FAT32_file_t*) * numDirectories);
+	state.pattern = (HDByte_t*)malloc(FAT32_AGING_PATTERN_SIZE);
+	state.buffer = (HDByte_t*)malloc(FAT32_AGING_READ_SIZE);
+
+	// The pattern is random too, so it's the same from run to run
+	uint64_t patternRandom = config->seed;
+	for (uint32_t i = 0; i < FAT32_AGING_PATTERN_SIZE; i += sizeof(uint64_t))
+	{
+		const uint64_t value = next_random(&patternRandom);
+		memcpy(&state.pattern[i], &value, sizeof(value));
+	}
+
+	// Files are spread over at least one directory
+	struct FAT32_aging_config_t fixedConfig = *config;
+	fixedConfig.num_directories = numDirectories;
+	state.config = &fixedConfig;
+
+	for (uint32_t i = 0; i < numDirectories; ++i)
+	{
+		char name[FAT32_AGING_NAME_LEN];
+		snprintf(name, FAT32_AGING_NAME_LEN, "aging%u", i);
+		FAT32_dir_new_directory(dir, name, &entry);
+		state.dirs[i] = FAT32_dir_open_entry(volume, &entry);
+	}
+
+	const uint32_t interval = config->checkpoint_interval > 0 ? config->checkpoint_interval : config->num_operations;
+	for (uint32_t operation = 0; operation < config->num_operations; ++operation)
+	{
+		// Delete the files whose time is up
+		while (state.num_files > 0 && state.files[0].death <= operation)
+		{
+			delete_first_file(&state);
+		}
+
+		if (state.num_files > 0 && random_between(&state.random, 0, 99) < config->append_percent)
+		{
+			append_file(&state);
+		}
+		else
+		{
+			create_file(&state, operation);
+		}
+
+		if ((operation + 1) % interval == 0 || operation + 1 == config->num_operations)
+		{
+			take_checkpoint(&state, operation + 1, callback, userData);
+		}
+	}
+
+	for (uint32_t i = 0; i < numDirectories; ++i)
+	{
+		FAT32_fclose(state.dirs[i]);
+	}
+
+	free(state.dirs);
+	free(state.files);
+	free(state.latencies);
+	free(state.pattern);
+	free(state.buffer);
+	return 1;
+}
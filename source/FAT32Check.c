@@ -0,0 +1,616 @@
+// FAT32Check.c
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "FAT32Internal.h"
+#include "FAT32Thread.h"
+#include "../include/FAT32Check.h"
+
+/* The maximum length of a path reported by the checker. */
+#define FAT32_CHECK_PATH_LEN 256
+
+/* The number of 64-bit words required for a bitmap with one bit per table entry. */
+#define FAT32_CHECK_BITMAP_WORDS(volume) (((volume)->num_entries + 63) / 64)
+
+/* Marks the end of a path that was too long to report in full. */
+#define FAT32_CHECK_PATH_ELLIPSIS "..."
+
+/* Entry offset used for problems in the root directory's own chain, which has no directory entry. */
+#define FAT32_CHECK_ROOT_OFFSET -1
+
+/* A directory waiting to be walked. */
+struct pending_dir_t
+{
+	FAT32_cluster_address_t address;
+
+	/* The directory's parent, as its '..' entry should refer to it (NULL for the root directory). */
+	FAT32_cluster_address_t parent;
+
+	char path[FAT32_CHECK_PATH_LEN];
+};
+
+/* A problem found in a cluster chain, recorded so it may be repaired once the walk is over. */
+struct chain_problem_t
+{
+	enum FAT32_check_problem_t type;
+
+	/* The directory containing the entry that owns the chain. */
+	FAT32_cluster_address_t dir;
+
+	/* The byte offset of the entry within the directory. */
+	long entry_offset;
+
+	/* The last good cluster in the chain, or NULL if the entry itself refers to a bad cluster. */
+	FAT32_cluster_address_t prev;
+
+	/* The offending cluster. */
+	FAT32_cluster_address_t cluster;
+
+	/* The number of good clusters in the chain before the offending cluster. */
+	uint32_t good_length;
+
+	/* For bad links, the address the link should refer to. */
+	FAT32_cluster_address_t expected;
+
+	char path[FAT32_CHECK_PATH_LEN];
+};
+
+struct check_state_t
+{
+	/* The volume being checked. */
+	struct FAT32_volume_t* volume;
+
+	/* One bit per cluster, set if the cluster's table entry is not NULL. */
+	uint64_t* allocated;
+
+	/* One bit per cluster, set once a chain has claimed the cluster. */
+	volatile uint64_t* owned;
+
+	/* Protects everything below. */
+	FAT32_mutex_t mutex;
+
+	/* Signalled when work is added, or when all work is done. */
+	FAT32_cond_t cond;
+
+	struct pending_dir_t* queue;
+	uint32_t queue_len;
+	uint32_t queue_capacity;
+
+	/* The number of directories currently being walked. */
+	uint32_t num_active;
+
+	struct chain_problem_t* problems;
+	uint32_t num_problems;
+	uint32_t problems_capacity;
+
+	uint32_t num_files;
+	uint32_t num_directories;
+
+	/* Set if some directory could not be walked, in which case unreachable clusters may not actually be lost. */
+	int incomplete;
+};
+
+static int test_bit(const volatile uint64_t* bitmap, uint32_t index)
+{
+	return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+/* Records a problem. Must be called with the mutex held. */
+static void add_problem(struct check_state_t* state, const struct chain_problem_t* problem)
+{
+	if (state->num_problems == state->problems_capacity)
+	{
+		state->problems_capacity = state->problems_capacity ? state->problems_capacity * 2 : 16;
+		state->problems = (struct chain_problem_t*)realloc(state->problems, sizeof(struct chain_problem_t) * state->problems_capacity);
+	}
+
+	state->problems[state->num_problems++] = *problem;
+}
+
+/* Adds a directory to the work queue. */
+static void push_dir(struct check_state_t* state, FAT32_cluster_address_t address, FAT32_cluster_address_t parent, const char* path)
+{
+	FAT32_mutex_lock(&state->mutex);
+
+	if (state->queue_len == state->queue_capacity)
+	{
+		state->queue_capacity = state->queue_capacity ? state->queue_capacity * 2 : 16;
+		state->queue = (struct pending_dir_t*)realloc(state->queue, sizeof(struct pending_dir_t) * state->queue_capacity);
+	}
+
+	struct pending_dir_t* dir = &state->queue[state->queue_len++];
+	dir->address = address;
+	dir->parent = parent;
+	snprintf(dir->path, FAT32_CHECK_PATH_LEN, "%s", path);
+
+	FAT32_cond_signal(&state->cond);
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+/* Returns whether other chains are known to lead into the cluster, as clones share them. */
+static int is_shared_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (FAT32_atomic_load64(&volume->num_shared_clusters) == 0)
+	{
+		return 0;
+	}
+
+	FAT32_mutex_lock(&volume->share_mutex);
+	const int shared = FAT32_get_cluster_shares(volume, address) != 0;
+	FAT32_mutex_unlock(&volume->share_mutex);
+
+	return shared;
+}
+
+/* Claims every cluster in a chain for its owner, stopping where it joins a shared chain that's been claimed already.
+* Returns whether the whole chain was good. */
+static int claim_chain(struct check_state_t* state, FAT32_cluster_address_t address, FAT32_cluster_address_t dir, long entryOffset, const char* path)
+{
+	struct FAT32_volume_t* volume = state->volume;
+	struct chain_problem_t problem;
+	problem.prev.index = FAT32_CLUSTER_ADDRESS_NULL;
+	problem.good_length = 0;
+
+	// Empty files have no chain at all
+	if (address.index == FAT32_CLUSTER_ADDRESS_NULL && entryOffset != FAT32_CHECK_ROOT_OFFSET)
+	{
+		return 1;
+	}
+
+	while (!FAT32_CLUSTER_ADDRESS_IS_EOC(address.index))
+	{
+		if (!FAT32_is_valid_cluster(volume, address))
+		{
+			problem.type = FAT32_CHECK_INVALID_ADDRESS;
+		}
+		else if (!test_bit(state->allocated, address.index))
+		{
+			problem.type = FAT32_CHECK_FREE_REFERENCE;
+		}
+		else if (FAT32_atomic_fetch_or64(&state->owned[address.index / 64], (uint64_t)1 << (address.index % 64)) & ((uint64_t)1 << (address.index % 64)))
+		{
+			// Chains are expected to meet where they're shared, and the rest has already been claimed
+			if (is_shared_cluster(volume, address))
+			{
+				return 1;
+			}
+
+			problem.type = FAT32_CHECK_CROSS_LINKED;
+		}
+		else
+		{
+			// This cluster is good, move to the next one
+			problem.prev = address;
+			problem.good_length += 1;
+			address = FAT32_get_table_entry(volume, address);
+			continue;
+		}
+
+		problem.dir = dir;
+		problem.entry_offset = entryOffset;
+		problem.cluster = address;
+		snprintf(problem.path, FAT32_CHECK_PATH_LEN, "%s", path);
+
+		FAT32_mutex_lock(&state->mutex);
+		add_problem(state, &problem);
+		FAT32_mutex_unlock(&state->mutex);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Records a bad link if a directory's '.' or '..' entry doesn't refer to where it should. */
+static void check_link(struct check_state_t* state, const struct pending_dir_t* pending, const struct FAT32_directory_entry_t* entry, long offset,
+	const char* path)
+{
+	// The root directory has no links, and is referred to by a NULL address
+	struct chain_problem_t problem;
+	const int isParent = entry->name[1] == '.';
+	problem.expected = isParent ? pending->parent : pending->address;
+	if (problem.expected.index == FAT32_get_root(state->volume).index)
+	{
+		problem.expected.index = FAT32_CLUSTER_ADDRESS_NULL;
+	}
+
+	problem.cluster = FAT32_dir_get_entry_address(entry);
+	if (pending->address.index == FAT32_get_root(state->volume).index || problem.cluster.index == problem.expected.index)
+	{
+		return;
+	}
+
+	problem.type = FAT32_CHECK_BAD_LINK;
+	problem.dir = pending->address;
+	problem.entry_offset = offset;
+	problem.prev.index = FAT32_CLUSTER_ADDRESS_NULL;
+	problem.good_length = 0;
+	snprintf(problem.path, FAT32_CHECK_PATH_LEN, "%s", path);
+
+	FAT32_mutex_lock(&state->mutex);
+	add_problem(state, &problem);
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+/* Claims the chains of every entry in the given directory, and queues its subdirectories. */
+static void check_directory(struct check_state_t* state, const struct pending_dir_t* pending)
+{
+	struct FAT32_volume_t* volume = state->volume;
+	uint32_t numFiles = 0;
+	uint32_t numDirectories = 1;
+	int incomplete = 0;
+
+	struct FAT32_file_t* dir = FAT32_fopen(volume, pending->address, UINT32_MAX);
+
+	struct FAT32_directory_entry_t entry;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	while (FAT32_dir_read_entry(dir, &entry, name))
+	{
+		const long offset = FAT32_ftell(dir) - (long)sizeof(entry);
+
+		// Paths nest without limit, so show where a long one was cut short
+		char path[FAT32_CHECK_PATH_LEN];
+		if (snprintf(path, FAT32_CHECK_PATH_LEN, "%s%s", pending->path, name) >= FAT32_CHECK_PATH_LEN)
+		{
+			strcpy(path + FAT32_CHECK_PATH_LEN - sizeof(FAT32_CHECK_PATH_ELLIPSIS), FAT32_CHECK_PATH_ELLIPSIS);
+		}
+
+		// The links to this directory and its parent have no chains of their own
+		if (FAT32_dir_is_dot_entry(&entry))
+		{
+			check_link(state, pending, &entry, offset, path);
+			continue;
+		}
+
+		const int good = claim_chain(state, FAT32_dir_get_entry_address(&entry), pending->address, offset, path);
+
+		if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+		{
+			// Only walk directories whose chain can be trusted
+			if (good)
+			{
+				strncat(path, "/", FAT32_CHECK_PATH_LEN - strlen(path) - 1);
+				push_dir(state, FAT32_dir_get_entry_address(&entry), pending->address, path);
+			}
+			else
+			{
+				incomplete = 1;
+			}
+		}
+		else
+		{
+			++numFiles;
+		}
+	}
+
+	FAT32_fclose(dir);
+
+	FAT32_mutex_lock(&state->mutex);
+	state->num_files += numFiles;
+	state->num_directories += numDirectories;
+	state->incomplete |= incomplete;
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+static void check_worker(void* userData)
+{
+	struct check_state_t* state = (struct check_state_t*)userData;
+
+	FAT32_mutex_lock(&state->mutex);
+	while (1)
+	{
+		if (state->queue_len > 0)
+		{
+			const struct pending_dir_t pending = state->queue[--state->queue_len];
+			state->num_active += 1;
+			FAT32_mutex_unlock(&state->mutex);
+
+			check_directory(state, &pending);
+
+			FAT32_mutex_lock(&state->mutex);
+			state->num_active -= 1;
+
+			// If that was the last of the work, wake everyone up so they can leave
+			if (state->queue_len == 0 && state->num_active == 0)
+			{
+				FAT32_cond_broadcast(&state->cond);
+			}
+
+			continue;
+		}
+
+		// Nothing left to do, and nobody left to produce more work
+		if (state->num_active == 0)
+		{
+			break;
+		}
+
+		FAT32_cond_wait(&state->cond, &state->mutex);
+	}
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+/* Claims every chain reachable from the root, forgetting the results of any earlier walk. */
+static void walk_tree(struct check_state_t* state, uint32_t numThreads)
+{
+	struct FAT32_volume_t* volume = state->volume;
+
+	memset((void*)state->owned, 0, sizeof(uint64_t) * FAT32_CHECK_BITMAP_WORDS(volume));
+	state->num_problems = 0;
+	state->num_files = 0;
+	state->num_directories = 0;
+	state->incomplete = 0;
+
+	// Start with the root
+	FAT32_cluster_address_t noDir;
+	noDir.index = FAT32_CLUSTER_ADDRESS_NULL;
+	if (claim_chain(state, FAT32_get_root(volume), noDir, FAT32_CHECK_ROOT_OFFSET, "/"))
+	{
+		push_dir(state, FAT32_get_root(volume), noDir, "/");
+	}
+	else
+	{
+		state->incomplete = 1;
+	}
+
+	FAT32_thread_t* threads = (FAT32_thread_t*)malloc(sizeof(FAT32_thread_t) * numThreads);
+	uint32_t numStarted = 0;
+	for (; numStarted + 1 < numThreads; ++numStarted)
+	{
+		if (!FAT32_thread_create(&threads[numStarted], &check_worker, state))
+		{
+			break;
+		}
+	}
+
+	check_worker(state);
+
+	for (uint32_t i = 0; i < numStarted; ++i)
+	{
+		FAT32_thread_join(threads[i]);
+	}
+	free(threads);
+}
+
+static int compare_problems(const void* a, const void* b)
+{
+	const struct chain_problem_t* lhs = (const struct chain_problem_t*)a;
+	const struct chain_problem_t* rhs = (const struct chain_problem_t*)b;
+
+	if (lhs->dir.index != rhs->dir.index)
+	{
+		return lhs->dir.index < rhs->dir.index ? -1 : 1;
+	}
+
+	return lhs->entry_offset < rhs->entry_offset ? -1 : lhs->entry_offset > rhs->entry_offset;
+}
+
+/* Cuts a chain off before its offending cluster, fixing up the owning entry. */
+static void repair_chain(struct FAT32_volume_t* volume, const struct chain_problem_t* problem)
+{
+	FAT32_cluster_address_t eoc;
+	eoc.index = FAT32_CLUSTER_ADDRESS_EOC;
+
+	// The root directory has no entry, so just fix its chain
+	if (problem->entry_offset == FAT32_CHECK_ROOT_OFFSET)
+	{
+		FAT32_set_table_entry(volume, problem->prev.index != FAT32_CLUSTER_ADDRESS_NULL ? problem->prev : FAT32_get_root(volume), eoc);
+		return;
+	}
+
+	struct FAT32_file_t* dir = FAT32_fopen(volume, problem->dir, UINT32_MAX);
+	FAT32_fseek(dir, problem->entry_offset, FAT32_SEEK_SET);
+
+	struct FAT32_directory_entry_t entry;
+	FAT32_fread(&entry, sizeof(entry), 1, dir);
+
+	if (problem->prev.index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		// None of the chain belongs to this entry, so drop the entry, along with its long name
+		FAT32_dir_delete_entry_at(dir, problem->entry_offset);
+		FAT32_fclose(dir);
+		return;
+	}
+
+	// Truncate the chain, and the file along with it
+	FAT32_set_table_entry(volume, problem->prev, eoc);
+
+	const uint32_t maxSize = problem->good_length << volume->cluster_shift;
+	if ((entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0 && entry.size > maxSize)
+	{
+		entry.size = maxSize;
+	}
+
+	FAT32_fseek(dir, problem->entry_offset, FAT32_SEEK_SET);
+	FAT32_fwrite(&entry, sizeof(entry), 1, dir);
+	FAT32_fclose(dir);
+}
+
+/* Points a directory's '.' or '..' entry back at the directory or its parent. */
+static void repair_link(struct FAT32_volume_t* volume, const struct chain_problem_t* problem)
+{
+	struct FAT32_file_t* dir = FAT32_fopen(volume, problem->dir, UINT32_MAX);
+	FAT32_fseek(dir, problem->entry_offset, FAT32_SEEK_SET);
+
+	struct FAT32_directory_entry_t entry;
+	FAT32_fread(&entry, sizeof(entry), 1, dir);
+	FAT32_dir_set_entry_address(&entry, problem->expected);
+
+	FAT32_fseek(dir, problem->entry_offset, FAT32_SEEK_SET);
+	FAT32_fwrite(&entry, sizeof(entry), 1, dir);
+	FAT32_fclose(dir);
+}
+
+uint32_t FAT32_check(struct FAT32_volume_t* volume, FAT32_check_flags_t flags, uint32_t numThreads, struct FAT32_check_report_t* outReport, FAT32_check_callback_t callback, void* userData)
+{
+	struct check_state_t* state = (struct check_state_t*)calloc(1, sizeof(struct check_state_t));
+	state->volume = volume;
+	state->allocated = (uint64_t*)calloc(FAT32_CHECK_BITMAP_WORDS(volume), sizeof(uint64_t));
+	state->owned = (volatile uint64_t*)calloc(FAT32_CHECK_BITMAP_WORDS(volume), sizeof(uint64_t));
+	FAT32_mutex_init(&state->mutex);
+	FAT32_cond_init(&state->cond);
+
+	// Find all allocated clusters in one pass over the table
+	const FAT32_cluster_address_t* table = FAT32_get_table(volume);
+	for (uint32_t index = FAT32_FIRST_CLUSTER; index < volume->num_entries; ++index)
+	{
+		if (table[index].index != FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			state->allocated[index / 64] |= (uint64_t)1 << (index % 64);
+		}
+	}
+
+	// Walk the tree
+	if (numThreads == 0)
+	{
+		numThreads = FAT32_thread_hardware_concurrency();
+	}
+
+	walk_tree(state, numThreads);
+
+	// Whichever thread claims a cross-linked cluster first keeps it, and the others are cut off.
+	// So that repairs don't depend on timing, walk again on one thread, where the first chain in walk order keeps it.
+	if (numThreads > 1)
+	{
+		for (uint32_t i = 0; i < state->num_problems; ++i)
+		{
+			if (state->problems[i].type == FAT32_CHECK_CROSS_LINKED)
+			{
+				walk_tree(state, 1);
+				break;
+			}
+		}
+	}
+
+	memset(outReport, 0, sizeof(struct FAT32_check_report_t));
+	outReport->num_files = state->num_files;
+	outReport->num_directories = state->num_directories;
+
+	// Repairs are committed together
+	FAT32_journal_begin(volume);
+
+	// Report chain problems in a stable order
+	if (state->num_problems > 1)
+	{
+		qsort(state->problems, state->num_problems, sizeof(struct chain_problem_t), &compare_problems);
+	}
+	for (uint32_t i = 0; i < state->num_problems; ++i)
+	{
+		const struct chain_problem_t* problem = &state->problems[i];
+		switch (problem->type)
+		{
+		case FAT32_CHECK_CROSS_LINKED:
+			outReport->num_cross_linked += 1;
+			break;
+
+		case FAT32_CHECK_FREE_REFERENCE:
+			outReport->num_free_references += 1;
+			break;
+
+		case FAT32_CHECK_BAD_LINK:
+			outReport->num_bad_links += 1;
+			break;
+
+		default:
+			outReport->num_invalid_addresses += 1;
+			break;
+		}
+
+		if (callback)
+		{
+			callback(problem->type, problem->path, problem->cluster, userData);
+		}
+
+		if (flags & FAT32_CHECK_REPAIR)
+		{
+			if (problem->type == FAT32_CHECK_BAD_LINK)
+			{
+				repair_link(volume, problem);
+			}
+			else
+			{
+				repair_chain(volume, problem);
+			}
+			outReport->num_repaired += 1;
+		}
+	}
+
+	// Anything allocated but unclaimed is lost
+	FAT32_cluster_address_t address;
+	for (address.index = FAT32_FIRST_CLUSTER; address.index < volume->num_entries; ++address.index)
+	{
+		if (!test_bit(state->allocated, address.index) || test_bit(state->owned, address.index))
+		{
+			continue;
+		}
+
+		outReport->num_lost_clusters += 1;
+		if (callback)
+		{
+			callback(FAT32_CHECK_LOST_CLUSTER, "", address, userData);
+		}
+
+		// Only free lost clusters if we're sure they're not part of a directory we couldn't walk
+		if ((flags & FAT32_CHECK_REPAIR) && !state->incomplete)
+		{
+			FAT32_cluster_address_t value;
+			value.index = FAT32_CLUSTER_ADDRESS_NULL;
+			FAT32_set_table_entry(volume, address, value);
+			outReport->num_repaired += 1;
+		}
+	}
+
+	FAT32_journal_end(volume);
+
+	FAT32_cond_destroy(&state->cond);
+	FAT32_mutex_destroy(&state->mutex);
+	free(state->queue);
+	free(state->problems);
+	free((void*)state->owned);
+	free(state->allocated);
+	free(state);
+
+	return outReport->num_cross_linked + outReport->num_lost_clusters + outReport->num_free_references + outReport->num_invalid_addresses +
+		outReport->num_bad_links;
+}
+
+static void print_problem(enum FAT32_check_problem_t problem, const char* path, FAT32_cluster_address_t cluster, void* userData)
+{
+	(void)userData;
+
+	switch (problem)
+	{
+	case FAT32_CHECK_CROSS_LINKED:
+		printf("%s: cross-linked at cluster %u\n", path, cluster.index);
+		break;
+
+	case FAT32_CHECK_LOST_CLUSTER:
+		printf("Lost cluster %u\n", cluster.index);
+		break;
+
+	case FAT32_CHECK_FREE_REFERENCE:
+		printf("%s: refers to free cluster %u\n", path, cluster.index);
+		break;
+
+	case FAT32_CHECK_INVALID_ADDRESS:
+		printf("%s: refers to invalid cluster %u\n", path, cluster.index);
+		break;
+
+	case FAT32_CHECK_BAD_LINK:
+		printf("%s: link refers to the wrong cluster %u\n", path, cluster.index);
+		break;
+	}
+}
+
+void FAT32_check_print_report(struct FAT32_volume_t* volume, FAT32_check_flags_t flags)
+{
+	struct FAT32_check_report_t report;
+	const uint32_t numProblems = FAT32_check(volume, flags, 0, &report, &print_problem, NULL);
+
+	printf("Checked %u files in %u directories: %u problems", report.num_files, report.num_directories, numProblems);
+	if (flags & FAT32_CHECK_REPAIR)
+	{
+		printf(", %u repaired", report.num_repaired);
+	}
+	printf("\n");
+}
@@ -0,0 +1,423 @@
+// FAT32Checksum.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#define FAT32_CHECKSUM_SSE42
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define FAT32_TARGET_SSE42
+#elif defined(FAT32_CHECKSUM_SSE42)
+#define FAT32_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+/* Identifies the checksum file kept alongside an image. */
+#define FAT32_CHECKSUM_MAGIC 0x43524346 /* "FCRC" */
+#define FAT32_CHECKSUM_HEADER_SIZE 16
+
+/* Appended to the image path to name its checksum file. */
+#define FAT32_CHECKSUM_FILE_SUFFIX ".crc"
+
+/* States of the checksum file, as recorded in its header. */
+enum
+{
+	/* The volume is mounted, so the checksums in the file may be out of date. */
+	FAT32_CHECKSUM_FILE_IN_USE = 0,
+
+	/* The checksums in the file were saved when the volume was unmounted. */
+	FAT32_CHECKSUM_FILE_CLEAN = 1,
+};
+
+/* The CRC32C polynomial, bit reversed. */
+#define FAT32_CRC32C_POLY 0x82F63B78
+
+/* The number of bytes of changes gathered at a time while updating a checksum. */
+#define FAT32_CHECKSUM_DELTA_CHUNK 1024
+
+/* Tables for the fallback: 'crc_table[k][b]' is the CRC of byte 'b' followed by 'k' zero bytes. */
+static uint32_t crc_table[8][256];
+
+/* 'zeroes_table[k]' is x^(2^k) modulo the polynomial, used to append runs of zeroes to a CRC without going through them. */
+static uint32_t zeroes_table[32];
+
+/* Whether the processor has the SSE4.2 CRC32 instruction. */
+static int have_sse42;
+
+static void init_tables(void)
+{
+	for (uint32_t b = 0; b < 256; ++b)
+	{
+		uint32_t crc = b;
+		for (int bit = 0; bit < 8; ++bit)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ FAT32_CRC32C_POLY : crc >> 1;
+		}
+		crc_table[0][b] = crc;
+	}
+
+	for (uint32_t b = 0; b < 256; ++b)
+	{
+		for (int k = 1; k < 8; ++k)
+		{
+			crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xFF];
+		}
+	}
+
+#if defined(FAT32_CHECKSUM_SSE42) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	have_sse42 = (info[2] >> 20) & 1;
+#elif defined(FAT32_CHECKSUM_SSE42)
+	__builtin_cpu_init();
+	have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* Multiplies two polynomials modulo the CRC polynomial, in the bit reversed form CRCs use. */
+static uint32_t multiply_mod_poly(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (uint32_t bit = (uint32_t)1 << 31; bit != 0; bit >>= 1)
+	{
+		if (a & bit)
+		{
+			product ^= b;
+		}
+		b = b & 1 ? (b >> 1) ^ FAT32_CRC32C_POLY : b >> 1;
+	}
+
+	return product;
+}
+
+static void init_zeroes_table(void)
+{
+	// x^1, then each entry squares the last
+	uint32_t power = (uint32_t)1 << 30;
+	for (int k = 0; k < 32; ++k)
+	{
+		zeroes_table[k] = power;
+		power = multiply_mod_poly(power, power);
+	}
+}
+
+/* Returns the CRC register after appending 'count' zero bytes to what gave 'crc', without the pre and post inversion. */
+static uint32_t append_zeroes(uint32_t crc, uint64_t count)
+{
+	// Appending n zero bits multiplies by x^n, built up from the powers of two in n
+	uint64_t bits = count * 8;
+	for (int k = 0; bits != 0; ++k, bits >>= 1)
+	{
+		if (bits & 1)
+		{
+			crc = multiply_mod_poly(zeroes_table[k], crc);
+		}
+	}
+
+	return crc;
+}
+
+static uint32_t update_table(uint32_t crc, const HDByte_t* bytes, size_t size)
+{
+	// Eight bytes at a time, then one at a time for the rest
+	while (size >= 8)
+	{
+		const uint32_t low = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+		crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^ crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24] ^
+			crc_table[3][bytes[4]] ^ crc_table[2][bytes[5]] ^ crc_table[1][bytes[6]] ^ crc_table[0][bytes[7]];
+		bytes += 8;
+		size -= 8;
+	}
+
+	for (; size > 0; --size, ++bytes)
+	{
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *bytes) & 0xFF];
+	}
+
+	return crc;
+}
+
+#if defined(FAT32_CHECKSUM_SSE42)
+FAT32_TARGET_SSE42 static uint32_t update_sse42(uint32_t crc, const HDByte_t* bytes, size_t size)
+{
+	uint64_t crc64 = crc;
+	while (size >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		bytes += 8;
+		size -= 8;
+	}
+
+	crc = (uint32_t)crc64;
+	for (; size > 0; --size, ++bytes)
+	{
+		crc = _mm_crc32_u8(crc, *bytes);
+	}
+
+	return crc;
+}
+#endif
+
+/* Runs bytes through the CRC register, without the pre and post inversion. */
+static uint32_t update_crc(uint32_t crc, const HDByte_t* bytes, size_t size)
+{
+#if defined(FAT32_CHECKSUM_SSE42)
+	if (have_sse42)
+	{
+		return update_sse42(crc, bytes, size);
+	}
+#endif
+
+	return update_table(crc, bytes, size);
+}
+
+uint32_t FAT32_crc32c(const void* bytes, size_t size)
+{
+	return ~update_crc(0xFFFFFFFF, (const HDByte_t*)bytes, size);
+}
+
+static FAT32_mutex_t* get_lock(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return &volume->checksum_locks[address.index % FAT32_CHECKSUM_LOCK_STRIPES];
+}
+
+static int is_verified(const struct FAT32_volume_t* volume, uint32_t index)
+{
+	return (FAT32_atomic_load64(&volume->verified_clusters[index / 64]) >> (index % 64)) & 1;
+}
+
+static void set_verified(struct FAT32_volume_t* volume, uint32_t index)
+{
+	FAT32_atomic_fetch_or64(&volume->verified_clusters[index / 64], (uint64_t)1 << (index % 64));
+}
+
+/* Works out the checksum of every cluster in use from its contents. */
+static void rebuild_checksums(struct FAT32_volume_t* volume)
+{
+	HDByte_t* cluster = (HDByte_t*)malloc(volume->cluster_size);
+
+	FAT32_cluster_address_t address;
+	for (address.index = FAT32_FIRST_CLUSTER; address.index < volume->num_entries; ++address.index)
+	{
+		if (FAT32_get_table_entry(volume, address).index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			continue;
+		}
+
+		FAT32_read_cluster_unverified(volume, address, 0, cluster, volume->cluster_size);
+		volume->checksums[address.index] = FAT32_crc32c(cluster, volume->cluster_size);
+		set_verified(volume, address.index);
+	}
+
+	free(cluster);
+}
+
+/* Loads the checksums from the checksum file, if it was saved along with the volume as it is now. */
+static int load_checksums(struct FAT32_volume_t* volume, uint32_t generation)
+{
+	HDByte_t header[FAT32_CHECKSUM_HEADER_SIZE];
+	uint32_t fields[4];
+	if (!FAT32_device_read(&volume->checksum_device, 0, header, sizeof(header)))
+	{
+		return 0;
+	}
+
+	memcpy(fields, header, sizeof(fields));
+	if (fields[0] != FAT32_CHECKSUM_MAGIC || fields[1] != volume->num_entries || fields[2] != generation || fields[3] != FAT32_CHECKSUM_FILE_CLEAN)
+	{
+		return 0;
+	}
+
+	return FAT32_device_read(&volume->checksum_device, FAT32_CHECKSUM_HEADER_SIZE, volume->checksums, sizeof(uint32_t) * volume->num_entries);
+}
+
+static void write_checksum_header(struct FAT32_volume_t* volume, uint32_t state)
+{
+	uint32_t fields[4];
+	fields[0] = FAT32_CHECKSUM_MAGIC;
+	fields[1] = volume->num_entries;
+	fields[2] = volume->summary_generation;
+	fields[3] = state;
+
+	FAT32_device_write(&volume->checksum_device, 0, fields, sizeof(fields));
+	FAT32_device_flush(&volume->checksum_device);
+}
+
+void FAT32_checksums_open(struct FAT32_volume_t* volume, const char* path, int clean, uint32_t generation)
+{
+	if (!crc_table[0][1])
+	{
+		init_tables();
+		init_zeroes_table();
+	}
+
+	volume->checksums = (uint32_t*)calloc(volume->num_entries, sizeof(uint32_t));
+	volume->verified_clusters = (volatile uint64_t*)calloc((volume->num_entries + 63) / 64, sizeof(uint64_t));
+	volume->zero_cluster_checksum = FAT32_crc32c(volume->zero_cluster, volume->cluster_size);
+	volume->checksum_device.fd = -1;
+	for (uint32_t i = 0; i < FAT32_CHECKSUM_LOCK_STRIPES; ++i)
+	{
+		FAT32_mutex_init(&volume->checksum_locks[i]);
+	}
+
+	// Image files keep their checksums in a file next to them. They can only be trusted if both were put away together.
+	int loaded = 0;
+	if (path)
+	{
+		const size_t length = strlen(path);
+		char* checksumPath = (char*)malloc(length + sizeof(FAT32_CHECKSUM_FILE_SUFFIX));
+		memcpy(checksumPath, path, length);
+		memcpy(checksumPath + length, FAT32_CHECKSUM_FILE_SUFFIX, sizeof(FAT32_CHECKSUM_FILE_SUFFIX));
+
+		const uint64_t size = FAT32_CHECKSUM_HEADER_SIZE + sizeof(uint32_t) * (uint64_t)volume->num_entries;
+		if (FAT32_device_open(&volume->checksum_device, checksumPath) && volume->checksum_device.size == size)
+		{
+			loaded = clean && load_checksums(volume, generation);
+		}
+		else
+		{
+			FAT32_device_close(&volume->checksum_device);
+			FAT32_device_create(&volume->checksum_device, checksumPath, size);
+		}
+
+		free(checksumPath);
+	}
+
+	if (!loaded)
+	{
+		rebuild_checksums(volume);
+	}
+
+	// Until it's saved again, the file is out of date as soon as anything is written
+	if (volume->checksum_device.fd >= 0)
+	{
+		write_checksum_header(volume, FAT32_CHECKSUM_FILE_IN_USE);
+	}
+}
+
+void FAT32_checksums_save(struct FAT32_volume_t* volume)
+{
+	if (volume->checksum_device.fd < 0)
+	{
+		return;
+	}
+
+	// Write the checksums out before the header that vouches for them
+	FAT32_device_write(&volume->checksum_device, FAT32_CHECKSUM_HEADER_SIZE, volume->checksums, sizeof(uint32_t) * volume->num_entries);
+	FAT32_device_flush(&volume->checksum_device);
+	write_checksum_header(volume, FAT32_CHECKSUM_FILE_CLEAN);
+}
+
+void FAT32_checksums_release(struct FAT32_volume_t* volume)
+{
+	if (!volume->checksums)
+	{
+		return;
+	}
+
+	FAT32_device_close(&volume->checksum_device);
+	for (uint32_t i = 0; i < FAT32_CHECKSUM_LOCK_STRIPES; ++i)
+	{
+		FAT32_mutex_destroy(&volume->checksum_locks[i]);
+	}
+
+	free(volume->checksums);
+	free((void*)volume->verified_clusters);
+	volume->checksums = NULL;
+	volume->verified_clusters = NULL;
+}
+
+void FAT32_checksum_new_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	// New clusters read as zeroes until they're written
+	FAT32_mutex_lock(get_lock(volume, address));
+	volume->checksums[address.index] = volume->zero_cluster_checksum;
+	set_verified(volume, address.index);
+	FAT32_mutex_unlock(get_lock(volume, address));
+}
+
+void FAT32_checksum_lock(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	FAT32_mutex_lock(get_lock(volume, address));
+}
+
+void FAT32_checksum_unlock(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	FAT32_mutex_unlock(get_lock(volume, address));
+}
+
+void FAT32_checksum_write(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size)
+{
+	// A whole cluster is checksummed as it is
+	if (offset == 0 && size == volume->cluster_size)
+	{
+		volume->checksums[address.index] = FAT32_crc32c(buffer, size);
+		set_verified(volume, address.index);
+		return;
+	}
+
+	// Otherwise the CRC of the cluster changes by the CRC of the bits that change, followed by the rest of the cluster as zeroes.
+	// Only the bytes being replaced have to be read, and any corruption elsewhere in the cluster stays detectable.
+	HDByte_t delta[FAT32_CHECKSUM_DELTA_CHUNK];
+	uint32_t crc = 0;
+	for (uint32_t done = 0; done < size; done += FAT32_CHECKSUM_DELTA_CHUNK)
+	{
+		const uint32_t span = size - done < FAT32_CHECKSUM_DELTA_CHUNK ? size - done : FAT32_CHECKSUM_DELTA_CHUNK;
+		FAT32_read_cluster_unverified(volume, address, offset + done, delta, span);
+
+		for (uint32_t i = 0; i < span; ++i)
+		{
+			delta[i] ^= ((const HDByte_t*)buffer)[done + i];
+		}
+		crc = update_crc(crc, delta, span);
+	}
+
+	volume->checksums[address.index] ^= append_zeroes(crc, volume->cluster_size - offset - size);
+}
+
+void FAT32_checksum_copy(struct FAT32_volume_t* volume, FAT32_cluster_address_t source, FAT32_cluster_address_t target)
+{
+	FAT32_checksum_lock(volume, source);
+	const uint32_t checksum = volume->checksums[source.index];
+	FAT32_checksum_unlock(volume, source);
+
+	FAT32_checksum_lock(volume, target);
+	volume->checksums[target.index] = checksum;
+	FAT32_checksum_unlock(volume, target);
+}
+
+int FAT32_checksum_read(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size)
+{
+	// Whole clusters are read straight into the buffer, and checked there
+	const int whole = offset == 0 && size == volume->cluster_size;
+	HDByte_t* cluster = whole ? (HDByte_t*)buffer : (HDByte_t*)malloc(volume->cluster_size);
+
+	// Writers to the cluster are held off, so it's read as a whole
+	FAT32_checksum_lock(volume, address);
+	FAT32_read_cluster_unverified(volume, address, 0, cluster, volume->cluster_size);
+	const int valid = FAT32_crc32c(cluster, volume->cluster_size) == volume->checksums[address.index];
+	if (valid)
+	{
+		set_verified(volume, address.index);
+	}
+	FAT32_checksum_unlock(volume, address);
+
+	if (!whole)
+	{
+		memcpy(buffer, cluster + offset, size);
+		free(cluster);
+	}
+
+	return valid;
+}
+
+int FAT32_checksum_is_verified(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return is_verified(volume, address.index);
+}
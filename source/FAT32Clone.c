@@ -0,0 +1,329 @@
+// FAT32Clone.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+#include "../include/FAT32Directory.h"
+
+/* Identifies the reference count file kept alongside an image. */
+#define FAT32_SHARE_MAGIC 0x46455246 /* "FREF" */
+#define FAT32_SHARE_HEADER_SIZE 16
+
+/* Appended to the image path to name its reference count file. */
+#define FAT32_SHARE_FILE_SUFFIX ".ref"
+
+/* States of the reference count file, as recorded in its header. */
+enum
+{
+	/* The volume is mounted, so the counts in the file may be out of date. */
+	FAT32_SHARE_FILE_IN_USE = 0,
+
+	/* The counts in the file were saved when the volume was unmounted. */
+	FAT32_SHARE_FILE_CLEAN = 1,
+};
+
+/* A directory waiting to be walked while working out the reference counts. */
+struct pending_share_dir_t
+{
+	FAT32_cluster_address_t address;
+};
+
+static void write_share_header(struct FAT32_volume_t* volume, uint32_t state)
+{
+	uint32_t fields[4];
+	fields[0] = FAT32_SHARE_MAGIC;
+	fields[1] = volume->num_entries;
+	fields[2] = volume->summary_generation;
+	fields[3] = state;
+
+	FAT32_device_write(&volume->share_device, 0, fields, sizeof(fields));
+	FAT32_device_flush(&volume->share_device);
+}
+
+/* Loads the counts from the reference count file, if it was saved along with the volume as it is now. */
+static int load_shares(struct FAT32_volume_t* volume, uint32_t generation)
+{
+	HDByte_t header[FAT32_SHARE_HEADER_SIZE];
+	uint32_t fields[4];
+	if (!FAT32_device_read(&volume->share_device, 0, header, sizeof(header)))
+	{
+		return 0;
+	}
+
+	memcpy(fields, header, sizeof(fields));
+	if (fields[0] != FAT32_SHARE_MAGIC || fields[1] != volume->num_entries || fields[2] != generation || fields[3] != FAT32_SHARE_FILE_CLEAN)
+	{
+		return 0;
+	}
+
+	return FAT32_device_read(&volume->share_device, FAT32_SHARE_HEADER_SIZE, volume->cluster_shares, sizeof(uint32_t) * volume->num_entries);
+}
+
+/* Counts the references to every cluster by walking the chain of every entry in the tree. A chain is only followed until it
+ * runs into a cluster that was already reached, since everything after that has been counted once already. */
+static void rebuild_shares(struct FAT32_volume_t* volume)
+{
+	memset(volume->cluster_shares, 0, sizeof(uint32_t) * volume->num_entries);
+	uint64_t* reached = (uint64_t*)calloc((volume->num_entries + 63) / 64, sizeof(uint64_t));
+
+	struct pending_share_dir_t* stack = (struct pending_share_dir_t*)malloc(sizeof(struct pending_share_dir_t) * 16);
+	uint32_t stackLen = 0;
+	uint32_t stackCapacity = 16;
+	stack[stackLen++].address = FAT32_get_root(volume);
+
+	while (stackLen > 0)
+	{
+		struct FAT32_file_t* dir = FAT32_fopen(volume, stack[--stackLen].address, UINT32_MAX);
+
+		struct FAT32_directory_entry_t entry;
+		while (FAT32_dir_read_entry(dir, &entry, NULL))
+		{
+			// Skip the links to this directory and its parent
+			if (FAT32_dir_is_dot_entry(&entry))
+			{
+				continue;
+			}
+
+			// Guard against looping chains by never walking more clusters than there are
+			FAT32_cluster_address_t address = FAT32_dir_get_entry_address(&entry);
+			const FAT32_cluster_address_t start = address;
+			for (uint32_t length = 0; FAT32_is_valid_cluster(volume, address) && length < volume->num_entries; ++length)
+			{
+				const uint64_t bit = (uint64_t)1 << (address.index % 64);
+				if (reached[address.index / 64] & bit)
+				{
+					volume->cluster_shares[address.index] += 1;
+					break;
+				}
+
+				reached[address.index / 64] |= bit;
+				address = FAT32_get_table_entry(volume, address);
+			}
+
+			// Directories are never shared, so each is only walked once
+			if ((entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) && FAT32_is_valid_cluster(volume, start) && address.index != start.index)
+			{
+				if (stackLen == stackCapacity)
+				{
+					stackCapacity *= 2;
+					stack = (struct pending_share_dir_t*)realloc(stack, sizeof(struct pending_share_dir_t) * stackCapacity);
+				}
+				stack[stackLen++].address = start;
+			}
+		}
+
+		FAT32_fclose(dir);
+	}
+
+	free(stack);
+	free(reached);
+
+	uint64_t numShared = 0;
+	for (uint32_t index = 0; index < volume->num_entries; ++index)
+	{
+		numShared += volume->cluster_shares[index] != 0;
+	}
+	volume->num_shared_clusters = numShared;
+}
+
+/* Builds the path of the reference count file of an image. */
+static char* share_file_path(const char* path)
+{
+	const size_t length = strlen(path);
+	char* sharePath = (char*)malloc(length + sizeof(FAT32_SHARE_FILE_SUFFIX));
+	memcpy(sharePath, path, length);
+	memcpy(sharePath + length, FAT32_SHARE_FILE_SUFFIX, sizeof(FAT32_SHARE_FILE_SUFFIX));
+
+	return sharePath;
+}
+
+void FAT32_shares_open(struct FAT32_volume_t* volume, const char* path, int clean, uint32_t generation, int shared)
+{
+	if (!path)
+	{
+		return;
+	}
+
+	// Volumes without a reference count file have never had anything shared, so there's nothing to do until they do.
+	// Unless the volume says otherwise, in which case the file was lost, and the counts have to be worked out again.
+	volume->share_path = share_file_path(path);
+	const uint64_t size = FAT32_SHARE_HEADER_SIZE + sizeof(uint32_t) * (uint64_t)volume->num_entries;
+	if (!FAT32_device_open(&volume->share_device, volume->share_path))
+	{
+		if (!shared)
+		{
+			return;
+		}
+
+		FAT32_device_create(&volume->share_device, volume->share_path, size);
+	}
+	else if (volume->share_device.size != size)
+	{
+		// A file of the wrong size is no use, but it still means something may be shared
+		FAT32_device_close(&volume->share_device);
+		FAT32_device_create(&volume->share_device, volume->share_path, size);
+	}
+
+	// The counts can only be trusted if both were put away together
+	volume->cluster_shares = (uint32_t*)malloc(sizeof(uint32_t) * volume->num_entries);
+	if (clean && load_shares(volume, generation))
+	{
+		uint64_t numShared = 0;
+		for (uint32_t index = 0; index < volume->num_entries; ++index)
+		{
+			numShared += volume->cluster_shares[index] != 0;
+		}
+		volume->num_shared_clusters = numShared;
+	}
+	else
+	{
+		rebuild_shares(volume);
+	}
+
+	// Until it's saved again, the file is out of date as soon as anything is shared or copied
+	write_share_header(volume, FAT32_SHARE_FILE_IN_USE);
+}
+
+void FAT32_shares_save(struct FAT32_volume_t* volume)
+{
+	if (volume->share_device.fd < 0)
+	{
+		return;
+	}
+
+	// Write the counts out before the header that vouches for them
+	FAT32_device_write(&volume->share_device, FAT32_SHARE_HEADER_SIZE, volume->cluster_shares, sizeof(uint32_t) * volume->num_entries);
+	FAT32_device_flush(&volume->share_device);
+	write_share_header(volume, FAT32_SHARE_FILE_CLEAN);
+}
+
+void FAT32_shares_release(struct FAT32_volume_t* volume)
+{
+	FAT32_device_close(&volume->share_device);
+	free(volume->cluster_shares);
+	free(volume->share_path);
+	volume->cluster_shares = NULL;
+	volume->share_path = NULL;
+}
+
+uint32_t FAT32_get_cluster_shares(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return volume->cluster_shares ? volume->cluster_shares[address.index] : 0;
+}
+
+void FAT32_add_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	// The counts are created along with the file they're saved to, the first time anything is shared
+	if (!volume->cluster_shares)
+	{
+		volume->cluster_shares = (uint32_t*)calloc(volume->num_entries, sizeof(uint32_t));
+		if (volume->share_path && FAT32_device_create(&volume->share_device, volume->share_path, FAT32_SHARE_HEADER_SIZE + sizeof(uint32_t) * (uint64_t)volume->num_entries))
+		{
+			write_share_header(volume, FAT32_SHARE_FILE_IN_USE);
+		}
+	}
+
+	// Anything shared is recorded in the image too, in case the file goes missing
+	FAT32_mark_volume_shared(volume);
+
+	if (volume->cluster_shares[address.index]++ == 0)
+	{
+		FAT32_atomic_fetch_add64(&volume->num_shared_clusters, 1);
+	}
+}
+
+void FAT32_remove_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (--volume->cluster_shares[address.index] == 0)
+	{
+		FAT32_atomic_fetch_add64(&volume->num_shared_clusters, (uint64_t)-1);
+	}
+}
+
+int FAT32_release_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (FAT32_atomic_load64(&volume->num_shared_clusters) == 0)
+	{
+		return 0;
+	}
+
+	FAT32_mutex_lock(&volume->share_mutex);
+	const uint32_t shares = volume->cluster_shares[address.index];
+	if (shares > 0)
+	{
+		FAT32_remove_cluster_share(volume, address);
+	}
+	FAT32_mutex_unlock(&volume->share_mutex);
+
+	return shares > 0;
+}
+
+int FAT32_is_chain_shared(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (FAT32_atomic_load64(&volume->num_shared_clusters) == 0)
+	{
+		return 0;
+	}
+
+	int shared = 0;
+	FAT32_mutex_lock(&volume->share_mutex);
+	for (uint32_t length = 0; !shared && FAT32_is_valid_cluster(volume, address) && length < volume->num_entries; ++length)
+	{
+		shared = volume->cluster_shares[address.index] != 0;
+		address = FAT32_get_table_entry(volume, address);
+	}
+	FAT32_mutex_unlock(&volume->share_mutex);
+
+	return shared;
+}
+
+int FAT32_clone(struct FAT32_file_t* dir, const struct FAT32_directory_entry_t* source, const char* name, struct FAT32_directory_entry_t* outEntry)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+
+	// A directory's chain can't be shared, since its entries change in place
+	if (source->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		return 0;
+	}
+
+	struct FAT32_directory_entry_t existing;
+	if (FAT32_dir_get_entry(dir, name, &existing))
+	{
+		return 0;
+	}
+
+	// Creating the entry and sharing the chain with it are one operation
+	FAT32_journal_begin(volume);
+	if (!FAT32_dir_new_entry(dir, name, source->attribs, outEntry))
+	{
+		FAT32_journal_end(volume);
+		return 0;
+	}
+
+	// The new entry doesn't need the cluster it was created with
+	FAT32_free_cluster(volume, FAT32_dir_get_entry_address(outEntry));
+
+	// Sharing the whole chain only takes a reference to its first cluster; the rest are reached through it
+	const FAT32_cluster_address_t address = FAT32_dir_get_entry_address(source);
+	if (FAT32_is_valid_cluster(volume, address))
+	{
+		FAT32_mutex_lock(&volume->share_mutex);
+		FAT32_add_cluster_share(volume, address);
+		FAT32_atomic_fetch_add64(&volume->share_generation, 1);
+		FAT32_mutex_unlock(&volume->share_mutex);
+	}
+
+	FAT32_dir_set_entry_address(outEntry, address);
+	outEntry->size = source->size;
+
+	// The case of the short name belongs to the clone's own name
+	const uint8_t caseFlags = FAT32_DIR_ENTRY_FLAG_LOWER_BASE | FAT32_DIR_ENTRY_FLAG_LOWER_EXT;
+	outEntry->flags = (uint8_t)((source->flags & ~caseFlags) | (outEntry->flags & caseFlags));
+	outEntry->last_modified_date = source->last_modified_date;
+	outEntry->last_modified_time = source->last_modified_time;
+	FAT32_dir_update_entry(dir, outEntry);
+
+	FAT32_journal_end(volume);
+	return 1;
+}
@@ -0,0 +1,628 @@
+// FAT32Compress.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+
+/* Identifies the container a compressed file is stored in. */
+#define FAT32_COMPRESS_MAGIC 0x345A4C46 /* "FLZ4" */
+#define FAT32_COMPRESS_HEADER_SIZE 16
+
+/* The number of bytes of the file compressed together. Reading any byte of a frame decompresses all of it. */
+#define FAT32_COMPRESS_FRAME_SIZE 16384
+
+/* Each frame is stored after a word giving its stored length. If this bit is set, the frame is stored as it is. */
+#define FAT32_COMPRESS_FRAME_RAW 0x80000000
+#define FAT32_COMPRESS_FRAME_HEADER_SIZE 4
+
+/* Room for a frame that doesn't compress, with the worst case of the block format's overhead. */
+#define FAT32_COMPRESS_PACKED_SIZE (FAT32_COMPRESS_FRAME_HEADER_SIZE + FAT32_COMPRESS_FRAME_SIZE + FAT32_COMPRESS_FRAME_SIZE / 255 + 16)
+
+/* Parameters of the LZ4 block format. Matches are at least 4 bytes, the last 5 bytes are always literals,
+ * and the last match starts at least 12 bytes before the end. */
+#define FAT32_LZ4_MIN_MATCH 4
+#define FAT32_LZ4_LAST_LITERALS 5
+#define FAT32_LZ4_MATCH_LIMIT 12
+#define FAT32_LZ4_MAX_OFFSET 65535
+#define FAT32_LZ4_HASH_BITS 12
+
+/* A compressed file, as it's seen through the file handle it's opened with.
+ * The file is stored as a header, the frames it's split into, and an index of where each frame starts. */
+struct FAT32_compressed_t
+{
+	/* The container the file is stored in, read and written as a plain file. */
+	struct FAT32_file_t* inner;
+
+	/* The size of the file and the position within it, in uncompressed bytes. */
+	uint32_t size;
+	uint32_t pos;
+
+	/* The stored offsets of the complete frames. */
+	uint32_t* index;
+	uint32_t num_frames;
+	uint32_t index_capacity;
+
+	/* Where the next frame is to be stored. */
+	uint32_t write_offset;
+
+	/* The bytes of the frame after the complete ones, not yet stored for good. */
+	HDByte_t* tail;
+
+	/* A complete frame, decompressed for reading, and which one it is. */
+	HDByte_t* cache;
+	uint32_t cached_frame;
+
+	/* Space to compress a frame into. */
+	HDByte_t* packed;
+
+	/* Whether the file has changed since its header and index were last stored. */
+	int dirty;
+
+	/* Whether the container turned out to be damaged. */
+	int failed;
+
+	/* Held by positional reads, which share the cached frame. */
+	FAT32_mutex_t mutex;
+};
+
+static uint32_t get_u32(const HDByte_t* bytes)
+{
+	return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void put_u32(HDByte_t* bytes, uint32_t value)
+{
+	bytes[0] = (HDByte_t)value;
+	bytes[1] = (HDByte_t)(value >> 8);
+	bytes[2] = (HDByte_t)(value >> 16);
+	bytes[3] = (HDByte_t)(value >> 24);
+}
+
+static uint32_t hash_sequence(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - FAT32_LZ4_HASH_BITS);
+}
+
+/* Writes a length that didn't fit in its 4 bits of the token, as a run of 255s and the remainder. */
+static uint32_t put_length(HDByte_t* out, uint32_t length)
+{
+	uint32_t written = 0;
+	for (; length >= 255; length -= 255)
+	{
+		out[written++] = 255;
+	}
+	out[written++] = (HDByte_t)length;
+
+	return written;
+}
+
+/* Compresses bytes in the LZ4 block format. Returns the compressed size, or 0 if it wouldn't fit in 'capacity'. */
+static uint32_t lz4_compress(const HDByte_t* src, uint32_t size, HDByte_t* dst, uint32_t capacity)
+{
+	// Positions (plus one) of the last sequence seen with each hash
+	uint32_t table[1 << FAT32_LZ4_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	uint32_t in = 0;
+	uint32_t anchor = 0;
+	uint32_t out = 0;
+
+	while (size > FAT32_LZ4_MATCH_LIMIT && in < size - FAT32_LZ4_MATCH_LIMIT)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, src + in, sizeof(sequence));
+		const uint32_t hash = hash_sequence(sequence);
+		const uint32_t candidate = table[hash];
+		table[hash] = in + 1;
+
+		uint32_t previous = ~sequence;
+		if (candidate != 0)
+		{
+			memcpy(&previous, src + candidate - 1, sizeof(previous));
+		}
+
+		if (previous != sequence || in - (candidate - 1) > FAT32_LZ4_MAX_OFFSET)
+		{
+			++in;
+			continue;
+		}
+
+		// Extend the match as far as it goes, short of the literals at the end
+		const uint32_t match = candidate - 1;
+		uint32_t matchLength = FAT32_LZ4_MIN_MATCH;
+		while (in + matchLength < size - FAT32_LZ4_LAST_LITERALS && src[match + matchLength] == src[in + matchLength])
+		{
+			++matchLength;
+		}
+
+		// Make sure the sequence fits, with room to spare for the lengths
+		const uint32_t literals = in - anchor;
+		if (out + 1 + literals + literals / 255 + 1 + 2 + (matchLength - FAT32_LZ4_MIN_MATCH) / 255 + 1 > capacity)
+		{
+			return 0;
+		}
+
+		HDByte_t* token = &dst[out++];
+		*token = (HDByte_t)((literals < 15 ? literals : 15) << 4);
+		if (literals >= 15)
+		{
+			out += put_length(&dst[out], literals - 15);
+		}
+		memcpy(&dst[out], &src[anchor], literals);
+		out += literals;
+
+		const uint32_t offset = in - match;
+		dst[out++] = (HDByte_t)offset;
+		dst[out++] = (HDByte_t)(offset >> 8);
+
+		const uint32_t extra = matchLength - FAT32_LZ4_MIN_MATCH;
+		*token |= (HDByte_t)(extra < 15 ? extra : 15);
+		if (extra >= 15)
+		{
+			out += put_length(&dst[out], extra - 15);
+		}
+
+		in += matchLength;
+		anchor = in;
+	}
+
+	// The rest goes out as literals
+	const uint32_t literals = size - anchor;
+	if (out + 1 + literals + literals / 255 + 1 > capacity)
+	{
+		return 0;
+	}
+
+	dst[out++] = (HDByte_t)((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15)
+	{
+		out += put_length(&dst[out], literals - 15);
+	}
+	memcpy(&dst[out], &src[anchor], literals);
+	out += literals;
+
+	return out;
+}
+
+/* Reads a length continued past its 4 bits of the token. Returns 0 if it runs off the end. */
+static int get_length(const HDByte_t* src, uint32_t size, uint32_t* in, uint32_t* length)
+{
+	HDByte_t byte;
+	do
+	{
+		if (*in >= size)
+		{
+			return 0;
+		}
+
+		byte = src[(*in)++];
+		*length += byte;
+	} while (byte == 255);
+
+	return 1;
+}
+
+/* Decompresses a block in the LZ4 block format. Returns the decompressed size, or UINT32_MAX if the block is damaged. */
+static uint32_t lz4_decompress(const HDByte_t* src, uint32_t size, HDByte_t* dst, uint32_t capacity)
+{
+	uint32_t in = 0;
+	uint32_t out = 0;
+
+	while (in < size)
+	{
+		const HDByte_t token = src[in++];
+
+		// Copy the literals
+		uint32_t literals = token >> 4;
+		if (literals == 15 && !get_length(src, size, &in, &literals))
+		{
+			return UINT32_MAX;
+		}
+		if (literals > size - in || literals > capacity - out)
+		{
+			return UINT32_MAX;
+		}
+
+		memcpy(&dst[out], &src[in], literals);
+		in += literals;
+		out += literals;
+
+		// The last sequence has no match
+		if (in == size)
+		{
+			break;
+		}
+
+		if (size - in < 2)
+		{
+			return UINT32_MAX;
+		}
+		const uint32_t offset = (uint32_t)src[in] | (uint32_t)src[in + 1] << 8;
+		in += 2;
+
+		uint32_t matchLength = token & 0x0F;
+		if (matchLength == 15 && !get_length(src, size, &in, &matchLength))
+		{
+			return UINT32_MAX;
+		}
+		matchLength += FAT32_LZ4_MIN_MATCH;
+
+		if (offset == 0 || offset > out || matchLength > capacity - out)
+		{
+			return UINT32_MAX;
+		}
+
+		// Matches may overlap what they produce, repeating it
+		if (offset >= matchLength)
+		{
+			memcpy(&dst[out], &dst[out - offset], matchLength);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < matchLength; ++i)
+			{
+				dst[out + i] = dst[out - offset + i];
+			}
+		}
+		out += matchLength;
+	}
+
+	return out;
+}
+
+/* Compresses a frame and stores it at 'offset'. Returns the stored length, including its header. */
+static uint32_t store_frame(struct FAT32_compressed_t* file, const HDByte_t* frame, uint32_t size, uint32_t offset)
+{
+	HDByte_t* payload = file->packed + FAT32_COMPRESS_FRAME_HEADER_SIZE;
+	uint32_t length = lz4_compress(frame, size, payload, size);
+
+	// Frames that don't shrink are stored as they are
+	if (length == 0)
+	{
+		memcpy(payload, frame, size);
+		length = size;
+		put_u32(file->packed, length | FAT32_COMPRESS_FRAME_RAW);
+	}
+	else
+	{
+		put_u32(file->packed, length);
+	}
+
+	length += FAT32_COMPRESS_FRAME_HEADER_SIZE;
+	FAT32_pwrite(file->inner, file->packed, length, offset);
+	return length;
+}
+
+/* Reads the frame stored at 'offset' and decompresses it, expecting 'size' bytes. Returns 0 if it's damaged. */
+static int load_frame(struct FAT32_compressed_t* file, uint32_t offset, HDByte_t* frame, uint32_t size)
+{
+	HDByte_t header[FAT32_COMPRESS_FRAME_HEADER_SIZE];
+	if (FAT32_pread(file->inner, header, sizeof(header), offset) != sizeof(header))
+	{
+		return 0;
+	}
+
+	const uint32_t length = get_u32(header) & ~FAT32_COMPRESS_FRAME_RAW;
+	if (length > FAT32_COMPRESS_PACKED_SIZE - FAT32_COMPRESS_FRAME_HEADER_SIZE ||
+		FAT32_pread(file->inner, file->packed, length, offset + FAT32_COMPRESS_FRAME_HEADER_SIZE) != length)
+	{
+		return 0;
+	}
+
+	if (get_u32(header) & FAT32_COMPRESS_FRAME_RAW)
+	{
+		if (length != size)
+		{
+			return 0;
+		}
+
+		memcpy(frame, file->packed, size);
+		return 1;
+	}
+
+	return lz4_decompress(file->packed, length, frame, size) == size;
+}
+
+static void append_index(struct FAT32_compressed_t* file, uint32_t offset)
+{
+	if (file->num_frames == file->index_capacity)
+	{
+		file->index_capacity = file->index_capacity ? file->index_capacity * 2 : 16;
+		file->index = (uint32_t*)realloc(file->index, sizeof(uint32_t) * file->index_capacity);
+	}
+
+	file->index[file->num_frames++] = offset;
+}
+
+/* Reads the header and index of a stored container. Returns 0 if they're damaged. */
+static int load_container(struct FAT32_compressed_t* file, uint32_t storedSize)
+{
+	HDByte_t header[FAT32_COMPRESS_HEADER_SIZE];
+	if (FAT32_pread(file->inner, header, sizeof(header), 0) != sizeof(header) ||
+		get_u32(&header[0]) != FAT32_COMPRESS_MAGIC || get_u32(&header[4]) != FAT32_COMPRESS_FRAME_SIZE)
+	{
+		return 0;
+	}
+
+	file->size = get_u32(&header[8]);
+	const uint32_t indexOffset = get_u32(&header[12]);
+	const uint32_t numFrames = (uint32_t)(((uint64_t)file->size + FAT32_COMPRESS_FRAME_SIZE - 1) / FAT32_COMPRESS_FRAME_SIZE);
+	if (indexOffset < FAT32_COMPRESS_HEADER_SIZE || indexOffset > storedSize || storedSize - indexOffset != numFrames * sizeof(uint32_t))
+	{
+		return 0;
+	}
+
+	HDByte_t* stored = (HDByte_t*)malloc((size_t)numFrames * sizeof(uint32_t) + 1);
+	const int valid = FAT32_pread(file->inner, stored, numFrames * sizeof(uint32_t), indexOffset) == numFrames * sizeof(uint32_t);
+	for (uint32_t i = 0; valid && i < numFrames; ++i)
+	{
+		append_index(file, get_u32(&stored[i * sizeof(uint32_t)]));
+	}
+	free(stored);
+
+	if (!valid)
+	{
+		return 0;
+	}
+
+	// A partly filled last frame is taken back into the tail, to be added to and stored again
+	file->write_offset = indexOffset;
+	const uint32_t tailSize = file->size % FAT32_COMPRESS_FRAME_SIZE;
+	if (tailSize > 0)
+	{
+		file->num_frames -= 1;
+		file->write_offset = file->index[file->num_frames];
+		return load_frame(file, file->write_offset, file->tail, tailSize);
+	}
+
+	return 1;
+}
+
+struct FAT32_compressed_t* FAT32_compressed_open(struct FAT32_file_t* inner, uint32_t storedSize)
+{
+	struct FAT32_compressed_t* file = (struct FAT32_compressed_t*)calloc(1, sizeof(struct FAT32_compressed_t));
+	file->inner = inner;
+	file->write_offset = FAT32_COMPRESS_HEADER_SIZE;
+	file->tail = (HDByte_t*)malloc(FAT32_COMPRESS_FRAME_SIZE);
+	file->cache = (HDByte_t*)malloc(FAT32_COMPRESS_FRAME_SIZE);
+	file->cached_frame = UINT32_MAX;
+	file->packed = (HDByte_t*)malloc(FAT32_COMPRESS_PACKED_SIZE);
+	file->dirty = storedSize == 0;
+	FAT32_mutex_init(&file->mutex);
+
+	// Files with nothing stored yet start out empty, ready to be written
+	if (storedSize > 0 && !load_container(file, storedSize))
+	{
+		file->failed = 1;
+		file->size = 0;
+		file->num_frames = 0;
+	}
+
+	return file;
+}
+
+uint32_t FAT32_compressed_finish(struct FAT32_compressed_t* file)
+{
+	if (!file->dirty)
+	{
+		FAT32_fseek(file->inner, 0, FAT32_SEEK_END);
+		return (uint32_t)FAT32_ftell(file->inner);
+	}
+
+	// Empty files store nothing at all
+	file->dirty = 0;
+	if (file->size == 0)
+	{
+		FAT32_ftruncate(file->inner, 0);
+		return 0;
+	}
+
+	// Store the tail as a short last frame. It stays in the tail, to be stored again if the file grows.
+	uint32_t offset = file->write_offset;
+	const uint32_t tailSize = file->size - file->num_frames * FAT32_COMPRESS_FRAME_SIZE;
+	const uint32_t numFrames = file->num_frames + (tailSize > 0);
+	if (tailSize > 0)
+	{
+		offset += store_frame(file, file->tail, tailSize, offset);
+	}
+
+	// Then the index, and the header pointing at it
+	HDByte_t* stored = (HDByte_t*)malloc((size_t)numFrames * sizeof(uint32_t) + 1);
+	for (uint32_t i = 0; i < file->num_frames; ++i)
+	{
+		put_u32(&stored[i * sizeof(uint32_t)], file->index[i]);
+	}
+	if (tailSize > 0)
+	{
+		put_u32(&stored[file->num_frames * sizeof(uint32_t)], file->write_offset);
+	}
+	FAT32_pwrite(file->inner, stored, numFrames * sizeof(uint32_t), offset);
+	free(stored);
+
+	HDByte_t header[FAT32_COMPRESS_HEADER_SIZE];
+	put_u32(&header[0], FAT32_COMPRESS_MAGIC);
+	put_u32(&header[4], FAT32_COMPRESS_FRAME_SIZE);
+	put_u32(&header[8], file->size);
+	put_u32(&header[12], offset);
+	FAT32_pwrite(file->inner, header, sizeof(header), 0);
+
+	// Let go of anything stored past the end
+	const uint32_t storedSize = offset + numFrames * sizeof(uint32_t);
+	FAT32_ftruncate(file->inner, storedSize);
+
+	return storedSize;
+}
+
+void FAT32_compressed_close(struct FAT32_compressed_t* file)
+{
+	FAT32_compressed_finish(file);
+	FAT32_fclose(file->inner);
+
+	FAT32_mutex_destroy(&file->mutex);
+	free(file->index);
+	free(file->tail);
+	free(file->cache);
+	free(file->packed);
+	free(file);
+}
+
+/* Copies bytes out of the file at the given position. The mutex must be held. */
+static size_t read_at(struct FAT32_compressed_t* file, HDByte_t* buffer, size_t size, uint32_t pos)
+{
+	size_t done = 0;
+	while (done < size && pos < file->size && !file->failed)
+	{
+		const uint32_t frame = pos / FAT32_COMPRESS_FRAME_SIZE;
+		const uint32_t frameOffset = pos % FAT32_COMPRESS_FRAME_SIZE;
+
+		// The frame being filled is read from the tail, and the others are decompressed when they're first needed
+		const HDByte_t* source = file->tail;
+		if (frame < file->num_frames)
+		{
+			if (file->cached_frame != frame)
+			{
+				if (!load_frame(file, file->index[frame], file->cache, FAT32_COMPRESS_FRAME_SIZE))
+				{
+					file->failed = 1;
+					file->cached_frame = UINT32_MAX;
+					break;
+				}
+				file->cached_frame = frame;
+			}
+			source = file->cache;
+		}
+
+		uint32_t span = FAT32_COMPRESS_FRAME_SIZE - frameOffset;
+		span = span < file->size - pos ? span : file->size - pos;
+		span = span < size - done ? span : (uint32_t)(size - done);
+
+		memcpy(buffer + done, source + frameOffset, span);
+		done += span;
+		pos += span;
+	}
+
+	return done;
+}
+
+size_t FAT32_compressed_read(struct FAT32_compressed_t* file, void* buffer, size_t size)
+{
+	FAT32_mutex_lock(&file->mutex);
+	const size_t done = read_at(file, (HDByte_t*)buffer, size, file->pos);
+	file->pos += (uint32_t)done;
+	FAT32_mutex_unlock(&file->mutex);
+
+	return done;
+}
+
+size_t FAT32_compressed_pread(struct FAT32_compressed_t* file, void* buffer, size_t size, uint32_t offset)
+{
+	FAT32_mutex_lock(&file->mutex);
+	const size_t done = read_at(file, (HDByte_t*)buffer, size, offset);
+	FAT32_mutex_unlock(&file->mutex);
+
+	return done;
+}
+
+size_t FAT32_compressed_write(struct FAT32_compressed_t* file, const void* buffer, size_t size)
+{
+	// Only appending is supported: frames aren't rewritten once they're stored
+	if (file->pos != file->size || file->failed)
+	{
+		return 0;
+	}
+
+	const size_t total = size < UINT32_MAX - file->size ? size : UINT32_MAX - file->size;
+	size_t done = 0;
+	while (done < total)
+	{
+		const uint32_t tailSize = file->size - file->num_frames * FAT32_COMPRESS_FRAME_SIZE;
+		uint32_t span = FAT32_COMPRESS_FRAME_SIZE - tailSize;
+		span = span < total - done ? span : (uint32_t)(total - done);
+
+		memcpy(file->tail + tailSize, (const HDByte_t*)buffer + done, span);
+		file->size += span;
+		done += span;
+
+		// Store the frame as soon as it's full
+		if (tailSize + span == FAT32_COMPRESS_FRAME_SIZE)
+		{
+			const uint32_t offset = file->write_offset;
+			file->write_offset += store_frame(file, file->tail, FAT32_COMPRESS_FRAME_SIZE, offset);
+			append_index(file, offset);
+		}
+	}
+
+	file->pos = file->size;
+	file->dirty |= done > 0;
+	return done;
+}
+
+int FAT32_compressed_truncate(struct FAT32_compressed_t* file, uint32_t size)
+{
+	if (size == file->size)
+	{
+		return 0;
+	}
+
+	// Only emptying the file is supported
+	if (size != 0)
+	{
+		return 1;
+	}
+
+	file->size = 0;
+	file->pos = 0;
+	file->num_frames = 0;
+	file->write_offset = FAT32_COMPRESS_HEADER_SIZE;
+	file->cached_frame = UINT32_MAX;
+	file->failed = 0;
+	file->dirty = 1;
+	return 0;
+}
+
+int FAT32_compressed_seek(struct FAT32_compressed_t* file, long offset, int origin)
+{
+	// Like plain files, seeks are clamped to the file
+	long target;
+	switch (origin)
+	{
+	case FAT32_SEEK_SET:
+		target = offset;
+		break;
+
+	case FAT32_SEEK_CUR:
+		target = (long)file->pos + offset;
+		break;
+
+	case FAT32_SEEK_END:
+		target = (long)file->size + (offset < 0 ? offset : 0);
+		break;
+
+	default:
+		return 1;
+	}
+
+	target = target > 0 ? target : 0;
+	file->pos = (uint64_t)target < file->size ? (uint32_t)target : file->size;
+	return 0;
+}
+
+long FAT32_compressed_tell(const struct FAT32_compressed_t* file)
+{
+	return (long)file->pos;
+}
+
+uint32_t FAT32_compressed_size(const struct FAT32_compressed_t* file)
+{
+	return file->size;
+}
+
+struct FAT32_file_t* FAT32_compressed_inner(const struct FAT32_compressed_t* file)
+{
+	return file->inner;
+}
+
+int FAT32_compressed_failed(const struct FAT32_compressed_t* file)
+{
+	return file->failed || FAT32_ferror(file->inner);
+}
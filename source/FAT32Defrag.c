@@ -0,0 +1,420 @@
+// FAT32Defrag.c
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "FAT32Internal.h"
+#include "../include/FAT32Defrag.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FAT32_DEFRAG_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* The maximum length of a path reported by the analysis pass. */
+#define FAT32_DEFRAG_PATH_LEN 256
+
+/* The number of 64-bit words required for a bitmap with one bit per table entry. */
+#define FAT32_DEFRAG_BITMAP_WORDS(volume) (((volume)->num_entries + 63) / 64)
+
+/* Returns the bits of a table entry that hold the cluster index. */
+static uint32_t get_index_mask(void)
+{
+	FAT32_cluster_address_t address;
+	memset(&address, 0, sizeof(address));
+	address.index = 0x0FFFFFFF;
+
+	uint32_t mask;
+	memcpy(&mask, &address, sizeof(mask));
+	return mask;
+}
+
+static uint32_t count_trailing_zeros(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)value))
+	{
+		return index;
+	}
+
+	_BitScanForward(&index, (unsigned long)(value >> 32));
+	return index + 32;
+#else
+	return (uint32_t)__builtin_ctzll(value);
+#endif
+}
+
+/* Sets a bit in 'bitmap' for every unused cluster. */
+static void build_free_bitmap(struct FAT32_volume_t* volume, uint64_t* bitmap)
+{
+	const FAT32_cluster_address_t* table = FAT32_get_table(volume);
+	uint32_t index = 0;
+
+	memset(bitmap, 0, sizeof(uint64_t) * FAT32_DEFRAG_BITMAP_WORDS(volume));
+
+#ifdef FAT32_DEFRAG_SSE2
+	// Compare four table entries against NULL at a time
+	const __m128i mask = _mm_set1_epi32((int)get_index_mask());
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; index + 4 <= volume->num_entries; index += 4)
+	{
+		const __m128i entries = _mm_loadu_si128((const __m128i*)&table[index]);
+		const __m128i unused = _mm_cmpeq_epi32(_mm_and_si128(entries, mask), zero);
+		const uint64_t bits = (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(unused));
+
+		bitmap[index / 64] |= bits << (index % 64);
+	}
+#endif
+
+	// Handle whatever is left over
+	for (; index < volume->num_entries; ++index)
+	{
+		if (table[index].index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+		}
+	}
+
+	// Reserved clusters are never free
+	for (index = 0; index < FAT32_FIRST_CLUSTER; ++index)
+	{
+		bitmap[index / 64] &= ~((uint64_t)1 << (index % 64));
+	}
+}
+
+/* Returns the index of the first bit at or after 'from' that equals 'value', or 'volume->num_entries' if there is none. */
+static uint32_t find_next_bit(const struct FAT32_volume_t* volume, const uint64_t* bitmap, uint32_t from, int value)
+{
+	while (from < volume->num_entries)
+	{
+		uint64_t word = value ? bitmap[from / 64] : ~bitmap[from / 64];
+		word &= ~(uint64_t)0 << (from % 64);
+
+		if (word != 0)
+		{
+			const uint32_t result = (from & ~63u) + count_trailing_zeros(word);
+			return result < volume->num_entries ? result : volume->num_entries;
+		}
+
+		from = (from & ~63u) + 64;
+	}
+
+	return volume->num_entries;
+}
+
+/* Finds the first run of at least 'length' unused clusters. Returns 0 if there is none. */
+static int find_free_extent(const struct FAT32_volume_t* volume, const uint64_t* bitmap, uint32_t length, FAT32_cluster_address_t* outStart)
+{
+	uint32_t start = find_next_bit(volume, bitmap, 0, 1);
+	while (start < volume->num_entries)
+	{
+		const uint32_t end = find_next_bit(volume, bitmap, start, 0);
+		if (end - start >= length)
+		{
+			outStart->index = start;
+			return 1;
+		}
+
+		start = find_next_bit(volume, bitmap, end, 1);
+	}
+
+	return 0;
+}
+
+/* Counts the number of clusters in a chain, and the number of contiguous runs it is split into. */
+static void measure_chain(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t* outLength, uint32_t* outFragments)
+{
+	uint32_t length = 0;
+	uint32_t fragments = 0;
+
+	// Guard against looping chains by never walking more clusters than there are
+	while (FAT32_is_valid_cluster(volume, address) && length < volume->num_entries)
+	{
+		const FAT32_cluster_address_t next = FAT32_get_table_entry(volume, address);
+		if (next.index != address.index + 1)
+		{
+			++fragments;
+		}
+
+		++length;
+		address = next;
+	}
+
+	*outLength = length;
+	*outFragments = fragments;
+}
+
+static void analyze_directory(struct FAT32_file_t* dir, char* path, size_t pathLen, struct FAT32_defrag_report_t* report,
+	FAT32_defrag_file_callback_t callback, void* userData)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+	struct FAT32_directory_entry_t entry;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	while (FAT32_dir_read_entry(dir, &entry, name))
+	{
+		// Skip the links to this directory and its parent
+		if (FAT32_dir_is_dot_entry(&entry))
+		{
+			continue;
+		}
+
+		// Append the name of the entry to the path
+		snprintf(path + pathLen, FAT32_DEFRAG_PATH_LEN - pathLen, "%s", name);
+
+		uint32_t length, fragments;
+		measure_chain(volume, FAT32_dir_get_entry_address(&entry), &length, &fragments);
+
+		report->num_files += 1;
+		report->num_fragments += fragments;
+		if (fragments > 1)
+		{
+			report->num_fragmented_files += 1;
+		}
+
+		if (callback)
+		{
+			callback(path, &entry, fragments, userData);
+		}
+
+		// Recurse into subdirectories
+		if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+		{
+			const size_t subPathLen = strlen(path);
+			if (subPathLen + 1 < FAT32_DEFRAG_PATH_LEN)
+			{
+				path[subPathLen] = '/';
+				path[subPathLen + 1] = 0;
+			}
+
+			struct FAT32_file_t* subdir = FAT32_dir_open_entry(volume, &entry);
+			analyze_directory(subdir, path, strlen(path), report, callback, userData);
+			FAT32_fclose(subdir);
+		}
+
+		path[pathLen] = 0;
+	}
+}
+
+void FAT32_defrag_analyze(struct FAT32_volume_t* volume, struct FAT32_defrag_report_t* outReport, FAT32_defrag_file_callback_t callback, void* userData)
+{
+	memset(outReport, 0, sizeof(struct FAT32_defrag_report_t));
+
+	// Gather free space statistics
+	uint64_t* bitmap = (uint64_t*)malloc(sizeof(uint64_t) * FAT32_DEFRAG_BITMAP_WORDS(volume));
+	build_free_bitmap(volume, bitmap);
+
+	uint32_t start = find_next_bit(volume, bitmap, 0, 1);
+	while (start < volume->num_entries)
+	{
+		const uint32_t end = find_next_bit(volume, bitmap, start, 0);
+		const uint32_t length = end - start;
+
+		outReport->num_free_clusters += length;
+		outReport->num_free_extents += 1;
+		if (length > outReport->largest_free_extent)
+		{
+			outReport->largest_free_extent = length;
+		}
+
+		// Find the histogram bucket (floor of log2)
+		uint32_t bucket = 0;
+		while ((length >> (bucket + 1)) != 0 && bucket + 1 < FAT32_DEFRAG_HISTOGRAM_BUCKETS)
+		{
+			++bucket;
+		}
+		outReport->free_extent_histogram[bucket] += 1;
+
+		start = find_next_bit(volume, bitmap, end, 1);
+	}
+
+	free(bitmap);
+
+	// Gather per-file statistics
+	char path[FAT32_DEFRAG_PATH_LEN] = "/";
+	struct FAT32_file_t* root = FAT32_fopen(volume, FAT32_get_root(volume), UINT32_MAX);
+	analyze_directory(root, path, 1, outReport, callback, userData);
+	FAT32_fclose(root);
+}
+
+static void print_fragmented_file(const char* path, const struct FAT32_directory_entry_t* entry, uint32_t fragments, void* userData)
+{
+	(void)entry;
+	(void)userData;
+
+	if (fragments > 1)
+	{
+		printf("%s: %u fragments\n", path, fragments);
+	}
+}
+
+void FAT32_defrag_print_report(struct FAT32_volume_t* volume)
+{
+	struct FAT32_defrag_report_t report;
+	FAT32_defrag_analyze(volume, &report, &print_fragmented_file, NULL);
+
+	printf("Files: %u (%u fragmented, %u fragments)\n", report.num_files, report.num_fragmented_files, report.num_fragments);
+	printf("Free clusters: %u in %u extents, largest extent: %u\n", report.num_free_clusters, report.num_free_extents, report.largest_free_extent);
+
+	for (uint32_t bucket = 0; bucket < FAT32_DEFRAG_HISTOGRAM_BUCKETS; ++bucket)
+	{
+		if (report.free_extent_histogram[bucket] != 0)
+		{
+			printf("  [%u, %u): %u\n", 1u << bucket, bucket < 31 ? 1u << (bucket + 1) : UINT32_MAX, report.free_extent_histogram[bucket]);
+		}
+	}
+}
+
+/* Copies the chain for the given entry into a contiguous extent, if one is available. Returns whether the chain was moved. */
+static int move_chain(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	FAT32_cluster_address_t source = FAT32_dir_get_entry_address(entry);
+
+	uint32_t length, fragments;
+	measure_chain(volume, source, &length, &fragments);
+	if (fragments <= 1)
+	{
+		return 0;
+	}
+
+	// Moving a chain shared with clones would copy it for this entry alone
+	if (FAT32_is_chain_shared(volume, source))
+	{
+		return 0;
+	}
+
+	// Find somewhere to put it
+	uint64_t* bitmap = (uint64_t*)malloc(sizeof(uint64_t) * FAT32_DEFRAG_BITMAP_WORDS(volume));
+	build_free_bitmap(volume, bitmap);
+
+	FAT32_cluster_address_t start;
+	const int found = find_free_extent(volume, bitmap, length, &start);
+	free(bitmap);
+
+	if (!found)
+	{
+		return 0;
+	}
+
+	// Copy each cluster, linking the new chain as we go
+	HDByte_t* cluster = (HDByte_t*)malloc(volume->cluster_size);
+	FAT32_cluster_address_t target = start;
+	for (uint32_t i = 0; i < length; ++i)
+	{
+		FAT32_journal_reuse_cluster(volume, target);
+		const int valid = FAT32_read_cluster(volume, source, 0, cluster, volume->cluster_size);
+		FAT32_write_cluster(volume, target, 0, cluster, volume->cluster_size);
+
+		// Keep a bad cluster looking bad in its new home
+		if (!valid)
+		{
+			FAT32_checksum_copy(volume, source, target);
+		}
+
+		FAT32_cluster_address_t next;
+		next.index = i + 1 < length ? target.index + 1 : FAT32_CLUSTER_ADDRESS_EOC;
+		FAT32_set_table_entry(volume, target, next);
+
+		source = FAT32_get_table_entry(volume, source);
+		target.index += 1;
+	}
+	free(cluster);
+
+	// Release the old chain
+	FAT32_free_cluster(volume, FAT32_dir_get_entry_address(entry));
+	FAT32_dir_set_entry_address(entry, start);
+
+	return 1;
+}
+
+/* Points the given directory's link to itself, and the parent links of all its subdirectories, at its current address. */
+static void update_links(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	struct FAT32_file_t* dir = FAT32_dir_open_entry(volume, entry);
+
+	struct FAT32_directory_entry_t selfEntry;
+	if (FAT32_dir_get_entry(dir, ".", &selfEntry))
+	{
+		FAT32_dir_set_entry_address(&selfEntry, FAT32_dir_get_entry_address(entry));
+		FAT32_fwrite(&selfEntry, sizeof(selfEntry), 1, dir);
+	}
+	FAT32_fseek(dir, 0, FAT32_SEEK_SET);
+
+	struct FAT32_directory_entry_t subEntry;
+	while (FAT32_dir_read_entry(dir, &subEntry, NULL))
+	{
+		if ((subEntry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0 || FAT32_dir_is_dot_entry(&subEntry))
+		{
+			continue;
+		}
+
+		struct FAT32_file_t* subdir = FAT32_dir_open_entry(volume, &subEntry);
+
+		struct FAT32_directory_entry_t parentEntry;
+		if (FAT32_dir_get_entry(subdir, "..", &parentEntry))
+		{
+			FAT32_dir_set_entry_address(&parentEntry, FAT32_dir_get_entry_address(entry));
+			FAT32_fwrite(&parentEntry, sizeof(parentEntry), 1, subdir);
+		}
+
+		FAT32_fclose(subdir);
+	}
+
+	FAT32_fclose(dir);
+}
+
+static uint32_t compact_directory(struct FAT32_file_t* dir)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+	uint32_t moved = 0;
+
+	struct FAT32_directory_entry_t entry;
+	while (FAT32_dir_read_entry(dir, &entry, NULL))
+	{
+		// Skip the links to this directory and its parent
+		if (FAT32_dir_is_dot_entry(&entry))
+		{
+			continue;
+		}
+
+		// System entries must not be physically moved. Moving a chain and updating everything that refers to it is one operation.
+		FAT32_journal_begin(volume);
+		if ((entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM) == 0 && move_chain(volume, &entry))
+		{
+			// Save the entry
+			FAT32_fseek(dir, -(long)sizeof(entry), FAT32_SEEK_CUR);
+			FAT32_fwrite(&entry, sizeof(entry), 1, dir);
+			++moved;
+
+			if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+			{
+				update_links(volume, &entry);
+			}
+		}
+		FAT32_journal_end(volume);
+
+		// Recurse into subdirectories
+		if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+		{
+			struct FAT32_file_t* subdir = FAT32_dir_open_entry(volume, &entry);
+			moved += compact_directory(subdir);
+			FAT32_fclose(subdir);
+		}
+	}
+
+	return moved;
+}
+
+uint32_t FAT32_defrag_compact(struct FAT32_volume_t* volume)
+{
+	struct FAT32_file_t* root = FAT32_fopen(volume, FAT32_get_root(volume), UINT32_MAX);
+	const uint32_t moved = compact_directory(root);
+	FAT32_fclose(root);
+
+	return moved;
+}
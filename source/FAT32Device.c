@@ -0,0 +1,186 @@
+// FAT32Device.c
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "FAT32Internal.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Opens a file as a device, for writing as well as reading if 'writable' is set. */
+static int open_device(struct FAT32_device_t* device, const char* path, int writable)
+{
+	memset(device, 0, sizeof(struct FAT32_device_t));
+
+#ifdef _WIN32
+	device->fd = _open(path, (writable ? _O_RDWR : _O_RDONLY) | _O_BINARY);
+#else
+	device->fd = open(path, writable ? O_RDWR : O_RDONLY);
+#endif
+
+	if (device->fd < 0)
+	{
+		return 0;
+	}
+
+	// Get the size of the image
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_fstat64(device->fd, &info) != 0)
+#else
+	struct stat info;
+	if (fstat(device->fd, &info) != 0)
+#endif
+	{
+		FAT32_device_close(device);
+		return 0;
+	}
+
+	device->size = (uint64_t)info.st_size;
+	return 1;
+}
+
+int FAT32_device_open(struct FAT32_device_t* device, const char* path)
+{
+	return open_device(device, path, 1);
+}
+
+int FAT32_device_open_readonly(struct FAT32_device_t* device, const char* path)
+{
+	return open_device(device, path, 0);
+}
+
+int FAT32_device_create(struct FAT32_device_t* device, const char* path, uint64_t size)
+{
+	memset(device, 0, sizeof(struct FAT32_device_t));
+
+#ifdef _WIN32
+	device->fd = _open(path, _O_RDWR | _O_BINARY | _O_CREAT | _O_TRUNC, _S_IREAD | _S_IWRITE);
+	const int sized = device->fd >= 0 && _chsize_s(device->fd, (__int64)size) == 0;
+#else
+	device->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	const int sized = device->fd >= 0 && ftruncate(device->fd, (off_t)size) == 0;
+#endif
+
+	if (!sized)
+	{
+		FAT32_device_close(device);
+		return 0;
+	}
+
+	device->size = size;
+	return 1;
+}
+
+void FAT32_device_open_memory(struct FAT32_device_t* device, uint64_t size)
+{
+	device->fd = -1;
+	device->memory = (HDByte_t*)calloc((size_t)size, 1);
+	device->size = size;
+}
+
+void FAT32_device_close(struct FAT32_device_t* device)
+{
+	if (device->fd >= 0)
+	{
+#ifdef _WIN32
+		_close(device->fd);
+#else
+		close(device->fd);
+#endif
+	}
+
+	free(device->memory);
+	device->fd = -1;
+	device->memory = NULL;
+	device->size = 0;
+}
+
+int FAT32_device_read(const struct FAT32_device_t* device, uint64_t offset, void* buffer, size_t size)
+{
+	if (offset + size > device->size)
+	{
+		return 0;
+	}
+
+	if (device->fd < 0)
+	{
+		memcpy(buffer, device->memory + offset, size);
+		return 1;
+	}
+
+#ifdef _WIN32
+	return _lseeki64(device->fd, (__int64)offset, SEEK_SET) >= 0 && _read(device->fd, buffer, (unsigned)size) == (int)size;
+#else
+	return pread(device->fd, buffer, size, (off_t)offset) == (ssize_t)size;
+#endif
+}
+
+int FAT32_device_write(struct FAT32_device_t* device, uint64_t offset, const void* buffer, size_t size)
+{
+	if (offset + size > device->size)
+	{
+		return 0;
+	}
+
+	if (device->fd < 0)
+	{
+		memcpy(device->memory + offset, buffer, size);
+		return 1;
+	}
+
+#ifdef _WIN32
+	return _lseeki64(device->fd, (__int64)offset, SEEK_SET) >= 0 && _write(device->fd, buffer, (unsigned)size) == (int)size;
+#else
+	return pwrite(device->fd, buffer, size, (off_t)offset) == (ssize_t)size;
+#endif
+}
+
+void FAT32_device_discard(struct FAT32_device_t* device, uint64_t offset, uint64_t size)
+{
+	if (device->fd < 0 || offset + size > device->size)
+	{
+		return;
+	}
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+	// Best effort: not every file system supports punching holes
+	fallocate(device->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size);
+#endif
+}
+
+void FAT32_device_prefetch(const struct FAT32_device_t* device, uint64_t offset, uint64_t size)
+{
+	if (device->fd < 0 || offset + size > device->size)
+	{
+		return;
+	}
+
+#if defined(__linux__) && defined(POSIX_FADV_WILLNEED)
+	// Only a hint, so it doesn't matter if it's ignored
+	posix_fadvise(device->fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void FAT32_device_flush(struct FAT32_device_t* device)
+{
+	if (device->fd < 0)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	_commit(device->fd);
+#else
+	fsync(device->fd);
+#endif
+}
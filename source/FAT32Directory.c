@@ -1,36 +1,66 @@
 // FAT32Directory.c
 
 #include <string.h>
-#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "FAT32Internal.h"
 #include "../include/FAT32Directory.h"
 
-static void update_modification_datetime(struct FAT32_directory_entry_t* entry)
+/* The highest numeric tail given to a short name, which leaves at least one character of the basis. */
+#define FAT32_DIR_MAX_NAME_TAIL 999999
+
+/* Characters that may not appear in short names, besides spaces and control characters. */
+#define FAT32_DIR_SHORT_NAME_INVALID "\"*+,./:;<=>?[\\]|"
+
+static struct FAT32_date_t unpack_date(uint16_t packed)
+{
+	struct FAT32_date_t date;
+	date.day = packed & 0x1F;
+	date.month = (packed >> 5) & 0x0F;
+	date.year = packed >> 9;
+	return date;
+}
+
+static struct FAT32_time_t unpack_time(uint16_t packed)
 {
-	// Get the current time and date
-	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
+	struct FAT32_time_t time;
+	time.seconds = packed & 0x1F;
+	time.minutes = (packed >> 5) & 0x3F;
+	time.hours = packed >> 11;
+	return time;
+}
 
-	// Set date values
-	entry->last_modified_date.year = tm.tm_year - 80;
-	entry->last_modified_date.month = tm.tm_mon + 1;
-	entry->last_modified_date.day = tm.tm_mday;
+/* Packs a date so that later dates compare greater. */
+static uint16_t pack_date(struct FAT32_date_t date)
+{
+	return (uint16_t)((date.year << 9) | (date.month << 5) | date.day);
+}
 
-	// Set time values
-	entry->last_modified_time.hours = tm.tm_hour;
-	entry->last_modified_time.minutes = tm.tm_min;
-	entry->last_modified_time.seconds = tm.tm_sec / 2;
+static void update_modification_datetime(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	const struct FAT32_clock_t clock = FAT32_get_clock(volume);
+	entry->last_modified_date = unpack_date(clock.date);
+	entry->last_modified_time = unpack_time(clock.time);
 }
 
-static void update_access_date(struct FAT32_directory_entry_t* entry)
+static void update_access_date(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
 {
-	// Get the current time and date
-	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
+	const FAT32_mount_flags_t flags = FAT32_get_mount_flags(volume);
+	if (flags & FAT32_MOUNT_NOATIME)
+	{
+		return;
+	}
+
+	const struct FAT32_clock_t clock = FAT32_get_clock(volume);
+	const uint16_t accessed = pack_date(entry->last_access_date);
 
-	// Set date values
-	entry->last_access_date.year = tm.tm_year - 80;
-	entry->last_access_date.month = tm.tm_mon + 1;
-	entry->last_access_date.day = tm.tm_mday;
+	// With relatime, a recent enough access date is left alone
+	if ((flags & FAT32_MOUNT_RELATIME) && accessed >= pack_date(entry->last_modified_date) && accessed >= clock.yesterday)
+	{
+		return;
+	}
+
+	entry->last_access_date = unpack_date(clock.date);
 }
 
 FAT32_cluster_address_t FAT32_dir_get_entry_address(const struct FAT32_directory_entry_t* entry)
@@ -48,10 +78,40 @@ void FAT32_dir_set_entry_address(struct FAT32_directory_entry_t* entry, FAT32_cl
 	entry->first_cluster_index_low = address.index_low;
 }
 
+static uint16_t fold_char(uint16_t c)
+{
+	return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+static char lower_char(char c)
+{
+	return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+/* Returns whether there's a lower case letter between 'begin' and 'end', and no upper case one. */
+static int is_lower_case(const char* begin, const char* end)
+{
+	int lower = 0;
+	for (; begin != end; ++begin)
+	{
+		if (*begin >= 'A' && *begin <= 'Z')
+		{
+			return 0;
+		}
+
+		lower |= *begin >= 'a' && *begin <= 'z';
+	}
+
+	return lower;
+}
+
 void FAT32_dir_get_entry_name(const struct FAT32_directory_entry_t* entry, char* outName)
 {
 	memset(outName, 0, FAT32_DIR_NAME_LEN);
 
+	const int lowerBase = (entry->flags & FAT32_DIR_ENTRY_FLAG_LOWER_BASE) != 0;
+	const int lowerExt = (entry->flags & FAT32_DIR_ENTRY_FLAG_LOWER_EXT) != 0;
+
 	// Extract the name
 	for (size_t i = 0; i < 8; ++i, ++outName)
 	{
@@ -60,7 +120,7 @@ void FAT32_dir_get_entry_name(const struct FAT32_directory_entry_t* entry, char*
 			break;
 		}
 
-		*outName = entry->name[i];
+		*outName = lowerBase ? lower_char(entry->name[i]) : entry->name[i];
 	}
 
 	// Extract the extension
@@ -77,7 +137,7 @@ void FAT32_dir_get_entry_name(const struct FAT32_directory_entry_t* entry, char*
 			break;
 		}
 
-		*outName = entry->ext[i];
+		*outName = lowerExt ? lower_char(entry->ext[i]) : entry->ext[i];
 	}
 }
 
@@ -86,6 +146,21 @@ void FAT32_dir_set_entry_name(struct FAT32_directory_entry_t* entry, const char*
 	memset(entry->name, ' ', 8);
 	memset(entry->ext, ' ', 3);
 
+	// Record which parts are in lower case, as they're stored in upper case
+	const char* dot = strchr(name, '.');
+	const char* end = name + strlen(name);
+	entry->flags &= (uint8_t)~(FAT32_DIR_ENTRY_FLAG_LOWER_BASE | FAT32_DIR_ENTRY_FLAG_LOWER_EXT);
+
+	if (is_lower_case(name, dot ? dot : end))
+	{
+		entry->flags |= FAT32_DIR_ENTRY_FLAG_LOWER_BASE;
+	}
+
+	if (dot && is_lower_case(dot + 1, end))
+	{
+		entry->flags |= FAT32_DIR_ENTRY_FLAG_LOWER_EXT;
+	}
+
 	char* target = entry->name;
 	for (; *name != 0; ++name)
 	{
@@ -95,200 +170,1236 @@ void FAT32_dir_set_entry_name(struct FAT32_directory_entry_t* entry, const char*
 		}
 		else
 		{
-			*target = *name;
+			*target = (char)fold_char((uint8_t)*name);
 			++target;
 		}
 	}
 }
 
-int FAT32_dir_get_entry(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry)
+/* The long name slots read so far while scanning a directory. */
+struct long_name_t
 {
-    // Rewind the file
-    FAT32_rewind(dir);
+	/* The UCS-2 characters of the name, in logical order. */
+	uint16_t chars[FAT32_DIR_LONG_NAME_MAX_SLOTS * FAT32_DIR_LONG_NAME_SLOT_CHARS];
+
+	/* Case-insensitive hash of the name, built up one slot at a time. */
+	uint32_t hash;
 
-    // Loop until the entry is found
-    while (FAT32_fread(outEntry, sizeof(struct FAT32_directory_entry_t), 1, dir))
-    {
-		// Get the name of the entry
-		char entryName[FAT32_DIR_NAME_LEN];
-		FAT32_dir_get_entry_name(outEntry, entryName);
+	/* The offset of the first slot in the directory. */
+	long start;
 
-        if (!strcmp(name, entryName))
-        {
-			// Rewind to the start of the entry
-			FAT32_fseek(dir, -(long)sizeof(struct FAT32_directory_entry_t), FAT32_SEEK_CUR);
-            return 1;
-        }
-    }
+	/* The short name checksum stored in the slots. */
+	uint8_t checksum;
 
-    return 0;
+	/* The number of slots in the name, or 0 if there is no (valid) long name. */
+	uint8_t num_slots;
+
+	/* The sequence number of the last slot read. */
+	uint8_t sequence;
+
+	/* Set to build up 'hash' as slots are read, which only lookups need. */
+	uint8_t want_hash;
+};
+
+static int is_free_slot(const struct FAT32_directory_entry_t* entry)
+{
+	return entry->name[0] == 0 || (uint8_t)entry->name[0] == FAT32_DIR_ENTRY_DELETED;
 }
 
-int FAT32_dir_get_entry_by_address(struct FAT32_file_t* dir, FAT32_cluster_address_t address, struct FAT32_directory_entry_t* outEntry)
+static int is_long_name_slot(const struct FAT32_directory_entry_t* entry)
 {
-	// Rewind the directory file
-	FAT32_rewind(dir);
+	return (entry->attribs & 0x3F) == FAT32_DIR_ENTRY_ATTRIB_LONG_NAME;
+}
+
+/* Hashes one slot's worth of characters. Slots are hashed independently so they may be read in any order. */
+static uint32_t hash_slot_chars(const uint16_t* chars, size_t len, uint8_t sequence)
+{
+	uint32_t hash = 2166136261u ^ sequence;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash = (hash ^ fold_char(chars[i])) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* Hashes a name the same way a long name is hashed while it is read from its slots. */
+static uint32_t hash_name(const char* name)
+{
+	uint32_t hash = 0;
+	const size_t len = strlen(name);
 
-	// Loop until the tnry is found
-	while (FAT32_fread(outEntry, sizeof(struct FAT32_directory_entry_t), 1, dir))
+	for (size_t slot = 0; slot * FAT32_DIR_LONG_NAME_SLOT_CHARS < len; ++slot)
 	{
-		if (FAT32_dir_get_entry_address(outEntry).index == address.index)
+		uint16_t chars[FAT32_DIR_LONG_NAME_SLOT_CHARS];
+		size_t numChars = 0;
+
+		for (; numChars < FAT32_DIR_LONG_NAME_SLOT_CHARS && slot * FAT32_DIR_LONG_NAME_SLOT_CHARS + numChars < len; ++numChars)
 		{
-			return 1;
+			chars[numChars] = (uint8_t)name[slot * FAT32_DIR_LONG_NAME_SLOT_CHARS + numChars];
 		}
+
+		hash += hash_slot_chars(chars, numChars, (uint8_t)(slot + 1));
 	}
 
-	return 0;
+	return hash;
 }
 
-struct FAT32_file_t* FAT32_dir_open_entry(struct FAT32_directory_entry_t* entry)
+/* Reads or writes the characters of a long name slot, in order. */
+static void copy_slot_chars(struct FAT32_long_name_entry_t* slot, uint16_t* chars, int toSlot)
 {
-    // Construct the address
-	FAT32_cluster_address_t address = FAT32_dir_get_entry_address(entry);
+	uint8_t* parts[3] = { slot->name0, slot->name1, slot->name2 };
+	const size_t partLens[3] = { 5, 6, 2 };
 
-	// If the entry is a subdirectory, open it with max size (directories are unsized)
-	if (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	for (size_t part = 0; part < 3; ++part)
 	{
-		return FAT32_fopen(address, UINT32_MAX);
+		for (size_t i = 0; i < partLens[part]; ++i, ++chars)
+		{
+			if (toSlot)
+			{
+				parts[part][i * 2] = (uint8_t)(*chars & 0xFF);
+				parts[part][i * 2 + 1] = (uint8_t)(*chars >> 8);
+			}
+			else
+			{
+				*chars = (uint16_t)(parts[part][i * 2] | (parts[part][i * 2 + 1] << 8));
+			}
+		}
+	}
+}
+
+/* Adds a long name slot to the name being read. */
+static void read_long_name_slot(struct long_name_t* longName, const struct FAT32_directory_entry_t* entry, long offset)
+{
+	struct FAT32_long_name_entry_t slot;
+	memcpy(&slot, entry, sizeof(slot));
+
+	const uint8_t sequence = slot.sequence & ~FAT32_DIR_LONG_NAME_LAST_SLOT;
+	if (sequence == 0 || sequence > FAT32_DIR_LONG_NAME_MAX_SLOTS)
+	{
+		longName->num_slots = 0;
+		return;
+	}
+
+	if (slot.sequence & FAT32_DIR_LONG_NAME_LAST_SLOT)
+	{
+		// This is the start of a new name
+		longName->num_slots = sequence;
+		longName->checksum = slot.checksum;
+		longName->start = offset;
+		longName->hash = 0;
+	}
+	else if (longName->num_slots == 0 || sequence + 1 != longName->sequence || slot.checksum != longName->checksum)
+	{
+		// This slot does not continue the name we were reading
+		longName->num_slots = 0;
+		return;
 	}
 
-	// Open the file, respecting its size
-	update_access_date(entry);
-	return FAT32_fopen(address, entry->size);
+	longName->sequence = sequence;
+
+	uint16_t* chars = &longName->chars[(sequence - 1) * FAT32_DIR_LONG_NAME_SLOT_CHARS];
+	copy_slot_chars(&slot, chars, 0);
+
+	if (longName->want_hash)
+	{
+		size_t len = 0;
+		while (len < FAT32_DIR_LONG_NAME_SLOT_CHARS && chars[len] != 0x0000 && chars[len] != 0xFFFF)
+		{
+			++len;
+		}
+
+		longName->hash += hash_slot_chars(chars, len, sequence);
+	}
 }
 
-void FAT32_dir_close_entry(struct FAT32_directory_entry_t* entry, struct FAT32_file_t* file)
+/* Feeds the slot at the given offset to the long name being read. Returns whether the slot is an entry, rather than
+* a free slot, a long name slot or a volume label. */
+static int accept_slot(struct long_name_t* longName, const struct FAT32_directory_entry_t* slot, long offset)
 {
-	// If the entry is not a directory, update the size
-	if ((entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0)
+	if (is_free_slot(slot))
 	{
-		FAT32_fseek(file, 0, FAT32_SEEK_END);
-		entry->size = FAT32_ftell(file);
+		longName->num_slots = 0;
+		return 0;
 	}
 
-	// If the file was modified, update the modification time
-	if (FAT32_fmodified(file))
+	if (is_long_name_slot(slot))
 	{
-		update_modification_datetime(entry);
+		read_long_name_slot(longName, slot, offset);
+		return 0;
 	}
 
-	// Close the file
-	FAT32_fclose(file);
+	// Volume labels aren't files
+	if (slot->attribs & FAT32_DIR_ENTRY_ATTRIB_VOLUME_ID)
+	{
+		longName->num_slots = 0;
+		return 0;
+	}
+
+	// Only keep the long name if it was complete and belongs to this entry
+	if (longName->num_slots != 0 && (longName->sequence != 1 || longName->checksum != FAT32_dir_get_entry_checksum(slot)))
+	{
+		longName->num_slots = 0;
+	}
+
+	if (longName->num_slots == 0)
+	{
+		longName->start = offset;
+	}
+
+	return 1;
 }
 
-int FAT32_dir_new_entry(struct FAT32_file_t* dir, const char* name, FAT32_dir_entry_attribs_t attribs, struct FAT32_directory_entry_t* outEntry)
+/* Reads the next entry from the directory, along with its long name (hashed if 'wantHash' is set). Returns 0 at the end of the directory. */
+static int read_next_entry(struct FAT32_file_t* dir, struct FAT32_directory_entry_t* outEntry, struct long_name_t* outLongName, long* outOffset, int wantHash)
 {
-	// Seek to the beginning of the file
-	FAT32_fseek(dir, 0, FAT32_SEEK_SET);
+	outLongName->num_slots = 0;
+	outLongName->want_hash = (uint8_t)wantHash;
 
-	// Loop until we either find an empty entry, or we run out of space
-	long insertPos = 0;
-	while (FAT32_fread(outEntry, sizeof(struct FAT32_directory_entry_t), 1, dir))
+	long offset = FAT32_ftell(dir);
+	for (; FAT32_fread(outEntry, sizeof(struct FAT32_directory_entry_t), 1, dir); offset += sizeof(struct FAT32_directory_entry_t))
+	{
+		if (accept_slot(outLongName, outEntry, offset))
+		{
+			*outOffset = offset;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Formats the long name of an entry, or its short name if it has none. */
+static void get_long_name(const struct FAT32_directory_entry_t* entry, const struct long_name_t* longName, char* outName)
+{
+	if (longName->num_slots == 0)
 	{
-		if (outEntry->name[0] == 0)
+		FAT32_dir_get_entry_name(entry, outName);
+		return;
+	}
+
+	size_t i = 0;
+	for (; i < (size_t)longName->num_slots * FAT32_DIR_LONG_NAME_SLOT_CHARS && i + 1 < FAT32_DIR_LONG_NAME_LEN; ++i)
+	{
+		const uint16_t c = longName->chars[i];
+		if (c == 0x0000 || c == 0xFFFF)
 		{
 			break;
 		}
 
-		insertPos = FAT32_ftell(dir);
+		outName[i] = c < 0x100 ? (char)c : '_';
 	}
 
-	// Set file properties
-	FAT32_dir_set_entry_name(outEntry, name);
-	outEntry->attribs = attribs;
-	outEntry->size = 0;
+	outName[i] = 0;
+}
 
-	// Set initial datetime values
-	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
-	outEntry->create_date.year = tm.tm_year - 80;
-	outEntry->create_date.month = tm.tm_mon + 1;
-	outEntry->create_date.day = tm.tm_mday;
-	outEntry->create_time.hours = tm.tm_hour;
-	outEntry->create_time.minutes = tm.tm_min;
-	outEntry->create_time.seconds = tm.tm_sec / 2;
-	outEntry->last_modified_date = outEntry->create_date;
-	outEntry->last_modified_time = outEntry->create_time;
-	outEntry->last_access_date = outEntry->create_date;
+static int names_equal(const char* lhs, const char* rhs)
+{
+	for (; *lhs != 0 && fold_char((uint8_t)*lhs) == fold_char((uint8_t)*rhs); ++lhs, ++rhs);
+	return *lhs == *rhs;
+}
 
-	// Create a cluster chain for the file
-	FAT32_dir_set_entry_address(outEntry, FAT32_new_cluster());
+/* Returns whether the character may be stored as is in a short name. Characters from the upper half of the code page are only kept
+* if 'allowHigh' is set, for names that were given with them, as generated names can't tell which code page they're meant in. */
+static int is_short_name_char(uint8_t c, int allowHigh)
+{
+	return c > ' ' && (c < 0x80 || allowHigh) && !strchr(FAT32_DIR_SHORT_NAME_INVALID, c);
+}
 
-	// Rewind to where we'll insert the file
-	FAT32_fseek(dir, insertPos, FAT32_SEEK_SET);
+/* Returns whether the name can be stored as is in an 8.3 short name. */
+static int fits_short_name(const char* name)
+{
+	const char* dot = strchr(name, '.');
+	const size_t len = strlen(name);
 
-	// Write the entry
-	FAT32_fwrite(outEntry, sizeof(struct FAT32_directory_entry_t), 1, dir);
+	if (len == 0 || dot == name || (dot && strchr(dot + 1, '.')))
+	{
+		return 0;
+	}
 
-	// Rewind again
-	FAT32_fseek(dir, insertPos, FAT32_SEEK_SET);
+	const size_t baseLen = dot ? (size_t)(dot - name) : len;
+	const size_t extLen = dot ? len - baseLen - 1 : 0;
+	if (baseLen > 8 || extLen > 3)
+	{
+		return 0;
+	}
+
+	for (const char* c = name; *c != 0; ++c)
+	{
+		if (c != dot && !is_short_name_char((uint8_t)*c, 1))
+		{
+			return 0;
+		}
+	}
 
 	return 1;
 }
 
-static void delete_entry(struct FAT32_directory_entry_t* entry)
+/* Packs a name into the name and extension of an entry, as short names are stored. Returns 0 if the name has no short form. */
+static int pack_short_name(const char* name, struct FAT32_directory_entry_t* outEntry)
 {
-	// If the entry is a subdirectory
-	if (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	memset(outEntry, 0, sizeof(struct FAT32_directory_entry_t));
+
+	// The links to a directory and its parent are the only names that start with a dot
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
 	{
-		// Open 'er up
-		struct FAT32_file_t* file = FAT32_dir_open_entry(entry);
+		memset(outEntry->name, ' ', 8);
+		memset(outEntry->ext, ' ', 3);
+		memcpy(outEntry->name, name, strlen(name));
+		return 1;
+	}
 
-		// Delete all entries in the subdirectory
-		struct FAT32_directory_entry_t subEntry;
-		while (FAT32_fread(&subEntry, sizeof(subEntry), 1, file))
+	if (!fits_short_name(name))
+	{
+		return 0;
+	}
+
+	FAT32_dir_set_entry_name(outEntry, name);
+	return 1;
+}
+
+static int short_names_equal(const struct FAT32_directory_entry_t* lhs, const struct FAT32_directory_entry_t* rhs)
+{
+	for (size_t i = 0; i < 8; ++i)
+	{
+		if (fold_char((uint8_t)lhs->name[i]) != fold_char((uint8_t)rhs->name[i]))
+		{
+			return 0;
+		}
+	}
+
+	for (size_t i = 0; i < 3; ++i)
+	{
+		if (fold_char((uint8_t)lhs->ext[i]) != fold_char((uint8_t)rhs->ext[i]))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Searches the directory for the given name. On success, 'outStart' is the offset of the entry's first long name slot, and 'outOffset' the offset of the entry itself. */
+static int find_entry(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry, long* outStart, long* outOffset)
+{
+	const uint32_t hash = hash_name(name);
+
+	// Short names are compared packed, as they're stored, and only if the name has a short form at all
+	struct FAT32_directory_entry_t shortName;
+	const int hasShortName = pack_short_name(name, &shortName);
+
+	FAT32_rewind(dir);
+
+	struct long_name_t longName;
+	while (read_next_entry(dir, outEntry, &longName, outOffset, 1))
+	{
+		// Only decode the long name if its hash matches
+		if (longName.num_slots != 0 && longName.hash == hash)
 		{
-			// If the subentry is not a real entry or a system entry
-			if (subEntry.name[0] == 0 || subEntry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM)
+			char entryName[FAT32_DIR_LONG_NAME_LEN];
+			get_long_name(outEntry, &longName, entryName);
+			if (names_equal(name, entryName))
 			{
-				continue;
+				*outStart = longName.start;
+				return 1;
 			}
+		}
 
-			delete_entry(&subEntry);
+		if (hasShortName && short_names_equal(outEntry, &shortName))
+		{
+			*outStart = longName.start;
+			return 1;
 		}
+	}
 
-		FAT32_fclose(file);
+	return 0;
+}
+
+int FAT32_dir_is_dot_entry(const struct FAT32_directory_entry_t* entry)
+{
+	return entry->name[0] == '.' && (entry->name[1] == ' ' || (entry->name[1] == '.' && entry->name[2] == ' '));
+}
+
+uint8_t FAT32_dir_get_entry_checksum(const struct FAT32_directory_entry_t* entry)
+{
+	uint8_t sum = 0;
+	for (size_t i = 0; i < 11; ++i)
+	{
+		const uint8_t c = i < 8 ? (uint8_t)entry->name[i] : (uint8_t)entry->ext[i - 8];
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + c);
 	}
 
-	// Free the cluster chain
-	FAT32_free_cluster(FAT32_dir_get_entry_address(entry));
+	return sum;
 }
 
-int FAT32_dir_remove_entry(struct FAT32_file_t* dir, const char* name)
+int FAT32_dir_read_entry(struct FAT32_file_t* dir, struct FAT32_directory_entry_t* outEntry, char* outName)
 {
-	// Get the entry to be removed
-	struct FAT32_directory_entry_t entry;
+	struct long_name_t longName;
+	long offset;
 
-	// Search for the entry
-	if (!FAT32_dir_get_entry(dir, name, &entry))
+	if (!read_next_entry(dir, outEntry, &longName, &offset, 0))
 	{
 		return 0;
 	}
 
-	// Make sure its not a system entry
-	if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM)
+	if (outName)
+	{
+		get_long_name(outEntry, &longName, outName);
+	}
+
+	return 1;
+}
+
+int FAT32_dir_get_entry(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry)
+{
+	long start, offset;
+	if (!find_entry(dir, name, outEntry, &start, &offset))
 	{
 		return 0;
 	}
 
-	// Delete it
-	delete_entry(&entry);
+	// Rewind to the start of the entry
+	FAT32_fseek(dir, offset, FAT32_SEEK_SET);
+	return 1;
+}
+
+int FAT32_dir_get_entry_by_address(struct FAT32_file_t* dir, FAT32_cluster_address_t address, struct FAT32_directory_entry_t* outEntry, char* outName)
+{
+	// Rewind the directory file
+	FAT32_rewind(dir);
 
-	// Overwite the entry with zeroes
-	memset(&entry, 0, sizeof(entry));
-	FAT32_fwrite(&entry, sizeof(entry), 1, dir);
+	// Loop until the entry is found
+	struct long_name_t longName;
+	long offset;
+	while (read_next_entry(dir, outEntry, &longName, &offset, 0))
+	{
+		if (FAT32_dir_get_entry_address(outEntry).index == address.index)
+		{
+			if (outName)
+			{
+				get_long_name(outEntry, &longName, outName);
+			}
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t FAT32_readdir_batch(struct FAT32_file_t* dir, uint32_t* cookie, struct FAT32_dirent_t* outEntries, uint32_t maxEntries)
+{
+	struct FAT32_directory_entry_t slots[FAT32_DIR_BATCH_SLOTS];
+	struct long_name_t longName;
+	longName.num_slots = 0;
+	longName.want_hash = 0;
+
+	// Cookies are slot indices, and always fall between entries, so no long name is cut in two
+	uint32_t next = *cookie;
+	FAT32_fseek(dir, (long)(next * sizeof(struct FAT32_directory_entry_t)), FAT32_SEEK_SET);
+
+	uint32_t numEntries = 0;
+	while (numEntries < maxEntries)
+	{
+		// Read a block of slots at a time, and decode them in memory
+		const uint32_t numSlots = (uint32_t)FAT32_fread(slots, sizeof(struct FAT32_directory_entry_t), FAT32_DIR_BATCH_SLOTS, dir);
+
+		uint32_t i = 0;
+		for (; i < numSlots && numEntries < maxEntries; ++i)
+		{
+			if (!accept_slot(&longName, &slots[i], (long)((next + i) * sizeof(struct FAT32_directory_entry_t))))
+			{
+				continue;
+			}
+
+			struct FAT32_dirent_t* out = &outEntries[numEntries++];
+			out->entry = slots[i];
+			out->slot = next + i;
+			out->first_slot = (uint32_t)(longName.start / sizeof(struct FAT32_directory_entry_t));
+			get_long_name(&slots[i], &longName, out->name);
+		}
+
+		next += i;
+		if (i < FAT32_DIR_BATCH_SLOTS)
+		{
+			break;
+		}
+	}
+
+	// Leave the directory just after the last entry returned
+	*cookie = next;
+	FAT32_fseek(dir, (long)(next * sizeof(struct FAT32_directory_entry_t)), FAT32_SEEK_SET);
+
+	return numEntries;
+}
+
+struct FAT32_file_t* FAT32_dir_open_entry(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+    // Construct the address
+	FAT32_cluster_address_t address = FAT32_dir_get_entry_address(entry);
+
+	// If the entry is a subdirectory, open it with max size (directories are unsized)
+	if (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		// Links to the root directory don't store its address
+		if (address.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			address = FAT32_get_root(volume);
+		}
+
+		return FAT32_fopen(volume, address, UINT32_MAX);
+	}
+
+	// Compressed files are read through their container, whose size is the one stored
+	if (entry->flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		return FAT32_fopen_compressed(volume, address, entry->size);
+	}
+
+	// Open the file, respecting its size. Its access date is updated when it's closed.
+	return FAT32_fopen(volume, address, entry->size);
+}
+
+struct FAT32_file_t* FAT32_dir_open_entry_overwrite(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	// Directories can't be overwritten
+	if (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		return NULL;
+	}
+
+	// Open it as empty, but keep its chain to be written over (containers are always written from the start, so nothing old shows through)
+	if (entry->flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		return FAT32_fopen_compressed(volume, FAT32_dir_get_entry_address(entry), 0);
+	}
+
+	return FAT32_fopen_overwrite(volume, FAT32_dir_get_entry_address(entry));
+}
+
+int FAT32_dir_close_entry(struct FAT32_directory_entry_t* entry, struct FAT32_file_t* file)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(file);
+	const struct FAT32_directory_entry_t original = *entry;
+	FAT32_journal_begin(volume);
+
+	// If the entry is not a directory, update the size (and the address, in case the file was empty)
+	if (entry->flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		// The container takes care of its own size, and is stored as it's finished
+		entry->size = FAT32_finish_compressed(file);
+		FAT32_dir_set_entry_address(entry, FAT32_faddress(file));
+		update_access_date(volume, entry);
+	}
+	else if ((entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0)
+	{
+		FAT32_fseek(file, 0, FAT32_SEEK_END);
+		const uint32_t size = (uint32_t)FAT32_ftell(file);
+
+		// Release any clusters past the new end (left over from overwriting the file with less, for example)
+		if (FAT32_fmodified(file) || size != entry->size)
+		{
+			FAT32_ftruncate(file, size);
+		}
+
+		entry->size = size;
+		FAT32_dir_set_entry_address(entry, FAT32_faddress(file));
+		update_access_date(volume, entry);
+	}
+
+	// If the file was modified, update the modification time
+	if (FAT32_fmodified(file))
+	{
+		update_modification_datetime(volume, entry);
+	}
+
+	// Close the file
+	FAT32_fclose(file);
+
+	FAT32_journal_end(volume);
+	return memcmp(&original, entry, sizeof(original)) != 0;
+}
+
+void FAT32_dir_update_entry(struct FAT32_file_t* dir, const struct FAT32_directory_entry_t* entry)
+{
+	FAT32_journal_begin(FAT32_fvolume(dir));
+	FAT32_fwrite_entry(dir, entry);
+	FAT32_journal_end(FAT32_fvolume(dir));
+}
+
+/* Returns the numeric tail of a short name that could have been generated from the basis, with the extension in 'entry', or 0 if it couldn't. */
+static uint32_t get_name_tail(const struct FAT32_directory_entry_t* other, const char* basis, const struct FAT32_directory_entry_t* entry)
+{
+	for (size_t i = 0; i < 3; ++i)
+	{
+		if (fold_char((uint8_t)other->ext[i]) != fold_char((uint8_t)entry->ext[i]))
+		{
+			return 0;
+		}
+	}
+
+	const char* tilde = memchr(other->name, '~', 8);
+	if (!tilde)
+	{
+		return 0;
+	}
+
+	// The tail runs to the end of the name, and has no leading zeroes
+	const size_t keep = (size_t)(tilde - other->name);
+	size_t tailLen = 1;
+	uint32_t tail = 0;
+	for (; keep + tailLen < 8 && other->name[keep + tailLen] != ' '; ++tailLen)
+	{
+		const char c = other->name[keep + tailLen];
+		if (c < '0' || c > '9' || (tail == 0 && c == '0'))
+		{
+			return 0;
+		}
+
+		tail = tail * 10 + (uint32_t)(c - '0');
+	}
+
+	for (size_t i = keep + tailLen; i < 8; ++i)
+	{
+		if (other->name[i] != ' ')
+		{
+			return 0;
+		}
+	}
+
+	// The basis must have been cut short just enough to make room for the tail
+	const size_t basisLen = strlen(basis);
+	if (keep != (basisLen < 8 - tailLen ? basisLen : 8 - tailLen))
+	{
+		return 0;
+	}
+
+	for (size_t i = 0; i < keep; ++i)
+	{
+		if (fold_char((uint8_t)other->name[i]) != (uint8_t)basis[i])
+		{
+			return 0;
+		}
+	}
+
+	return tail;
+}
+
+static int compare_tails(const void* a, const void* b)
+{
+	const uint32_t lhs = *(const uint32_t*)a;
+	const uint32_t rhs = *(const uint32_t*)b;
+	return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* Generates a unique short name (such as 'LONGNA~1.TXT') for a long name. */
+static void generate_short_name(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* entry)
+{
+	char basis[9] = { 0 };
+	char ext[4] = { 0 };
+
+	// Take the extension from after the last dot
+	const char* lastDot = strrchr(name, '.');
+	if (lastDot == name)
+	{
+		lastDot = NULL;
+	}
+
+	// Keep only valid characters, in upper case, and replace the rest
+	size_t len = 0;
+	for (const char* c = name; *c != 0 && c != lastDot && len < 8; ++c)
+	{
+		if (*c != ' ' && *c != '.')
+		{
+			basis[len++] = is_short_name_char((uint8_t)*c, 0) ? (char)fold_char((uint8_t)*c) : '_';
+		}
+	}
+
+	// Names with nothing to make a basis from get one from their hash, as Windows does
+	if (len == 0)
+	{
+		const uint32_t hash = hash_name(name);
+		for (; len < 4; ++len)
+		{
+			basis[len] = "0123456789ABCDEF"[(hash >> (12 - 4 * len)) & 0xF];
+		}
+	}
+
+	len = 0;
+	for (const char* c = lastDot ? lastDot + 1 : ""; *c != 0 && len < 3; ++c)
+	{
+		if (*c != ' ')
+		{
+			ext[len++] = is_short_name_char((uint8_t)*c, 0) ? (char)fold_char((uint8_t)*c) : '_';
+		}
+	}
+
+	memset(entry->ext, ' ', 3);
+	memcpy(entry->ext, ext, len);
+
+	// Collect the tails already given to names from the same basis, in one pass over the directory
+	uint32_t* tails = NULL;
+	uint32_t numTails = 0;
+	uint32_t tailsCapacity = 0;
+
+	FAT32_rewind(dir);
+
+	struct FAT32_directory_entry_t other;
+	while (FAT32_fread(&other, sizeof(other), 1, dir))
+	{
+		if (is_free_slot(&other) || is_long_name_slot(&other))
+		{
+			continue;
+		}
+
+		const uint32_t taken = get_name_tail(&other, basis, entry);
+		if (taken == 0)
+		{
+			continue;
+		}
+
+		if (numTails == tailsCapacity)
+		{
+			tailsCapacity = tailsCapacity ? tailsCapacity * 2 : 16;
+			tails = (uint32_t*)realloc(tails, sizeof(uint32_t) * tailsCapacity);
+		}
+
+		tails[numTails++] = taken;
+	}
+
+	// Take the lowest tail that's free
+	if (numTails > 1)
+	{
+		qsort(tails, numTails, sizeof(uint32_t), &compare_tails);
+	}
+
+	uint32_t tail = 1;
+	for (uint32_t i = 0; i < numTails && tails[i] <= tail; ++i)
+	{
+		tail = tails[i] + 1;
+	}
+
+	free(tails);
+
+	if (tail > FAT32_DIR_MAX_NAME_TAIL)
+	{
+		tail = FAT32_DIR_MAX_NAME_TAIL;
+	}
+
+	// Cut the basis short to make room for the tail
+	char tailStr[8];
+	const size_t tailLen = (size_t)snprintf(tailStr, sizeof(tailStr), "~%u", tail);
+	const size_t keep = strlen(basis) < 8 - tailLen ? strlen(basis) : 8 - tailLen;
+
+	memset(entry->name, ' ', 8);
+	memcpy(entry->name, basis, keep);
+	memcpy(entry->name + keep, tailStr, tailLen);
+}
+
+/* Returns whether the short form of the name (which must fit) would read back differently, as when a part of it mixes upper and lower case. */
+static int short_name_loses_case(const char* name)
+{
+	struct FAT32_directory_entry_t entry;
+	memset(&entry, 0, sizeof(entry));
+	FAT32_dir_set_entry_name(&entry, name);
+
+	char shortName[FAT32_DIR_NAME_LEN];
+	FAT32_dir_get_entry_name(&entry, shortName);
+	return strcmp(shortName, name) != 0;
+}
+
+/* Returns how many long name slots 'name' needs ahead of its entry, which is none when it fits in 8.3 as it is. */
+static uint32_t count_long_name_slots(const char* name)
+{
+	if (fits_short_name(name) && !short_name_loses_case(name))
+	{
+		return 0;
+	}
+
+	return (uint32_t)(strlen(name) + FAT32_DIR_LONG_NAME_SLOT_CHARS - 1) / FAT32_DIR_LONG_NAME_SLOT_CHARS;
+}
+
+/* Writes the long name slots for 'name' at the current position in the directory. */
+static void write_long_name(struct FAT32_file_t* dir, const char* name, uint32_t numSlots, uint8_t checksum)
+{
+	const size_t len = strlen(name);
+
+	for (uint32_t sequence = numSlots; sequence > 0; --sequence)
+	{
+		struct FAT32_long_name_entry_t slot;
+		memset(&slot, 0, sizeof(slot));
+		slot.sequence = (uint8_t)(sequence == numSlots ? sequence | FAT32_DIR_LONG_NAME_LAST_SLOT : sequence);
+		slot.attribs = FAT32_DIR_ENTRY_ATTRIB_LONG_NAME;
+		slot.checksum = checksum;
+
+		// The name is terminated with a NULL character, then padded out with 0xFFFF
+		uint16_t chars[FAT32_DIR_LONG_NAME_SLOT_CHARS];
+		for (size_t i = 0; i < FAT32_DIR_LONG_NAME_SLOT_CHARS; ++i)
+		{
+			const size_t index = (sequence - 1) * FAT32_DIR_LONG_NAME_SLOT_CHARS + i;
+			chars[i] = index < len ? (uint8_t)name[index] : index == len ? 0x0000 : 0xFFFF;
+		}
+
+		copy_slot_chars(&slot, chars, 1);
+		FAT32_fwrite(&slot, sizeof(slot), 1, dir);
+	}
+}
+
+/* Marks the slots of an entry and its long name as deleted, leaving its chain alone. */
+static void mark_deleted(struct FAT32_file_t* dir, long start, long offset)
+{
+	struct FAT32_directory_entry_t entry;
+	FAT32_fseek(dir, start, FAT32_SEEK_SET);
+	for (; start <= offset; start += sizeof(entry))
+	{
+		FAT32_fread(&entry, sizeof(entry), 1, dir);
+		entry.name[0] = (char)FAT32_DIR_ENTRY_DELETED;
+
+		FAT32_fseek(dir, start, FAT32_SEEK_SET);
+		FAT32_fwrite(&entry, sizeof(entry), 1, dir);
+	}
+}
+
+void FAT32_dir_delete_entry_at(struct FAT32_file_t* dir, long offset)
+{
+	// Find where the entry's long name starts, if it has one
+	FAT32_rewind(dir);
+
+	struct FAT32_directory_entry_t entry;
+	struct long_name_t longName;
+	long entryOffset;
+	while (read_next_entry(dir, &entry, &longName, &entryOffset, 0))
+	{
+		if (entryOffset == offset)
+		{
+			mark_deleted(dir, longName.start, offset);
+			return;
+		}
+	}
+
+	mark_deleted(dir, offset, offset);
+}
+
+/* Writes an entry under the given name (which must fit) to the first run of free slots long enough for it, or the end of the directory.
+* Everything but the name is taken from 'entry'. Leaves the directory positioned at the entry, as 'FAT32_dir_get_entry' does.
+* Returns 0 if the directory had to grow, but the volume is out of clusters. If given, 'outStart' receives the position of the first slot.
+*/
+static int add_entry(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* entry, long* outStart)
+{
+	// Names that don't fit in 8.3 need long name slots ahead of the entry
+	const uint32_t numSlots = count_long_name_slots(name);
+
+	// Seek to the beginning of the file
+	FAT32_fseek(dir, 0, FAT32_SEEK_SET);
+
+	// Loop until we either find enough empty slots in a row, or we run out of space
+	struct FAT32_directory_entry_t slot;
+	long insertPos = 0;
+	uint32_t numFree = 0;
+	while (numFree < numSlots + 1 && FAT32_fread(&slot, sizeof(slot), 1, dir))
+	{
+		if (is_free_slot(&slot))
+		{
+			++numFree;
+			continue;
+		}
+
+		numFree = 0;
+		insertPos = FAT32_ftell(dir);
+	}
+
+	// Grow the directory with free slots first, so running out of clusters leaves nothing half written
+	if (numFree < numSlots + 1)
+	{
+		struct FAT32_directory_entry_t empty;
+		memset(&empty, 0, sizeof(empty));
+
+		for (; numFree < numSlots + 1; ++numFree)
+		{
+			if (!FAT32_fwrite(&empty, sizeof(empty), 1, dir))
+			{
+				return 0;
+			}
+		}
+	}
+
+	// Name the entry
+	if (numSlots > 0)
+	{
+		// The long name holds the case, and the short name is all upper case
+		entry->flags &= (uint8_t)~(FAT32_DIR_ENTRY_FLAG_LOWER_BASE | FAT32_DIR_ENTRY_FLAG_LOWER_EXT);
+		generate_short_name(dir, name, entry);
+	}
+	else
+	{
+		FAT32_dir_set_entry_name(entry, name);
+	}
+
+	// Rewind to where we'll insert the file
+	FAT32_fseek(dir, insertPos, FAT32_SEEK_SET);
+
+	// Write the long name, then the entry
+	write_long_name(dir, name, numSlots, FAT32_dir_get_entry_checksum(entry));
+	FAT32_fwrite(entry, sizeof(struct FAT32_directory_entry_t), 1, dir);
+
+	// Rewind again, to the entry itself
+	FAT32_fseek(dir, insertPos + (long)(numSlots * sizeof(struct FAT32_directory_entry_t)), FAT32_SEEK_SET);
+	if (outStart)
+	{
+		*outStart = insertPos;
+	}
+
+	return 1;
+}
+
+/* Renames an entry where it is, when only the case of its name changes. Its short name (tail and all) still fits, so only its case flags
+* and long name are rewritten, the long name ending just ahead of the entry. Returns 0 if the new name needs more slots than the old one had.
+*/
+static int rename_in_place(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* entry, long start, long offset)
+{
+	const uint32_t numSlots = count_long_name_slots(name);
+	const long newStart = offset - (long)(numSlots * sizeof(struct FAT32_directory_entry_t));
+	if (newStart < start)
+	{
+		return 0;
+	}
+
+	if (numSlots > 0)
+	{
+		entry->flags &= (uint8_t)~(FAT32_DIR_ENTRY_FLAG_LOWER_BASE | FAT32_DIR_ENTRY_FLAG_LOWER_EXT);
+	}
+	else
+	{
+		FAT32_dir_set_entry_name(entry, name);
+	}
+
+	// Slots the old long name used that the new one doesn't are freed
+	if (start < newStart)
+	{
+		mark_deleted(dir, start, newStart - (long)sizeof(struct FAT32_directory_entry_t));
+	}
+
+	FAT32_fseek(dir, newStart, FAT32_SEEK_SET);
+	write_long_name(dir, name, numSlots, FAT32_dir_get_entry_checksum(entry));
+	FAT32_fwrite(entry, sizeof(struct FAT32_directory_entry_t), 1, dir);
+	return 1;
+}
+
+/* Fills in a new, empty entry with the given attributes, created now. */
+static void init_entry(struct FAT32_file_t* dir, FAT32_dir_entry_attribs_t attribs, struct FAT32_directory_entry_t* outEntry)
+{
+	// Set file properties
+	memset(outEntry, 0, sizeof(struct FAT32_directory_entry_t));
+	outEntry->attribs = attribs;
+	outEntry->size = 0;
+
+	// Set initial datetime values
+	const struct FAT32_clock_t clock = FAT32_get_clock(FAT32_fvolume(dir));
+	outEntry->create_date = unpack_date(clock.date);
+	outEntry->create_time = unpack_time(clock.time);
+	outEntry->last_modified_date = outEntry->create_date;
+	outEntry->last_modified_time = outEntry->create_time;
+	outEntry->last_access_date = outEntry->create_date;
+}
+
+int FAT32_dir_new_entry(struct FAT32_file_t* dir, const char* name, FAT32_dir_entry_attribs_t attribs, struct FAT32_directory_entry_t* outEntry)
+{
+	if (strlen(name) >= FAT32_DIR_LONG_NAME_LEN)
+	{
+		return 0;
+	}
+
+	init_entry(dir, attribs, outEntry);
+
+	// Create a cluster chain for the file, and add the entry for it as one operation
+	FAT32_journal_begin(FAT32_fvolume(dir));
+	FAT32_dir_set_entry_address(outEntry, FAT32_new_cluster(FAT32_fvolume(dir)));
+	if (FAT32_dir_get_entry_address(outEntry).index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		FAT32_journal_end(FAT32_fvolume(dir));
+		return 0;
+	}
+
+	if (!add_entry(dir, name, outEntry, NULL))
+	{
+		FAT32_free_cluster(FAT32_fvolume(dir), FAT32_dir_get_entry_address(outEntry));
+		FAT32_journal_end(FAT32_fvolume(dir));
+		return 0;
+	}
+
+	FAT32_journal_end(FAT32_fvolume(dir));
+	return 1;
+}
+
+int FAT32_dir_new_file(struct FAT32_file_t* dir, const char* name, FAT32_dir_entry_attribs_t attribs, uint32_t size, struct FAT32_directory_entry_t* outEntry)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+	if (strlen(name) >= FAT32_DIR_LONG_NAME_LEN)
+	{
+		return 0;
+	}
+
+	init_entry(dir, attribs, outEntry);
+
+	// Add the entry first, so if the directory has to grow it doesn't split the chain
+	FAT32_journal_begin(volume);
+	long start;
+	if (!add_entry(dir, name, outEntry, &start))
+	{
+		FAT32_journal_end(volume);
+		return 0;
+	}
+
+	// Then give it a chain long enough for all of it (even empty files get a cluster), and write the entry again
+	const uint32_t numClusters = (uint32_t)(((uint64_t)size + volume->cluster_size - 1) >> volume->cluster_shift);
+	FAT32_dir_set_entry_address(outEntry, FAT32_new_chain(volume, numClusters > 0 ? numClusters : 1));
+	if (FAT32_dir_get_entry_address(outEntry).index == FAT32_CLUSTER_ADDRESS_NULL)
+	{
+		// Out of clusters, so take the entry back out
+		mark_deleted(dir, start, FAT32_ftell(dir));
+		FAT32_journal_end(volume);
+		return 0;
+	}
+
+	outEntry->size = size;
+	FAT32_dir_update_entry(dir, outEntry);
+
+	FAT32_journal_end(volume);
+	return 1;
+}
+
+int FAT32_dir_new_directory(struct FAT32_file_t* dir, const char* name, struct FAT32_directory_entry_t* outEntry)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+
+	// Create the entry and its links as one operation
+	FAT32_journal_begin(volume);
+	if (!FAT32_dir_new_entry(dir, name, FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY, outEntry))
+	{
+		FAT32_journal_end(volume);
+		return 0;
+	}
+
+	struct FAT32_file_t* subdir = FAT32_dir_open_entry(volume, outEntry);
+
+	// Create an entry for the directory itself
+	struct FAT32_directory_entry_t selfEntry = *outEntry;
+	FAT32_dir_set_entry_name(&selfEntry, "");
+	selfEntry.attribs = FAT32_DIR_ENTRY_ATTRIB_SYSTEM | FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY;
+	selfEntry.name[0] = '.';
+
+	// Create an entry for the parent (the root directory is referred to by a NULL address)
+	struct FAT32_directory_entry_t parentEntry = selfEntry;
+	FAT32_cluster_address_t parentAddress = FAT32_faddress(dir);
+	if (parentAddress.index == FAT32_get_root(volume).index)
+	{
+		parentAddress.index = FAT32_CLUSTER_ADDRESS_NULL;
+	}
+	FAT32_dir_set_entry_address(&parentEntry, parentAddress);
+	parentEntry.name[1] = '.';
+
+	// Write them to the directory file
+	FAT32_fwrite(&selfEntry, sizeof(selfEntry), 1, subdir);
+	FAT32_fwrite(&parentEntry, sizeof(parentEntry), 1, subdir);
+	FAT32_fclose(subdir);
+
+	FAT32_journal_end(volume);
+	return 1;
+}
+
+static void delete_entry(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	// If the entry is a subdirectory
+	if (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		// Open 'er up
+		struct FAT32_file_t* file = FAT32_dir_open_entry(volume, entry);
+
+		// Delete all entries in the subdirectory
+		struct FAT32_directory_entry_t subEntry;
+		while (FAT32_dir_read_entry(file, &subEntry, NULL))
+		{
+			// If the subentry is a system entry, or a link to this directory or its parent
+			if (subEntry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM || FAT32_dir_is_dot_entry(&subEntry))
+			{
+				continue;
+			}
+
+			delete_entry(volume, &subEntry);
+		}
+
+		FAT32_fclose(file);
+	}
+
+	// Free the cluster chain
+	FAT32_free_cluster(volume, FAT32_dir_get_entry_address(entry));
+}
+
+int FAT32_dir_remove_entry(struct FAT32_file_t* dir, const char* name)
+{
+	// Get the entry to be removed
+	struct FAT32_directory_entry_t entry;
+
+	// Search for the entry
+	long start, offset;
+	if (!find_entry(dir, name, &entry, &start, &offset))
+	{
+		return 0;
+	}
+
+	// Make sure its not a system entry, or a link to this directory or its parent
+	if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM || FAT32_dir_is_dot_entry(&entry))
+	{
+		return 0;
+	}
+
+	// Delete it, and its entry, as one operation
+	FAT32_journal_begin(FAT32_fvolume(dir));
+	delete_entry(FAT32_fvolume(dir), &entry);
+
+	// Mark the entry and its long name as deleted
+	mark_deleted(dir, start, offset);
+
+	FAT32_journal_end(FAT32_fvolume(dir));
+	return 1;
+}
+
+/* Returns whether the directory starting at 'address' is 'ancestor', or lies somewhere beneath it. */
+static int is_within(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, FAT32_cluster_address_t ancestor)
+{
+	const FAT32_cluster_address_t root = FAT32_get_root(volume);
+
+	// Climb the parent links up to the root, guarding against loops by never climbing further than there are clusters
+	for (uint32_t depth = 0; depth < volume->num_entries; ++depth)
+	{
+		if (address.index == ancestor.index)
+		{
+			return 1;
+		}
+
+		if (address.index == root.index || !FAT32_is_valid_cluster(volume, address))
+		{
+			return 0;
+		}
+
+		struct FAT32_file_t* dir = FAT32_fopen(volume, address, UINT32_MAX);
+		struct FAT32_directory_entry_t parentEntry;
+		const int found = FAT32_dir_get_entry(dir, "..", &parentEntry);
+		FAT32_fclose(dir);
+
+		if (!found)
+		{
+			return 0;
+		}
+
+		// Links to the root directory don't store its address
+		address = FAT32_dir_get_entry_address(&parentEntry);
+		if (address.index == FAT32_CLUSTER_ADDRESS_NULL)
+		{
+			address = root;
+		}
+	}
+
+	return 0;
+}
+
+int FAT32_dir_rename(struct FAT32_file_t* dir, const char* name, struct FAT32_file_t* newDir, const char* newName)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(dir);
+	if (strlen(newName) >= FAT32_DIR_LONG_NAME_LEN)
+	{
+		return 0;
+	}
+
+	struct FAT32_directory_entry_t entry;
+	long start, offset;
+	if (!find_entry(dir, name, &entry, &start, &offset))
+	{
+		return 0;
+	}
+
+	// System entries and the links to this directory and its parent stay where they are
+	if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SYSTEM || FAT32_dir_is_dot_entry(&entry))
+	{
+		return 0;
+	}
+
+	// Don't replace anything, though an entry may be renamed over itself to change the case of its name
+	struct FAT32_directory_entry_t existing;
+	long existingStart, existingOffset;
+	const int sameDir = FAT32_faddress(newDir).index == FAT32_faddress(dir).index;
+	if (find_entry(newDir, newName, &existing, &existingStart, &existingOffset))
+	{
+		if (!sameDir || existingOffset != offset)
+		{
+			return 0;
+		}
+
+		FAT32_journal_begin(volume);
+		const int renamed = rename_in_place(dir, newName, &entry, start, offset);
+		FAT32_journal_end(volume);
+		if (renamed)
+		{
+			return 1;
+		}
+	}
+
+	// A directory can't be moved into itself, or anywhere beneath it
+	const int isDirectory = (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) != 0;
+	const FAT32_cluster_address_t parent = FAT32_faddress(newDir);
+	if (isDirectory && is_within(volume, parent, FAT32_dir_get_entry_address(&entry)))
+	{
+		return 0;
+	}
+
+	// Only the entry moves, so its chain (and everything in it) stays where it is. Moving it is one operation.
+	// The new entry goes in first, so if its directory can't grow, the old one is still there.
+	FAT32_journal_begin(volume);
+	if (!add_entry(newDir, newName, &entry, NULL))
+	{
+		FAT32_journal_end(volume);
+		return 0;
+	}
+
+	mark_deleted(dir, start, offset);
+
+	// A directory's parent link follows it to its new parent
+	if (isDirectory && !sameDir)
+	{
+		struct FAT32_file_t* subdir = FAT32_dir_open_entry(volume, &entry);
+
+		struct FAT32_directory_entry_t parentEntry;
+		if (FAT32_dir_get_entry(subdir, "..", &parentEntry))
+		{
+			// The root directory is referred to by a NULL address
+			FAT32_cluster_address_t parentAddress = parent;
+			if (parentAddress.index == FAT32_get_root(volume).index)
+			{
+				parentAddress.index = FAT32_CLUSTER_ADDRESS_NULL;
+			}
+
+			FAT32_dir_set_entry_address(&parentEntry, parentAddress);
+			FAT32_dir_update_entry(subdir, &parentEntry);
+		}
+
+		FAT32_fclose(subdir);
+	}
+
+	FAT32_journal_end(volume);
 	return 1;
 }
 
-void FAT32_dir_clear_entry(struct FAT32_directory_entry_t* entry)
+void FAT32_dir_clear_entry(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
 {
 	// Delete the entry (not as bad as it sounds)
-	delete_entry(entry);
+	FAT32_journal_begin(volume);
+	delete_entry(volume, entry);
 	entry->size = 0;
 
 	// Update the modification date
-	update_modification_datetime(entry);
+	update_modification_datetime(volume, entry);
 
 	// Reallocate the cluster chain
-	FAT32_dir_set_entry_address(entry, FAT32_new_cluster());
+	FAT32_dir_set_entry_address(entry, FAT32_new_cluster(volume));
+	FAT32_journal_end(volume);
 }
@@ -0,0 +1,233 @@
+// FAT32EntryCache.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+
+/* The number of directory entries held before they are all written back. The cache grows past this while they wait to be journaled. */
+#define FAT32_ENTRY_CACHE_CAPACITY 256
+
+static int has_cached_entries(const struct FAT32_volume_t* volume, uint32_t index)
+{
+	return (FAT32_atomic_load64(&volume->cached_clusters[index / 64]) >> (index % 64)) & 1;
+}
+
+/* Returns the position of the first cached entry at or after the given slot. */
+static uint32_t find_cached_entry(const struct FAT32_volume_t* volume, uint32_t cluster, uint32_t slot)
+{
+	uint32_t low = 0;
+	uint32_t high = volume->num_cached_entries;
+
+	while (low < high)
+	{
+		const uint32_t mid = low + (high - low) / 2;
+		const struct FAT32_cached_entry_t* entry = &volume->cached_entries[mid];
+
+		if (entry->cluster < cluster || (entry->cluster == cluster && entry->slot < slot))
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+void FAT32_entry_cache_flush_locked(struct FAT32_volume_t* volume)
+{
+	uint32_t pos = 0;
+	while (pos < volume->num_cached_entries)
+	{
+		// Gather a run of consecutive slots, to be written together
+		const struct FAT32_cached_entry_t* first = &volume->cached_entries[pos];
+		uint32_t length = 0;
+		do
+		{
+			memcpy(volume->entry_run + length * FAT32_ENTRY_SLOT_SIZE, volume->cached_entries[pos + length].data, FAT32_ENTRY_SLOT_SIZE);
+			++length;
+		} while (pos + length < volume->num_cached_entries && volume->cached_entries[pos + length].cluster == first->cluster &&
+			volume->cached_entries[pos + length].slot == first->slot + length);
+
+		FAT32_cluster_address_t address;
+		address.index = first->cluster;
+		FAT32_write_cluster_uncached(volume, address, first->slot * FAT32_ENTRY_SLOT_SIZE, volume->entry_run, length * FAT32_ENTRY_SLOT_SIZE);
+		FAT32_atomic_fetch_and64(&volume->cached_clusters[address.index / 64], ~((uint64_t)1 << (address.index % 64)));
+
+		pos += length;
+	}
+
+	volume->num_cached_entries = 0;
+}
+
+void FAT32_entry_cache_init(struct FAT32_volume_t* volume)
+{
+	volume->cached_entries = (struct FAT32_cached_entry_t*)malloc(sizeof(struct FAT32_cached_entry_t) * FAT32_ENTRY_CACHE_CAPACITY);
+	volume->num_cached_entries = 0;
+	volume->max_cached_entries = FAT32_ENTRY_CACHE_CAPACITY;
+	volume->cached_clusters = (volatile uint64_t*)calloc((volume->num_entries + 63) / 64, sizeof(uint64_t));
+	volume->entry_run = (HDByte_t*)malloc(FAT32_ENTRY_CACHE_CAPACITY * FAT32_ENTRY_SLOT_SIZE);
+	FAT32_mutex_init(&volume->entry_cache_mutex);
+}
+
+void FAT32_entry_cache_release(struct FAT32_volume_t* volume)
+{
+	if (volume->cached_entries)
+	{
+		FAT32_mutex_destroy(&volume->entry_cache_mutex);
+	}
+
+	free(volume->cached_entries);
+	free((void*)volume->cached_clusters);
+	free(volume->entry_run);
+	volume->cached_entries = NULL;
+	volume->cached_clusters = NULL;
+	volume->entry_run = NULL;
+}
+
+/* Adds an entry to the cache at the given position. The cache must be locked. */
+static void insert_entry(struct FAT32_volume_t* volume, uint32_t pos, FAT32_cluster_address_t address, uint32_t slot, const void* entry)
+{
+	// Make room for it. Entries can't be written back early while the journal is holding them back, so grow instead.
+	if (volume->num_cached_entries == volume->max_cached_entries)
+	{
+		if (volume->journal_active)
+		{
+			volume->max_cached_entries *= 2;
+			volume->cached_entries = (struct FAT32_cached_entry_t*)realloc(volume->cached_entries, sizeof(struct FAT32_cached_entry_t) * volume->max_cached_entries);
+			volume->entry_run = (HDByte_t*)realloc(volume->entry_run, (size_t)volume->max_cached_entries * FAT32_ENTRY_SLOT_SIZE);
+		}
+		else
+		{
+			FAT32_entry_cache_flush_locked(volume);
+			pos = 0;
+		}
+	}
+
+	memmove(&volume->cached_entries[pos + 1], &volume->cached_entries[pos], sizeof(struct FAT32_cached_entry_t) * (volume->num_cached_entries - pos));
+	volume->cached_entries[pos].cluster = address.index;
+	volume->cached_entries[pos].slot = slot;
+	memcpy(volume->cached_entries[pos].data, entry, FAT32_ENTRY_SLOT_SIZE);
+	volume->num_cached_entries += 1;
+	FAT32_atomic_fetch_or64(&volume->cached_clusters[address.index / 64], (uint64_t)1 << (address.index % 64));
+}
+
+void FAT32_entry_cache_put(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t slot, const void* entry)
+{
+	// The cluster's checksum changes now, even though the entry is written later
+	if (volume->checksums)
+	{
+		FAT32_checksum_lock(volume, address);
+		FAT32_checksum_write(volume, address, slot * FAT32_ENTRY_SLOT_SIZE, entry, FAT32_ENTRY_SLOT_SIZE);
+	}
+
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+
+	// Replace the entry if it's already cached
+	uint32_t pos = find_cached_entry(volume, address.index, slot);
+	if (pos < volume->num_cached_entries && volume->cached_entries[pos].cluster == address.index && volume->cached_entries[pos].slot == slot)
+	{
+		memcpy(volume->cached_entries[pos].data, entry, FAT32_ENTRY_SLOT_SIZE);
+	}
+	else
+	{
+		insert_entry(volume, pos, address, slot, entry);
+	}
+
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+
+	if (volume->checksums)
+	{
+		FAT32_checksum_unlock(volume, address);
+	}
+}
+
+/* Copies the overlapping bytes between the given range of a cluster and the cached entries that lie within it,
+ * into the buffer, or from it if 'toCache' is set. The cache must be locked. */
+static void copy_overlaps(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, HDByte_t* buffer, uint32_t size, int toCache)
+{
+	uint32_t pos = find_cached_entry(volume, address.index, offset / FAT32_ENTRY_SLOT_SIZE);
+	for (; pos < volume->num_cached_entries && volume->cached_entries[pos].cluster == address.index; ++pos)
+	{
+		struct FAT32_cached_entry_t* cached = &volume->cached_entries[pos];
+		const uint32_t entryStart = cached->slot * FAT32_ENTRY_SLOT_SIZE;
+		if (entryStart >= offset + size)
+		{
+			break;
+		}
+
+		const uint32_t start = entryStart > offset ? entryStart : offset;
+		const uint32_t end = entryStart + FAT32_ENTRY_SLOT_SIZE < offset + size ? entryStart + FAT32_ENTRY_SLOT_SIZE : offset + size;
+
+		if (toCache)
+		{
+			memcpy(cached->data + (start - entryStart), buffer + (start - offset), end - start);
+		}
+		else
+		{
+			memcpy(buffer + (start - offset), cached->data + (start - entryStart), end - start);
+		}
+	}
+}
+
+void FAT32_entry_cache_overlay(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size)
+{
+	if (!has_cached_entries(volume, address.index))
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+	copy_overlaps(volume, address, offset, (HDByte_t*)buffer, size, 0);
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+}
+
+int FAT32_entry_cache_holds(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return has_cached_entries(volume, address.index);
+}
+
+void FAT32_entry_cache_absorb(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size)
+{
+	if (!has_cached_entries(volume, address.index))
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+	copy_overlaps(volume, address, offset, (HDByte_t*)buffer, size, 1);
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+}
+
+void FAT32_entry_cache_drop(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (!has_cached_entries(volume, address.index))
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+
+	// The cluster's entries are all together, so cut them out in one go
+	const uint32_t first = find_cached_entry(volume, address.index, 0);
+	uint32_t last = first;
+	while (last < volume->num_cached_entries && volume->cached_entries[last].cluster == address.index)
+	{
+		++last;
+	}
+
+	memmove(&volume->cached_entries[first], &volume->cached_entries[last], sizeof(struct FAT32_cached_entry_t) * (volume->num_cached_entries - last));
+	volume->num_cached_entries -= last - first;
+	FAT32_atomic_fetch_and64(&volume->cached_clusters[address.index / 64], ~((uint64_t)1 << (address.index % 64)));
+
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+}
+
+void FAT32_entry_cache_flush(struct FAT32_volume_t* volume)
+{
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+	FAT32_entry_cache_flush_locked(volume);
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+}
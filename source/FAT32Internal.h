@@ -0,0 +1,512 @@
+// FAT32Internal.h
+#pragma once
+
+#include "../include/FAT32.h"
+#include "FAT32Thread.h"
+
+/* The first cluster index that may be allocated. Entries 0 and 1 of the table are reserved. */
+#define FAT32_FIRST_CLUSTER 2
+
+/* Type used to represent a byte on the hard drive. */
+typedef uint8_t HDByte_t;
+
+/* The storage behind a volume: either an image file, or a block of memory. */
+struct FAT32_device_t
+{
+	/* The image file descriptor, or -1 for an in-memory device. */
+	int fd;
+
+	/* The contents of an in-memory device. */
+	HDByte_t* memory;
+
+	/* The size of the device, in bytes. */
+	uint64_t size;
+};
+
+/* Opens an image file as a device. Returns 0 on failure. */
+int FAT32_device_open(struct FAT32_device_t* device, const char* path);
+
+/* Opens a file as a device that's only read from. Returns 0 on failure. */
+int FAT32_device_open_readonly(struct FAT32_device_t* device, const char* path);
+
+/* Creates (or replaces) a zeroed file of the given size, and opens it as a device. Returns 0 on failure. */
+int FAT32_device_create(struct FAT32_device_t* device, const char* path, uint64_t size);
+
+/* Creates a zeroed in-memory device of the given size. */
+void FAT32_device_open_memory(struct FAT32_device_t* device, uint64_t size);
+
+/* Closes the device. */
+void FAT32_device_close(struct FAT32_device_t* device);
+
+/* Reads bytes from the device. Returns 0 on failure. */
+int FAT32_device_read(const struct FAT32_device_t* device, uint64_t offset, void* buffer, size_t size);
+
+/* Writes bytes to the device. Returns 0 on failure. */
+int FAT32_device_write(struct FAT32_device_t* device, uint64_t offset, const void* buffer, size_t size);
+
+/* Tells the device that a range of bytes is no longer in use. It may read back as anything afterward. */
+void FAT32_device_discard(struct FAT32_device_t* device, uint64_t offset, uint64_t size);
+
+/* Tells the device that a range of bytes will be read soon, so it can start reading them in the background. */
+void FAT32_device_prefetch(const struct FAT32_device_t* device, uint64_t offset, uint64_t size);
+
+/* Flushes any writes to the device to stable storage. */
+void FAT32_device_flush(struct FAT32_device_t* device);
+
+/* A date and time in the packed form stored in directory entries. */
+struct FAT32_clock_t
+{
+	/* The seconds since the epoch the clock was last read at, rounded down to the 2 second resolution of FAT times. */
+	int64_t tick;
+
+	/* The current date and time. */
+	uint16_t date;
+	uint16_t time;
+
+	/* The date a day before 'date'. */
+	uint16_t yesterday;
+};
+
+/* The size of a directory entry slot, in bytes. */
+#define FAT32_ENTRY_SLOT_SIZE 32
+
+/* The number of buckets changes to directories are counted in. */
+#define FAT32_DIR_GENERATION_BUCKETS 64
+
+/* The number of locks the clusters are spread over while their checksums are updated or verified. */
+#define FAT32_CHECKSUM_LOCK_STRIPES 64
+
+/* A directory entry whose changes haven't been written to the device yet. */
+struct FAT32_cached_entry_t
+{
+	/* The directory cluster holding the entry. */
+	uint32_t cluster;
+
+	/* The index of the entry's slot within the cluster. */
+	uint32_t slot;
+
+	/* The contents of the entry. */
+	HDByte_t data[FAT32_ENTRY_SLOT_SIZE];
+};
+
+/* A run of consecutive clusters. */
+struct FAT32_extent_t
+{
+	uint32_t start;
+	uint32_t length;
+};
+
+/* State of a mounted volume. */
+struct FAT32_volume_t
+{
+	struct FAT32_device_t device;
+
+	/* The number of bytes in a sector. */
+	uint32_t bytes_per_sector;
+
+	/* The number of bytes in a FAT32 cluster. */
+	uint32_t cluster_size;
+
+	/* Cluster sizes are powers of two, so byte offsets are split into clusters with this shift and mask instead of a division. */
+	uint32_t cluster_shift;
+	uint32_t cluster_mask;
+
+	/* The number of entries in the File Allocation Table that map to clusters, including the two reserved ones. */
+	uint32_t num_entries;
+
+	/* The number of copies of the File Allocation Table. */
+	uint32_t num_fats;
+
+	/* The copy of the File Allocation Table that is read from. */
+	uint32_t active_fat;
+
+	/* Whether writes to the File Allocation Table go to every copy, or just the active one. */
+	int mirror_fats;
+
+	/* The reserved sectors, up to 'fat_offset', are laid out as:
+	 *  - the boot record (sectors 0 to 2), with the FSInfo sector (usually sector 1) at 'fsinfo_offset'. Bytes 496 and 500 of FSInfo,
+	 *    reserved by FAT32, hold the generation of the free extent summary and the volume's flags.
+	 *  - the backup boot record, if there is one (usually sectors 6 to 8).
+	 *  - the free extent summary, at 'summary_offset': the first sector past both boot records, and no earlier than byte 6144.
+	 *  - the metadata journal, at 'journal_offset', in up to half of the sectors after the summary, ending where the table begins.
+	 * The summary and journal are only kept if the volume reserves sectors past the boot records, as the usual 32 do. */
+
+	/* The byte offset of the first copy of the File Allocation Table. */
+	uint64_t fat_offset;
+
+	/* The size of each copy of the File Allocation Table, in bytes. */
+	uint64_t fat_size;
+
+	/* The byte offset of the first data cluster. */
+	uint64_t data_offset;
+
+	/* The first cluster of the root directory. */
+	FAT32_cluster_address_t root;
+
+	/* The byte offset of the FSInfo sector, or 0 if there is none. */
+	uint64_t fsinfo_offset;
+
+	/* Flags kept in the FSInfo sector, describing what the volume holds beyond plain FAT32. */
+	uint32_t fsinfo_flags;
+
+	/* The number of free clusters. */
+	uint32_t free_count;
+
+	/* The cluster to start searching from for the next allocation. */
+	uint32_t next_free;
+
+	/* In-memory copy of the active File Allocation Table. Only the chunks marked in 'loaded_chunks' have been read. */
+	FAT32_cluster_address_t* table;
+
+	/* Bitmap of the chunks of 'table' that have been read from the device. */
+	volatile uint64_t* loaded_chunks;
+
+	/* Whether every chunk of 'table' has been read. */
+	int table_complete;
+
+	/* Serializes loading chunks of 'table'. */
+	FAT32_mutex_t table_mutex;
+
+	/* The free extents of the volume, sorted by address. */
+	struct FAT32_extent_t* free_extents;
+
+	/* Whether 'free_extents' lists every free cluster. If not, free clusters have to be found by scanning the table. */
+	int free_extents_valid;
+
+	/* The number of extents in 'free_extents'. */
+	uint32_t num_free_extents;
+
+	/* The capacity of 'free_extents'. */
+	uint32_t max_free_extents;
+
+	/* The byte offset of the persisted free extent summary, or 0 if there is no room for one. */
+	uint64_t summary_offset;
+
+	/* The generation of the persisted free extent summary, echoed in the FSInfo sector. */
+	uint32_t summary_generation;
+
+	/* Bitmap of clusters that have been allocated but never written. They read as zeroes, whatever the device holds.
+	 * With a journal, they're zeroed on the device before their table entries are committed; without one, only at unmount. */
+	volatile uint64_t* unzeroed;
+
+	/* A cluster's worth of zeroes. */
+	HDByte_t* zero_cluster;
+
+	/* The options the volume was mounted with. */
+	FAT32_mount_flags_t mount_flags;
+
+	/* The time used to stamp directory entries. Only converted from the system time when it moves on by a tick. */
+	struct FAT32_clock_t clock;
+
+	/* Serializes refreshing 'clock'. */
+	FAT32_mutex_t clock_mutex;
+
+	/* Directory entries waiting to be written back, sorted by cluster and slot. */
+	struct FAT32_cached_entry_t* cached_entries;
+
+	/* The number of entries in 'cached_entries'. */
+	uint32_t num_cached_entries;
+
+	/* The capacity of 'cached_entries'. */
+	uint32_t max_cached_entries;
+
+	/* Bitmap of the clusters that have entries in 'cached_entries'. */
+	volatile uint64_t* cached_clusters;
+
+	/* Space to gather runs of consecutive entries while writing them back. */
+	HDByte_t* entry_run;
+
+	/* Protects 'cached_entries'. */
+	FAT32_mutex_t entry_cache_mutex;
+
+	/* Counts the changes made to directories, bucketed by the index of their first cluster. */
+	volatile uint64_t dir_generations[FAT32_DIR_GENERATION_BUCKETS];
+
+	/* The byte offset of the metadata journal, at the end of the reserved sectors, or 0 if there is no room for one. */
+	uint64_t journal_offset;
+
+	/* The size of the journal, in bytes, including its header sector. */
+	uint64_t journal_size;
+
+	/* Whether changes to the table and directories are held back to be committed through the journal, rather than written in place. */
+	int journal_active;
+
+	/* Transactions are only replayed if they belong to the current epoch. Moving to the next one empties the journal. */
+	uint32_t journal_epoch;
+
+	/* The sequence number of the next transaction in this epoch. */
+	uint32_t journal_sequence;
+
+	/* The number of bytes of the journal used by transactions in this epoch. */
+	uint64_t journal_used;
+
+	/* The number of operations in progress. Transactions are only committed between operations. */
+	uint32_t journal_depth;
+
+	/* The clock tick of the last commit. */
+	int64_t journal_commit_tick;
+
+	/* Bitmap of the sectors of the table that have changed since the last commit, and how many there are. */
+	volatile uint64_t* dirty_table_sectors;
+	uint32_t journal_dirty_sectors;
+
+	/* Bitmap of the clusters written to by transactions in this epoch. The journal is emptied before any of them are reused. */
+	volatile uint64_t* journaled_clusters;
+
+	/* Space to build or replay a transaction in. */
+	HDByte_t* journal_buffer;
+
+	/* Protects the journal. */
+	FAT32_mutex_t journal_mutex;
+
+	/* Signalled when the last operation in progress finishes. */
+	FAT32_cond_t journal_idle;
+
+	/* The CRC32C of the contents of each cluster in use, if the volume was mounted with 'FAT32_MOUNT_CHECKSUMS', or NULL. */
+	uint32_t* checksums;
+
+	/* Bitmap of the clusters whose contents are known to match their checksums, having been checked or written since mounting. */
+	volatile uint64_t* verified_clusters;
+
+	/* The CRC32C of a cluster of zeroes. */
+	uint32_t zero_cluster_checksum;
+
+	/* The file the checksums of an image are saved to, or closed for in-memory volumes. */
+	struct FAT32_device_t checksum_device;
+
+	/* Held while a cluster's checksum is updated along with its contents, or while it's checked. */
+	FAT32_mutex_t checksum_locks[FAT32_CHECKSUM_LOCK_STRIPES];
+
+	/* For each cluster, the number of references to it besides the one it was allocated for: from clones sharing the chain it
+	 * starts, or from the chains of files that copied the clusters before it. NULL until anything is shared. */
+	uint32_t* cluster_shares;
+
+	/* The number of clusters with any references in 'cluster_shares'. Nothing needs to be copied on write while it's 0. */
+	volatile uint64_t num_shared_clusters;
+
+	/* Moves on whenever a clone shares a chain, so files know to look again for shared clusters they thought were their own. */
+	volatile uint64_t share_generation;
+
+	/* Protects 'cluster_shares', and the copying of shared clusters. */
+	FAT32_mutex_t share_mutex;
+
+	/* The file the reference counts of an image are saved to, or closed until anything is shared. */
+	struct FAT32_device_t share_device;
+
+	/* The path of the image, so 'share_device' can be created when it's first needed. NULL for in-memory volumes. */
+	char* share_path;
+};
+
+/* Returns the current date and time, for stamping directory entries. */
+struct FAT32_clock_t FAT32_get_clock(struct FAT32_volume_t* volume);
+
+/* Returns the address stored in the File Allocation Table for the given address. */
+FAT32_cluster_address_t FAT32_get_table_entry(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Sets the address stored in the File Allocation Table for the given address, in every mirrored copy.
+ * Keeps the free cluster count and free extents up to date. */
+void FAT32_set_table_entry(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, FAT32_cluster_address_t value);
+
+/* Returns the File Allocation Table, as an array of 'volume->num_entries' entries. Loads any of it that hasn't been read yet. */
+FAT32_cluster_address_t* FAT32_get_table(struct FAT32_volume_t* volume);
+
+/* Writes a run of (loaded) table entries to each copy of the table on the device, bypassing the journal. */
+void FAT32_write_table_copies(struct FAT32_volume_t* volume, uint32_t first, uint32_t count);
+
+/* Records in the FSInfo sector that chains are shared between clones, before any is. */
+void FAT32_mark_volume_shared(struct FAT32_volume_t* volume);
+
+/* Returns whether the given cluster has been allocated, but never written. */
+int FAT32_is_unzeroed(const struct FAT32_volume_t* volume, uint32_t index);
+
+/* Returns whether the given address refers to a data cluster on the volume. */
+int FAT32_is_valid_cluster(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Starts reading up to 'maxClusters' clusters of the chain in the background, one request per contiguous run, so they're ready
+ * when they're read for real. */
+void FAT32_prefetch_chain(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t maxClusters);
+
+/* Returns the byte offset of the given data cluster on the device. */
+static inline uint64_t FAT32_get_cluster_offset(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	return volume->data_offset + ((uint64_t)(address.index - FAT32_FIRST_CLUSTER) << volume->cluster_shift);
+}
+
+/* Reads bytes from the given data cluster. If the volume keeps checksums, the whole cluster is checked against its checksum
+ * the first time any of it is read. Returns 0 if it doesn't match, though the bytes are still read. */
+int FAT32_read_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size);
+
+/* Reads bytes from the given data cluster, without checking them. */
+void FAT32_read_cluster_unverified(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size);
+
+/* Writes bytes to the given data cluster. */
+void FAT32_write_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size);
+
+/* Writes bytes to the given data cluster, leaving any cached entries in it alone. */
+void FAT32_write_cluster_uncached(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size);
+
+/* Writes a directory entry at the position of the file, like 'FAT32_fwrite'. The write is deferred to the entry cache
+ * if the entry lies within a single cluster of the file. */
+size_t FAT32_fwrite_entry(struct FAT32_file_t* file, const void* entry);
+
+/* Records that the directory starting at the given cluster has changed, making snapshots of it stale. */
+void FAT32_touch_directory(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Returns the number of changes recorded for the directory starting at the given cluster (and any others sharing its bucket). */
+uint64_t FAT32_get_directory_generation(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Opens a file as empty, to be written over, given the address of its chain. The chain is reused as the file is written, and whatever the file
+* hasn't grown into by the time it skips ahead (or is closed) is released, so none of its old contents can be read back. */
+struct FAT32_file_t* FAT32_fopen_overwrite(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Marks the entry at the given offset in the directory deleted, along with the long name slots ahead of it, leaving its chain alone.
+* Used to drop entries without going by their names, which may be damaged. */
+void FAT32_dir_delete_entry_at(struct FAT32_file_t* dir, long offset);
+
+/* A compressed file, stored as a container of compressed frames in a plain file. */
+struct FAT32_compressed_t;
+
+/* Opens a compressed file, given the address and stored size of its container. Its handle reads and writes the uncompressed bytes. */
+struct FAT32_file_t* FAT32_fopen_compressed(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t storedSize);
+
+/* Stores whatever hasn't been stored yet of a compressed file, and returns the stored size of its container. */
+uint32_t FAT32_finish_compressed(struct FAT32_file_t* file);
+
+/* Reads the container held by the given plain file, which it takes over. A damaged container leaves the file failed and empty. */
+struct FAT32_compressed_t* FAT32_compressed_open(struct FAT32_file_t* inner, uint32_t storedSize);
+
+/* Stores the last frame, the index and the header if the file has changed, and returns the stored size of the container. */
+uint32_t FAT32_compressed_finish(struct FAT32_compressed_t* file);
+
+/* Finishes the file, and closes its container. */
+void FAT32_compressed_close(struct FAT32_compressed_t* file);
+
+/* Reads and writes the uncompressed bytes of the file, like their plain counterparts. Writes are only accepted at the end of the file. */
+size_t FAT32_compressed_read(struct FAT32_compressed_t* file, void* buffer, size_t size);
+size_t FAT32_compressed_pread(struct FAT32_compressed_t* file, void* buffer, size_t size, uint32_t offset);
+size_t FAT32_compressed_write(struct FAT32_compressed_t* file, const void* buffer, size_t size);
+
+/* Truncates the file. Only emptying it is supported; returns 1 for any other size. */
+int FAT32_compressed_truncate(struct FAT32_compressed_t* file, uint32_t size);
+
+int FAT32_compressed_seek(struct FAT32_compressed_t* file, long offset, int origin);
+long FAT32_compressed_tell(const struct FAT32_compressed_t* file);
+
+/* Returns the uncompressed size of the file. */
+uint32_t FAT32_compressed_size(const struct FAT32_compressed_t* file);
+
+/* Returns the plain file holding the container. */
+struct FAT32_file_t* FAT32_compressed_inner(const struct FAT32_compressed_t* file);
+
+/* Returns whether the container turned out to be damaged, or couldn't be read. */
+int FAT32_compressed_failed(const struct FAT32_compressed_t* file);
+
+/* Sets up the directory entry cache of a mounted volume. */
+void FAT32_entry_cache_init(struct FAT32_volume_t* volume);
+
+/* Frees the directory entry cache, without writing anything back. */
+void FAT32_entry_cache_release(struct FAT32_volume_t* volume);
+
+/* Stores an entry in the cache, replacing any older version of it. Writes back the cache first if it's full. */
+void FAT32_entry_cache_put(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t slot, const void* entry);
+
+/* Copies any cached entries within the given range of a cluster over the bytes read from the device. */
+void FAT32_entry_cache_overlay(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size);
+
+/* Returns whether the cluster holds any cached entries, so its bytes on the device may be out of date. */
+int FAT32_entry_cache_holds(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Copies bytes about to be written to a cluster into any cached entries they overlap, so the cache doesn't undo them later. */
+void FAT32_entry_cache_absorb(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size);
+
+/* Forgets any cached entries in a cluster that has been freed. */
+void FAT32_entry_cache_drop(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Writes every cached entry back to the device, in cluster and slot order. */
+void FAT32_entry_cache_flush(struct FAT32_volume_t* volume);
+
+/* Like 'FAT32_entry_cache_flush', for callers that already hold 'entry_cache_mutex'. */
+void FAT32_entry_cache_flush_locked(struct FAT32_volume_t* volume);
+
+/* Returns the CRC32C (Castagnoli) of the given bytes. */
+uint32_t FAT32_crc32c(const void* bytes, size_t size);
+
+/* Sets up the cluster checksums of a mounted volume. They're loaded from the file alongside the image if it was saved
+ * when the volume was last unmounted cleanly (at the given generation), and worked out from the clusters otherwise. */
+void FAT32_checksums_open(struct FAT32_volume_t* volume, const char* path, int clean, uint32_t generation);
+
+/* Saves the checksums to the file alongside the image, marking it as up to date with the volume. */
+void FAT32_checksums_save(struct FAT32_volume_t* volume);
+
+/* Frees the checksums, without saving them. */
+void FAT32_checksums_release(struct FAT32_volume_t* volume);
+
+/* Gives a newly allocated cluster the checksum of its (zeroed) contents. */
+void FAT32_checksum_new_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Holds off other writers and checks of the cluster's checksum, while it's written. */
+void FAT32_checksum_lock(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+void FAT32_checksum_unlock(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Updates the checksum of a cluster for bytes about to be written to it, by what they change. The cluster must be locked. */
+void FAT32_checksum_write(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, const void* buffer, uint32_t size);
+
+/* Gives a cluster the checksum of another, after its contents were copied over. Copies of clusters that failed their check still fail. */
+void FAT32_checksum_copy(struct FAT32_volume_t* volume, FAT32_cluster_address_t source, FAT32_cluster_address_t target);
+
+/* Reads bytes from a cluster that hasn't been checked yet, checking the whole cluster. Returns 0 if it doesn't match its checksum. */
+int FAT32_checksum_read(struct FAT32_volume_t* volume, FAT32_cluster_address_t address, uint32_t offset, void* buffer, uint32_t size);
+
+/* Returns whether the cluster is known to match its checksum. */
+int FAT32_checksum_is_verified(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Sets up the reference counts of a mounted volume. If any were saved alongside the image, they're loaded if they were saved
+ * when the volume was last unmounted cleanly (at the given generation), and worked out from the directory tree otherwise.
+ * They're also worked out if the volume says chains are shared ('shared'), but the file they were saved to has gone. */
+void FAT32_shares_open(struct FAT32_volume_t* volume, const char* path, int clean, uint32_t generation, int shared);
+
+/* Saves the reference counts to the file alongside the image, if there is one, marking it as up to date with the volume. */
+void FAT32_shares_save(struct FAT32_volume_t* volume);
+
+/* Frees the reference counts, without saving them. */
+void FAT32_shares_release(struct FAT32_volume_t* volume);
+
+/* Returns the number of extra references to a cluster. 'share_mutex' must be held. */
+uint32_t FAT32_get_cluster_shares(const struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Adds a reference to a cluster, from a clone or a copied chain leading into it. 'share_mutex' must be held. */
+void FAT32_add_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Takes away one of the extra references to a cluster, which must have some. 'share_mutex' must be held. */
+void FAT32_remove_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Takes away a reference to a cluster, if it has any besides the one it was allocated for. Returns 0 if it had none,
+ * in which case the cluster belongs to the chain alone. */
+int FAT32_release_cluster_share(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Returns whether any cluster in the chain is shared with another file. */
+int FAT32_is_chain_shared(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
+
+/* Sets up the journal of a volume with 'journal_offset' and 'journal_size' set, and replays any transactions committed to it
+ * that may not have been written in place. Returns the number of transactions replayed. */
+int FAT32_journal_open(struct FAT32_volume_t* volume);
+
+/* Frees the journal, without writing anything. */
+void FAT32_journal_release(struct FAT32_volume_t* volume);
+
+/* Marks the start and end of an operation that changes metadata. Operations may nest. Changes are only committed once
+ * the last operation in progress ends, so each operation is replayed after a crash in full, or not at all. */
+void FAT32_journal_begin(struct FAT32_volume_t* volume);
+void FAT32_journal_end(struct FAT32_volume_t* volume);
+
+/* Waits for the operations in progress to end, then commits every change made so far. */
+void FAT32_journal_commit(struct FAT32_volume_t* volume);
+
+/* Commits every change, writes it all in place and empties the journal. Changes are written in place directly afterward. */
+void FAT32_journal_close(struct FAT32_volume_t* volume);
+
+/* Records that a run of table entries has changed, to be written by the next commit. */
+void FAT32_journal_mark_table(struct FAT32_volume_t* volume, uint32_t first, uint32_t count);
+
+/* Called before a cluster is allocated. Empties the journal if it holds writes to the cluster, so they're never replayed over its new contents. */
+void FAT32_journal_reuse_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address);
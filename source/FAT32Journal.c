@@ -0,0 +1,505 @@
+// FAT32Journal.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+
+/* Identifies the header sector of the journal, and each transaction in it. */
+#define FAT32_JOURNAL_MAGIC 0x4C4E4A46 /* "FJNL" */
+#define FAT32_JOURNAL_TRANSACTION_MAGIC 0x58544A46 /* "FJTX" */
+
+#define FAT32_JOURNAL_HEADER_SIZE 12
+#define FAT32_JOURNAL_TRANSACTION_HEADER_SIZE 20
+#define FAT32_JOURNAL_RECORD_HEADER_SIZE 16
+
+/* Kinds of journal record. */
+enum
+{
+	/* Bytes of the File Allocation Table, at an offset within each copy of it. */
+	FAT32_JOURNAL_RECORD_TABLE = 1,
+
+	/* Bytes at an offset on the device. */
+	FAT32_JOURNAL_RECORD_DATA = 2,
+
+	/* Zeroes at an offset on the device. The record carries no bytes. */
+	FAT32_JOURNAL_RECORD_ZERO = 3,
+};
+
+/* Operations are committed together once this many seconds have passed since the last commit. */
+#define FAT32_JOURNAL_COMMIT_INTERVAL 5
+
+static uint32_t get_u32(const HDByte_t* bytes)
+{
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void put_u32(HDByte_t* bytes, uint32_t value)
+{
+	bytes[0] = (HDByte_t)value;
+	bytes[1] = (HDByte_t)(value >> 8);
+	bytes[2] = (HDByte_t)(value >> 16);
+	bytes[3] = (HDByte_t)(value >> 24);
+}
+
+/* FNV-1a, continued from 'hash'. */
+static uint32_t checksum(uint32_t hash, const HDByte_t* bytes, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static int test_bit(const volatile uint64_t* bitmap, uint32_t index)
+{
+	return (FAT32_atomic_load64(&bitmap[index / 64]) >> (index % 64)) & 1;
+}
+
+static void set_bit(volatile uint64_t* bitmap, uint32_t index)
+{
+	FAT32_atomic_fetch_or64(&bitmap[index / 64], (uint64_t)1 << (index % 64));
+}
+
+/* The number of bytes of the journal that transactions can use, after the header sector. */
+static uint64_t journal_capacity(const struct FAT32_volume_t* volume)
+{
+	return volume->journal_size - volume->bytes_per_sector;
+}
+
+static uint32_t num_table_sectors(const struct FAT32_volume_t* volume)
+{
+	return (uint32_t)(((uint64_t)volume->num_entries * sizeof(FAT32_cluster_address_t) + volume->bytes_per_sector - 1) / volume->bytes_per_sector);
+}
+
+static void write_header(struct FAT32_volume_t* volume)
+{
+	HDByte_t header[FAT32_JOURNAL_HEADER_SIZE];
+	put_u32(&header[0], FAT32_JOURNAL_MAGIC);
+	put_u32(&header[4], volume->journal_epoch);
+	put_u32(&header[8], checksum(2166136261u, header, 8));
+	FAT32_device_write(&volume->device, volume->journal_offset, header, sizeof(header));
+}
+
+/* Applies the records of a transaction to the device. */
+static void apply_records(struct FAT32_volume_t* volume, const HDByte_t* records, uint32_t size)
+{
+	uint32_t pos = 0;
+	while (pos + FAT32_JOURNAL_RECORD_HEADER_SIZE <= size)
+	{
+		const uint32_t kind = get_u32(&records[pos]);
+		const uint32_t length = get_u32(&records[pos + 4]);
+		const uint64_t offset = get_u32(&records[pos + 8]) | ((uint64_t)get_u32(&records[pos + 12]) << 32);
+		const HDByte_t* data = &records[pos + FAT32_JOURNAL_RECORD_HEADER_SIZE];
+		pos += FAT32_JOURNAL_RECORD_HEADER_SIZE;
+
+		if (kind == FAT32_JOURNAL_RECORD_TABLE && pos + length <= size && offset + length <= volume->fat_size)
+		{
+			for (uint32_t fat = 0; fat < volume->num_fats; ++fat)
+			{
+				if (volume->mirror_fats || fat == volume->active_fat)
+				{
+					FAT32_device_write(&volume->device, volume->fat_offset + fat * volume->fat_size + offset, data, length);
+				}
+			}
+			pos += length;
+		}
+		else if (kind == FAT32_JOURNAL_RECORD_DATA && pos + length <= size)
+		{
+			FAT32_device_write(&volume->device, offset, data, length);
+			pos += length;
+		}
+		else if (kind == FAT32_JOURNAL_RECORD_ZERO)
+		{
+			for (uint32_t done = 0; done < length; done += volume->cluster_size)
+			{
+				const uint32_t span = length - done < volume->cluster_size ? length - done : volume->cluster_size;
+				FAT32_device_write(&volume->device, offset + done, volume->zero_cluster, span);
+			}
+		}
+		else
+		{
+			return;
+		}
+	}
+}
+
+int FAT32_journal_open(struct FAT32_volume_t* volume)
+{
+	const uint32_t bytesPerSector = volume->bytes_per_sector;
+	volume->journal_buffer = (HDByte_t*)malloc((size_t)journal_capacity(volume));
+	volume->dirty_table_sectors = (volatile uint64_t*)calloc((num_table_sectors(volume) + 63) / 64, sizeof(uint64_t));
+	volume->journaled_clusters = (volatile uint64_t*)calloc((volume->num_entries + 63) / 64, sizeof(uint64_t));
+	FAT32_mutex_init(&volume->journal_mutex);
+	FAT32_cond_init(&volume->journal_idle);
+
+	// A journal without a valid header hasn't been used yet
+	HDByte_t header[FAT32_JOURNAL_HEADER_SIZE];
+	if (!FAT32_device_read(&volume->device, volume->journal_offset, header, sizeof(header)) ||
+		get_u32(&header[0]) != FAT32_JOURNAL_MAGIC || get_u32(&header[8]) != checksum(2166136261u, header, 8))
+	{
+		volume->journal_epoch = 1;
+		write_header(volume);
+		FAT32_device_flush(&volume->device);
+		return 0;
+	}
+	volume->journal_epoch = get_u32(&header[4]);
+
+	// Replay every complete transaction of the current epoch, in order
+	uint32_t replayed = 0;
+	uint64_t pos = 0;
+	while (pos + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE <= journal_capacity(volume))
+	{
+		HDByte_t* transaction = volume->journal_buffer;
+		const uint64_t offset = volume->journal_offset + bytesPerSector + pos;
+		if (!FAT32_device_read(&volume->device, offset, transaction, FAT32_JOURNAL_TRANSACTION_HEADER_SIZE) ||
+			get_u32(&transaction[0]) != FAT32_JOURNAL_TRANSACTION_MAGIC || get_u32(&transaction[4]) != volume->journal_epoch ||
+			get_u32(&transaction[8]) != replayed)
+		{
+			break;
+		}
+
+		const uint32_t size = get_u32(&transaction[12]);
+		if (pos + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + size > journal_capacity(volume) ||
+			!FAT32_device_read(&volume->device, offset + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE, transaction + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE, size) ||
+			checksum(checksum(2166136261u, transaction, 16), transaction + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE, size) != get_u32(&transaction[16]))
+		{
+			break;
+		}
+
+		apply_records(volume, transaction + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE, size);
+		pos += (FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + size + bytesPerSector - 1) / bytesPerSector * bytesPerSector;
+		++replayed;
+	}
+
+	// Once the replayed changes are on disk, start a new epoch so they aren't replayed again
+	if (replayed > 0)
+	{
+		FAT32_device_flush(&volume->device);
+		volume->journal_epoch += 1;
+		write_header(volume);
+		FAT32_device_flush(&volume->device);
+	}
+
+	return (int)replayed;
+}
+
+void FAT32_journal_release(struct FAT32_volume_t* volume)
+{
+	if (volume->journal_buffer)
+	{
+		FAT32_mutex_destroy(&volume->journal_mutex);
+		FAT32_cond_destroy(&volume->journal_idle);
+	}
+
+	free(volume->journal_buffer);
+	free((void*)volume->dirty_table_sectors);
+	free((void*)volume->journaled_clusters);
+	volume->journal_buffer = NULL;
+	volume->dirty_table_sectors = NULL;
+	volume->journaled_clusters = NULL;
+}
+
+/* Empties the journal. Everything it holds must already have been written in place. The journal must be locked. */
+static void checkpoint_locked(struct FAT32_volume_t* volume)
+{
+	if (volume->journal_used == 0)
+	{
+		return;
+	}
+
+	// The changes have to be on disk before the transactions holding them are thrown away
+	FAT32_device_flush(&volume->device);
+	volume->journal_epoch += 1;
+	write_header(volume);
+
+	volume->journal_used = 0;
+	volume->journal_sequence = 0;
+	memset((void*)volume->journaled_clusters, 0, (volume->num_entries + 63) / 64 * sizeof(uint64_t));
+}
+
+/* Appends a record header to the transaction being built. Returns 0 if the record won't fit. */
+static int add_record(struct FAT32_volume_t* volume, uint32_t* size, uint32_t kind, uint64_t offset, const void* data, uint32_t length)
+{
+	const uint32_t dataLength = kind == FAT32_JOURNAL_RECORD_ZERO ? 0 : length;
+	if (FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + *size + FAT32_JOURNAL_RECORD_HEADER_SIZE + dataLength > journal_capacity(volume))
+	{
+		return 0;
+	}
+
+	HDByte_t* record = volume->journal_buffer + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + *size;
+	put_u32(&record[0], kind);
+	put_u32(&record[4], length);
+	put_u32(&record[8], (uint32_t)offset);
+	put_u32(&record[12], (uint32_t)(offset >> 32));
+	if (dataLength > 0)
+	{
+		memcpy(record + FAT32_JOURNAL_RECORD_HEADER_SIZE, data, dataLength);
+	}
+
+	*size += FAT32_JOURNAL_RECORD_HEADER_SIZE + dataLength;
+	return 1;
+}
+
+/* Builds a transaction out of everything that has changed since the last commit. Returns 0 if it won't fit in the journal. */
+static int build_transaction(struct FAT32_volume_t* volume, uint32_t* outSize)
+{
+	const uint32_t bytesPerSector = volume->bytes_per_sector;
+	const uint64_t tableSize = (uint64_t)volume->num_entries * sizeof(FAT32_cluster_address_t);
+	uint32_t size = 0;
+
+	// The changed sectors of the table
+	for (uint32_t sector = 0; sector < num_table_sectors(volume); ++sector)
+	{
+		if (test_bit(volume->dirty_table_sectors, sector))
+		{
+			const uint64_t offset = (uint64_t)sector * bytesPerSector;
+			const uint32_t length = (uint32_t)(tableSize - offset < bytesPerSector ? tableSize - offset : bytesPerSector);
+			if (!add_record(volume, &size, FAT32_JOURNAL_RECORD_TABLE, offset, (const HDByte_t*)volume->table + offset, length))
+			{
+				return 0;
+			}
+		}
+	}
+
+	// The changed directory entries, a run of slots at a time
+	uint32_t pos = 0;
+	while (pos < volume->num_cached_entries)
+	{
+		const struct FAT32_cached_entry_t* first = &volume->cached_entries[pos];
+		FAT32_cluster_address_t address;
+		address.index = first->cluster;
+
+		// A cluster that has never been written has to be zeroed first, or replaying the entries would leave garbage around them
+		if ((pos == 0 || volume->cached_entries[pos - 1].cluster != first->cluster) && FAT32_is_unzeroed(volume, address.index) &&
+			!add_record(volume, &size, FAT32_JOURNAL_RECORD_ZERO, FAT32_get_cluster_offset(volume, address), NULL, volume->cluster_size))
+		{
+			return 0;
+		}
+
+		uint32_t length = 0;
+		do
+		{
+			memcpy(volume->entry_run + length * FAT32_ENTRY_SLOT_SIZE, volume->cached_entries[pos + length].data, FAT32_ENTRY_SLOT_SIZE);
+			++length;
+		} while (pos + length < volume->num_cached_entries && volume->cached_entries[pos + length].cluster == first->cluster &&
+			volume->cached_entries[pos + length].slot == first->slot + length);
+
+		if (!add_record(volume, &size, FAT32_JOURNAL_RECORD_DATA, FAT32_get_cluster_offset(volume, address) + first->slot * FAT32_ENTRY_SLOT_SIZE,
+			volume->entry_run, length * FAT32_ENTRY_SLOT_SIZE))
+		{
+			return 0;
+		}
+
+		pos += length;
+	}
+
+	*outSize = size;
+	return 1;
+}
+
+/* Writes everything that has changed since the last commit in place, and forgets about it. */
+static void apply_changes(struct FAT32_volume_t* volume, int journaled)
+{
+	const uint32_t entriesPerSector = volume->bytes_per_sector / sizeof(FAT32_cluster_address_t);
+
+	for (uint32_t sector = 0; sector < num_table_sectors(volume); ++sector)
+	{
+		if (test_bit(volume->dirty_table_sectors, sector))
+		{
+			const uint32_t first = sector * entriesPerSector;
+			const uint32_t count = volume->num_entries - first < entriesPerSector ? volume->num_entries - first : entriesPerSector;
+			FAT32_write_table_copies(volume, first, count);
+		}
+	}
+	memset((void*)volume->dirty_table_sectors, 0, (num_table_sectors(volume) + 63) / 64 * sizeof(uint64_t));
+	volume->journal_dirty_sectors = 0;
+
+	// Clusters the journal has written to mustn't be reused until it's emptied, or replaying it could overwrite them
+	if (journaled)
+	{
+		for (uint32_t pos = 0; pos < volume->num_cached_entries; ++pos)
+		{
+			set_bit(volume->journaled_clusters, volume->cached_entries[pos].cluster);
+		}
+	}
+
+	FAT32_entry_cache_flush_locked(volume);
+}
+
+/* Zeroes the clusters handed out by the changed sectors of the table that have never been written, in place. Their entries are about
+ * to be committed, and a crash afterward mustn't expose whatever the clusters held before. Zero records won't do, since replaying
+ * them would also wipe anything written to the clusters after the commit. Returns whether any were zeroed. */
+static int zero_new_clusters(struct FAT32_volume_t* volume)
+{
+	const uint32_t entriesPerSector = volume->bytes_per_sector / sizeof(FAT32_cluster_address_t);
+	int zeroed = 0;
+
+	for (uint32_t sector = 0; sector < num_table_sectors(volume); ++sector)
+	{
+		if (!test_bit(volume->dirty_table_sectors, sector))
+		{
+			continue;
+		}
+
+		const uint32_t first = sector * entriesPerSector;
+		const uint32_t last = volume->num_entries - first < entriesPerSector ? volume->num_entries : first + entriesPerSector;
+		for (uint32_t index = first; index < last; ++index)
+		{
+			if (FAT32_is_unzeroed(volume, index))
+			{
+				FAT32_cluster_address_t address;
+				address.index = index;
+				FAT32_write_cluster_uncached(volume, address, 0, volume->zero_cluster, volume->cluster_size);
+				zeroed = 1;
+			}
+		}
+	}
+
+	return zeroed;
+}
+
+/* Commits everything that has changed since the last commit. The journal must be locked, with no operations in progress. */
+static void commit_locked(struct FAT32_volume_t* volume)
+{
+	volume->journal_commit_tick = FAT32_get_clock(volume).tick;
+
+	FAT32_mutex_lock(&volume->entry_cache_mutex);
+	if (volume->journal_dirty_sectors == 0 && volume->num_cached_entries == 0)
+	{
+		FAT32_mutex_unlock(&volume->entry_cache_mutex);
+		return;
+	}
+
+	// The zeroes have to be on the disk before the table entries that hand out the clusters
+	if (zero_new_clusters(volume))
+	{
+		FAT32_device_flush(&volume->device);
+	}
+
+	uint32_t size;
+	if (!build_transaction(volume, &size))
+	{
+		// Too big for the journal, so write it in place. The old transactions mustn't be replayed over it afterward.
+		checkpoint_locked(volume);
+		apply_changes(volume, 0);
+		FAT32_mutex_unlock(&volume->entry_cache_mutex);
+		FAT32_device_flush(&volume->device);
+		return;
+	}
+
+	// Make room for the transaction
+	const uint32_t bytesPerSector = volume->bytes_per_sector;
+	const uint64_t paddedSize = (FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + size + bytesPerSector - 1) / bytesPerSector * bytesPerSector;
+	if (volume->journal_used + paddedSize > journal_capacity(volume))
+	{
+		checkpoint_locked(volume);
+	}
+
+	HDByte_t* header = volume->journal_buffer;
+	put_u32(&header[0], FAT32_JOURNAL_TRANSACTION_MAGIC);
+	put_u32(&header[4], volume->journal_epoch);
+	put_u32(&header[8], volume->journal_sequence);
+	put_u32(&header[12], size);
+	put_u32(&header[16], checksum(checksum(2166136261u, header, 16), header + FAT32_JOURNAL_TRANSACTION_HEADER_SIZE, size));
+
+	// A single flush makes the whole group of operations durable, along with any file contents written before it
+	FAT32_device_write(&volume->device, volume->journal_offset + bytesPerSector + volume->journal_used, header, FAT32_JOURNAL_TRANSACTION_HEADER_SIZE + size);
+	FAT32_device_flush(&volume->device);
+	volume->journal_used += paddedSize;
+	volume->journal_sequence += 1;
+
+	// Now it's safe to write the changes in place. They don't need flushing, since the journal can replay them.
+	apply_changes(volume, 1);
+	FAT32_mutex_unlock(&volume->entry_cache_mutex);
+}
+
+void FAT32_journal_begin(struct FAT32_volume_t* volume)
+{
+	if (!volume->journal_active)
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->journal_mutex);
+	volume->journal_depth += 1;
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
+
+void FAT32_journal_end(struct FAT32_volume_t* volume)
+{
+	if (!volume->journal_active)
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->journal_mutex);
+	volume->journal_depth -= 1;
+
+	if (volume->journal_depth == 0)
+	{
+		FAT32_cond_broadcast(&volume->journal_idle);
+
+		// Commit once enough has piled up, or it's been waiting long enough
+		const uint64_t pending = (uint64_t)volume->journal_dirty_sectors * (volume->bytes_per_sector + FAT32_JOURNAL_RECORD_HEADER_SIZE) +
+			(uint64_t)volume->num_cached_entries * (FAT32_ENTRY_SLOT_SIZE + FAT32_JOURNAL_RECORD_HEADER_SIZE);
+		if (pending >= journal_capacity(volume) / 2 || FAT32_get_clock(volume).tick - volume->journal_commit_tick >= FAT32_JOURNAL_COMMIT_INTERVAL)
+		{
+			commit_locked(volume);
+		}
+	}
+
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
+
+void FAT32_journal_commit(struct FAT32_volume_t* volume)
+{
+	FAT32_mutex_lock(&volume->journal_mutex);
+	while (volume->journal_depth > 0)
+	{
+		FAT32_cond_wait(&volume->journal_idle, &volume->journal_mutex);
+	}
+
+	commit_locked(volume);
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
+
+void FAT32_journal_close(struct FAT32_volume_t* volume)
+{
+	FAT32_journal_commit(volume);
+
+	FAT32_mutex_lock(&volume->journal_mutex);
+	checkpoint_locked(volume);
+	volume->journal_active = 0;
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
+
+void FAT32_journal_mark_table(struct FAT32_volume_t* volume, uint32_t first, uint32_t count)
+{
+	const uint32_t entriesPerSector = volume->bytes_per_sector / sizeof(FAT32_cluster_address_t);
+	const uint32_t last = (first + count - 1) / entriesPerSector;
+
+	FAT32_mutex_lock(&volume->journal_mutex);
+	for (uint32_t sector = first / entriesPerSector; sector <= last; ++sector)
+	{
+		if (!test_bit(volume->dirty_table_sectors, sector))
+		{
+			set_bit(volume->dirty_table_sectors, sector);
+			volume->journal_dirty_sectors += 1;
+		}
+	}
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
+
+void FAT32_journal_reuse_cluster(struct FAT32_volume_t* volume, FAT32_cluster_address_t address)
+{
+	if (!volume->journal_active || !test_bit(volume->journaled_clusters, address.index))
+	{
+		return;
+	}
+
+	FAT32_mutex_lock(&volume->journal_mutex);
+	checkpoint_locked(volume);
+	FAT32_mutex_unlock(&volume->journal_mutex);
+}
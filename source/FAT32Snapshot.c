@@ -0,0 +1,168 @@
+// FAT32Snapshot.c
+
+#include <stdlib.h>
+#include <string.h>
+#include "FAT32Internal.h"
+#include "../include/FAT32Snapshot.h"
+
+/* The number of entries a new snapshot has room for. */
+#define FAT32_SNAPSHOT_INITIAL_CAPACITY 64
+
+static void grow_snapshot(struct FAT32_dir_snapshot_t* snapshot)
+{
+	snapshot->capacity = snapshot->capacity ? snapshot->capacity * 2 : FAT32_SNAPSHOT_INITIAL_CAPACITY;
+	snapshot->names = (char(*)[FAT32_SNAPSHOT_NAME_LEN])realloc(snapshot->names, (size_t)snapshot->capacity * FAT32_SNAPSHOT_NAME_LEN);
+	snapshot->attribs = (FAT32_dir_entry_attribs_t*)realloc(snapshot->attribs, snapshot->capacity * sizeof(FAT32_dir_entry_attribs_t));
+	snapshot->sizes = (uint32_t*)realloc(snapshot->sizes, snapshot->capacity * sizeof(uint32_t));
+	snapshot->first_clusters = (uint32_t*)realloc(snapshot->first_clusters, snapshot->capacity * sizeof(uint32_t));
+	snapshot->slots = (uint32_t*)realloc(snapshot->slots, snapshot->capacity * sizeof(uint32_t));
+}
+
+static void take_snapshot(struct FAT32_dir_snapshot_t* snapshot, struct FAT32_file_t* dir)
+{
+	struct FAT32_directory_entry_t slots[FAT32_DIR_BATCH_SLOTS];
+
+	// Note the generation first, so changes made while we read make the snapshot stale rather than being missed
+	snapshot->volume = FAT32_fvolume(dir);
+	snapshot->directory = FAT32_faddress(dir);
+	snapshot->generation = FAT32_get_directory_generation(snapshot->volume, snapshot->directory);
+	snapshot->num_entries = 0;
+
+	FAT32_fseek(dir, 0, FAT32_SEEK_SET);
+
+	uint32_t slot = 0;
+	size_t numSlots;
+	while ((numSlots = FAT32_fread(slots, sizeof(struct FAT32_directory_entry_t), FAT32_DIR_BATCH_SLOTS, dir)) > 0)
+	{
+		for (size_t i = 0; i < numSlots; ++i, ++slot)
+		{
+			const struct FAT32_directory_entry_t* entry = &slots[i];
+
+			// Skip free slots, long name slots and volume labels
+			if (entry->name[0] == 0 || (uint8_t)entry->name[0] == FAT32_DIR_ENTRY_DELETED ||
+				(entry->attribs & 0x3F) == FAT32_DIR_ENTRY_ATTRIB_LONG_NAME || (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_VOLUME_ID))
+			{
+				continue;
+			}
+
+			if (snapshot->num_entries == snapshot->capacity)
+			{
+				grow_snapshot(snapshot);
+			}
+
+			const uint32_t index = snapshot->num_entries++;
+			memcpy(snapshot->names[index], entry->name, FAT32_SNAPSHOT_NAME_LEN);
+			snapshot->attribs[index] = entry->attribs;
+			snapshot->sizes[index] = entry->size;
+			snapshot->first_clusters[index] = FAT32_dir_get_entry_address(entry).index;
+			snapshot->slots[index] = slot;
+		}
+	}
+}
+
+struct FAT32_dir_snapshot_t* FAT32_dir_snapshot_create(struct FAT32_file_t* dir)
+{
+	struct FAT32_dir_snapshot_t* snapshot = (struct FAT32_dir_snapshot_t*)calloc(1, sizeof(struct FAT32_dir_snapshot_t));
+	take_snapshot(snapshot, dir);
+
+	return snapshot;
+}
+
+int FAT32_dir_snapshot_is_stale(const struct FAT32_dir_snapshot_t* snapshot)
+{
+	return FAT32_get_directory_generation(snapshot->volume, snapshot->directory) != snapshot->generation;
+}
+
+int FAT32_dir_snapshot_refresh(struct FAT32_dir_snapshot_t* snapshot, struct FAT32_file_t* dir)
+{
+	// A different directory is always taken again
+	if (FAT32_fvolume(dir) == snapshot->volume && FAT32_faddress(dir).index == snapshot->directory.index && !FAT32_dir_snapshot_is_stale(snapshot))
+	{
+		return 0;
+	}
+
+	take_snapshot(snapshot, dir);
+	return 1;
+}
+
+void FAT32_dir_snapshot_free(struct FAT32_dir_snapshot_t* snapshot)
+{
+	if (!snapshot)
+	{
+		return;
+	}
+
+	free(snapshot->names);
+	free(snapshot->attribs);
+	free(snapshot->sizes);
+	free(snapshot->first_clusters);
+	free(snapshot->slots);
+	free(snapshot);
+}
+
+uint32_t FAT32_dir_snapshot_filter_attribs(const struct FAT32_dir_snapshot_t* snapshot, FAT32_dir_entry_attribs_t mask, FAT32_dir_entry_attribs_t value, uint32_t* outIndices)
+{
+	const FAT32_dir_entry_attribs_t* attribs = snapshot->attribs;
+	const uint32_t numEntries = snapshot->num_entries;
+
+	// Every index is written, and only the matching ones are kept, so the loop doesn't branch on the data
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < numEntries; ++i)
+	{
+		outIndices[count] = i;
+		count += (attribs[i] & mask) == value;
+	}
+
+	return count;
+}
+
+uint32_t FAT32_dir_snapshot_filter_size(const struct FAT32_dir_snapshot_t* snapshot, uint32_t minSize, uint32_t* outIndices)
+{
+	const uint32_t* sizes = snapshot->sizes;
+	const uint32_t numEntries = snapshot->num_entries;
+
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < numEntries; ++i)
+	{
+		outIndices[count] = i;
+		count += sizes[i] >= minSize;
+	}
+
+	return count;
+}
+
+int32_t FAT32_dir_snapshot_find(const struct FAT32_dir_snapshot_t* snapshot, const char* shortName)
+{
+	// Pack the name the way it's stored. Names that don't fit can't match anything.
+	char packed[FAT32_SNAPSHOT_NAME_LEN];
+	memset(packed, ' ', FAT32_SNAPSHOT_NAME_LEN);
+
+	uint32_t pos = 0;
+	uint32_t end = 8;
+	for (; *shortName != 0; ++shortName)
+	{
+		if (*shortName == '.' && end == 8)
+		{
+			pos = 8;
+			end = FAT32_SNAPSHOT_NAME_LEN;
+		}
+		else if (pos == end)
+		{
+			return -1;
+		}
+		else
+		{
+			packed[pos++] = *shortName;
+		}
+	}
+
+	for (uint32_t i = 0; i < snapshot->num_entries; ++i)
+	{
+		if (memcmp(snapshot->names[i], packed, FAT32_SNAPSHOT_NAME_LEN) == 0)
+		{
+			return (int32_t)i;
+		}
+	}
+
+	return -1;
+}
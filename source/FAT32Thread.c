@@ -0,0 +1,200 @@
+// FAT32Thread.c
+
+#include <stdlib.h>
+#include "FAT32Thread.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#endif
+
+struct thread_start_t
+{
+	FAT32_thread_func_t func;
+	void* userData;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID param)
+#else
+static void* thread_main(void* param)
+#endif
+{
+	struct thread_start_t start = *(struct thread_start_t*)param;
+	free(param);
+
+	start.func(start.userData);
+	return 0;
+}
+
+int FAT32_thread_create(FAT32_thread_t* outThread, FAT32_thread_func_t func, void* userData)
+{
+	struct thread_start_t* start = (struct thread_start_t*)malloc(sizeof(struct thread_start_t));
+	start->func = func;
+	start->userData = userData;
+
+#ifdef _WIN32
+	*outThread = CreateThread(NULL, 0, &thread_main, start, 0, NULL);
+	if (*outThread == NULL)
+#else
+	if (pthread_create(outThread, NULL, &thread_main, start) != 0)
+#endif
+	{
+		free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+void FAT32_thread_join(FAT32_thread_t thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+uint32_t FAT32_thread_hardware_concurrency(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+uint64_t FAT32_monotonic_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void FAT32_mutex_init(FAT32_mutex_t* mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void FAT32_mutex_destroy(FAT32_mutex_t* mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void FAT32_mutex_lock(FAT32_mutex_t* mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void FAT32_mutex_unlock(FAT32_mutex_t* mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void FAT32_cond_init(FAT32_cond_t* cond)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void FAT32_cond_destroy(FAT32_cond_t* cond)
+{
+#ifndef _WIN32
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void FAT32_cond_wait(FAT32_cond_t* cond, FAT32_mutex_t* mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void FAT32_cond_signal(FAT32_cond_t* cond)
+{
+#ifdef _WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void FAT32_cond_broadcast(FAT32_cond_t* cond)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+uint64_t FAT32_atomic_load64(const volatile uint64_t* target)
+{
+#ifdef _WIN32
+	return (uint64_t)InterlockedCompareExchange64((volatile LONG64*)target, 0, 0);
+#else
+	return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+#endif
+}
+
+uint64_t FAT32_atomic_fetch_or64(volatile uint64_t* target, uint64_t value)
+{
+#ifdef _WIN32
+	return (uint64_t)InterlockedOr64((volatile LONG64*)target, (LONG64)value);
+#else
+	return __atomic_fetch_or(target, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+uint64_t FAT32_atomic_fetch_and64(volatile uint64_t* target, uint64_t value)
+{
+#ifdef _WIN32
+	return (uint64_t)InterlockedAnd64((volatile LONG64*)target, (LONG64)value);
+#else
+	return __atomic_fetch_and(target, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+uint64_t FAT32_atomic_fetch_add64(volatile uint64_t* target, uint64_t value)
+{
+#ifdef _WIN32
+	return (uint64_t)InterlockedExchangeAdd64((volatile LONG64*)target, (LONG64)value);
+#else
+	return __atomic_fetch_add(target, value, __ATOMIC_ACQ_REL);
+#endif
+}
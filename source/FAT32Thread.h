@@ -0,0 +1,58 @@
+// FAT32Thread.h
+#pragma once
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE FAT32_thread_t;
+typedef CRITICAL_SECTION FAT32_mutex_t;
+typedef CONDITION_VARIABLE FAT32_cond_t;
+#else
+#include <pthread.h>
+
+typedef pthread_t FAT32_thread_t;
+typedef pthread_mutex_t FAT32_mutex_t;
+typedef pthread_cond_t FAT32_cond_t;
+#endif
+
+/* Function run on a new thread. */
+typedef void(*FAT32_thread_func_t)(void* userData);
+
+/* Starts a new thread running 'func'. Returns 0 on failure. */
+int FAT32_thread_create(FAT32_thread_t* outThread, FAT32_thread_func_t func, void* userData);
+
+/* Waits for the given thread to finish. */
+void FAT32_thread_join(FAT32_thread_t thread);
+
+/* Returns the number of hardware threads available to the process. */
+uint32_t FAT32_thread_hardware_concurrency(void);
+
+/* Returns the time in nanoseconds on a clock that only moves forward, for timing things. */
+uint64_t FAT32_monotonic_ns(void);
+
+void FAT32_mutex_init(FAT32_mutex_t* mutex);
+void FAT32_mutex_destroy(FAT32_mutex_t* mutex);
+void FAT32_mutex_lock(FAT32_mutex_t* mutex);
+void FAT32_mutex_unlock(FAT32_mutex_t* mutex);
+
+void FAT32_cond_init(FAT32_cond_t* cond);
+void FAT32_cond_destroy(FAT32_cond_t* cond);
+
+/* Releases 'mutex' and waits for the condition to be signalled, then reacquires 'mutex'. */
+void FAT32_cond_wait(FAT32_cond_t* cond, FAT32_mutex_t* mutex);
+void FAT32_cond_signal(FAT32_cond_t* cond);
+void FAT32_cond_broadcast(FAT32_cond_t* cond);
+
+/* Atomically reads 'target'. Writes made before a 'FAT32_atomic_fetch_or64' on the same target are visible afterward. */
+uint64_t FAT32_atomic_load64(const volatile uint64_t* target);
+
+/* Atomically ORs 'value' into 'target', and returns the previous value. */
+uint64_t FAT32_atomic_fetch_or64(volatile uint64_t* target, uint64_t value);
+
+/* Atomically ANDs 'value' into 'target', and returns the previous value. */
+uint64_t FAT32_atomic_fetch_and64(volatile uint64_t* target, uint64_t value);
+
+/* Atomically adds 'value' to 'target', and returns the previous value. */
+uint64_t FAT32_atomic_fetch_add64(volatile uint64_t* target, uint64_t value);
@@ -0,0 +1,502 @@
+// FAT32Transfer.c
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "FAT32Internal.h"
+#include "FAT32Thread.h"
+#include "../include/FAT32Transfer.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <dirent.h>
+#endif
+
+/* The maximum length of a host path. */
+#define FAT32_TRANSFER_PATH_LEN 1024
+
+/* The number of files that may be waiting to be copied before the tree walk waits for the workers to catch up. */
+#define FAT32_TRANSFER_QUEUE_LEN 256
+
+/* The number of bytes each worker copies at a time. */
+#define FAT32_TRANSFER_BUFFER_SIZE (1024 * 1024)
+
+/* A file whose entry exists on both sides, waiting to have its contents copied. */
+struct transfer_job_t
+{
+	/* The entry of the file in the volume. Its chain is already the right length when importing. */
+	struct FAT32_directory_entry_t entry;
+
+	char path[FAT32_TRANSFER_PATH_LEN];
+};
+
+struct transfer_state_t
+{
+	/* The volume being copied into or out of. */
+	struct FAT32_volume_t* volume;
+
+	/* Set when copying from the host into the volume, rather than out of it. */
+	int importing;
+
+	/* The number of worker threads. If there are none, files are copied as they're found. */
+	uint32_t num_workers;
+
+	/* Protects everything below. */
+	FAT32_mutex_t mutex;
+
+	/* Signalled when a job is queued, or when the walk is over. */
+	FAT32_cond_t queued;
+
+	/* Signalled when a job is taken from the queue. */
+	FAT32_cond_t taken;
+
+	/* A ring of jobs, starting at 'queue_head'. */
+	struct transfer_job_t* queue;
+	uint32_t queue_head;
+	uint32_t queue_len;
+
+	/* Set once the whole tree has been walked, so the workers leave when the queue runs dry. */
+	int walked;
+
+	struct FAT32_transfer_report_t report;
+};
+
+/* Joins a directory path and a name. Returns 0 if the result doesn't fit. */
+static int join_path(char* outPath, const char* dirPath, const char* name)
+{
+	const int length = snprintf(outPath, FAT32_TRANSFER_PATH_LEN, "%s/%s", dirPath, name);
+	return length > 0 && length < FAT32_TRANSFER_PATH_LEN;
+}
+
+static void add_failure(struct transfer_state_t* state)
+{
+	FAT32_mutex_lock(&state->mutex);
+	state->report.num_failed += 1;
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+/* Copies a host file into the preallocated chain of its entry. Returns whether all of it was copied. */
+static int import_file(struct transfer_state_t* state, const struct transfer_job_t* job, HDByte_t* buffer, uint64_t* outBytes)
+{
+	struct FAT32_device_t host;
+	if (!FAT32_device_open_readonly(&host, job->path))
+	{
+		return 0;
+	}
+
+	// The file may have changed since it was sized, but it can't grow past its chain
+	const uint32_t size = job->entry.size;
+	struct FAT32_file_t* file = FAT32_fopen(state->volume, FAT32_dir_get_entry_address(&job->entry), size);
+
+	uint32_t done = 0;
+	while (done < size)
+	{
+		const uint32_t span = size - done < FAT32_TRANSFER_BUFFER_SIZE ? size - done : FAT32_TRANSFER_BUFFER_SIZE;
+		if (!FAT32_device_read(&host, done, buffer, span) || FAT32_pwrite(file, buffer, span, done) != span)
+		{
+			break;
+		}
+
+		done += span;
+	}
+
+	FAT32_fclose(file);
+	FAT32_device_close(&host);
+
+	*outBytes = done;
+	return done == size;
+}
+
+/* Copies a file out of the volume into a host file created at its full size. Returns whether all of it was copied. */
+static int export_file(struct transfer_state_t* state, const struct transfer_job_t* job, HDByte_t* buffer, uint64_t* outBytes)
+{
+	struct FAT32_directory_entry_t entry = job->entry;
+	struct FAT32_file_t* file = FAT32_dir_open_entry(state->volume, &entry);
+
+	// Compressed files hold more than the size they're stored at
+	uint32_t size = entry.size;
+	if (entry.flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		FAT32_fseek(file, 0, FAT32_SEEK_END);
+		size = (uint32_t)FAT32_ftell(file);
+		FAT32_rewind(file);
+	}
+
+	struct FAT32_device_t host;
+	if (!FAT32_device_create(&host, job->path, size))
+	{
+		FAT32_fclose(file);
+		return 0;
+	}
+
+	uint32_t done = 0;
+	while (done < size)
+	{
+		const uint32_t span = size - done < FAT32_TRANSFER_BUFFER_SIZE ? size - done : FAT32_TRANSFER_BUFFER_SIZE;
+		if (FAT32_pread(file, buffer, span, done) != span || !FAT32_device_write(&host, done, buffer, span))
+		{
+			break;
+		}
+
+		done += span;
+	}
+
+	FAT32_device_close(&host);
+	FAT32_fclose(file);
+
+	*outBytes = done;
+	return done == size;
+}
+
+/* Copies the contents of one file, and records how it went. */
+static void run_job(struct transfer_state_t* state, const struct transfer_job_t* job, HDByte_t* buffer)
+{
+	uint64_t bytes = 0;
+	const int copied = state->importing ? import_file(state, job, buffer, &bytes) : export_file(state, job, buffer, &bytes);
+
+	FAT32_mutex_lock(&state->mutex);
+	state->report.num_bytes += bytes;
+	if (copied)
+	{
+		state->report.num_files += 1;
+	}
+	else
+	{
+		state->report.num_failed += 1;
+	}
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+/* Queues a file to be copied, waiting for room in the queue if the workers have fallen behind. */
+static void push_job(struct transfer_state_t* state, const struct transfer_job_t* job)
+{
+	if (state->num_workers == 0)
+	{
+		HDByte_t* buffer = (HDByte_t*)malloc(FAT32_TRANSFER_BUFFER_SIZE);
+		run_job(state, job, buffer);
+		free(buffer);
+		return;
+	}
+
+	FAT32_mutex_lock(&state->mutex);
+	while (state->queue_len == FAT32_TRANSFER_QUEUE_LEN)
+	{
+		FAT32_cond_wait(&state->taken, &state->mutex);
+	}
+
+	state->queue[(state->queue_head + state->queue_len) % FAT32_TRANSFER_QUEUE_LEN] = *job;
+	state->queue_len += 1;
+
+	FAT32_cond_signal(&state->queued);
+	FAT32_mutex_unlock(&state->mutex);
+}
+
+static void transfer_worker(void* userData)
+{
+	struct transfer_state_t* state = (struct transfer_state_t*)userData;
+	HDByte_t* buffer = (HDByte_t*)malloc(FAT32_TRANSFER_BUFFER_SIZE);
+	struct transfer_job_t* job = (struct transfer_job_t*)malloc(sizeof(struct transfer_job_t));
+
+	FAT32_mutex_lock(&state->mutex);
+	while (1)
+	{
+		if (state->queue_len > 0)
+		{
+			*job = state->queue[state->queue_head];
+			state->queue_head = (state->queue_head + 1) % FAT32_TRANSFER_QUEUE_LEN;
+			state->queue_len -= 1;
+			FAT32_cond_signal(&state->taken);
+			FAT32_mutex_unlock(&state->mutex);
+
+			run_job(state, job, buffer);
+
+			FAT32_mutex_lock(&state->mutex);
+			continue;
+		}
+
+		// Nothing left to do, and nothing more coming
+		if (state->walked)
+		{
+			break;
+		}
+
+		FAT32_cond_wait(&state->queued, &state->mutex);
+	}
+	FAT32_mutex_unlock(&state->mutex);
+
+	free(job);
+	free(buffer);
+}
+
+/* Lists the names in a host directory, other than '.' and '..'. Returns NULL if it can't be read. */
+static char** list_host_directory(const char* path, uint32_t* outCount)
+{
+	uint32_t count = 0;
+	uint32_t capacity = 16;
+	char** names = (char**)malloc(sizeof(char*) * capacity);
+
+#ifdef _WIN32
+	char pattern[FAT32_TRANSFER_PATH_LEN];
+	WIN32_FIND_DATAA found;
+	HANDLE find = join_path(pattern, path, "*") ? FindFirstFileA(pattern, &found) : INVALID_HANDLE_VALUE;
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		free(names);
+		return NULL;
+	}
+
+	do
+	{
+		const char* name = found.cFileName;
+#else
+	DIR* host = opendir(path);
+	if (!host)
+	{
+		free(names);
+		return NULL;
+	}
+
+	const struct dirent* found;
+	while ((found = readdir(host)) != NULL)
+	{
+		const char* name = found->d_name;
+#endif
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (count == capacity)
+		{
+			capacity *= 2;
+			names = (char**)realloc(names, sizeof(char*) * capacity);
+		}
+
+		const size_t length = strlen(name) + 1;
+		names[count] = (char*)malloc(length);
+		memcpy(names[count], name, length);
+		++count;
+#ifdef _WIN32
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+#else
+	}
+	closedir(host);
+#endif
+
+	*outCount = count;
+	return names;
+}
+
+/* Creates a file in the volume with a chain long enough to hold 'size' bytes, and queues its contents to be copied. */
+static int import_new_file(struct transfer_state_t* state, struct FAT32_file_t* dir, const char* name, const char* path, uint64_t size)
+{
+	struct FAT32_volume_t* volume = state->volume;
+	struct transfer_job_t job;
+
+	// Files can't be larger than 4GB, nor larger than the space that's left
+	const uint64_t numClusters = (size + volume->cluster_size - 1) >> volume->cluster_shift;
+	if (size > UINT32_MAX || numClusters >= volume->free_count || FAT32_dir_get_entry(dir, name, &job.entry))
+	{
+		return 0;
+	}
+
+	// The entry's whole chain is allocated along with it
+	if (!FAT32_dir_new_file(dir, name, FAT32_DIR_ENTRY_ATTRIB_ARCHIVE, (uint32_t)size, &job.entry))
+	{
+		return 0;
+	}
+
+	// Empty files have nothing to copy
+	if (size == 0)
+	{
+		FAT32_mutex_lock(&state->mutex);
+		state->report.num_files += 1;
+		FAT32_mutex_unlock(&state->mutex);
+		return 1;
+	}
+
+	snprintf(job.path, FAT32_TRANSFER_PATH_LEN, "%s", path);
+	push_job(state, &job);
+	return 1;
+}
+
+/* Creates the entries for the contents of a host directory, recursing into its subdirectories. */
+static void import_directory(struct transfer_state_t* state, struct FAT32_file_t* dir, const char* hostPath)
+{
+	uint32_t numNames = 0;
+	char** names = list_host_directory(hostPath, &numNames);
+	if (!names)
+	{
+		add_failure(state);
+		return;
+	}
+
+	for (uint32_t i = 0; i < numNames; ++i)
+	{
+		char path[FAT32_TRANSFER_PATH_LEN];
+#ifdef _WIN32
+		struct _stat64 info;
+		const int found = join_path(path, hostPath, names[i]) && _stat64(path, &info) == 0;
+#else
+		struct stat info;
+		const int found = join_path(path, hostPath, names[i]) && stat(path, &info) == 0;
+#endif
+
+		if (!found)
+		{
+			add_failure(state);
+		}
+		else if ((info.st_mode & S_IFMT) == S_IFDIR)
+		{
+			// Merge into the directory if it's already there
+			struct FAT32_directory_entry_t entry;
+			const int exists = FAT32_dir_get_entry(dir, names[i], &entry);
+			if ((exists && (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0) || (!exists && !FAT32_dir_new_directory(dir, names[i], &entry)))
+			{
+				add_failure(state);
+			}
+			else
+			{
+				FAT32_mutex_lock(&state->mutex);
+				state->report.num_directories += 1;
+				FAT32_mutex_unlock(&state->mutex);
+
+				struct FAT32_file_t* subdir = FAT32_dir_open_entry(state->volume, &entry);
+				import_directory(state, subdir, path);
+				FAT32_fclose(subdir);
+			}
+		}
+		else if ((info.st_mode & S_IFMT) == S_IFREG && !import_new_file(state, dir, names[i], path, (uint64_t)info.st_size))
+		{
+			add_failure(state);
+		}
+
+		free(names[i]);
+	}
+
+	free(names);
+}
+
+/* Creates a host directory, unless it's already there. */
+static int make_host_directory(const char* path)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	return _mkdir(path) == 0 || (_stat64(path, &info) == 0 && ((info.st_mode & S_IFMT) == S_IFDIR));
+#else
+	struct stat info;
+	return mkdir(path, 0755) == 0 || (stat(path, &info) == 0 && ((info.st_mode & S_IFMT) == S_IFDIR));
+#endif
+}
+
+/* Creates the host directory for a directory in the volume, and queues its files, recursing into its subdirectories. */
+static void export_directory(struct transfer_state_t* state, struct FAT32_file_t* dir, const char* hostPath)
+{
+	if (!make_host_directory(hostPath))
+	{
+		add_failure(state);
+		return;
+	}
+
+	struct transfer_job_t job;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	while (FAT32_dir_read_entry(dir, &job.entry, name))
+	{
+		// Skip the links to this directory and its parent, and volume labels
+		if (FAT32_dir_is_dot_entry(&job.entry) || (job.entry.attribs & FAT32_DIR_ENTRY_ATTRIB_VOLUME_ID))
+		{
+			continue;
+		}
+
+		if (!join_path(job.path, hostPath, name))
+		{
+			add_failure(state);
+		}
+		else if (job.entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+		{
+			FAT32_mutex_lock(&state->mutex);
+			state->report.num_directories += 1;
+			FAT32_mutex_unlock(&state->mutex);
+
+			struct FAT32_file_t* subdir = FAT32_dir_open_entry(state->volume, &job.entry);
+			export_directory(state, subdir, job.path);
+			FAT32_fclose(subdir);
+		}
+		else
+		{
+			push_job(state, &job);
+		}
+	}
+}
+
+/* Walks the tree on this thread, while 'numThreads' workers copy the files it finds. */
+static uint32_t transfer(struct FAT32_file_t* dir, const char* hostPath, int importing, uint32_t numThreads, struct FAT32_transfer_report_t* outReport)
+{
+	struct transfer_state_t* state = (struct transfer_state_t*)calloc(1, sizeof(struct transfer_state_t));
+	state->volume = FAT32_fvolume(dir);
+	state->importing = importing;
+	state->queue = (struct transfer_job_t*)malloc(sizeof(struct transfer_job_t) * FAT32_TRANSFER_QUEUE_LEN);
+	FAT32_mutex_init(&state->mutex);
+	FAT32_cond_init(&state->queued);
+	FAT32_cond_init(&state->taken);
+
+	if (numThreads == 0)
+	{
+		numThreads = FAT32_thread_hardware_concurrency();
+	}
+
+	FAT32_thread_t* threads = (FAT32_thread_t*)malloc(sizeof(FAT32_thread_t) * numThreads);
+	for (; state->num_workers < numThreads; ++state->num_workers)
+	{
+		if (!FAT32_thread_create(&threads[state->num_workers], &transfer_worker, state))
+		{
+			break;
+		}
+	}
+
+	// Start from the beginning of the directory
+	FAT32_rewind(dir);
+	if (importing)
+	{
+		import_directory(state, dir, hostPath);
+	}
+	else
+	{
+		export_directory(state, dir, hostPath);
+	}
+
+	// Let the workers finish what's queued, then leave
+	FAT32_mutex_lock(&state->mutex);
+	state->walked = 1;
+	FAT32_cond_broadcast(&state->queued);
+	FAT32_mutex_unlock(&state->mutex);
+
+	for (uint32_t i = 0; i < state->num_workers; ++i)
+	{
+		FAT32_thread_join(threads[i]);
+	}
+	free(threads);
+
+	*outReport = state->report;
+
+	FAT32_cond_destroy(&state->taken);
+	FAT32_cond_destroy(&state->queued);
+	FAT32_mutex_destroy(&state->mutex);
+	free(state->queue);
+	free(state);
+
+	return outReport->num_failed;
+}
+
+uint32_t FAT32_import(struct FAT32_file_t* dir, const char* hostPath, uint32_t numThreads, struct FAT32_transfer_report_t* outReport)
+{
+	return transfer(dir, hostPath, 1, numThreads, outReport);
+}
+
+uint32_t FAT32_export(struct FAT32_file_t* dir, const char* hostPath, uint32_t numThreads, struct FAT32_transfer_report_t* outReport)
+{
+	return transfer(dir, hostPath, 0, numThreads, outReport);
+}
@@ -0,0 +1,457 @@
+// FAT32Walk.c
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include "FAT32Internal.h"
+#include "FAT32Thread.h"
+#include "../include/FAT32Walk.h"
+
+/* The maximum length of a path built by the walk. */
+#define FAT32_WALK_PATH_LEN 1024
+
+/* The number of entries each thread reads from a directory at a time. */
+#define FAT32_WALK_BATCH_ENTRIES 64
+
+/* The number of clusters of a subdirectory read ahead when it's found. */
+#define FAT32_WALK_PREFETCH_CLUSTERS 8
+
+/* A directory waiting to be walked. */
+struct pending_walk_dir_t
+{
+	FAT32_cluster_address_t address;
+	uint32_t depth;
+	char* path;
+};
+
+/* The directories a thread has found but not walked yet. The thread takes the newest from the bottom, so it carries on depth first,
+ * while other threads take the oldest from the top, which tend to have the most below them. */
+struct walk_deque_t
+{
+	FAT32_mutex_t mutex;
+
+	struct pending_walk_dir_t* dirs;
+	uint32_t top;
+	uint32_t bottom;
+	uint32_t capacity;
+};
+
+struct walk_state_t
+{
+	struct FAT32_volume_t* volume;
+	FAT32_walk_callback_t callback;
+	void* userData;
+
+	/* One deque per thread. */
+	struct walk_deque_t* deques;
+	uint32_t num_threads;
+
+	/* One bit per cluster, set once a directory starting there has been queued. */
+	volatile uint64_t* queued;
+
+	/* The number of directories queued or being walked. The walk is over when this reaches 0. */
+	volatile uint64_t num_pending;
+
+	/* The number of threads waiting for work. */
+	volatile uint64_t num_idle;
+
+	/* Set once the callback asks to stop. */
+	volatile uint64_t stopped;
+
+	/* Held by threads going idle. */
+	FAT32_mutex_t mutex;
+
+	/* Signalled when a directory is queued while threads are idle, or when the walk is over. */
+	FAT32_cond_t cond;
+};
+
+/* The arguments of one walking thread. */
+struct walk_worker_t
+{
+	struct walk_state_t* state;
+	uint32_t index;
+};
+
+/* Adds a directory to the given thread's deque, and wakes an idle thread to take it. */
+static void push_dir(struct walk_state_t* state, uint32_t thread, FAT32_cluster_address_t address, uint32_t depth, const char* path)
+{
+	// Never walk a directory twice, even if it's reached twice
+	const uint64_t bit = (uint64_t)1 << (address.index % 64);
+	if (FAT32_atomic_fetch_or64(&state->queued[address.index / 64], bit) & bit)
+	{
+		return;
+	}
+
+	// Start reading it in while it waits
+	FAT32_prefetch_chain(state->volume, address, FAT32_WALK_PREFETCH_CLUSTERS);
+	FAT32_atomic_fetch_add64(&state->num_pending, 1);
+
+	struct walk_deque_t* deque = &state->deques[thread];
+	FAT32_mutex_lock(&deque->mutex);
+
+	if (deque->bottom == deque->capacity)
+	{
+		// Reuse the room left at the top by thieves, or make more
+		if (deque->top > 0)
+		{
+			memmove(deque->dirs, &deque->dirs[deque->top], sizeof(struct pending_walk_dir_t) * (deque->bottom - deque->top));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		}
+		else
+		{
+			deque->capacity = deque->capacity ? deque->capacity * 2 : 16;
+			deque->dirs = (struct pending_walk_dir_t*)realloc(deque->dirs, sizeof(struct pending_walk_dir_t) * deque->capacity);
+		}
+	}
+
+	struct pending_walk_dir_t* dir = &deque->dirs[deque->bottom++];
+	dir->address = address;
+	dir->depth = depth;
+	const size_t length = strlen(path) + 1;
+	dir->path = (char*)malloc(length);
+	memcpy(dir->path, path, length);
+
+	FAT32_mutex_unlock(&deque->mutex);
+
+	if (FAT32_atomic_load64(&state->num_idle) > 0)
+	{
+		FAT32_mutex_lock(&state->mutex);
+		FAT32_cond_signal(&state->cond);
+		FAT32_mutex_unlock(&state->mutex);
+	}
+}
+
+/* Takes the newest directory from the thread's own deque, or else the oldest from another thread's. Returns 0 if there are none. */
+static int take_dir(struct walk_state_t* state, uint32_t thread, struct pending_walk_dir_t* outDir)
+{
+	struct walk_deque_t* own = &state->deques[thread];
+	FAT32_mutex_lock(&own->mutex);
+	if (own->bottom > own->top)
+	{
+		*outDir = own->dirs[--own->bottom];
+		FAT32_mutex_unlock(&own->mutex);
+		return 1;
+	}
+	FAT32_mutex_unlock(&own->mutex);
+
+	for (uint32_t i = 1; i < state->num_threads; ++i)
+	{
+		struct walk_deque_t* victim = &state->deques[(thread + i) % state->num_threads];
+		FAT32_mutex_lock(&victim->mutex);
+		if (victim->bottom > victim->top)
+		{
+			*outDir = victim->dirs[victim->top++];
+			FAT32_mutex_unlock(&victim->mutex);
+			return 1;
+		}
+		FAT32_mutex_unlock(&victim->mutex);
+	}
+
+	return 0;
+}
+
+/* Joins a directory path and a name, truncating it if it's too long. */
+static void join_path(char* outPath, const char* dirPath, const char* name)
+{
+	const size_t length = strlen(dirPath);
+	snprintf(outPath, FAT32_WALK_PATH_LEN, length > 0 && dirPath[length - 1] == '/' ? "%s%s" : "%s/%s", dirPath, name);
+}
+
+/* Visits the entries of a directory, and queues its subdirectories. */
+static void walk_directory(struct walk_state_t* state, uint32_t thread, const struct pending_walk_dir_t* pending, struct FAT32_dirent_t* batch, char* path)
+{
+	struct FAT32_file_t* dir = FAT32_fopen(state->volume, pending->address, UINT32_MAX);
+
+	struct FAT32_walk_entry_t visit;
+	visit.path = path;
+	visit.dir = pending->address;
+	visit.depth = pending->depth;
+	visit.thread = thread;
+
+	uint32_t cookie = 0;
+	uint32_t numEntries;
+	while (!FAT32_atomic_load64(&state->stopped) && (numEntries = FAT32_readdir_batch(dir, &cookie, batch, FAT32_WALK_BATCH_ENTRIES)) > 0)
+	{
+		for (uint32_t i = 0; i < numEntries; ++i)
+		{
+			// Skip the links to this directory and its parent
+			if (FAT32_dir_is_dot_entry(&batch[i].entry))
+			{
+				continue;
+			}
+
+			join_path(path, pending->path, batch[i].name);
+			visit.dirent = &batch[i];
+
+			const enum FAT32_walk_action_t action = state->callback(&visit, state->userData);
+			if (action == FAT32_WALK_STOP)
+			{
+				FAT32_atomic_fetch_or64(&state->stopped, 1);
+				break;
+			}
+
+			const FAT32_cluster_address_t address = FAT32_dir_get_entry_address(&batch[i].entry);
+			if (action == FAT32_WALK_CONTINUE && (batch[i].entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) && FAT32_is_valid_cluster(state->volume, address))
+			{
+				push_dir(state, thread, address, pending->depth + 1, path);
+			}
+		}
+	}
+
+	FAT32_fclose(dir);
+}
+
+static void walk_worker(void* userData)
+{
+	const struct walk_worker_t* worker = (const struct walk_worker_t*)userData;
+	struct walk_state_t* state = worker->state;
+	struct FAT32_dirent_t* batch = (struct FAT32_dirent_t*)malloc(sizeof(struct FAT32_dirent_t) * FAT32_WALK_BATCH_ENTRIES);
+	char* path = (char*)malloc(FAT32_WALK_PATH_LEN);
+
+	while (1)
+	{
+		struct pending_walk_dir_t pending;
+		if (!take_dir(state, worker->index, &pending))
+		{
+			// Out of work, so wait for more, unless nobody is left to make any
+			FAT32_mutex_lock(&state->mutex);
+			FAT32_atomic_fetch_add64(&state->num_idle, 1);
+
+			int found = 0;
+			while (!(found = take_dir(state, worker->index, &pending)) && FAT32_atomic_load64(&state->num_pending) > 0)
+			{
+				FAT32_cond_wait(&state->cond, &state->mutex);
+			}
+
+			FAT32_atomic_fetch_add64(&state->num_idle, (uint64_t)-1);
+			FAT32_mutex_unlock(&state->mutex);
+
+			if (!found)
+			{
+				break;
+			}
+		}
+
+		// Once stopped, what's left is only cleared away
+		if (!FAT32_atomic_load64(&state->stopped))
+		{
+			walk_directory(state, worker->index, &pending, batch, path);
+		}
+		free(pending.path);
+
+		// If that was the last of the work, wake everyone up so they can leave
+		if (FAT32_atomic_fetch_add64(&state->num_pending, (uint64_t)-1) == 1)
+		{
+			FAT32_mutex_lock(&state->mutex);
+			FAT32_cond_broadcast(&state->cond);
+			FAT32_mutex_unlock(&state->mutex);
+		}
+	}
+
+	free(path);
+	free(batch);
+}
+
+int FAT32_walk(struct FAT32_file_t* dir, const char* path, uint32_t numThreads, FAT32_walk_callback_t callback, void* userData)
+{
+	if (numThreads == 0)
+	{
+		numThreads = FAT32_thread_hardware_concurrency();
+	}
+
+	struct walk_state_t* state = (struct walk_state_t*)calloc(1, sizeof(struct walk_state_t));
+	state->volume = FAT32_fvolume(dir);
+	state->callback = callback;
+	state->userData = userData;
+	state->num_threads = numThreads;
+	state->deques = (struct walk_deque_t*)calloc(numThreads, sizeof(struct walk_deque_t));
+	state->queued = (volatile uint64_t*)calloc((state->volume->num_entries + 63) / 64, sizeof(uint64_t));
+	FAT32_mutex_init(&state->mutex);
+	FAT32_cond_init(&state->cond);
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		FAT32_mutex_init(&state->deques[i].mutex);
+	}
+
+	// Start with the given directory
+	push_dir(state, 0, FAT32_faddress(dir), 0, path);
+
+	struct walk_worker_t* workers = (struct walk_worker_t*)malloc(sizeof(struct walk_worker_t) * numThreads);
+	FAT32_thread_t* threads = (FAT32_thread_t*)malloc(sizeof(FAT32_thread_t) * numThreads);
+	uint32_t numStarted = 0;
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		workers[i].state = state;
+		workers[i].index = i;
+	}
+
+	// This thread is the first walker; any that fail to start leave their share to the rest
+	for (; numStarted + 1 < numThreads; ++numStarted)
+	{
+		if (!FAT32_thread_create(&threads[numStarted], &walk_worker, &workers[numStarted + 1]))
+		{
+			break;
+		}
+	}
+
+	walk_worker(&workers[0]);
+
+	for (uint32_t i = 0; i < numStarted; ++i)
+	{
+		FAT32_thread_join(threads[i]);
+	}
+	free(threads);
+	free(workers);
+
+	const int completed = !state->stopped;
+
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		FAT32_mutex_destroy(&state->deques[i].mutex);
+		free(state->deques[i].dirs);
+	}
+	FAT32_cond_destroy(&state->cond);
+	FAT32_mutex_destroy(&state->mutex);
+	free((void*)state->queued);
+	free(state->deques);
+	free(state);
+
+	return completed;
+}
+
+int FAT32_walk_match(const char* pattern, const char* name)
+{
+	// Where to carry on from if what follows the last '*' stops matching
+	const char* starPattern = NULL;
+	const char* starName = NULL;
+
+	while (*name)
+	{
+		if (*pattern == '*')
+		{
+			starPattern = ++pattern;
+			starName = name;
+		}
+		else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name))
+		{
+			++pattern;
+			++name;
+		}
+		else if (starPattern)
+		{
+			// Let the '*' swallow one more character, and try again
+			pattern = starPattern;
+			name = ++starName;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+
+	// Only trailing '*'s can match nothing
+	while (*pattern == '*')
+	{
+		++pattern;
+	}
+
+	return *pattern == '\0';
+}
+
+/* The state of a 'FAT32_find'. */
+struct find_state_t
+{
+	const struct FAT32_find_query_t* query;
+	FAT32_find_callback_t callback;
+	void* userData;
+
+	/* Makes sure the callback is only called by one thread at a time. */
+	FAT32_mutex_t mutex;
+	uint32_t num_matches;
+};
+
+static enum FAT32_walk_action_t find_visit(const struct FAT32_walk_entry_t* entry, void* userData)
+{
+	struct find_state_t* state = (struct find_state_t*)userData;
+	const FAT32_dir_entry_attribs_t attribs = entry->dirent->entry.attribs;
+
+	if ((attribs & state->query->attribs_set) == state->query->attribs_set && (attribs & state->query->attribs_clear) == 0 &&
+		(!state->query->pattern || FAT32_walk_match(state->query->pattern, entry->dirent->name)))
+	{
+		FAT32_mutex_lock(&state->mutex);
+		state->num_matches += 1;
+		state->callback(entry->path, &entry->dirent->entry, state->userData);
+		FAT32_mutex_unlock(&state->mutex);
+	}
+
+	return FAT32_WALK_CONTINUE;
+}
+
+uint32_t FAT32_find(struct FAT32_file_t* dir, const char* path, const struct FAT32_find_query_t* query, uint32_t numThreads, FAT32_find_callback_t callback, void* userData)
+{
+	struct find_state_t state;
+	state.query = query;
+	state.callback = callback;
+	state.userData = userData;
+	state.num_matches = 0;
+	FAT32_mutex_init(&state.mutex);
+
+	FAT32_walk(dir, path, numThreads, &find_visit, &state);
+
+	FAT32_mutex_destroy(&state.mutex);
+	return state.num_matches;
+}
+
+/* The state of a 'FAT32_du', with one total per thread so they're added up without locking. */
+struct du_state_t
+{
+	struct FAT32_volume_t* volume;
+	struct FAT32_du_report_t* totals;
+};
+
+static enum FAT32_walk_action_t du_visit(const struct FAT32_walk_entry_t* entry, void* userData)
+{
+	struct du_state_t* state = (struct du_state_t*)userData;
+	struct FAT32_du_report_t* total = &state->totals[entry->thread];
+	const struct FAT32_directory_entry_t* dirEntry = &entry->dirent->entry;
+
+	if (dirEntry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		total->num_directories += 1;
+	}
+	else
+	{
+		total->num_files += 1;
+		total->num_bytes += dirEntry->size;
+		total->num_allocated_bytes += ((uint64_t)dirEntry->size + state->volume->cluster_mask) & ~(uint64_t)state->volume->cluster_mask;
+	}
+
+	return FAT32_WALK_CONTINUE;
+}
+
+void FAT32_du(struct FAT32_file_t* dir, uint32_t numThreads, struct FAT32_du_report_t* outReport)
+{
+	if (numThreads == 0)
+	{
+		numThreads = FAT32_thread_hardware_concurrency();
+	}
+
+	struct du_state_t state;
+	state.volume = FAT32_fvolume(dir);
+	state.totals = (struct FAT32_du_report_t*)calloc(numThreads, sizeof(struct FAT32_du_report_t));
+
+	FAT32_walk(dir, "", numThreads, &du_visit, &state);
+
+	memset(outReport, 0, sizeof(struct FAT32_du_report_t));
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		outReport->num_files += state.totals[i].num_files;
+		outReport->num_directories += state.totals[i].num_directories;
+		outReport->num_bytes += state.totals[i].num_bytes;
+		outReport->num_allocated_bytes += state.totals[i].num_allocated_bytes;
+	}
+
+	free(state.totals);
+}
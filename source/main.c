@@ -1,8 +1,14 @@
 // main.c
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../include/FAT32Directory.h"
+#include "../include/FAT32Defrag.h"
+#include "../include/FAT32Check.h"
+#include "../include/FAT32Transfer.h"
+#include "../include/FAT32Walk.h"
+#include "../include/FAT32Aging.h"
 
 static void cmd_help(void)
 {
@@ -16,31 +22,39 @@ static void cmd_help(void)
 	printf("write - write to a file\n");
 	printf("rm - remove a file/directory\n");
 	printf("stat - print the stats of file/directory\n");
+	printf("compress - store a file compressed\n");
+	printf("clone - copy a file, sharing its clusters until either is changed\n");
+	printf("mv - rename a file/directory, or move it into a directory\n");
+	printf("import - copy a directory tree on the host into the current directory\n");
+	printf("export - copy the current directory tree into a directory on the host\n");
+	printf("find - list the files/directories below this one whose names match a pattern\n");
+	printf("du - print the total size of the files in each directory\n");
+	printf("age - age the volume with a seeded workload of creating, appending to and deleting files\n");
 	printf("help - print this menu\n");
 	printf("disk - print a visualization of the state of the disk\n");
+	printf("frag - print a fragmentation report\n");
+	printf("defrag - move fragmented files into contiguous clusters\n");
+	printf("check - check the consistency of the file system\n");
+	printf("repair - check the file system, and repair any problems\n");
+	printf("sync - write all pending changes to the disk\n");
 	printf("exit - exit the program\n");
 	printf("\n");
 }
 
 static void cmd_ls(struct FAT32_file_t* cwdir)
 {
-    // Seek to the beginning of the directory file
-    FAT32_fseek(cwdir, 0, FAT32_SEEK_SET);
-
-    struct FAT32_directory_entry_t entry;
-    while (FAT32_fread(&entry, sizeof(entry), 1, cwdir))
-    {
-		// Skip deleted entries
-		if (entry.name[0] == 0)
+	// Read the directory a batch of entries at a time, from the beginning
+	struct FAT32_dirent_t entries[32];
+	uint32_t cookie = 0;
+	uint32_t numEntries;
+	while ((numEntries = FAT32_readdir_batch(cwdir, &cookie, entries, 32)) > 0)
+	{
+		for (uint32_t i = 0; i < numEntries; ++i)
 		{
-			continue;
+			// Print the name
+			printf("%s\n", entries[i].name);
 		}
-
-		// Print the name
-		char name[FAT32_DIR_NAME_LEN];
-		FAT32_dir_get_entry_name(&entry, name);
-		printf("%s\n", name);
-    }
+	}
 }
 
 static struct FAT32_file_t* cmd_cd(struct FAT32_file_t* cwdir, const char* path)
@@ -62,10 +76,11 @@ static struct FAT32_file_t* cmd_cd(struct FAT32_file_t* cwdir, const char* path)
     }
 
     // Close the current directory
+    struct FAT32_volume_t* volume = FAT32_fvolume(cwdir);
     FAT32_fclose(cwdir);
 
     // Open the subdirectory
-    return FAT32_dir_open_entry(&entry);
+    return FAT32_dir_open_entry(volume, &entry);
 }
 
 static void cmd_open(struct FAT32_file_t* cwdir, const char* path)
@@ -87,7 +102,7 @@ static void cmd_open(struct FAT32_file_t* cwdir, const char* path)
     }
 
     // Print all contents of the file to the screen
-    struct FAT32_file_t* file = FAT32_dir_open_entry(&entry);
+    struct FAT32_file_t* file = FAT32_dir_open_entry(FAT32_fvolume(cwdir), &entry);
     char c;
     while (FAT32_fread(&c, 1, 1, file))
     {
@@ -95,37 +110,27 @@ static void cmd_open(struct FAT32_file_t* cwdir, const char* path)
     }
 
 	printf("\n");
+	if (FAT32_ferror(file))
+	{
+		printf("Error, '%s' is corrupt: its contents don't match their checksums\n", path);
+	}
 
-    // Close the file
-	FAT32_dir_close_entry(&entry, file);
-
-	// Write entry changes
-	FAT32_fwrite(&entry, sizeof(entry), 1, cwdir);
+    // Close the file, and write back the entry if that changed it
+	if (FAT32_dir_close_entry(&entry, file))
+	{
+		FAT32_dir_update_entry(cwdir, &entry);
+	}
 }
 
 static void cmd_mkdir(struct FAT32_file_t* cwdir, const char* path)
 {
     struct FAT32_directory_entry_t entry;
 
-    // Create an entry in the current directory
-    FAT32_dir_new_entry(cwdir, path, FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY, &entry);
-
-    // Open the directory
-    struct FAT32_file_t* subdir = FAT32_dir_open_entry(&entry);
-
-    // Create an entry for the parent
-    struct FAT32_directory_entry_t parentEntry;
-	FAT32_dir_set_entry_name(&parentEntry, "");
-	FAT32_dir_set_entry_address(&parentEntry, FAT32_faddress(cwdir));
-    parentEntry.attribs = FAT32_DIR_ENTRY_ATTRIB_SYSTEM | FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY;
-	parentEntry.name[0] = '.';
-	parentEntry.name[1] = '.';
-
-    // Write it to the directory file
-    FAT32_fwrite(&parentEntry, sizeof(parentEntry), 1, subdir);
-
-    // Close the file
-    FAT32_fclose(subdir);
+    // Create the directory, along with its links to itself and the current directory
+    if (!FAT32_dir_new_directory(cwdir, path, &entry))
+	{
+		printf("Error: '%s' could not be created\n", path);
+	}
 }
 
 static void cmd_new(struct FAT32_file_t* cwdir, const char* path)
@@ -138,7 +143,10 @@ static void cmd_new(struct FAT32_file_t* cwdir, const char* path)
 		return;
 	}
 
-	FAT32_dir_new_entry(cwdir, path, 0, &entry);
+	if (!FAT32_dir_new_entry(cwdir, path, 0, &entry))
+	{
+		printf("Error: '%s' could not be created\n", path);
+	}
 }
 
 static void cmd_rm(struct FAT32_file_t* cwdir, const char* path)
@@ -153,6 +161,7 @@ static void cmd_write(struct FAT32_file_t* cwdir, const char* path, const char*
 {
 	// See if the file already exists
     struct FAT32_directory_entry_t entry;
+	struct FAT32_file_t* file;
     if(FAT32_dir_get_entry(cwdir, path, &entry))
     {
 		// Make sure the file isn't a folder
@@ -162,22 +171,257 @@ static void cmd_write(struct FAT32_file_t* cwdir, const char* path, const char*
 			return;
 		}
 
-		// Clear the existing contents of the file
-		FAT32_dir_clear_entry(&entry);
+		// Write over the existing contents of the file
+		file = FAT32_dir_open_entry_overwrite(FAT32_fvolume(cwdir), &entry);
     }
 	else
 	{
 		// Create a new file
-		FAT32_dir_new_entry(cwdir, path, 0, &entry);
+		if (!FAT32_dir_new_entry(cwdir, path, 0, &entry))
+		{
+			printf("Error: '%s' could not be created\n", path);
+			return;
+		}
+		file = FAT32_dir_open_entry(FAT32_fvolume(cwdir), &entry);
 	}
 
-	// Open the entry
-    struct FAT32_file_t* file = FAT32_dir_open_entry(&entry);
-    FAT32_fwrite(write, 1, strlen(write), file);
+	// Write the contents
+    if (FAT32_fwrite(write, 1, strlen(write), file) < strlen(write))
+	{
+		printf("Error: the volume is full\n");
+	}
+
+	// Save the entry, if writing changed it
+	if (FAT32_dir_close_entry(&entry, file))
+	{
+		FAT32_dir_update_entry(cwdir, &entry);
+	}
+}
+
+static void cmd_compress(struct FAT32_file_t* cwdir, const char* path)
+{
+	// Get the entry
+	struct FAT32_directory_entry_t entry;
+	if (!FAT32_dir_get_entry(cwdir, path, &entry))
+	{
+		printf("Error: '%s' does not name a directory entry\n", path);
+		return;
+	}
+
+	if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		printf("Error: '%s' is a directory, and may not be compressed\n", path);
+		return;
+	}
+
+	if (entry.flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		printf("Error: '%s' is already compressed\n", path);
+		return;
+	}
+
+	// Read in the whole file
+	struct FAT32_volume_t* volume = FAT32_fvolume(cwdir);
+	struct FAT32_file_t* file = FAT32_dir_open_entry(volume, &entry);
+	char* contents = (char*)malloc(entry.size + 1);
+	const size_t size = FAT32_fread(contents, 1, entry.size, file);
+	const int failed = FAT32_ferror(file);
+	FAT32_fclose(file);
+
+	if (failed)
+	{
+		printf("Error, '%s' is corrupt: its contents don't match their checksums\n", path);
+		free(contents);
+		return;
+	}
+
+	// Write it back over itself, compressed
+	entry.flags |= FAT32_DIR_ENTRY_FLAG_COMPRESSED;
+	file = FAT32_dir_open_entry_overwrite(volume, &entry);
+	FAT32_fwrite(contents, 1, size, file);
+	free(contents);
+
 	FAT32_dir_close_entry(&entry, file);
+	FAT32_dir_update_entry(cwdir, &entry);
+	printf("Stored %u bytes in %u\n", (uint32_t)size, entry.size);
+}
+
+static void cmd_clone(struct FAT32_file_t* cwdir, const char* path, const char* newPath)
+{
+	struct FAT32_directory_entry_t entry;
+	if (!FAT32_dir_get_entry(cwdir, path, &entry))
+	{
+		printf("Error: '%s' does not name a directory entry\n", path);
+		return;
+	}
+
+	if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		printf("Error: '%s' is a directory, and may not be cloned\n", path);
+		return;
+	}
+
+	struct FAT32_directory_entry_t clone;
+	if (FAT32_dir_get_entry(cwdir, newPath, &clone))
+	{
+		printf("Error: '%s' already exists in this directory\n", newPath);
+		return;
+	}
 
-	// Save the entry
-	FAT32_fwrite(&entry, sizeof(entry), 1, cwdir);
+	if (!FAT32_clone(cwdir, &entry, newPath, &clone))
+	{
+		printf("Error: '%s' could not be created\n", newPath);
+	}
+}
+
+static void cmd_mv(struct FAT32_file_t* cwdir, const char* path, const char* target)
+{
+	struct FAT32_directory_entry_t entry;
+	if (!FAT32_dir_get_entry(cwdir, path, &entry))
+	{
+		printf("Error: '%s' does not name a directory entry\n", path);
+		return;
+	}
+
+	// Moving into a directory keeps the name, otherwise the entry is renamed where it is (as when the target is the entry itself, in another case)
+	struct FAT32_directory_entry_t targetEntry;
+	if (FAT32_dir_get_entry(cwdir, target, &targetEntry) && (targetEntry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) &&
+		FAT32_dir_get_entry_address(&targetEntry).index != FAT32_dir_get_entry_address(&entry).index)
+	{
+		struct FAT32_file_t* targetDir = FAT32_dir_open_entry(FAT32_fvolume(cwdir), &targetEntry);
+		const int moved = FAT32_dir_rename(cwdir, path, targetDir, path);
+		FAT32_fclose(targetDir);
+
+		if (!moved)
+		{
+			printf("Error: '%s' may not be moved into '%s'\n", path, target);
+		}
+		return;
+	}
+
+	if (!FAT32_dir_rename(cwdir, path, cwdir, target))
+	{
+		printf("Error: '%s' may not be renamed to '%s'\n", path, target);
+	}
+}
+
+static void cmd_transfer(struct FAT32_file_t* cwdir, const char* hostPath, int importing)
+{
+	struct FAT32_transfer_report_t report;
+	const uint32_t numFailed = importing ? FAT32_import(cwdir, hostPath, 0, &report) : FAT32_export(cwdir, hostPath, 0, &report);
+
+	printf("%s %u files (%llu bytes) and %u directories\n", importing ? "Imported" : "Exported", report.num_files, (unsigned long long)report.num_bytes,
+		report.num_directories);
+	if (numFailed > 0)
+	{
+		printf("Error: %u files/directories could not be copied\n", numFailed);
+	}
+}
+
+/* The paths found by 'cmd_find', gathered so they can be printed in order. */
+struct find_results_t
+{
+	char** paths;
+	uint32_t num_paths;
+	uint32_t capacity;
+};
+
+static void add_find_result(const char* path, const struct FAT32_directory_entry_t* entry, void* userData)
+{
+	struct find_results_t* results = (struct find_results_t*)userData;
+	if (results->num_paths == results->capacity)
+	{
+		results->capacity = results->capacity ? results->capacity * 2 : 16;
+		results->paths = (char**)realloc(results->paths, sizeof(char*) * results->capacity);
+	}
+
+	// Mark directories with a trailing slash
+	const size_t length = strlen(path);
+	char* copy = (char*)malloc(length + 2);
+	memcpy(copy, path, length);
+	copy[length] = (entry->attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) ? '/' : '\0';
+	copy[length + 1] = '\0';
+	results->paths[results->num_paths++] = copy;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void cmd_find(struct FAT32_file_t* cwdir, const char* pattern, const char* type)
+{
+	// Optionally only find files ('f') or directories ('d')
+	struct FAT32_find_query_t query;
+	query.pattern = pattern;
+	query.attribs_set = !strcmp(type, "d") ? FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY : 0;
+	query.attribs_clear = !strcmp(type, "f") ? FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY : 0;
+
+	struct find_results_t results;
+	memset(&results, 0, sizeof(results));
+	FAT32_find(cwdir, ".", &query, 0, &add_find_result, &results);
+
+	// They're found in no particular order, so sort them
+	qsort(results.paths, results.num_paths, sizeof(char*), &compare_paths);
+	for (uint32_t i = 0; i < results.num_paths; ++i)
+	{
+		printf("%s\n", results.paths[i]);
+		free(results.paths[i]);
+	}
+	free(results.paths);
+}
+
+static void cmd_du(struct FAT32_file_t* cwdir)
+{
+	// Print the total of each subdirectory
+	struct FAT32_dirent_t entries[32];
+	uint32_t cookie = 0;
+	uint32_t numEntries;
+	while ((numEntries = FAT32_readdir_batch(cwdir, &cookie, entries, 32)) > 0)
+	{
+		for (uint32_t i = 0; i < numEntries; ++i)
+		{
+			if ((entries[i].entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY) == 0 || FAT32_dir_is_dot_entry(&entries[i].entry))
+			{
+				continue;
+			}
+
+			struct FAT32_du_report_t report;
+			struct FAT32_file_t* subdir = FAT32_dir_open_entry(FAT32_fvolume(cwdir), &entries[i].entry);
+			FAT32_du(subdir, 0, &report);
+			FAT32_fclose(subdir);
+
+			printf("%12llu  %s/\n", (unsigned long long)report.num_bytes, entries[i].name);
+		}
+	}
+
+	// Then the total of everything
+	struct FAT32_du_report_t total;
+	FAT32_du(cwdir, 0, &total);
+	printf("%12llu  total (%llu allocated) in %u files and %u directories\n", (unsigned long long)total.num_bytes,
+		(unsigned long long)total.num_allocated_bytes, total.num_files, total.num_directories);
+}
+
+static void print_aging_checkpoint(const struct FAT32_aging_checkpoint_t* checkpoint, void* userData)
+{
+	(void)userData;
+
+	printf("%10u %8u %12llu %8.2f %10.1f %10.1f %10.1f %10.1f %8u %8u\n", checkpoint->operation, checkpoint->num_files,
+		(unsigned long long)checkpoint->num_bytes, checkpoint->fragments_per_file, checkpoint->read_mb_per_second, checkpoint->mean_allocation_us,
+		checkpoint->p99_allocation_us, checkpoint->max_allocation_us, checkpoint->num_free_extents, checkpoint->largest_free_extent);
+}
+
+static void cmd_age(struct FAT32_file_t* cwdir, uint64_t seed, uint32_t numOperations)
+{
+	struct FAT32_aging_config_t config;
+	FAT32_aging_default_config(seed, numOperations, &config);
+
+	printf("%10s %8s %12s %8s %10s %10s %10s %10s %8s %8s\n", "ops", "files", "bytes", "frags", "read MB/s", "alloc us", "p99 us",
+		"max us", "extents", "largest");
+	if (!FAT32_age(cwdir, &config, &print_aging_checkpoint, NULL))
+	{
+		printf("Error: this directory has already been aged\n");
+	}
 }
 
 static void cmd_stat(struct FAT32_file_t* cwdir, const char* path)
@@ -197,12 +441,17 @@ static void cmd_stat(struct FAT32_file_t* cwdir, const char* path)
 		return;
 	}
 
-	// Get the file's name
+	// Get the file's short name
 	char name[FAT32_DIR_NAME_LEN];
 	FAT32_dir_get_entry_name(&entry, name);
 
-	printf("Name: '%s'\n", name);
+	printf("Name: '%s'\n", path);
+	printf("Short name: '%s'\n", name);
 	printf("Size: %u\n", entry.size);
+	if (entry.flags & FAT32_DIR_ENTRY_FLAG_COMPRESSED)
+	{
+		printf("Compressed: yes (the size is the stored size)\n");
+	}
 
 	printf("Created: %u/%u/%u %u:%u:%u\n", entry.create_date.month, entry.create_date.day, entry.create_date.year + 1980,
 		entry.create_time.hours, entry.create_time.minutes, entry.create_time.seconds * 2);
@@ -213,6 +462,22 @@ static void cmd_stat(struct FAT32_file_t* cwdir, const char* path)
 	printf("Last access: %u/%u/%u\n", entry.last_access_date.month, entry.last_access_date.day, entry.last_access_date.year + 1980);
 }
 
+static struct FAT32_file_t* cmd_defrag(struct FAT32_file_t* cwdir)
+{
+	struct FAT32_volume_t* volume = FAT32_fvolume(cwdir);
+	const uint32_t moved = FAT32_defrag_compact(volume);
+	printf("Moved %u files\n", moved);
+
+	if (moved == 0)
+	{
+		return cwdir;
+	}
+
+	// The current directory may have moved, so go back to the root
+	FAT32_fclose(cwdir);
+	return FAT32_fopen(volume, FAT32_get_root(volume), UINT32_MAX);
+}
+
 static void print_tree_trace(struct FAT32_file_t* cwdir)
 {
 	// Get the parent directory
@@ -225,27 +490,56 @@ static void print_tree_trace(struct FAT32_file_t* cwdir)
 	}
 
 	// Open the parent directory
-	struct FAT32_file_t* parentDir = FAT32_dir_open_entry(&parentEntry);
+	struct FAT32_file_t* parentDir = FAT32_dir_open_entry(FAT32_fvolume(cwdir), &parentEntry);
 	print_tree_trace(parentDir);
 
 	// Find this directory in the parent
 	struct FAT32_directory_entry_t myEntry;
-	FAT32_dir_get_entry_by_address(parentDir, FAT32_faddress(cwdir), &myEntry);
+	char myName[FAT32_DIR_LONG_NAME_LEN];
+	FAT32_dir_get_entry_by_address(parentDir, FAT32_faddress(cwdir), &myEntry, myName);
 
 	// Print current name
-	char myName[FAT32_DIR_NAME_LEN];
-	FAT32_dir_get_entry_name(&myEntry, myName);
 	printf("%s/", myName);
 
 	// Close the parent file
 	FAT32_fclose(parentDir);
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    // Open the root directory
-	FAT32_init();
-    struct FAT32_file_t* cwdir = FAT32_fopen(FAT32_get_root(), 0);
+	// Any arguments after the image are mount options
+	FAT32_mount_flags_t flags = 0;
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "noatime") == 0)
+		{
+			flags |= FAT32_MOUNT_NOATIME;
+		}
+		else if (strcmp(argv[i], "relatime") == 0)
+		{
+			flags |= FAT32_MOUNT_RELATIME;
+		}
+		else if (strcmp(argv[i], "checksums") == 0)
+		{
+			flags |= FAT32_MOUNT_CHECKSUMS;
+		}
+		else
+		{
+			printf("Error: unknown mount option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	// Mount the given image, or an in-memory volume
+	struct FAT32_volume_t* volume = FAT32_init(argc > 1 ? argv[1] : NULL, flags);
+	if (!volume)
+	{
+		printf("Error: '%s' is not a FAT32 image\n", argv[1]);
+		return 1;
+	}
+
+    // Open the root directory (directories are unsized)
+    struct FAT32_file_t* cwdir = FAT32_fopen(volume, FAT32_get_root(volume), UINT32_MAX);
     cmd_help();
 
     while (1)
@@ -262,34 +556,35 @@ int main()
         else if (!strcmp(cmd, "cd"))
         {
             // Get directory argument
-			char arg0[16];
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
             scanf("%s", arg0);
             cwdir = cmd_cd(cwdir, arg0);
         }
         else if (!strcmp(cmd, "open"))
         {
             // Get directory input
-            scanf("%s", cmd);
-			cmd_open(cwdir, cmd);
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
+            scanf("%s", arg0);
+			cmd_open(cwdir, arg0);
         }
         else if (!strcmp(cmd, "new"))
         {
             // Create new file
-			char arg0[16];
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
             scanf("%s", arg0);
             cmd_new(cwdir, arg0);
         }
         else if (!strcmp(cmd, "mkdir"))
         {
             // Make a new directory
-			char arg0[16];
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
             scanf("%s", arg0);
             cmd_mkdir(cwdir, arg0);
         }
         else if (!strcmp(cmd, "write"))
         {
             // Write to a file
-            char arg0[16];
+            char arg0[FAT32_DIR_LONG_NAME_LEN];
 			char arg1[1024];
             scanf("%s", arg0);
 			fgets(arg1, 1024, stdin);
@@ -303,21 +598,99 @@ int main()
         else if (!strcmp(cmd, "rm"))
         {
             // Remove a file/directory
-			char arg0[16];
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
             scanf("%s", arg0);
             cmd_rm(cwdir, arg0);
         }
         else if (!strcmp(cmd, "stat"))
         {
             // Print the stats of the current file/directory
-			char arg0[16];
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
             scanf("%s", arg0);
             cmd_stat(cwdir, arg0);
         }
+		else if (!strcmp(cmd, "compress"))
+		{
+			// Store a file compressed
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
+			scanf("%s", arg0);
+			cmd_compress(cwdir, arg0);
+		}
+		else if (!strcmp(cmd, "clone"))
+		{
+			// Clone a file
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
+			char arg1[FAT32_DIR_LONG_NAME_LEN];
+			scanf("%s %s", arg0, arg1);
+			cmd_clone(cwdir, arg0, arg1);
+		}
+		else if (!strcmp(cmd, "mv"))
+		{
+			// Rename or move a file/directory
+			char arg0[FAT32_DIR_LONG_NAME_LEN];
+			char arg1[FAT32_DIR_LONG_NAME_LEN];
+			scanf("%s %s", arg0, arg1);
+			cmd_mv(cwdir, arg0, arg1);
+		}
+		else if (!strcmp(cmd, "import") || !strcmp(cmd, "export"))
+		{
+			// Copy a directory tree between the host and the volume
+			char arg0[1024];
+			scanf("%1023s", arg0);
+			cmd_transfer(cwdir, arg0, !strcmp(cmd, "import"));
+		}
+		else if (!strcmp(cmd, "find"))
+		{
+			// Find entries by name, and optionally by type
+			char line[1024];
+			char arg0[FAT32_DIR_LONG_NAME_LEN] = "*";
+			char arg1[16] = "";
+			fgets(line, 1024, stdin);
+			sscanf(line, "%255s %15s", arg0, arg1);
+			cmd_find(cwdir, arg0, arg1);
+		}
+		else if (!strcmp(cmd, "du"))
+		{
+			// Print disk usage
+			cmd_du(cwdir);
+		}
+		else if (!strcmp(cmd, "age"))
+		{
+			// Age the volume
+			unsigned long long seed;
+			unsigned numOperations;
+			scanf("%llu %u", &seed, &numOperations);
+			cmd_age(cwdir, seed, numOperations);
+		}
 		else if (!strcmp(cmd, "disk"))
 		{
 			// Print the state of the disk
-			FAT32_print_disk();
+			FAT32_print_disk(volume);
+		}
+		else if (!strcmp(cmd, "frag"))
+		{
+			// Print the fragmentation report
+			FAT32_defrag_print_report(volume);
+		}
+		else if (!strcmp(cmd, "defrag"))
+		{
+			// Defragment the disk
+			cwdir = cmd_defrag(cwdir);
+		}
+		else if (!strcmp(cmd, "check"))
+		{
+			// Check the file system
+			FAT32_check_print_report(volume, 0);
+		}
+		else if (!strcmp(cmd, "repair"))
+		{
+			// Check and repair the file system
+			FAT32_check_print_report(volume, FAT32_CHECK_REPAIR);
+		}
+		else if (!strcmp(cmd, "sync"))
+		{
+			// Write back pending changes
+			FAT32_sync(volume);
 		}
         else if (!strcmp(cmd, "help"))
         {
@@ -338,4 +711,7 @@ int main()
 
     // Close the current directory
     FAT32_fclose(cwdir);
+
+	// Unmount the volume
+	FAT32_shutdown(volume);
 }
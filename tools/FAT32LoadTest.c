@@ -0,0 +1,506 @@
+// FAT32LoadTest.c
+// Load tests a running FAT32Server: several clients each keep a number of reads and writes in flight on a file of their own,
+// and the throughput and latencies are reported at the end. Linux only.
+// Build from the repository root with:
+//   gcc -O2 -pthread tools/FAT32LoadTest.c source/FAT32Thread.c -o fat32loadtest
+// Run as:
+//   fat32loadtest <socket> [-c clients] [-d depth] [-n requests] [-b block bytes] [-f file bytes] [-w write percent]
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../source/FAT32Thread.h"
+#include "FAT32Protocol.h"
+
+/* The directory the test files are made in. */
+#define FAT32_LOAD_TEST_DIR "/loadtest"
+
+/* The number of bytes received from the server at a time. */
+#define FAT32_LOAD_TEST_RECEIVE_SIZE (256 * 1024)
+
+struct load_test_config_t
+{
+	const char* socket_path;
+
+	/* The number of clients, each with its own connection and file. */
+	uint32_t num_clients;
+
+	/* The most requests each client has in flight. Once half have been answered, it sends the rest again in one batch. */
+	uint32_t depth;
+
+	/* The number of requests each client makes. */
+	uint32_t num_requests;
+
+	/* The size of each read and write. */
+	uint32_t block_size;
+
+	/* The size of each client's file. */
+	uint32_t file_size;
+
+	/* The percentage of requests that are writes rather than reads. */
+	uint32_t write_percent;
+};
+
+/* A connection to the server, with the replies received but not yet read. */
+struct load_test_connection_t
+{
+	int fd;
+	char* received;
+	size_t received_size;
+	size_t received_pos;
+};
+
+struct load_test_client_t
+{
+	const struct load_test_config_t* config;
+	uint32_t index;
+
+	/* The time each request took to be answered, in nanoseconds. */
+	uint64_t* latencies;
+
+	/* The number of payload bytes read and written. */
+	uint64_t num_bytes;
+
+	/* The number of requests that failed, and of reads that didn't return the bytes expected. */
+	uint32_t num_errors;
+	uint32_t num_mismatches;
+};
+
+/* The byte kept at each offset of the test files. Writes put back the same bytes, so reads can always be checked. */
+static uint8_t pattern_byte(uint32_t offset)
+{
+	return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+static void fill_pattern(uint8_t* buffer, uint32_t size, uint32_t offset)
+{
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		buffer[i] = pattern_byte(offset + i);
+	}
+}
+
+static int connect_to_server(const char* path, struct load_test_connection_t* outConnection)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+	outConnection->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (outConnection->fd < 0 || connect(outConnection->fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+	{
+		return 0;
+	}
+
+	outConnection->received = (char*)malloc(FAT32_LOAD_TEST_RECEIVE_SIZE);
+	outConnection->received_size = 0;
+	outConnection->received_pos = 0;
+	return 1;
+}
+
+static void disconnect(struct load_test_connection_t* connection)
+{
+	close(connection->fd);
+	free(connection->received);
+}
+
+static int send_all(int fd, const void* data, size_t size)
+{
+	const char* bytes = (const char*)data;
+	while (size)
+	{
+		const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (sent <= 0)
+		{
+			return 0;
+		}
+		bytes += sent;
+		size -= (size_t)sent;
+	}
+	return 1;
+}
+
+/* Reads the next bytes the server sent. 'buffer' may be NULL to skip them. */
+static int receive_all(struct load_test_connection_t* connection, void* buffer, size_t size)
+{
+	char* bytes = (char*)buffer;
+	while (size)
+	{
+		// Receive more once everything received has been read
+		if (connection->received_pos == connection->received_size)
+		{
+			const ssize_t received = recv(connection->fd, connection->received, FAT32_LOAD_TEST_RECEIVE_SIZE, 0);
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received <= 0)
+			{
+				return 0;
+			}
+			connection->received_size = (size_t)received;
+			connection->received_pos = 0;
+		}
+
+		size_t span = connection->received_size - connection->received_pos;
+		span = span < size ? span : size;
+		if (bytes)
+		{
+			memcpy(bytes, connection->received + connection->received_pos, span);
+			bytes += span;
+		}
+		connection->received_pos += span;
+		size -= span;
+	}
+	return 1;
+}
+
+/* Sends one request, and waits for its reply. 'payload' receives at most 'payloadSize' bytes of the reply's payload. */
+static int call(struct load_test_connection_t* connection, const struct FAT32_request_t* request, const void* requestPayload,
+	struct FAT32_reply_t* outReply, void* payload, uint32_t payloadSize)
+{
+	if (!send_all(connection->fd, request, sizeof(*request)) || !send_all(connection->fd, requestPayload, request->payload_size) ||
+		!receive_all(connection, outReply, sizeof(*outReply)))
+	{
+		return 0;
+	}
+
+	const uint32_t kept = outReply->payload_size < payloadSize ? outReply->payload_size : payloadSize;
+	return receive_all(connection, payload, kept) && receive_all(connection, NULL, outReply->payload_size - kept);
+}
+
+/* Makes a request on a path, and returns the reply's status. */
+static uint32_t call_path(struct load_test_connection_t* connection, uint8_t op, uint8_t flags, uint32_t size, const char* path, uint32_t* outValue)
+{
+	struct FAT32_request_t request = { (uint32_t)strlen(path), 0, op, flags, 0, 0, 0, size };
+	struct FAT32_reply_t reply;
+	if (!call(connection, &request, path, &reply, NULL, 0))
+	{
+		return UINT32_MAX;
+	}
+	if (outValue)
+	{
+		*outValue = reply.value;
+	}
+	return reply.status;
+}
+
+static void test_file_path(uint32_t index, char* outPath)
+{
+	sprintf(outPath, FAT32_LOAD_TEST_DIR "/client%u", index);
+}
+
+/* Creates the test files (or reuses them, from an earlier run), and fills them with the pattern. */
+static int set_up(const struct load_test_config_t* config)
+{
+	struct load_test_connection_t connection;
+	if (!connect_to_server(config->socket_path, &connection))
+	{
+		printf("Error: can't connect to '%s': %s\n", config->socket_path, strerror(errno));
+		return 0;
+	}
+
+	call_path(&connection, FAT32_OP_CREATE, FAT32_CREATE_DIRECTORY, 0, FAT32_LOAD_TEST_DIR, NULL);
+
+	uint8_t* block = (uint8_t*)malloc(FAT32_PROTOCOL_MAX_PAYLOAD);
+	int ok = 1;
+	for (uint32_t i = 0; i < config->num_clients && ok; ++i)
+	{
+		char path[64];
+		test_file_path(i, path);
+
+		// Allocate the file in one go, so its clusters are contiguous, then write the pattern over it
+		const uint32_t created = call_path(&connection, FAT32_OP_CREATE, 0, config->file_size, path, NULL);
+		uint32_t handle;
+		if ((created != FAT32_STATUS_OK && created != FAT32_STATUS_EXISTS) ||
+			call_path(&connection, FAT32_OP_OPEN, 0, 0, path, &handle) != FAT32_STATUS_OK)
+		{
+			printf("Error: can't create '%s'\n", path);
+			ok = 0;
+			break;
+		}
+
+		for (uint32_t offset = 0; offset < config->file_size && ok; offset += FAT32_PROTOCOL_MAX_PAYLOAD)
+		{
+			const uint32_t size = config->file_size - offset < FAT32_PROTOCOL_MAX_PAYLOAD ? config->file_size - offset : FAT32_PROTOCOL_MAX_PAYLOAD;
+			fill_pattern(block, size, offset);
+
+			struct FAT32_request_t request = { size, 0, FAT32_OP_WRITE, 0, 0, handle, offset, 0 };
+			struct FAT32_reply_t reply;
+			if (!call(&connection, &request, block, &reply, NULL, 0) || reply.status != FAT32_STATUS_OK)
+			{
+				printf("Error: can't write '%s'\n", path);
+				ok = 0;
+			}
+		}
+
+		struct FAT32_request_t request = { 0, 0, FAT32_OP_CLOSE, 0, 0, handle, 0, 0 };
+		struct FAT32_reply_t reply;
+		call(&connection, &request, NULL, &reply, NULL, 0);
+	}
+
+	free(block);
+	disconnect(&connection);
+	return ok;
+}
+
+/* Returns the next of a sequence of random numbers. */
+static uint64_t next_random(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static void client_thread(void* userData)
+{
+	struct load_test_client_t* client = (struct load_test_client_t*)userData;
+	const struct load_test_config_t* config = client->config;
+
+	struct load_test_connection_t connection;
+	char path[64];
+	test_file_path(client->index, path);
+	uint32_t handle;
+	if (!connect_to_server(config->socket_path, &connection))
+	{
+		client->num_errors = config->num_requests;
+		return;
+	}
+	if (call_path(&connection, FAT32_OP_OPEN, 0, 0, path, &handle) != FAT32_STATUS_OK)
+	{
+		client->num_errors = config->num_requests;
+		disconnect(&connection);
+		return;
+	}
+
+	// Requests are answered in order, so the ones in flight are a ring of the times they were sent and what they were
+	struct in_flight_t
+	{
+		uint64_t sent;
+		uint32_t offset;
+		uint8_t op;
+	};
+	struct in_flight_t* inFlight = (struct in_flight_t*)malloc(config->depth * sizeof(struct in_flight_t));
+	char* batch = (char*)malloc((size_t)config->depth * (sizeof(struct FAT32_request_t) + config->block_size));
+	uint8_t* expected = (uint8_t*)malloc(config->block_size);
+	uint8_t* actual = (uint8_t*)malloc(config->block_size);
+
+	uint64_t random = client->index + 1;
+	const uint32_t numBlocks = config->file_size / config->block_size;
+	uint32_t numSent = 0;
+	uint32_t numAnswered = 0;
+	while (numAnswered < config->num_requests)
+	{
+		// Top the requests in flight back up, in one batch, once half have been answered
+		if (numSent - numAnswered <= config->depth / 2 && numSent < config->num_requests)
+		{
+			size_t batchSize = 0;
+			while (numSent - numAnswered < config->depth && numSent < config->num_requests)
+			{
+				struct in_flight_t* request = &inFlight[numSent % config->depth];
+				request->offset = (uint32_t)(next_random(&random) % numBlocks) * config->block_size;
+				request->op = next_random(&random) % 100 < config->write_percent ? FAT32_OP_WRITE : FAT32_OP_READ;
+
+				const uint32_t payloadSize = request->op == FAT32_OP_WRITE ? config->block_size : 0;
+				const struct FAT32_request_t header = { payloadSize, numSent, request->op, 0, 0, handle, request->offset, config->block_size };
+				memcpy(batch + batchSize, &header, sizeof(header));
+				batchSize += sizeof(header);
+				if (payloadSize)
+				{
+					fill_pattern((uint8_t*)batch + batchSize, payloadSize, request->offset);
+					batchSize += payloadSize;
+				}
+
+				request->sent = FAT32_monotonic_ns();
+				++numSent;
+			}
+
+			if (!send_all(connection.fd, batch, batchSize))
+			{
+				break;
+			}
+		}
+
+		// Take the next reply
+		struct FAT32_reply_t reply;
+		if (!receive_all(&connection, &reply, sizeof(reply)))
+		{
+			break;
+		}
+		const struct in_flight_t* request = &inFlight[numAnswered % config->depth];
+		client->latencies[numAnswered] = FAT32_monotonic_ns() - request->sent;
+
+		if (reply.id != numAnswered || reply.status != FAT32_STATUS_OK)
+		{
+			++client->num_errors;
+		}
+
+		if (request->op == FAT32_OP_READ)
+		{
+			// Check the bytes read are the ones written
+			const uint32_t kept = reply.payload_size < config->block_size ? reply.payload_size : config->block_size;
+			if (!receive_all(&connection, actual, kept) || !receive_all(&connection, NULL, reply.payload_size - kept))
+			{
+				break;
+			}
+			fill_pattern(expected, config->block_size, request->offset);
+			if (reply.payload_size != config->block_size || memcmp(expected, actual, config->block_size) != 0)
+			{
+				++client->num_mismatches;
+			}
+			client->num_bytes += kept;
+		}
+		else
+		{
+			client->num_bytes += reply.value;
+		}
+		++numAnswered;
+	}
+
+	// Count any requests left unanswered by a failed connection as errors
+	client->num_errors += config->num_requests - numAnswered;
+
+	struct FAT32_request_t request = { 0, 0, FAT32_OP_CLOSE, 0, 0, handle, 0, 0 };
+	struct FAT32_reply_t reply;
+	if (numAnswered == config->num_requests)
+	{
+		call(&connection, &request, NULL, &reply, NULL, 0);
+	}
+
+	free(actual);
+	free(expected);
+	free(batch);
+	free(inFlight);
+	disconnect(&connection);
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("Usage: %s <socket> [-c clients] [-d depth] [-n requests] [-b block bytes] [-f file bytes] [-w write percent]\n", argv[0]);
+		return 1;
+	}
+
+	struct load_test_config_t config = { argv[1], 4, 32, 100000, 4096, 16 * 1024 * 1024, 10 };
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		const uint32_t value = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+		if (strcmp(argv[i], "-c") == 0)
+		{
+			config.num_clients = value;
+		}
+		else if (strcmp(argv[i], "-d") == 0)
+		{
+			config.depth = value;
+		}
+		else if (strcmp(argv[i], "-n") == 0)
+		{
+			config.num_requests = value;
+		}
+		else if (strcmp(argv[i], "-b") == 0)
+		{
+			config.block_size = value;
+		}
+		else if (strcmp(argv[i], "-f") == 0)
+		{
+			config.file_size = value;
+		}
+		else if (strcmp(argv[i], "-w") == 0)
+		{
+			config.write_percent = value;
+		}
+		else
+		{
+			printf("Error: unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (!config.num_clients || !config.depth || !config.num_requests || !config.block_size || config.block_size > FAT32_PROTOCOL_MAX_PAYLOAD ||
+		config.file_size < config.block_size)
+	{
+		printf("Error: there must be at least one client, request and block, blocks may be at most %u bytes, and files must hold a block\n",
+			FAT32_PROTOCOL_MAX_PAYLOAD);
+		return 1;
+	}
+
+	// Clients don't read replies while they send, so what they send at once must fit in what the server reads ahead
+	const uint64_t requestSize = sizeof(struct FAT32_request_t) + (config.write_percent ? config.block_size : 0);
+	if (config.depth * requestSize > 4 * (uint64_t)FAT32_PROTOCOL_MAX_PAYLOAD)
+	{
+		printf("Error: the requests in flight may hold at most %u bytes\n", 4 * FAT32_PROTOCOL_MAX_PAYLOAD);
+		return 1;
+	}
+
+	if (!set_up(&config))
+	{
+		return 1;
+	}
+
+	// Run the clients together
+	struct load_test_client_t* clients = (struct load_test_client_t*)calloc(config.num_clients, sizeof(struct load_test_client_t));
+	FAT32_thread_t* threads = (FAT32_thread_t*)malloc(config.num_clients * sizeof(FAT32_thread_t));
+	const uint64_t start = FAT32_monotonic_ns();
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		clients[i].config = &config;
+		clients[i].index = i;
+		clients[i].latencies = (uint64_t*)calloc(config.num_requests, sizeof(uint64_t));
+		FAT32_thread_create(&threads[i], client_thread, &clients[i]);
+	}
+
+	// Gather the results
+	const uint64_t numRequests = (uint64_t)config.num_clients * config.num_requests;
+	uint64_t* latencies = (uint64_t*)malloc(numRequests * sizeof(uint64_t));
+	uint64_t numBytes = 0;
+	uint64_t totalLatency = 0;
+	uint32_t numErrors = 0;
+	uint32_t numMismatches = 0;
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		FAT32_thread_join(threads[i]);
+		memcpy(latencies + (uint64_t)i * config.num_requests, clients[i].latencies, config.num_requests * sizeof(uint64_t));
+		numBytes += clients[i].num_bytes;
+		numErrors += clients[i].num_errors;
+		numMismatches += clients[i].num_mismatches;
+		free(clients[i].latencies);
+	}
+	const double seconds = (double)(FAT32_monotonic_ns() - start) / 1e9;
+
+	qsort(latencies, numRequests, sizeof(uint64_t), compare_latencies);
+	for (uint64_t i = 0; i < numRequests; ++i)
+	{
+		totalLatency += latencies[i];
+	}
+
+	printf("%u clients, %u in flight each, %u byte blocks, %u%% writes\n", config.num_clients, config.depth, config.block_size, config.write_percent);
+	printf("Requests: %llu in %.2fs (%.0f/s)\n", (unsigned long long)numRequests, seconds, (double)numRequests / seconds);
+	printf("Throughput: %.1f MB/s\n", (double)numBytes / (1024.0 * 1024.0) / seconds);
+	printf("Latency (us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n", (double)totalLatency / (double)numRequests / 1e3,
+		(double)latencies[numRequests / 2] / 1e3, (double)latencies[numRequests * 99 / 100] / 1e3, (double)latencies[numRequests - 1] / 1e3);
+	printf("Errors: %u, mismatched reads: %u\n", numErrors, numMismatches);
+
+	free(latencies);
+	free(threads);
+	free(clients);
+	return numErrors || numMismatches;
+}
@@ -0,0 +1,155 @@
+// FAT32Protocol.h
+#pragma once
+
+#include <stdint.h>
+
+/* The messages 'FAT32Server' exchanges with its clients over a Unix domain socket.
+* Each request is a 'FAT32_request_t' followed by 'payload_size' bytes, and is answered with a 'FAT32_reply_t' followed by its own payload.
+* Both ends are on the same machine, so fields are in its byte order.
+* Requests may be pipelined: a client can send any number of them (in one write, to batch them) before reading the replies.
+* The replies to the requests of one connection come back in the order the requests were sent. */
+
+/* The most bytes a request or reply may carry after its header. Larger requests close the connection. */
+#define FAT32_PROTOCOL_MAX_PAYLOAD (1024 * 1024)
+
+/* The most entries a 'FAT32_OP_READDIR' reply holds. */
+#define FAT32_PROTOCOL_MAX_DIRENTS 256
+
+enum
+{
+    /* Opens the file at the path in the payload. The reply's value is the handle to use for the file.
+    * Flags: 'FAT32_OPEN_CREATE', 'FAT32_OPEN_TRUNCATE'. */
+    FAT32_OP_OPEN = 1,
+
+    /* Closes the file 'handle', writing back its entry if it changed. */
+    FAT32_OP_CLOSE,
+
+    /* Reads up to 'size' bytes at 'offset' in the file 'handle'. The reply carries the bytes, and its value is how many there are. */
+    FAT32_OP_READ,
+
+    /* Writes the payload at 'offset' in the file 'handle'. The reply's value is the number of bytes written. */
+    FAT32_OP_WRITE,
+
+    /* Lists the directory at the path in the payload. 'offset' is where to carry on from: 0 at first, then the value of the last reply.
+    * 'size' is the most entries to return. The reply carries the entries as 'FAT32_protocol_stat_t' records, each followed by its name,
+    * and none once the end of the directory is reached. */
+    FAT32_OP_READDIR,
+
+    /* Describes the entry at the path in the payload. The reply carries a 'FAT32_protocol_stat_t' with no name. */
+    FAT32_OP_STAT,
+
+    /* Creates the file at the path in the payload, 'size' bytes long, or a directory with the 'FAT32_CREATE_DIRECTORY' flag. */
+    FAT32_OP_CREATE,
+
+    /* Deletes the entry at the path in the payload. Files must not be open, and directories must be empty. */
+    FAT32_OP_REMOVE,
+
+    /* Writes back any cached changes, and flushes the image to stable storage. */
+    FAT32_OP_SYNC,
+};
+
+enum
+{
+    /* 'FAT32_OP_OPEN': creates the file if it doesn't exist. */
+    FAT32_OPEN_CREATE = 0x01,
+
+    /* 'FAT32_OP_OPEN': empties the file, to be written over from the start. Fails if the file is already open. */
+    FAT32_OPEN_TRUNCATE = 0x02,
+
+    /* 'FAT32_OP_CREATE': creates a directory rather than a file. */
+    FAT32_CREATE_DIRECTORY = 0x01,
+};
+
+enum
+{
+    FAT32_STATUS_OK = 0,
+
+    /* An entry on the path doesn't exist. */
+    FAT32_STATUS_NOT_FOUND,
+
+    /* The entry to create already exists. */
+    FAT32_STATUS_EXISTS,
+
+    /* The entry is a directory, but must be a file. */
+    FAT32_STATUS_IS_DIRECTORY,
+
+    /* The entry (or one on the way to it) is a file, but must be a directory. */
+    FAT32_STATUS_NOT_DIRECTORY,
+
+    /* The handle isn't one of the connection's open files. */
+    FAT32_STATUS_BAD_HANDLE,
+
+    /* The operation is unknown, or its path or sizes are out of range. */
+    FAT32_STATUS_BAD_REQUEST,
+
+    /* The volume has run out of clusters, or the file can't be written this way (compressed files may only be appended to). */
+    FAT32_STATUS_NO_SPACE,
+
+    /* The file is open, so it can't be deleted or emptied, or the directory has entries, so it can't be deleted. */
+    FAT32_STATUS_BUSY,
+
+    /* The file's contents don't match their checksums. The reply carries the bytes before the damage. */
+    FAT32_STATUS_IO_ERROR,
+};
+
+struct FAT32_request_t
+{
+    /* The number of bytes following the header. */
+    uint32_t payload_size;
+
+    /* Chosen by the client, and copied into the reply. */
+    uint32_t id;
+
+    /* One of the 'FAT32_OP_' values. */
+    uint8_t op;
+
+    /* Options of the operation. */
+    uint8_t flags;
+
+    uint16_t reserved;
+
+    /* The file, for operations on open files. */
+    uint32_t handle;
+
+    /* Byte offset in the file, or where to carry on listing a directory. */
+    uint32_t offset;
+
+    /* Bytes to read, the size of a new file, or the most directory entries to return. */
+    uint32_t size;
+};
+
+struct FAT32_reply_t
+{
+    /* The number of bytes following the header. */
+    uint32_t payload_size;
+
+    /* The id of the request this answers. */
+    uint32_t id;
+
+    /* One of the 'FAT32_STATUS_' values. */
+    uint32_t status;
+
+    /* The result of the operation, as described for each one. */
+    uint32_t value;
+};
+
+/* An entry, as described by 'FAT32_OP_STAT' and 'FAT32_OP_READDIR'. */
+struct FAT32_protocol_stat_t
+{
+    /* The size of the file in bytes (the stored size, for compressed files). */
+    uint32_t size;
+
+    /* The first cluster of the entry's chain. */
+    uint32_t first_cluster;
+
+    /* The entry's 'FAT32_DIR_ENTRY_ATTRIB_' and 'FAT32_DIR_ENTRY_FLAG_' bits. */
+    uint8_t attribs;
+    uint8_t flags;
+
+    /* The date and time the entry was last modified, packed as in directory entries. */
+    uint16_t last_modified_date;
+    uint16_t last_modified_time;
+
+    /* The number of bytes of the name following the record, without a terminator. */
+    uint16_t name_size;
+};
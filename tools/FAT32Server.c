@@ -0,0 +1,1345 @@
+// FAT32Server.c
+// Serves a FAT32 image to local processes over a Unix domain socket, speaking the protocol in FAT32Protocol.h. Linux only.
+// Build from the repository root with:
+//   gcc -O2 -pthread tools/FAT32Server.c source/FAT32*.c -o fat32server
+// Run as:
+//   fat32server <image> <socket> [-j threads] [noatime] [relatime] [checksums]
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../source/FAT32Thread.h"
+#include "../include/FAT32Directory.h"
+#include "FAT32Protocol.h"
+
+/* The most bytes of requests read from a connection before it's waited on to catch up with them. */
+#define FAT32_SERVER_INPUT_LIMIT (4 * (FAT32_PROTOCOL_MAX_PAYLOAD + sizeof(struct FAT32_request_t)))
+
+/* The number of bytes of replies gathered before they're sent. */
+#define FAT32_SERVER_OUTPUT_FLUSH (256 * 1024)
+
+/* How long a send waits for a client that isn't reading its replies before the connection is given up on. */
+#define FAT32_SERVER_SEND_TIMEOUT_MS 30000
+
+/* The number of bytes read through 'FAT32_pread' at a time, where a read can't be sent straight from the image. */
+#define FAT32_SERVER_COPY_CHUNK (64 * 1024)
+
+/* The number of pieces a read reply may be sent in. */
+#define FAT32_SERVER_MAX_PIECES 64
+
+/* The number of events taken from epoll at a time. */
+#define FAT32_SERVER_MAX_EVENTS 64
+
+/* A growable array of bytes. */
+struct server_buffer_t
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+};
+
+/* A file clients have open. Every handle to the same file shares it, so they all see the same chain as it grows. */
+struct server_open_file_t
+{
+	struct FAT32_file_t* file;
+
+	/* The file's entry, as of when it was first opened. */
+	struct FAT32_directory_entry_t entry;
+
+	/* The directory holding the entry, and its name there, to write it back on closing. */
+	FAT32_cluster_address_t dir;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+
+	/* The number of handles to the file. It's closed when the last one is. */
+	uint32_t num_handles;
+
+	/* The number of reads sending the file's clusters straight from the image, which they do once they've let go of the volume, and
+	 * the number of writes waiting for them to finish. Writes may move or free the clusters, so they wait, and reads copy the file
+	 * instead while any are waiting. Guarded by the server's 'mutex'. */
+	uint32_t num_sending;
+	uint32_t num_waiting;
+
+	struct server_open_file_t* next;
+};
+
+struct server_connection_t
+{
+	int fd;
+
+	/* Guards the fields below, which the event loop and the worker serving the connection share. */
+	FAT32_mutex_t mutex;
+
+	/* Bytes received but not yet taken by a worker. */
+	struct server_buffer_t input;
+
+	/* Set while a worker is serving the connection, or it's queued to be. Only one worker serves a connection at a time,
+	 * so its requests are answered in order. */
+	int busy;
+
+	/* Set once the client has hung up, or the connection has failed. */
+	int closed;
+
+	/* Set while the connection isn't polled for input, having sent more than 'FAT32_SERVER_INPUT_LIMIT' bytes ahead. */
+	int paused;
+
+	/* The client's open files, indexed by handle minus one, or NULL for free handles. Only used by the worker serving the connection. */
+	struct server_open_file_t** handles;
+	uint32_t num_handles;
+
+	/* Links in the list of connections the event loop keeps, and in the queue of connections waiting for a worker. */
+	struct server_connection_t* prev;
+	struct server_connection_t* next;
+	struct server_connection_t* next_queued;
+};
+
+struct server_t
+{
+	struct FAT32_volume_t* volume;
+
+	/* Requests that change the volume hold this exclusively; ones that only read it share it. */
+	pthread_rwlock_t volume_lock;
+
+	/* Every file clients have open. Only used while holding the volume exclusively. */
+	struct server_open_file_t* open_files;
+
+	int epoll_fd;
+
+	/* Written by workers when they've finished with a connection, so the event loop frees it. */
+	int event_fd;
+
+	/* Every open connection. Only used by the event loop. */
+	struct server_connection_t* connections;
+
+	/* Guards the fields below. */
+	FAT32_mutex_t mutex;
+
+	/* Signalled when a connection is queued, or the workers should stop. */
+	FAT32_cond_t cond;
+
+	/* Signalled when a read has finished sending clusters from the image. */
+	FAT32_cond_t sent_cond;
+
+	/* Connections waiting for a worker. */
+	struct server_connection_t* queue_head;
+	struct server_connection_t* queue_tail;
+
+	/* Connections the workers have finished with, waiting to be freed by the event loop. */
+	struct server_connection_t* dead;
+
+	int stopping;
+};
+
+/* A part of a read reply: bytes in the image file, or in the worker's copy buffer. */
+struct server_piece_t
+{
+	/* The image file descriptor, or -1 for bytes in the copy buffer. */
+	int fd;
+	uint64_t offset;
+	uint32_t size;
+};
+
+/* The state of one worker thread. */
+struct server_worker_t
+{
+	struct server_t* server;
+
+	/* The requests being answered, taken from a connection. */
+	struct server_buffer_t batch;
+
+	/* Replies gathered to be sent together. */
+	struct server_buffer_t output;
+
+	/* Holds the bytes of reads that can't be sent straight from the image. */
+	char* copy_buffer;
+
+	/* The parts of a read to send once the volume is let go of, and the file they're from. */
+	struct server_piece_t pieces[FAT32_SERVER_MAX_PIECES];
+	uint32_t num_pieces;
+	struct server_open_file_t* sending;
+
+	/* Holds directory entries being listed. */
+	struct FAT32_dirent_t* dirents;
+};
+
+static void buffer_reserve(struct server_buffer_t* buffer, size_t size)
+{
+	if (buffer->size + size <= buffer->capacity)
+	{
+		return;
+	}
+
+	size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+	while (capacity < buffer->size + size)
+	{
+		capacity *= 2;
+	}
+	buffer->data = (char*)realloc(buffer->data, capacity);
+	buffer->capacity = capacity;
+}
+
+static void buffer_append(struct server_buffer_t* buffer, const void* data, size_t size)
+{
+	buffer_reserve(buffer, size);
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+/* Returns the number of bytes at the start of the buffer that make up whole requests. Returns SIZE_MAX if a request is too large. */
+static size_t complete_requests(const struct server_buffer_t* buffer)
+{
+	size_t pos = 0;
+	while (buffer->size - pos >= sizeof(struct FAT32_request_t))
+	{
+		struct FAT32_request_t request;
+		memcpy(&request, buffer->data + pos, sizeof(request));
+		if (request.payload_size > FAT32_PROTOCOL_MAX_PAYLOAD)
+		{
+			return SIZE_MAX;
+		}
+		if (buffer->size - pos - sizeof(request) < request.payload_size)
+		{
+			break;
+		}
+		pos += sizeof(request) + request.payload_size;
+	}
+	return pos;
+}
+
+/* Queues a connection for a worker to serve. */
+static void queue_connection(struct server_t* server, struct server_connection_t* connection)
+{
+	FAT32_mutex_lock(&server->mutex);
+	connection->next_queued = NULL;
+	if (server->queue_tail)
+	{
+		server->queue_tail->next_queued = connection;
+	}
+	else
+	{
+		server->queue_head = connection;
+	}
+	server->queue_tail = connection;
+	FAT32_cond_signal(&server->cond);
+	FAT32_mutex_unlock(&server->mutex);
+}
+
+/* Waits for the connection's socket to take more bytes. Returns 0 if the client has stopped reading. */
+static int wait_writable(int fd)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	return poll(&pfd, 1, FAT32_SERVER_SEND_TIMEOUT_MS) == 1 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+/* Sends bytes to the client. Returns 0 if the connection has failed. */
+static int send_all(int fd, const char* data, size_t size)
+{
+	while (size)
+	{
+		const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if (sent > 0)
+		{
+			data += sent;
+			size -= (size_t)sent;
+		}
+		else if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (sent < 0 && errno == EAGAIN && wait_writable(fd))
+		{
+			continue;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Sends bytes to the client straight from the image file, without copying them through the process. Returns 0 if the connection has failed. */
+static int sendfile_all(int fd, int imageFd, uint64_t offset, size_t size)
+{
+	off_t pos = (off_t)offset;
+	while (size)
+	{
+		const ssize_t sent = sendfile(fd, imageFd, &pos, size);
+		if (sent > 0)
+		{
+			size -= (size_t)sent;
+		}
+		else if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (sent < 0 && errno == EAGAIN && wait_writable(fd))
+		{
+			continue;
+		}
+		else
+		{
+			// Stopping short of the size promised in the reply header leaves the client no way to find the next reply
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Sends the gathered replies. */
+static void flush_output(struct server_worker_t* worker, struct server_connection_t* connection)
+{
+	if (worker->output.size && !send_all(connection->fd, worker->output.data, worker->output.size))
+	{
+		FAT32_mutex_lock(&connection->mutex);
+		connection->closed = 1;
+		FAT32_mutex_unlock(&connection->mutex);
+	}
+	worker->output.size = 0;
+}
+
+/* Adds a reply to the output, to be sent with the rest of the batch. */
+static void add_reply(struct server_worker_t* worker, uint32_t id, uint32_t status, uint32_t value, const void* payload, uint32_t payloadSize)
+{
+	const struct FAT32_reply_t reply = { payloadSize, id, status, value };
+	buffer_append(&worker->output, &reply, sizeof(reply));
+	if (payloadSize)
+	{
+		buffer_append(&worker->output, payload, payloadSize);
+	}
+}
+
+/* Opens the directory holding the entry at the given path, and copies the entry's name into 'outName'. The name is empty for the root
+* directory itself. Returns a 'FAT32_STATUS_' value. */
+static uint32_t open_parent(struct FAT32_volume_t* volume, const char* path, uint32_t pathSize, struct FAT32_file_t** outDir, char* outName)
+{
+	*outDir = FAT32_fopen(volume, FAT32_get_root(volume), UINT32_MAX);
+
+	// Allow for clients that send the path's terminator
+	while (pathSize && !path[pathSize - 1])
+	{
+		--pathSize;
+	}
+
+	uint32_t pos = 0;
+	while (1)
+	{
+		// Take the next name from the path
+		while (pos < pathSize && path[pos] == '/')
+		{
+			++pos;
+		}
+		uint32_t end = pos;
+		while (end < pathSize && path[end] != '/')
+		{
+			++end;
+		}
+		if (end - pos >= FAT32_DIR_LONG_NAME_LEN || memchr(path + pos, 0, end - pos))
+		{
+			FAT32_fclose(*outDir);
+			return FAT32_STATUS_BAD_REQUEST;
+		}
+		memcpy(outName, path + pos, end - pos);
+		outName[end - pos] = 0;
+
+		// Skip any trailing slashes, to see if this is the last name
+		uint32_t next = end;
+		while (next < pathSize && path[next] == '/')
+		{
+			++next;
+		}
+		if (next == pathSize)
+		{
+			return FAT32_STATUS_OK;
+		}
+
+		// Go down into the directory
+		struct FAT32_directory_entry_t entry;
+		if (!FAT32_dir_get_entry(*outDir, outName, &entry))
+		{
+			FAT32_fclose(*outDir);
+			return FAT32_STATUS_NOT_FOUND;
+		}
+		if (!(entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY))
+		{
+			FAT32_fclose(*outDir);
+			return FAT32_STATUS_NOT_DIRECTORY;
+		}
+
+		struct FAT32_file_t* dir = FAT32_dir_open_entry(volume, &entry);
+		FAT32_fclose(*outDir);
+		*outDir = dir;
+		pos = next;
+	}
+}
+
+/* Describes an entry for the protocol. */
+static void fill_stat(const struct FAT32_directory_entry_t* entry, uint16_t nameSize, struct FAT32_protocol_stat_t* outStat)
+{
+	outStat->size = entry->size;
+	outStat->first_cluster = FAT32_dir_get_entry_address(entry).index;
+	outStat->attribs = entry->attribs;
+	outStat->flags = entry->flags;
+	memcpy(&outStat->last_modified_date, &entry->last_modified_date, sizeof(uint16_t));
+	memcpy(&outStat->last_modified_time, &entry->last_modified_time, sizeof(uint16_t));
+	outStat->name_size = nameSize;
+}
+
+/* Returns the open file for a handle, or NULL if the handle isn't open. */
+static struct server_open_file_t* get_handle(struct server_connection_t* connection, uint32_t handle)
+{
+	if (handle == 0 || handle > connection->num_handles)
+	{
+		return NULL;
+	}
+	return connection->handles[handle - 1];
+}
+
+/* Returns the open file for the given entry of the directory, or NULL if no client has it open. The volume must be held exclusively. */
+static struct server_open_file_t* find_open_file(struct server_t* server, FAT32_cluster_address_t dir, const char* name, const struct FAT32_directory_entry_t* entry)
+{
+	// Files are told apart by their chains. Files without one can only be told apart by where their entries are.
+	const FAT32_cluster_address_t address = FAT32_dir_get_entry_address(entry);
+	for (struct server_open_file_t* openFile = server->open_files; openFile; openFile = openFile->next)
+	{
+		const FAT32_cluster_address_t openAddress = FAT32_dir_get_entry_address(&openFile->entry);
+		if (address.index != FAT32_CLUSTER_ADDRESS_NULL ? openAddress.index == address.index :
+			openAddress.index == FAT32_CLUSTER_ADDRESS_NULL && openFile->dir.index == dir.index && strcasecmp(openFile->name, name) == 0)
+		{
+			return openFile;
+		}
+	}
+	return NULL;
+}
+
+/* Closes a handle. Closing the last handle to a file closes the file, writing its entry back to its directory if that changed.
+* The volume must be held exclusively. */
+static void close_handle(struct server_t* server, struct server_connection_t* connection, uint32_t handle)
+{
+	struct server_open_file_t* openFile = connection->handles[handle - 1];
+	connection->handles[handle - 1] = NULL;
+	if (--openFile->num_handles)
+	{
+		return;
+	}
+
+	const FAT32_cluster_address_t address = FAT32_dir_get_entry_address(&openFile->entry);
+	if (FAT32_dir_close_entry(&openFile->entry, openFile->file))
+	{
+		// Only write back the entry if it's still the same file
+		struct FAT32_file_t* dir = FAT32_fopen(server->volume, openFile->dir, UINT32_MAX);
+		struct FAT32_directory_entry_t current;
+		if (FAT32_dir_get_entry(dir, openFile->name, &current) && FAT32_dir_get_entry_address(&current).index == address.index)
+		{
+			FAT32_dir_update_entry(dir, &openFile->entry);
+		}
+		FAT32_fclose(dir);
+	}
+
+	struct server_open_file_t** link = &server->open_files;
+	while (*link != openFile)
+	{
+		link = &(*link)->next;
+	}
+	*link = openFile->next;
+	free(openFile);
+}
+
+/* Closes every handle the connection has open. The volume must be held exclusively. */
+static void close_handles(struct server_t* server, struct server_connection_t* connection)
+{
+	for (uint32_t i = 1; i <= connection->num_handles; ++i)
+	{
+		if (connection->handles[i - 1])
+		{
+			close_handle(server, connection, i);
+		}
+	}
+}
+
+static uint32_t op_open(struct server_t* server, struct server_connection_t* connection, const struct FAT32_request_t* request, const char* path, uint32_t* outHandle)
+{
+	struct FAT32_file_t* dir;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	uint32_t status = open_parent(server->volume, path, request->payload_size, &dir, name);
+	if (status != FAT32_STATUS_OK)
+	{
+		return status;
+	}
+
+	struct FAT32_directory_entry_t entry;
+	struct server_open_file_t* openFile = NULL;
+	if (!name[0])
+	{
+		status = FAT32_STATUS_IS_DIRECTORY;
+	}
+	else if (!FAT32_dir_get_entry(dir, name, &entry))
+	{
+		if (!(request->flags & FAT32_OPEN_CREATE))
+		{
+			status = FAT32_STATUS_NOT_FOUND;
+		}
+		else if (!FAT32_dir_new_entry(dir, name, 0, &entry))
+		{
+			status = FAT32_STATUS_NO_SPACE;
+		}
+	}
+	else if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY)
+	{
+		status = FAT32_STATUS_IS_DIRECTORY;
+	}
+	else
+	{
+		// Share the file with the other handles to it, but don't empty it under them
+		openFile = find_open_file(server, FAT32_faddress(dir), name, &entry);
+		if (openFile && (request->flags & FAT32_OPEN_TRUNCATE))
+		{
+			status = FAT32_STATUS_BUSY;
+		}
+	}
+
+	if (status == FAT32_STATUS_OK)
+	{
+		if (!openFile)
+		{
+			openFile = (struct server_open_file_t*)calloc(1, sizeof(struct server_open_file_t));
+			openFile->entry = entry;
+			openFile->file = request->flags & FAT32_OPEN_TRUNCATE ? FAT32_dir_open_entry_overwrite(server->volume, &openFile->entry) :
+				FAT32_dir_open_entry(server->volume, &openFile->entry);
+			openFile->dir = FAT32_faddress(dir);
+			strcpy(openFile->name, name);
+			openFile->next = server->open_files;
+			server->open_files = openFile;
+		}
+		++openFile->num_handles;
+
+		// Reuse a free handle, or add one
+		uint32_t index = 0;
+		while (index < connection->num_handles && connection->handles[index])
+		{
+			++index;
+		}
+		if (index == connection->num_handles)
+		{
+			connection->handles = (struct server_open_file_t**)realloc(connection->handles, ++connection->num_handles * sizeof(struct server_open_file_t*));
+		}
+		connection->handles[index] = openFile;
+		*outHandle = index + 1;
+	}
+
+	FAT32_fclose(dir);
+	return status;
+}
+
+/* Answers a read. Parts of the file that lie in the image as they are are left in the worker's pieces, to be sent straight from the
+* image by 'send_pieces' once the volume has been let go of, and the rest is copied now. */
+static void op_read(struct server_worker_t* worker, struct server_connection_t* connection, const struct FAT32_request_t* request)
+{
+	struct server_t* server = worker->server;
+	struct server_open_file_t* handle = get_handle(connection, request->handle);
+	if (!handle)
+	{
+		add_reply(worker, request->id, FAT32_STATUS_BAD_HANDLE, 0, NULL, 0);
+		return;
+	}
+
+	// Writes set 'num_waiting' while they hold the volume, so it can't change while this read shares it
+	FAT32_mutex_lock(&server->mutex);
+	const int mappable = handle->num_waiting == 0;
+	FAT32_mutex_unlock(&server->mutex);
+
+	// Work out where each part of the read comes from. Runs of clusters that lie in the image as they are can be sent with 'sendfile',
+	// and the rest is copied through 'FAT32_pread'.
+	const uint32_t size = request->size < FAT32_PROTOCOL_MAX_PAYLOAD ? request->size : FAT32_PROTOCOL_MAX_PAYLOAD;
+	struct server_piece_t* pieces = worker->pieces;
+	uint32_t numPieces = 0;
+	uint32_t done = 0;
+	uint32_t copied = 0;
+	uint32_t status = FAT32_STATUS_OK;
+	while (done < size && numPieces < FAT32_SERVER_MAX_PIECES)
+	{
+		struct server_piece_t* piece = &pieces[numPieces];
+		piece->size = mappable ? (uint32_t)FAT32_pread_map(handle->file, size - done, request->offset + done, &piece->fd, &piece->offset) : 0;
+		if (!piece->size)
+		{
+			// Copy a chunk, then look again for bytes that can be sent from the image
+			const uint32_t chunk = size - done < FAT32_SERVER_COPY_CHUNK ? size - done : FAT32_SERVER_COPY_CHUNK;
+			piece->fd = -1;
+			piece->offset = copied;
+			piece->size = (uint32_t)FAT32_pread(handle->file, worker->copy_buffer + copied, chunk, request->offset + done);
+			copied += piece->size;
+
+			// Stop at the end of the file, or at damage
+			if (piece->size < chunk)
+			{
+				status = FAT32_ferror(handle->file) ? FAT32_STATUS_IO_ERROR : FAT32_STATUS_OK;
+				done += piece->size;
+				numPieces += piece->size != 0;
+				break;
+			}
+		}
+		done += piece->size;
+		++numPieces;
+	}
+
+	// Reads that were all copied are only gathered with the other replies
+	if (copied == done)
+	{
+		add_reply(worker, request->id, status, done, worker->copy_buffer, done);
+		return;
+	}
+
+	// Otherwise the header goes out with the replies gathered so far, followed by the pieces. Writes to the file wait for them to be sent.
+	const struct FAT32_reply_t reply = { done, request->id, status, done };
+	buffer_append(&worker->output, &reply, sizeof(reply));
+	worker->num_pieces = numPieces;
+	worker->sending = handle;
+
+	FAT32_mutex_lock(&server->mutex);
+	++handle->num_sending;
+	FAT32_mutex_unlock(&server->mutex);
+}
+
+/* Sends the reply 'op_read' left in the worker's pieces, in order, then lets writes to the file go ahead. */
+static void send_pieces(struct server_worker_t* worker, struct server_connection_t* connection)
+{
+	struct server_t* server = worker->server;
+	flush_output(worker, connection);
+	for (uint32_t i = 0; i < worker->num_pieces; ++i)
+	{
+		const struct server_piece_t* piece = &worker->pieces[i];
+		const int sent = piece->fd < 0 ? send_all(connection->fd, worker->copy_buffer + piece->offset, piece->size) :
+			sendfile_all(connection->fd, piece->fd, piece->offset, piece->size);
+		if (!sent)
+		{
+			FAT32_mutex_lock(&connection->mutex);
+			connection->closed = 1;
+			FAT32_mutex_unlock(&connection->mutex);
+			break;
+		}
+	}
+
+	FAT32_mutex_lock(&server->mutex);
+	if (--worker->sending->num_sending == 0)
+	{
+		FAT32_cond_broadcast(&server->sent_cond);
+	}
+	FAT32_mutex_unlock(&server->mutex);
+	worker->sending = NULL;
+}
+
+/* Waits until no reads are sending the file's clusters from the image, so a write can change them. The volume must be held exclusively,
+* and is let go of while waiting. */
+static void wait_for_sends(struct server_t* server, struct server_open_file_t* openFile)
+{
+	FAT32_mutex_lock(&server->mutex);
+	if (openFile->num_sending)
+	{
+		++openFile->num_waiting;
+		while (openFile->num_sending)
+		{
+			// The volume is always taken before the mutex
+			pthread_rwlock_unlock(&server->volume_lock);
+			FAT32_cond_wait(&server->sent_cond, &server->mutex);
+			FAT32_mutex_unlock(&server->mutex);
+			pthread_rwlock_wrlock(&server->volume_lock);
+			FAT32_mutex_lock(&server->mutex);
+		}
+		--openFile->num_waiting;
+	}
+	FAT32_mutex_unlock(&server->mutex);
+}
+
+static void op_readdir(struct server_worker_t* worker, const struct FAT32_request_t* request, const char* path)
+{
+	struct FAT32_volume_t* volume = worker->server->volume;
+	struct FAT32_file_t* parent;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	uint32_t status = open_parent(volume, path, request->payload_size, &parent, name);
+	if (status != FAT32_STATUS_OK)
+	{
+		add_reply(worker, request->id, status, 0, NULL, 0);
+		return;
+	}
+
+	// Open the directory itself
+	struct FAT32_file_t* dir = parent;
+	if (name[0])
+	{
+		struct FAT32_directory_entry_t entry;
+		dir = NULL;
+		if (!FAT32_dir_get_entry(parent, name, &entry))
+		{
+			status = FAT32_STATUS_NOT_FOUND;
+		}
+		else if (!(entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY))
+		{
+			status = FAT32_STATUS_NOT_DIRECTORY;
+		}
+		else
+		{
+			dir = FAT32_dir_open_entry(volume, &entry);
+		}
+		FAT32_fclose(parent);
+	}
+	if (!dir)
+	{
+		add_reply(worker, request->id, status, 0, NULL, 0);
+		return;
+	}
+
+	// Decode the entries, and write them straight into the output after the reply header
+	const uint32_t maxEntries = request->size < FAT32_PROTOCOL_MAX_DIRENTS ? request->size : FAT32_PROTOCOL_MAX_DIRENTS;
+	uint32_t cookie = request->offset;
+	const uint32_t numEntries = FAT32_readdir_batch(dir, &cookie, worker->dirents, maxEntries);
+	FAT32_fclose(dir);
+
+	const size_t replyPos = worker->output.size;
+	buffer_reserve(&worker->output, sizeof(struct FAT32_reply_t) + numEntries * (sizeof(struct FAT32_protocol_stat_t) + FAT32_DIR_LONG_NAME_LEN));
+	worker->output.size += sizeof(struct FAT32_reply_t);
+	for (uint32_t i = 0; i < numEntries; ++i)
+	{
+		const uint16_t nameSize = (uint16_t)strlen(worker->dirents[i].name);
+		struct FAT32_protocol_stat_t stat;
+		fill_stat(&worker->dirents[i].entry, nameSize, &stat);
+		buffer_append(&worker->output, &stat, sizeof(stat));
+		buffer_append(&worker->output, worker->dirents[i].name, nameSize);
+	}
+
+	const struct FAT32_reply_t reply = { (uint32_t)(worker->output.size - replyPos - sizeof(struct FAT32_reply_t)), request->id, FAT32_STATUS_OK, cookie };
+	memcpy(worker->output.data + replyPos, &reply, sizeof(reply));
+}
+
+static uint32_t op_stat(struct FAT32_volume_t* volume, const struct FAT32_request_t* request, const char* path, struct FAT32_protocol_stat_t* outStat)
+{
+	struct FAT32_file_t* dir;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	uint32_t status = open_parent(volume, path, request->payload_size, &dir, name);
+	if (status != FAT32_STATUS_OK)
+	{
+		return status;
+	}
+
+	// The root directory has no entry of its own
+	struct FAT32_directory_entry_t entry;
+	if (!name[0])
+	{
+		memset(&entry, 0, sizeof(entry));
+		entry.attribs = FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY;
+		FAT32_dir_set_entry_address(&entry, FAT32_get_root(volume));
+	}
+	else if (!FAT32_dir_get_entry(dir, name, &entry))
+	{
+		status = FAT32_STATUS_NOT_FOUND;
+	}
+
+	fill_stat(&entry, 0, outStat);
+	FAT32_fclose(dir);
+	return status;
+}
+
+static uint32_t op_create(struct FAT32_volume_t* volume, const struct FAT32_request_t* request, const char* path)
+{
+	struct FAT32_file_t* dir;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	uint32_t status = open_parent(volume, path, request->payload_size, &dir, name);
+	if (status != FAT32_STATUS_OK)
+	{
+		return status;
+	}
+
+	struct FAT32_directory_entry_t entry;
+	if (!name[0] || FAT32_dir_get_entry(dir, name, &entry))
+	{
+		status = FAT32_STATUS_EXISTS;
+	}
+	else if (request->flags & FAT32_CREATE_DIRECTORY)
+	{
+		if (!FAT32_dir_new_directory(dir, name, &entry))
+		{
+			status = FAT32_STATUS_NO_SPACE;
+		}
+	}
+	else if (!FAT32_dir_new_file(dir, name, 0, request->size, &entry))
+	{
+		status = FAT32_STATUS_NO_SPACE;
+	}
+
+	FAT32_fclose(dir);
+	return status;
+}
+
+/* Returns whether the directory has any entries besides its '.' and '..' links. */
+static int has_entries(struct FAT32_volume_t* volume, struct FAT32_directory_entry_t* entry)
+{
+	struct FAT32_file_t* dir = FAT32_dir_open_entry(volume, entry);
+	struct FAT32_directory_entry_t child;
+	int found = 0;
+	while (!found && FAT32_dir_read_entry(dir, &child, NULL))
+	{
+		found = !FAT32_dir_is_dot_entry(&child) && !(child.attribs & FAT32_DIR_ENTRY_ATTRIB_VOLUME_ID);
+	}
+	FAT32_fclose(dir);
+	return found;
+}
+
+static uint32_t op_remove(struct server_t* server, const struct FAT32_request_t* request, const char* path)
+{
+	struct FAT32_file_t* dir;
+	char name[FAT32_DIR_LONG_NAME_LEN];
+	uint32_t status = open_parent(server->volume, path, request->payload_size, &dir, name);
+	if (status != FAT32_STATUS_OK)
+	{
+		return status;
+	}
+
+	// Only remove files no one has open, and empty directories, so no open file is ever deleted from under its handles
+	struct FAT32_directory_entry_t entry;
+	if (!name[0])
+	{
+		status = FAT32_STATUS_BAD_REQUEST;
+	}
+	else if (!FAT32_dir_get_entry(dir, name, &entry))
+	{
+		status = FAT32_STATUS_NOT_FOUND;
+	}
+	else if (entry.attribs & FAT32_DIR_ENTRY_ATTRIB_SUBDIRECTORY ? has_entries(server->volume, &entry) :
+		find_open_file(server, FAT32_faddress(dir), name, &entry) != NULL)
+	{
+		status = FAT32_STATUS_BUSY;
+	}
+	else if (!FAT32_dir_remove_entry(dir, name))
+	{
+		status = FAT32_STATUS_BAD_REQUEST;
+	}
+
+	FAT32_fclose(dir);
+	return status;
+}
+
+/* Answers one request. */
+static void serve_request(struct server_worker_t* worker, struct server_connection_t* connection, const struct FAT32_request_t* request, const char* payload)
+{
+	struct server_t* server = worker->server;
+	struct FAT32_volume_t* volume = server->volume;
+
+	// Reads share the volume with each other, and everything else has it to itself
+	const int exclusive = !(request->op == FAT32_OP_READ || request->op == FAT32_OP_READDIR || request->op == FAT32_OP_STAT);
+	if (exclusive)
+	{
+		pthread_rwlock_wrlock(&server->volume_lock);
+	}
+	else
+	{
+		pthread_rwlock_rdlock(&server->volume_lock);
+	}
+
+	uint32_t status = FAT32_STATUS_OK;
+	uint32_t value = 0;
+	switch (request->op)
+	{
+	case FAT32_OP_OPEN:
+		status = op_open(server, connection, request, payload, &value);
+		add_reply(worker, request->id, status, value, NULL, 0);
+		break;
+
+	case FAT32_OP_CLOSE:
+	{
+		struct server_open_file_t* handle = get_handle(connection, request->handle);
+		if (handle)
+		{
+			close_handle(server, connection, request->handle);
+		}
+		add_reply(worker, request->id, handle ? FAT32_STATUS_OK : FAT32_STATUS_BAD_HANDLE, 0, NULL, 0);
+		break;
+	}
+
+	case FAT32_OP_READ:
+		op_read(worker, connection, request);
+		break;
+
+	case FAT32_OP_WRITE:
+	{
+		struct server_open_file_t* handle = get_handle(connection, request->handle);
+		if (handle)
+		{
+			wait_for_sends(server, handle);
+			value = (uint32_t)FAT32_pwrite(handle->file, payload, request->payload_size, request->offset);
+			status = value == request->payload_size ? FAT32_STATUS_OK : FAT32_STATUS_NO_SPACE;
+		}
+		add_reply(worker, request->id, handle ? status : FAT32_STATUS_BAD_HANDLE, value, NULL, 0);
+		break;
+	}
+
+	case FAT32_OP_READDIR:
+		op_readdir(worker, request, payload);
+		break;
+
+	case FAT32_OP_STAT:
+	{
+		struct FAT32_protocol_stat_t stat;
+		status = op_stat(volume, request, payload, &stat);
+		add_reply(worker, request->id, status, 0, &stat, status == FAT32_STATUS_OK ? sizeof(stat) : 0);
+		break;
+	}
+
+	case FAT32_OP_CREATE:
+		add_reply(worker, request->id, op_create(volume, request, payload), 0, NULL, 0);
+		break;
+
+	case FAT32_OP_REMOVE:
+		add_reply(worker, request->id, op_remove(server, request, payload), 0, NULL, 0);
+		break;
+
+	case FAT32_OP_SYNC:
+		FAT32_sync(volume);
+		add_reply(worker, request->id, FAT32_STATUS_OK, 0, NULL, 0);
+		break;
+
+	default:
+		add_reply(worker, request->id, FAT32_STATUS_BAD_REQUEST, 0, NULL, 0);
+		break;
+	}
+
+	pthread_rwlock_unlock(&server->volume_lock);
+
+	// Reads send from the image without holding the volume, so a slow client doesn't hold up the others
+	if (worker->sending)
+	{
+		send_pieces(worker, connection);
+	}
+
+	// Don't let replies pile up
+	if (worker->output.size >= FAT32_SERVER_OUTPUT_FLUSH)
+	{
+		flush_output(worker, connection);
+	}
+}
+
+/* Closes the files of a connection whose client has gone, and hands it back to the event loop to be freed. */
+static void retire_connection(struct server_t* server, struct server_connection_t* connection)
+{
+	pthread_rwlock_wrlock(&server->volume_lock);
+	close_handles(server, connection);
+	pthread_rwlock_unlock(&server->volume_lock);
+
+	FAT32_mutex_lock(&server->mutex);
+	connection->next_queued = server->dead;
+	server->dead = connection;
+	FAT32_mutex_unlock(&server->mutex);
+
+	const uint64_t one = 1;
+	ssize_t written = write(server->event_fd, &one, sizeof(one));
+	(void)written;
+}
+
+/* Answers the whole requests a connection has sent so far. If it's sent more by then, it goes to the back of the queue,
+* so a client that never stops sending can't keep a worker from the others. */
+static void serve_connection(struct server_worker_t* worker, struct server_connection_t* connection)
+{
+	struct server_t* server = worker->server;
+	FAT32_mutex_lock(&connection->mutex);
+
+	// Take the whole requests, leaving any partial one behind
+	size_t size = complete_requests(&connection->input);
+	if (size == SIZE_MAX)
+	{
+		connection->closed = 1;
+		size = 0;
+	}
+	if (size)
+	{
+		struct server_buffer_t taken = connection->input;
+		connection->input = worker->batch;
+		connection->input.size = 0;
+		if (taken.size > size)
+		{
+			buffer_append(&connection->input, taken.data + size, taken.size - size);
+		}
+		taken.size = size;
+		worker->batch = taken;
+	}
+
+	// Start listening to the client again, now its requests have been taken
+	if (connection->paused && !connection->closed)
+	{
+		struct epoll_event event = { EPOLLIN | EPOLLRDHUP, { .ptr = connection } };
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+		connection->paused = 0;
+	}
+
+	// Once the client has gone and everything it sent has been answered, the connection is done with
+	if (!size && connection->closed)
+	{
+		FAT32_mutex_unlock(&connection->mutex);
+		retire_connection(server, connection);
+		return;
+	}
+	FAT32_mutex_unlock(&connection->mutex);
+
+	// Answer the requests in order, and send the replies together
+	size_t pos = 0;
+	while (pos < size)
+	{
+		struct FAT32_request_t request;
+		memcpy(&request, worker->batch.data + pos, sizeof(request));
+		serve_request(worker, connection, &request, worker->batch.data + pos + sizeof(request));
+		pos += sizeof(request) + request.payload_size;
+	}
+	flush_output(worker, connection);
+
+	// Queue the connection again if there's more to do, or leave it to the event loop
+	FAT32_mutex_lock(&connection->mutex);
+	const int more = connection->closed || complete_requests(&connection->input) != 0;
+	connection->busy = more;
+	FAT32_mutex_unlock(&connection->mutex);
+
+	if (more)
+	{
+		queue_connection(server, connection);
+	}
+}
+
+static void worker_thread(void* userData)
+{
+	struct server_worker_t* worker = (struct server_worker_t*)userData;
+	struct server_t* server = worker->server;
+
+	while (1)
+	{
+		FAT32_mutex_lock(&server->mutex);
+		while (!server->queue_head && !server->stopping)
+		{
+			FAT32_cond_wait(&server->cond, &server->mutex);
+		}
+
+		// Finish the queued connections before stopping
+		struct server_connection_t* connection = server->queue_head;
+		if (!connection)
+		{
+			FAT32_mutex_unlock(&server->mutex);
+			return;
+		}
+		server->queue_head = connection->next_queued;
+		if (!server->queue_head)
+		{
+			server->queue_tail = NULL;
+		}
+		FAT32_mutex_unlock(&server->mutex);
+
+		serve_connection(worker, connection);
+	}
+}
+
+static void accept_connections(struct server_t* server, int listenFd)
+{
+	while (1)
+	{
+		const int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			return;
+		}
+
+		struct server_connection_t* connection = (struct server_connection_t*)calloc(1, sizeof(struct server_connection_t));
+		connection->fd = fd;
+		FAT32_mutex_init(&connection->mutex);
+
+		connection->next = server->connections;
+		if (server->connections)
+		{
+			server->connections->prev = connection;
+		}
+		server->connections = connection;
+
+		struct epoll_event event = { EPOLLIN | EPOLLRDHUP, { .ptr = connection } };
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+/* Reads what the client has sent, and queues the connection if it has whole requests to answer. */
+static void receive(struct server_t* server, struct server_connection_t* connection, uint32_t events)
+{
+	FAT32_mutex_lock(&connection->mutex);
+
+	// Hang-ups are reported even while the connection is paused, so don't rely on reading to notice them
+	if (events & (EPOLLHUP | EPOLLERR))
+	{
+		connection->closed = 1;
+	}
+
+	while (!connection->closed && connection->input.size < FAT32_SERVER_INPUT_LIMIT)
+	{
+		buffer_reserve(&connection->input, 64 * 1024);
+		const ssize_t received = recv(connection->fd, connection->input.data + connection->input.size, connection->input.capacity - connection->input.size, 0);
+		if (received > 0)
+		{
+			connection->input.size += (size_t)received;
+		}
+		else if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			// The client has hung up, or failed
+			if (received == 0 || errno != EAGAIN)
+			{
+				connection->closed = 1;
+			}
+			break;
+		}
+	}
+
+	// Stop polling a client that's hung up, or that's too far ahead of the workers
+	if (connection->closed)
+	{
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	}
+	else if (connection->input.size >= FAT32_SERVER_INPUT_LIMIT && !connection->paused)
+	{
+		struct epoll_event event = { 0, { .ptr = connection } };
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+		connection->paused = 1;
+	}
+
+	const int queue = !connection->busy && (connection->closed || complete_requests(&connection->input));
+	connection->busy |= queue;
+	FAT32_mutex_unlock(&connection->mutex);
+
+	if (queue)
+	{
+		queue_connection(server, connection);
+	}
+}
+
+static void free_connection(struct server_t* server, struct server_connection_t* connection)
+{
+	if (connection->prev)
+	{
+		connection->prev->next = connection->next;
+	}
+	else
+	{
+		server->connections = connection->next;
+	}
+	if (connection->next)
+	{
+		connection->next->prev = connection->prev;
+	}
+
+	close(connection->fd);
+	FAT32_mutex_destroy(&connection->mutex);
+	free(connection->input.data);
+	free(connection->handles);
+	free(connection);
+}
+
+/* Frees the connections the workers have finished with. */
+static void free_dead_connections(struct server_t* server)
+{
+	FAT32_mutex_lock(&server->mutex);
+	struct server_connection_t* connection = server->dead;
+	server->dead = NULL;
+	FAT32_mutex_unlock(&server->mutex);
+
+	while (connection)
+	{
+		struct server_connection_t* next = connection->next_queued;
+		free_connection(server, connection);
+		connection = next;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("Usage: %s <image> <socket> [-j threads] [noatime] [relatime] [checksums]\n", argv[0]);
+		return 1;
+	}
+
+	// Any arguments after the socket are the number of workers and mount options
+	uint32_t numThreads = FAT32_thread_hardware_concurrency();
+	FAT32_mount_flags_t flags = 0;
+	for (int i = 3; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+		{
+			numThreads = (uint32_t)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "noatime") == 0)
+		{
+			flags |= FAT32_MOUNT_NOATIME;
+		}
+		else if (strcmp(argv[i], "relatime") == 0)
+		{
+			flags |= FAT32_MOUNT_RELATIME;
+		}
+		else if (strcmp(argv[i], "checksums") == 0)
+		{
+			flags |= FAT32_MOUNT_CHECKSUMS;
+		}
+		else
+		{
+			printf("Error: unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	numThreads = numThreads ? numThreads : 1;
+
+	struct server_t server;
+	memset(&server, 0, sizeof(server));
+	server.volume = FAT32_init(argv[1], flags);
+	if (!server.volume)
+	{
+		printf("Error: '%s' is not a FAT32 image\n", argv[1]);
+		return 1;
+	}
+
+	// Listen on the socket, replacing any left behind by an earlier run
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(argv[2]) >= sizeof(address.sun_path))
+	{
+		printf("Error: the socket path '%s' is too long\n", argv[2]);
+		FAT32_shutdown(server.volume);
+		return 1;
+	}
+	strcpy(address.sun_path, argv[2]);
+	unlink(argv[2]);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+	{
+		printf("Error: can't listen on '%s': %s\n", argv[2], strerror(errno));
+		FAT32_shutdown(server.volume);
+		return 1;
+	}
+
+	// Stop cleanly on Ctrl+C or 'kill', and never die writing to a client that's gone
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+	// Let waiting writers in ahead of new readers, so a stream of reads can't hold off writes
+	pthread_rwlockattr_t lockAttributes;
+	pthread_rwlockattr_init(&lockAttributes);
+	pthread_rwlockattr_setkind_np(&lockAttributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&server.volume_lock, &lockAttributes);
+	pthread_rwlockattr_destroy(&lockAttributes);
+
+	FAT32_mutex_init(&server.mutex);
+	FAT32_cond_init(&server.cond);
+	FAT32_cond_init(&server.sent_cond);
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	// The listening socket, the signals and the worker notifications are told apart by their data
+	struct epoll_event event = { EPOLLIN, { .ptr = &listenFd } };
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listenFd, &event);
+	event.data.ptr = &server.event_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.event_fd, &event);
+	event.data.ptr = &signalFd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, signalFd, &event);
+
+	// Start the workers. Each has its own buffers, so nothing is allocated per request once they've grown.
+	struct server_worker_t* workers = (struct server_worker_t*)calloc(numThreads, sizeof(struct server_worker_t));
+	FAT32_thread_t* threads = (FAT32_thread_t*)malloc(numThreads * sizeof(FAT32_thread_t));
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		workers[i].server = &server;
+		workers[i].copy_buffer = (char*)malloc(FAT32_PROTOCOL_MAX_PAYLOAD);
+		workers[i].dirents = (struct FAT32_dirent_t*)malloc(FAT32_PROTOCOL_MAX_DIRENTS * sizeof(struct FAT32_dirent_t));
+		FAT32_thread_create(&threads[i], worker_thread, &workers[i]);
+	}
+
+	printf("Serving '%s' on '%s' with %u threads\n", argv[1], argv[2], numThreads);
+	fflush(stdout);
+
+	int running = 1;
+	while (running)
+	{
+		struct epoll_event events[FAT32_SERVER_MAX_EVENTS];
+		const int numEvents = epoll_wait(server.epoll_fd, events, FAT32_SERVER_MAX_EVENTS, -1);
+		for (int i = 0; i < numEvents; ++i)
+		{
+			if (events[i].data.ptr == &listenFd)
+			{
+				accept_connections(&server, listenFd);
+			}
+			else if (events[i].data.ptr == &server.event_fd)
+			{
+				uint64_t count;
+				ssize_t numRead = read(server.event_fd, &count, sizeof(count));
+				(void)numRead;
+			}
+			else if (events[i].data.ptr == &signalFd)
+			{
+				running = 0;
+			}
+			else
+			{
+				receive(&server, (struct server_connection_t*)events[i].data.ptr, events[i].events);
+			}
+		}
+
+		// Connections are only freed between batches of events, which may still refer to them
+		free_dead_connections(&server);
+	}
+
+	// Let the workers finish what's queued
+	FAT32_mutex_lock(&server.mutex);
+	server.stopping = 1;
+	FAT32_cond_broadcast(&server.cond);
+	FAT32_mutex_unlock(&server.mutex);
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		FAT32_thread_join(threads[i]);
+		free(workers[i].batch.data);
+		free(workers[i].output.data);
+		free(workers[i].copy_buffer);
+		free(workers[i].dirents);
+	}
+	free(threads);
+	free(workers);
+
+	// Close the files the remaining clients have open
+	free_dead_connections(&server);
+	while (server.connections)
+	{
+		close_handles(&server, server.connections);
+		free_connection(&server, server.connections);
+	}
+
+	close(server.epoll_fd);
+	close(server.event_fd);
+	close(signalFd);
+	close(listenFd);
+	unlink(argv[2]);
+	pthread_rwlock_destroy(&server.volume_lock);
+	FAT32_cond_destroy(&server.cond);
+	FAT32_cond_destroy(&server.sent_cond);
+	FAT32_mutex_destroy(&server.mutex);
+
+	FAT32_shutdown(server.volume);
+	printf("Stopped\n");
+	return 0;
+}